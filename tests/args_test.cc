@@ -3,6 +3,10 @@
 
 #include "xpano/cli/args.h"
 
+#include <filesystem>
+#include <string>
+#include <vector>
+
 #include <catch2/catch_test_macros.hpp>
 
 #include "tests/utils.h"
@@ -103,3 +107,80 @@ TEST_CASE("Args parse gui and output incompatible") {
   auto args = xpano::cli::ParseArgs(test_args.GetArgc(), test_args.GetArgv());
   REQUIRE(!args);
 }
+
+TEST_CASE("Args parse auto") {
+  auto test_args = xpano::tests::Args("xpano", "input1.jpg", "input2.jpg",
+                                      "--auto", "--output=panos",
+                                      "--summary=summary.json");
+
+  auto args = xpano::cli::ParseArgs(test_args.GetArgc(), test_args.GetArgv());
+  REQUIRE(args);
+  REQUIRE(args->input_paths.size() == 2);
+  REQUIRE(args->auto_detect == true);
+  REQUIRE(args->output_path);
+  REQUIRE(*args->output_path == "panos");
+  REQUIRE(args->print_summary == false);
+  REQUIRE(args->summary_path);
+  REQUIRE(*args->summary_path == "summary.json");
+}
+
+TEST_CASE("Args parse print summary") {
+  auto test_args =
+      xpano::tests::Args("xpano", "input1.jpg", "input2.jpg", "--summary");
+
+  auto args = xpano::cli::ParseArgs(test_args.GetArgc(), test_args.GetArgv());
+  REQUIRE(args);
+  REQUIRE(args->auto_detect == false);
+  REQUIRE(args->print_summary == true);
+  REQUIRE(!args->summary_path);
+}
+
+TEST_CASE("Args parse quantize") {
+  auto test_args = xpano::tests::Args("xpano", "input1.jpg", "input2.jpg",
+                                      "--auto", "--quantize");
+
+  auto args = xpano::cli::ParseArgs(test_args.GetArgc(), test_args.GetArgv());
+  REQUIRE(args);
+  REQUIRE(args->quantize_descriptors == true);
+  REQUIRE(args->input_paths.size() == 2);
+}
+
+TEST_CASE("Args parse auto missing inputs") {
+  auto test_args = xpano::tests::Args("xpano", "--auto");
+  auto args = xpano::cli::ParseArgs(test_args.GetArgc(), test_args.GetArgv());
+  REQUIRE(!args);
+}
+
+TEST_CASE("Args parse auto with gui") {
+  auto test_args = xpano::tests::Args("xpano", "input1.jpg", "input2.jpg",
+                                      "--auto", "--gui");
+  auto args = xpano::cli::ParseArgs(test_args.GetArgc(), test_args.GetArgv());
+  REQUIRE(!args);
+}
+
+TEST_CASE("Args parse watch") {
+  const auto directory = std::filesystem::temp_directory_path();
+  const auto watch_arg = "--watch=" + directory.string();
+  auto args = xpano::cli::ParseArgs(std::vector<std::string>{
+      watch_arg, "--output=panos", "--stable-period=5"});
+  REQUIRE(args);
+  REQUIRE(args->watch_dir);
+  REQUIRE(*args->watch_dir == directory);
+  REQUIRE(args->stable_period == 5);
+  REQUIRE(args->output_path);
+  REQUIRE(*args->output_path == "panos");
+}
+
+TEST_CASE("Args parse watch invalid") {
+  const auto directory = std::filesystem::temp_directory_path();
+  const auto watch_arg = "--watch=" + directory.string();
+  CHECK(!xpano::cli::ParseArgs(
+      std::vector<std::string>{"--watch=nonexistent_directory"}));
+  CHECK(!xpano::cli::ParseArgs(
+      std::vector<std::string>{watch_arg, "input1.jpg", "input2.jpg"}));
+  CHECK(!xpano::cli::ParseArgs(std::vector<std::string>{watch_arg, "--gui"}));
+  CHECK(!xpano::cli::ParseArgs(
+      std::vector<std::string>{watch_arg, "--stable-period=-1"}));
+  CHECK(!xpano::cli::ParseArgs(
+      std::vector<std::string>{watch_arg, "--stable-period=abc"}));
+}
@@ -0,0 +1,94 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/utils/bigtiff.h"
+
+#include <algorithm>
+#include <filesystem>
+
+#include <catch2/catch_test_macros.hpp>
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "tests/utils.h"
+
+using xpano::utils::bigtiff::TiledWriter;
+
+namespace {
+
+cv::Mat Gradient(cv::Size size, int channels) {
+  cv::Mat image(size, CV_8UC(channels));
+  for (int y = 0; y < size.height; y++) {
+    auto* row = image.ptr<unsigned char>(y);
+    for (int x = 0; x < size.width * channels; x++) {
+      row[x] = static_cast<unsigned char>((x * 3 + y * 7) % 256);
+    }
+  }
+  return image;
+}
+
+// Same order as the tiles are composed in
+bool WriteTiles(TiledWriter* writer, const cv::Mat& image,
+                cv::Size tile_size) {
+  for (int y = 0; y < image.rows; y += tile_size.height) {
+    for (int x = 0; x < image.cols; x += tile_size.width) {
+      cv::Rect tile(x, y, std::min(tile_size.width, image.cols - x),
+                    std::min(tile_size.height, image.rows - y));
+      if (!writer->Write(image(tile))) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool Equal(const cv::Mat& lhs, const cv::Mat& rhs) {
+  return lhs.size() == rhs.size() && lhs.type() == rhs.type() &&
+         cv::norm(lhs, rhs, cv::NORM_INF) == 0.0;
+}
+
+}  // namespace
+
+TEST_CASE("BigTIFF RGB") {
+  auto path = xpano::tests::TmpPath().replace_extension("tif");
+  auto image = Gradient({100, 70}, 3);
+  cv::Size tile_size(32, 16);
+
+  TiledWriter writer(path, image.size(), tile_size, 3);
+  REQUIRE(writer.IsOpen());
+  REQUIRE(WriteTiles(&writer, image, tile_size));
+  REQUIRE(writer.Close());
+
+  auto read = cv::imread(path.string(), cv::IMREAD_UNCHANGED);
+  REQUIRE(!read.empty());
+  cv::cvtColor(read, read, cv::COLOR_BGR2RGB);
+  CHECK(Equal(read, image));
+  std::filesystem::remove(path);
+}
+
+TEST_CASE("BigTIFF RGBA single tile") {
+  auto path = xpano::tests::TmpPath().replace_extension("tif");
+  auto image = Gradient({20, 10}, 4);
+  cv::Size tile_size(32, 32);
+
+  TiledWriter writer(path, image.size(), tile_size, 4);
+  REQUIRE(WriteTiles(&writer, image, tile_size));
+  REQUIRE(writer.Close());
+
+  auto read = cv::imread(path.string(), cv::IMREAD_UNCHANGED);
+  REQUIRE(!read.empty());
+  cv::cvtColor(read, read, cv::COLOR_BGRA2RGBA);
+  CHECK(Equal(read, image));
+  std::filesystem::remove(path);
+}
+
+TEST_CASE("BigTIFF missing tiles") {
+  auto path = xpano::tests::TmpPath().replace_extension("tif");
+  auto image = Gradient({100, 70}, 3);
+
+  TiledWriter writer(path, image.size(), {32, 16}, 3);
+  REQUIRE(writer.Write(image(cv::Rect(0, 0, 32, 16))));
+  CHECK_FALSE(writer.Close());
+  std::filesystem::remove(path);
+}
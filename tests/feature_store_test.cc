@@ -0,0 +1,151 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/algorithm/feature_store.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <vector>
+
+#include <catch2/catch_test_macros.hpp>
+#include <opencv2/core.hpp>
+
+#include "tests/utils.h"
+#include "xpano/constants.h"
+#include "xpano/utils/mmap.h"
+
+using xpano::algorithm::FeatureSource;
+using xpano::algorithm::FeatureStore;
+using xpano::utils::mmap::MappedFile;
+
+// NOLINTBEGIN(readability-magic-numbers)
+
+namespace {
+
+std::vector<cv::KeyPoint> MakeKeypoints(int count, float offset) {
+  std::vector<cv::KeyPoint> keypoints;
+  for (int i = 0; i < count; i++) {
+    keypoints.emplace_back(offset + i, offset - i, 2.0f + i, 10.0f * i,
+                           0.01f * i);
+  }
+  return keypoints;
+}
+
+cv::Mat MakeDescriptors(int count, float offset) {
+  cv::Mat descriptors(count, 128, CV_32F);
+  cv::randu(descriptors, offset, offset + 1.0f);
+  return descriptors;
+}
+
+void CheckKeypoints(const xpano::algorithm::KeypointsView& view,
+                    const std::vector<cv::KeyPoint>& keypoints) {
+  REQUIRE(view.Size() == static_cast<int>(keypoints.size()));
+  for (int i = 0; i < view.Size(); i++) {
+    CHECK(view.Point(i) == keypoints[i].pt);
+    CHECK(view.size[i] == keypoints[i].size);
+    CHECK(view.angle[i] == keypoints[i].angle);
+    CHECK(view.response[i] == keypoints[i].response);
+  }
+}
+
+}  // namespace
+
+TEST_CASE("Feature store pack") {
+  auto keypoints = MakeKeypoints(50, 100.0f);
+  auto descriptors = MakeDescriptors(50, 0.0f);
+  auto store = FeatureStore::Pack(keypoints, descriptors);
+  REQUIRE(store != nullptr);
+  REQUIRE(store->NumImages() == 1);
+
+  CheckKeypoints(store->Keypoints(0), keypoints);
+  auto packed = store->Descriptors(0);
+  CHECK(packed.type() == CV_32F);
+  CHECK(cv::norm(packed, descriptors, cv::NORM_INF) == 0.0);
+  CHECK(reinterpret_cast<std::uintptr_t>(packed.data) %
+            xpano::kFeatureStoreAlignment ==
+        0);
+}
+
+TEST_CASE("Feature store without descriptors") {
+  auto keypoints = MakeKeypoints(10, 0.0f);
+  auto store = FeatureStore::Pack(keypoints, cv::Mat());
+  REQUIRE(store != nullptr);
+  CheckKeypoints(store->Keypoints(0), keypoints);
+  CHECK(store->Descriptors(0).empty());
+}
+
+TEST_CASE("Feature store rejects mismatched descriptors") {
+  auto keypoints = MakeKeypoints(10, 0.0f);
+  CHECK(FeatureStore::Pack(keypoints, MakeDescriptors(5, 0.0f)) == nullptr);
+
+  auto keypoints2 = MakeKeypoints(10, 0.0f);
+  auto store1 = FeatureStore::Pack(keypoints, MakeDescriptors(10, 0.0f));
+  auto store2 = FeatureStore::Pack(keypoints2, cv::Mat(10, 64, CV_8U));
+  CHECK(FeatureStore::Pack(
+            {FeatureSource{store1->Keypoints(0), store1->Descriptors(0)},
+             FeatureSource{store2->Keypoints(0), store2->Descriptors(0)}}) ==
+        nullptr);
+}
+
+TEST_CASE("Feature store descriptors outlive the store") {
+  auto descriptors = MakeDescriptors(20, 0.0f);
+  cv::Mat packed;
+  {
+    auto store = FeatureStore::Pack(MakeKeypoints(20, 0.0f), descriptors);
+    packed = store->Descriptors(0);
+  }
+  CHECK(cv::norm(packed, descriptors, cv::NORM_INF) == 0.0);
+}
+
+TEST_CASE("Feature store mapped from a file") {
+  const auto path = xpano::tests::TmpPath().replace_extension("bin");
+  std::vector<std::vector<cv::KeyPoint>> keypoints = {
+      MakeKeypoints(30, 0.0f), MakeKeypoints(0, 0.0f), MakeKeypoints(40, 5.0f)};
+  std::vector<cv::Mat> descriptors = {MakeDescriptors(30, 0.0f), cv::Mat(),
+                                      MakeDescriptors(40, 2.0f)};
+
+  std::vector<std::shared_ptr<const FeatureStore>> stores;
+  std::vector<FeatureSource> sources;
+  for (int i = 0; i < 3; i++) {
+    stores.push_back(FeatureStore::Pack(keypoints[i], descriptors[i]));
+    sources.push_back({stores[i]->Keypoints(0), stores[i]->Descriptors(0)});
+  }
+
+  const std::uint64_t offset = xpano::kFeatureStoreAlignment;
+  {
+    std::ofstream stream(path, std::ios::binary);
+    std::vector<char> padding(offset, 'x');
+    stream.write(padding.data(), static_cast<std::streamsize>(offset));
+    REQUIRE(FeatureStore::Write(stream, sources));
+  }
+  CHECK(std::filesystem::file_size(path) ==
+        offset + FeatureStore::Pack(sources)->SizeBytes());
+
+  cv::Mat mapped_descriptors;
+  {
+    auto store = FeatureStore::View(MappedFile::Open(path), offset);
+    REQUIRE(store != nullptr);
+    REQUIRE(store->NumImages() == 3);
+    for (int i = 0; i < 3; i++) {
+      CheckKeypoints(store->Keypoints(i), keypoints[i]);
+    }
+    CHECK(store->Descriptors(1).empty());
+    mapped_descriptors = store->Descriptors(2);
+
+    // Misaligned or out of bounds
+    CHECK(FeatureStore::View(MappedFile::Open(path), offset + 4) == nullptr);
+    CHECK(FeatureStore::View(MappedFile::Open(path), 0) == nullptr);
+    CHECK(FeatureStore::View(MappedFile::Open(path), 1 << 20) == nullptr);
+  }
+  // The mapping stays alive with the descriptors
+  CHECK(cv::norm(mapped_descriptors, descriptors[2], cv::NORM_INF) == 0.0);
+  mapped_descriptors.release();
+
+  std::filesystem::resize_file(path, offset + 100);
+  CHECK(FeatureStore::View(MappedFile::Open(path), offset) == nullptr);
+  std::filesystem::remove(path);
+}
+
+// NOLINTEND(readability-magic-numbers)
@@ -0,0 +1,88 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/algorithm/image_store.h"
+
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <memory>
+#include <vector>
+
+#include <catch2/catch_test_macros.hpp>
+#include <opencv2/core.hpp>
+
+#include "tests/utils.h"
+#include "xpano/algorithm/feature_store.h"
+#include "xpano/algorithm/image.h"
+
+// NOLINTBEGIN(readability-magic-numbers)
+
+TEST_CASE("Image store frees spilled descriptors") {
+  // Smaller than any entry, every image is spilled right away
+  auto image_store = std::make_shared<xpano::algorithm::ImageStore>(
+      xpano::tests::TmpPath(), 1);
+  xpano::algorithm::Image image("data/image01.jpg");
+  image.Load({.preview_longer_side = 512});
+  int num_keypoints = image.GetKeypoints().Size();
+  REQUIRE(num_keypoints > 0);
+  std::weak_ptr<const xpano::algorithm::FeatureStore> slab =
+      xpano::algorithm::FeatureStore::Owner(image.GetDescriptors());
+  REQUIRE(!slab.expired());
+  auto preview_size = image.GetPreview().size();
+
+  image.MoveToStore(image_store);
+  CHECK(image_store->Stats().num_spilled == 1);
+  // Nothing but the spilled entry referenced the descriptor slab
+  CHECK(slab.expired());
+  CHECK(image.GetPreviewSize() == preview_size);
+  CHECK(image_store->Stats().reloads == 0);
+  CHECK(image.GetKeypoints().Size() == num_keypoints);
+  CHECK(image.GetDescriptors().rows == num_keypoints);
+  CHECK(image_store->Stats().reloads == 1);
+}
+
+TEST_CASE("Image store keeps entries it fails to spill") {
+  // The spill directory can't be created under a regular file
+  const auto file_path = xpano::tests::TmpPath();
+  std::ofstream(file_path) << "file";
+  xpano::algorithm::ImageStore image_store(file_path / "spill", 1);
+  cv::Mat preview(16, 16, CV_8UC3, cv::Scalar::all(1));
+  int id = image_store.Add(preview, cv::Mat(), nullptr);
+
+  CHECK(image_store.GetPreview(id).size() == preview.size());
+  auto stats = image_store.Stats();
+  CHECK(stats.num_spilled == 0);
+  CHECK(stats.num_resident == 1);
+  // Served from memory, not read back
+  CHECK(stats.reloads == 0);
+  std::filesystem::remove(file_path);
+}
+
+TEST_CASE("Image store concurrent reloads") {
+  xpano::algorithm::ImageStore image_store(xpano::tests::TmpPath(), 1);
+  std::vector<cv::Mat> previews;
+  for (int i = 0; i < 4; i++) {
+    previews.emplace_back(32, 32, CV_8UC3);
+    cv::randu(previews.back(), 0, 255);
+    REQUIRE(image_store.Add(previews.back(), cv::Mat(), nullptr) == i);
+  }
+
+  std::vector<std::future<bool>> readers;
+  for (int reader = 0; reader < 8; reader++) {
+    readers.push_back(std::async(std::launch::async, [&]() {
+      bool same = true;
+      for (int i = 0; i < 4; i++) {
+        same &= cv::norm(image_store.GetPreview(i), previews[i],
+                         cv::NORM_INF) == 0.0;
+      }
+      return same;
+    }));
+  }
+  for (auto& reader : readers) {
+    CHECK(reader.get());
+  }
+  CHECK(image_store.Stats().num_spilled == 4);
+}
+
+// NOLINTEND(readability-magic-numbers)
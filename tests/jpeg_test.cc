@@ -0,0 +1,107 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/utils/jpeg.h"
+
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <vector>
+
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/generators/catch_generators.hpp>
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+
+#include "tests/utils.h"
+
+using xpano::utils::jpeg::StripEncoder;
+using xpano::utils::jpeg::Subsampling;
+
+namespace {
+
+cv::Mat Smooth(cv::Size size) {
+  cv::Mat image(size, CV_8UC3);
+  for (int y = 0; y < size.height; y++) {
+    for (int x = 0; x < size.width; x++) {
+      image.at<cv::Vec3b>(y, x) = {
+          static_cast<unsigned char>(x * 255 / size.width),
+          static_cast<unsigned char>(y * 255 / size.height),
+          static_cast<unsigned char>(128 + 100 * std::sin(x * 0.05) *
+                                               std::cos(y * 0.03))};
+    }
+  }
+  return image;
+}
+
+// The strips are encoded concurrently and written in order
+cv::Mat EncodeAndRead(const cv::Mat& image, int strip_rows, int quality,
+                      Subsampling subsampling) {
+  StripEncoder encoder(image.size(), quality, subsampling);
+  std::vector<std::future<std::vector<unsigned char>>> strips;
+  for (int row = 0; row < image.rows; row += strip_rows) {
+    cv::Mat strip =
+        image.rowRange(row, std::min(row + strip_rows, image.rows));
+    strips.push_back(std::async(std::launch::async, [&encoder, strip, row]() {
+      return encoder.Encode(strip, row);
+    }));
+  }
+
+  std::vector<unsigned char> file = encoder.Header();
+  for (auto& strip : strips) {
+    auto data = strip.get();
+    file.insert(file.end(), data.begin(), data.end());
+  }
+  auto trailer = StripEncoder::Trailer();
+  file.insert(file.end(), trailer.begin(), trailer.end());
+
+  auto path = xpano::tests::TmpPath().replace_extension("jpg");
+  {
+    std::ofstream stream(path, std::ios::binary);
+    stream.write(reinterpret_cast<const char*>(file.data()),
+                 static_cast<std::streamsize>(file.size()));
+  }
+  auto read = cv::imread(path.string());
+  std::filesystem::remove(path);
+  return read;
+}
+
+double MeanDifference(const cv::Mat& lhs, const cv::Mat& rhs) {
+  return cv::norm(lhs, rhs, cv::NORM_L1) /
+         static_cast<double>(lhs.total() * lhs.channels());
+}
+
+}  // namespace
+
+TEST_CASE("JPEG strips") {
+  auto image = Smooth({333, 257});
+  auto subsampling = GENERATE(Subsampling::k444, Subsampling::k422,
+                              Subsampling::k420);
+  auto read = EncodeAndRead(image, 32, 95, subsampling);
+  REQUIRE(read.size() == image.size());
+  CHECK(MeanDifference(read, image) < 1.5);
+}
+
+TEST_CASE("JPEG single strip") {
+  auto image = Smooth({17, 9});
+  auto read = EncodeAndRead(image, image.rows, 100, Subsampling::k444);
+  REQUIRE(read.size() == image.size());
+  CHECK(MeanDifference(read, image) < 1.0);
+}
+
+TEST_CASE("JPEG quality") {
+  auto image = Smooth({128, 128});
+  auto low = EncodeAndRead(image, 16, 10, Subsampling::k420);
+  auto high = EncodeAndRead(image, 16, 95, Subsampling::k420);
+  REQUIRE(!low.empty());
+  REQUIRE(!high.empty());
+  CHECK(MeanDifference(high, image) < MeanDifference(low, image));
+}
+
+TEST_CASE("JPEG size limits") {
+  CHECK(StripEncoder::IsSupported({65535, 100}));
+  CHECK_FALSE(StripEncoder::IsSupported({65536, 100}));
+  CHECK_FALSE(StripEncoder::IsSupported({0, 0}));
+}
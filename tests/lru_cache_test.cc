@@ -0,0 +1,68 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/utils/lru_cache.h"
+
+#include <string>
+
+#include <catch2/catch_test_macros.hpp>
+
+using xpano::utils::LruCache;
+
+TEST_CASE("LruCache Get/Put") {
+  auto cache = LruCache<int, std::string>(10);
+  CHECK_FALSE(cache.Get(0).has_value());
+
+  CHECK(cache.Put(0, "zero", 4).empty());
+  CHECK(cache.Put(1, "one", 3).empty());
+  CHECK(cache.Get(0) == "zero");
+  CHECK(cache.Get(1) == "one");
+
+  auto stats = cache.Stats();
+  CHECK(stats.size_bytes == 7);
+  CHECK(stats.num_entries == 2);
+  CHECK(stats.hits == 2);
+  CHECK(stats.misses == 1);
+  CHECK(stats.evictions == 0);
+}
+
+TEST_CASE("LruCache eviction order") {
+  auto cache = LruCache<int, std::string>(10);
+  cache.Put(0, "zero", 4);
+  cache.Put(1, "one", 3);
+  cache.Put(2, "two", 3);
+  // 0 becomes the most recently used entry
+  CHECK(cache.Get(0).has_value());
+
+  auto evicted = cache.Put(3, "three", 5);
+  REQUIRE(evicted.size() == 2);
+  CHECK(evicted[0].first == 1);
+  CHECK(evicted[1].first == 2);
+  CHECK(cache.Contains(0));
+  CHECK(cache.Contains(3));
+  CHECK(cache.Stats().size_bytes == 9);
+  CHECK(cache.Stats().evictions == 2);
+}
+
+TEST_CASE("LruCache oversized value") {
+  auto cache = LruCache<int, std::string>(10);
+  cache.Put(0, "zero", 4);
+
+  auto evicted = cache.Put(1, "huge", 11);
+  REQUIRE(evicted.size() == 1);
+  CHECK(evicted[0].first == 1);
+  CHECK(cache.Contains(0));
+  CHECK_FALSE(cache.Contains(1));
+}
+
+TEST_CASE("LruCache replace and erase") {
+  auto cache = LruCache<int, std::string>(10);
+  cache.Put(0, "zero", 4);
+  cache.Put(0, "zero!", 5);
+  CHECK(cache.Stats().size_bytes == 5);
+  CHECK(cache.Get(0) == "zero!");
+
+  cache.Erase(0);
+  CHECK(cache.Stats().size_bytes == 0);
+  CHECK(cache.Stats().num_entries == 0);
+}
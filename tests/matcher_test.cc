@@ -0,0 +1,120 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/algorithm/matcher.h"
+
+#include <string>
+
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/generators/catch_generators.hpp>
+#include <opencv2/core.hpp>
+
+#include "xpano/algorithm/image.h"
+#include "xpano/algorithm/options.h"
+
+using xpano::algorithm::Image;
+using xpano::algorithm::KnnMatch;
+using xpano::algorithm::MatcherType;
+
+// NOLINTBEGIN(readability-magic-numbers)
+
+namespace {
+
+Image LoadImage(const std::string& path, bool quantize = false) {
+  Image image(path);
+  image.Load({.preview_longer_side = 1024, .quantize_descriptors = quantize});
+  return image;
+}
+
+}  // namespace
+
+TEST_CASE("SIMD matcher is exact") {
+  auto query = LoadImage("data/image01.jpg");
+  auto train = LoadImage("data/image02.jpg");
+  REQUIRE(!query.GetKeypoints().Empty());
+  REQUIRE(!train.GetKeypoints().Empty());
+
+  auto simd = KnnMatch(query, train, MatcherType::kSimd);
+  auto brute_force = KnnMatch(query, train, MatcherType::kBruteForce);
+  REQUIRE(simd.size() == query.GetKeypoints().Size());
+  REQUIRE(simd.size() == brute_force.size());
+
+  // Both are exact, only ties and rounding can differ
+  int num_different = 0;
+  for (int i = 0; i < simd.size(); i++) {
+    if (simd[i].best != brute_force[i].best) {
+      num_different++;
+    }
+  }
+  CHECK(num_different < simd.size() / 100);
+}
+
+TEST_CASE("Quantized SIMD matcher is exact") {
+  auto query = LoadImage("data/image01.jpg");
+  auto train = LoadImage("data/image02.jpg");
+  auto quantized_query = LoadImage("data/image01.jpg", true);
+  auto quantized_train = LoadImage("data/image02.jpg", true);
+  REQUIRE(quantized_query.GetDescriptors().type() == CV_8U);
+  REQUIRE(quantized_query.GetDescriptorIndex() == nullptr);
+
+  auto simd = KnnMatch(query, train, MatcherType::kSimd);
+  auto quantized =
+      KnnMatch(quantized_query, quantized_train, MatcherType::kSimd);
+  REQUIRE(quantized.size() == simd.size());
+
+  // The sums of squares of whole numbers are exact in both
+  for (int i = 0; i < simd.size(); i++) {
+    CHECK(quantized[i].best == simd[i].best);
+    CHECK(quantized[i].second == simd[i].second);
+    CHECK(quantized[i].best_distance == simd[i].best_distance);
+  }
+
+  // No index to search, the exact search is used instead
+  auto flann = KnnMatch(quantized_query, quantized_train, MatcherType::kFlann);
+  CHECK(flann.size() == simd.size());
+}
+
+TEST_CASE("Matcher mixed quantization") {
+  const auto matcher = GENERATE(MatcherType::kFlann, MatcherType::kBruteForce,
+                                MatcherType::kSimd);
+  auto query = LoadImage("data/image01.jpg");
+  auto train = LoadImage("data/image02.jpg");
+  auto quantized_query = LoadImage("data/image01.jpg", true);
+  auto quantized_train = LoadImage("data/image02.jpg", true);
+
+  // The float side is quantized, matching exactly like two quantized images
+  auto reference =
+      KnnMatch(quantized_query, quantized_train, MatcherType::kSimd);
+  for (const auto& mixed : {KnnMatch(query, quantized_train, matcher),
+                            KnnMatch(quantized_query, train, matcher)}) {
+    REQUIRE(mixed.size() == reference.size());
+    int num_different = 0;
+    for (int i = 0; i < mixed.size(); i++) {
+      if (mixed[i].best != reference[i].best) {
+        num_different++;
+      }
+    }
+    CHECK(num_different < reference.size() / 100);
+  }
+}
+
+TEST_CASE("Matcher benchmark", "[.benchmark]") {
+  auto query = LoadImage("data/image01.jpg");
+  auto train = LoadImage("data/image02.jpg");
+  INFO("SIMD instruction set: " << xpano::algorithm::SimdInstructionSet());
+
+  for (auto matcher : xpano::algorithm::kMatcherTypes) {
+    BENCHMARK(xpano::algorithm::Label(matcher)) {
+      return KnnMatch(query, train, matcher);
+    };
+  }
+
+  auto quantized_query = LoadImage("data/image01.jpg", true);
+  auto quantized_train = LoadImage("data/image02.jpg", true);
+  BENCHMARK("SIMD quantized") {
+    return KnnMatch(quantized_query, quantized_train, MatcherType::kSimd);
+  };
+}
+
+// NOLINTEND(readability-magic-numbers)
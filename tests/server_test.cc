@@ -0,0 +1,174 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/cli/server.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <future>
+#include <string>
+#include <thread>
+
+#include <catch2/catch_test_macros.hpp>
+
+#include "tests/utils.h"
+
+using xpano::cli::ResultType;
+using xpano::cli::server::Handlers;
+
+namespace {
+
+class Client {
+ public:
+  explicit Client(const std::filesystem::path& socket_path)
+      : fd_(socket(AF_UNIX, SOCK_STREAM, 0)) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    std::strcpy(address.sun_path, socket_path.c_str());
+    // The server might not be listening yet
+    for (int attempt = 0; attempt < 100; attempt++) {
+      if (connect(fd_, reinterpret_cast<const sockaddr*>(&address),
+                  sizeof(address)) == 0) {
+        connected_ = true;
+        break;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+  }
+  ~Client() { close(fd_); }
+  Client(const Client&) = delete;
+  Client& operator=(const Client&) = delete;
+  Client(Client&&) = delete;
+  Client& operator=(Client&&) = delete;
+
+  [[nodiscard]] bool Connected() const { return connected_; }
+
+  void Send(const std::string& line) {
+    std::string data = line + "\n";
+    REQUIRE(send(fd_, data.data(), data.size(), 0) ==
+            static_cast<ssize_t>(data.size()));
+  }
+
+  std::string ReadLine() {
+    std::string line;
+    char character = 0;
+    while (recv(fd_, &character, 1, 0) == 1 && character != '\n') {
+      line += character;
+    }
+    return line;
+  }
+
+ private:
+  int fd_;
+  bool connected_ = false;
+};
+
+Handlers TestHandlers() {
+  return {.run_job =
+              [](const xpano::cli::Args& args, xpano::cli::Summary* summary) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(300));
+                summary->num_inputs =
+                    static_cast<int>(args.input_paths.size());
+                return ResultType::kSuccess;
+              },
+          .progress =
+              []() {
+                return xpano::pipeline::ProgressReport{
+                    .type = xpano::pipeline::ProgressType::kStitchingPano,
+                    .tasks_done = 1,
+                    .num_tasks = 2};
+              },
+          .cancel = []() {}};
+}
+
+}  // namespace
+
+TEST_CASE("Server job") {
+  const auto socket_path = xpano::tests::TmpPath();
+  std::atomic_int cancel = 0;
+  auto handlers = TestHandlers();
+  auto server = std::async(std::launch::async, [&]() {
+    return xpano::cli::server::Serve(socket_path, handlers, cancel);
+  });
+
+  {
+    Client client(socket_path);
+    REQUIRE(client.Connected());
+    client.Send("input1.jpg\tinput2.jpg\t--auto");
+    CHECK(client.ReadLine() ==
+          R"({"progress":{"type":"stitching_pano","done":1,"total":2}})");
+    auto result = client.ReadLine();
+    CHECK(result.starts_with(R"({"result":"success","summary":{"inputs":2,)"));
+
+    client.Send("--gui");
+    CHECK(client.ReadLine() == R"({"error":"invalid request"})");
+
+    client.Send("shutdown");
+    CHECK(client.ReadLine() == R"({"result":"shutdown"})");
+  }
+
+  CHECK(server.get() == ResultType::kSuccess);
+  CHECK(!std::filesystem::exists(socket_path));
+}
+
+TEST_CASE("Server cancels the job of a disconnected client") {
+  const auto socket_path = xpano::tests::TmpPath();
+  std::atomic_int cancel = 0;
+  std::atomic_int progress = 0;
+  std::atomic_int cancel_calls = 0;
+  auto handlers = TestHandlers();
+  // Runs until cancelled, the changing progress is sent on every poll
+  handlers.run_job = [&cancel_calls](const xpano::cli::Args& /*args*/,
+                                     xpano::cli::Summary* /*summary*/) {
+    for (int i = 0; i < 100 && cancel_calls < 2; i++) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    return cancel_calls < 2 ? ResultType::kSuccess : ResultType::kError;
+  };
+  handlers.progress = [&progress]() {
+    return xpano::pipeline::ProgressReport{
+        .type = xpano::pipeline::ProgressType::kStitchingPano,
+        .tasks_done = progress++,
+        .num_tasks = 1000};
+  };
+  handlers.cancel = [&cancel_calls]() { cancel_calls++; };
+  auto server = std::async(std::launch::async, [&]() {
+    return xpano::cli::server::Serve(socket_path, handlers, cancel);
+  });
+
+  {
+    Client client(socket_path);
+    REQUIRE(client.Connected());
+    client.Send("input1.jpg\tinput2.jpg");
+    client.ReadLine();
+  }
+
+  // Cancelled until the job returns, then the next client is served
+  Client client(socket_path);
+  REQUIRE(client.Connected());
+  client.Send("shutdown");
+  CHECK(client.ReadLine() == R"({"result":"shutdown"})");
+  CHECK(cancel_calls >= 2);
+  CHECK(server.get() == ResultType::kSuccess);
+}
+
+TEST_CASE("Server cancel") {
+  const auto socket_path = xpano::tests::TmpPath();
+  std::atomic_int cancel = 0;
+  auto handlers = TestHandlers();
+  auto server = std::async(std::launch::async, [&]() {
+    return xpano::cli::server::Serve(socket_path, handlers, cancel);
+  });
+
+  Client client(socket_path);
+  REQUIRE(client.Connected());
+  cancel = 1;
+  CHECK(server.get() == ResultType::kSuccess);
+  CHECK(!std::filesystem::exists(socket_path));
+}
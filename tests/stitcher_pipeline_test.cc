@@ -3,11 +3,24 @@
 
 #include "xpano/pipeline/stitcher_pipeline.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <filesystem>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <map>
+#include <memory>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #include <catch2/catch_test_macros.hpp>
+#include <catch2/generators/catch_generators.hpp>
 #include <catch2/matchers/catch_matchers_floating_point.hpp>
 #include <catch2/matchers/catch_matchers_string.hpp>
 #include <catch2/matchers/catch_matchers_vector.hpp>
@@ -19,6 +32,9 @@
 #include <opencv2/imgproc.hpp>
 
 #include "tests/utils.h"
+#include "xpano/algorithm/algorithm.h"
+#include "xpano/algorithm/feature_store.h"
+#include "xpano/algorithm/image.h"
 
 using Catch::Matchers::Equals;
 using Catch::Matchers::WithinAbs;
@@ -37,6 +53,15 @@ int CountNonZero(const cv::Mat& image) {
   return cv::countNonZero(image_gray);
 }
 
+std::map<std::pair<int, int>, int> InlierCounts(
+    const std::vector<xpano::algorithm::Match>& matches) {
+  std::map<std::pair<int, int>, int> counts;
+  for (const auto& match : matches) {
+    counts[{match.id1, match.id2}] = static_cast<int>(match.matches.size());
+  }
+  return counts;
+}
+
 TEST_CASE("Stitcher pipeline defaults") {
   xpano::pipeline::StitcherPipeline stitcher;
 
@@ -46,6 +71,7 @@ TEST_CASE("Stitcher pipeline defaults") {
 
   CHECK(result.images.size() == 10);
   CHECK(result.matches.size() == 17);
+  CHECK(result.matching_stats.full == 17);
   REQUIRE(result.panos.size() == 2);
   REQUIRE_THAT(result.panos[0].ids, Equals<int>({1, 2, 3, 4, 5}));
   REQUIRE_THAT(result.panos[1].ids, Equals<int>({6, 7, 8}));
@@ -86,9 +112,499 @@ TEST_CASE("Stitcher pipeline defaults") {
   CHECK(total_pixels == non_zero_pixels);
 }
 
+TEST_CASE("Stitcher pipeline partial panos") {
+  xpano::pipeline::StitcherPipeline stitcher;
+
+  auto result = stitcher.RunLoading(kInputs, {}, {}).get();
+  // After the last match, the partial panos are the final ones
+  auto partial_panos = stitcher.PartialPanos();
+  REQUIRE(partial_panos.size() == result.panos.size());
+  for (int i = 0; i < partial_panos.size(); i++) {
+    CHECK_THAT(partial_panos[i].ids, Equals<int>(result.panos[i].ids));
+  }
+
+  stitcher.Cancel();
+  CHECK(stitcher.PartialPanos().empty());
+}
+
+TEST_CASE("Stitcher pipeline partial panos skip failed inputs") {
+  xpano::pipeline::StitcherPipeline stitcher;
+  auto inputs = kInputs;
+  inputs.insert(inputs.begin() + 3, "data/missing.jpg");
+
+  auto result = stitcher.RunLoading(inputs, {}, {}).get();
+  REQUIRE(result.images.size() == 10);
+  // The ids are those of the loaded images, not of the inputs
+  auto partial_panos = stitcher.PartialPanos();
+  REQUIRE(partial_panos.size() == result.panos.size());
+  REQUIRE(!partial_panos.empty());
+  for (int i = 0; i < partial_panos.size(); i++) {
+    CHECK_THAT(partial_panos[i].ids, Equals<int>(result.panos[i].ids));
+  }
+
+  auto preview = stitcher.RunPartialStitching(0, {}).get();
+  CHECK(preview.pano_id == 0);
+  CHECK(preview.pano.has_value());
+  // The matches of a partial pano keep changing, its cameras aren't cached
+  stitcher.RunPartialStitching(0, {}).get();
+  CHECK(stitcher.NumRegistrations() == 2);
+  CHECK(stitcher.RunPartialStitching(100, {}).get().status !=
+        cv::Stitcher::OK);
+}
+
+TEST_CASE("Stitcher pipeline full resolution registration") {
+  xpano::pipeline::StitcherPipeline stitcher;
+  auto result = stitcher.RunLoading(kInputs, {}, {}).get();
+  REQUIRE(result.panos.size() == 2);
+
+  auto reused = stitcher
+                    .RunStitching(result, {.pano_id = 1, .full_res = true})
+                    .get();
+  auto registered_again =
+      stitcher
+          .RunStitching(
+              result,
+              {.pano_id = 1,
+               .full_res = true,
+               .stitch_algorithm = {.reuse_preview_registration = false}})
+          .get();
+
+  REQUIRE(reused.pano.has_value());
+  REQUIRE(reused.mask.has_value());
+  REQUIRE(registered_again.pano.has_value());
+  CHECK(reused.pano->size() == reused.mask->size());
+
+  // The second stitch doesn't decode the images again
+  auto cache_stats = stitcher.FullResCacheStats();
+  CHECK(cache_stats.misses == 3);
+  CHECK(cache_stats.hits == 3);
+  CHECK(cache_stats.num_entries == 3);
+
+  const float eps = 0.02;
+  CHECK_THAT(reused.pano->rows, WithinRel(registered_again.pano->rows, eps));
+  CHECK_THAT(reused.pano->cols, WithinRel(registered_again.pano->cols, eps));
+}
+
+TEST_CASE("Stitcher pipeline keeps caches for the same inputs") {
+  xpano::pipeline::StitcherPipeline stitcher;
+  auto result = stitcher.RunLoading(kInputs, {}, {}).get();
+  REQUIRE(result.panos.size() == 2);
+  stitcher.RunStitching(result, {.pano_id = 1, .full_res = true}).get();
+
+  // Loading the same inputs again doesn't decode the images again
+  result = stitcher.RunLoading(kInputs, {}, {}).get();
+  REQUIRE(result.panos.size() == 2);
+  stitcher.RunStitching(result, {.pano_id = 1, .full_res = true}).get();
+  auto cache_stats = stitcher.FullResCacheStats();
+  CHECK(cache_stats.misses == 3);
+  CHECK(cache_stats.hits == 3);
+
+  stitcher.RunLoading({kInputs[0], kInputs[1]}, {}, {}).get();
+  CHECK(stitcher.FullResCacheStats().num_entries == 0);
+}
+
+TEST_CASE("Stitcher pipeline registers again with other matches") {
+  xpano::pipeline::StitcherPipeline stitcher;
+  auto result = stitcher.RunLoading(kInputs, {}, {}).get();
+  REQUIRE(result.panos.size() == 2);
+  stitcher.RunStitching(result, {.pano_id = 0}).get();
+  CHECK(stitcher.NumRegistrations() == 1);
+
+  // Same inputs and matches, the cameras are reused
+  result = stitcher.RunLoading(kInputs, {}, {}).get();
+  stitcher.RunStitching(result, {.pano_id = 0}).get();
+  CHECK(stitcher.NumRegistrations() == 1);
+
+  // Same inputs, but the cameras were estimated from other matches
+  result = stitcher
+               .RunLoading(kInputs, {},
+                           {.match_threshold = 65,
+                            .cross_check = true,
+                            .matcher = xpano::algorithm::MatcherType::kSimd})
+               .get();
+  REQUIRE(!result.panos.empty());
+  REQUIRE_THAT(result.panos[0].ids, Equals<int>({1, 2, 3, 4, 5}));
+  stitcher.RunStitching(result, {.pano_id = 0}).get();
+  CHECK(stitcher.NumRegistrations() == 2);
+}
+
+TEST_CASE("Stitcher pipeline cancel from another thread") {
+  xpano::pipeline::StitcherPipeline stitcher;
+  auto loading = stitcher.RunLoading(kInputs, {}, {});
+  auto cancelling = std::async(std::launch::async, [&stitcher]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    stitcher.Cancel();
+  });
+  // Cut short while running, or dropped before it started
+  try {
+    CHECK(loading.get().panos.size() <= 2);
+  } catch (const std::future_error& error) {
+    CHECK(error.code() == std::future_errc::broken_promise);
+  }
+  cancelling.get();
+
+  auto result = stitcher.RunLoading(kInputs, {}, {}).get();
+  CHECK(result.panos.size() == 2);
+}
+
+TEST_CASE("Stitcher pipeline tiled export") {
+  const std::filesystem::path tmp_path =
+      xpano::tests::TmpPath().replace_extension("tif");
+
+  xpano::pipeline::StitcherPipeline stitcher;
+  auto result = stitcher.RunLoading(kInputs, {}, {}).get();
+  REQUIRE(result.panos.size() == 2);
+
+  auto in_memory =
+      stitcher.RunStitching(result, {.pano_id = 1, .full_res = true}).get();
+  auto tiled =
+      stitcher
+          .RunStitching(result,
+                        {.pano_id = 1,
+                         .full_res = true,
+                         .export_path = tmp_path,
+                         .stitch_algorithm = {.tiled_export = true}})
+          .get();
+  auto progress = stitcher.Progress();
+  CHECK(progress.tasks_done == progress.num_tasks);
+
+  REQUIRE(in_memory.pano.has_value());
+  REQUIRE(in_memory.mask.has_value());
+  REQUIRE(tiled.export_path.has_value());
+  CHECK(*tiled.export_path == tmp_path);
+  // Only the preview is kept in memory
+  REQUIRE(tiled.pano.has_value());
+  CHECK_FALSE(tiled.full_res);
+  CHECK(tiled.pano->cols < in_memory.pano->cols);
+
+  auto exported = cv::imread(tmp_path.string(), cv::IMREAD_UNCHANGED);
+  REQUIRE(exported.channels() == 4);
+  CHECK(exported.size() == in_memory.pano->size());
+
+  // The alpha channel holds the pano mask
+  cv::Mat alpha;
+  cv::extractChannel(exported, alpha, 3);
+  CHECK_THAT(cv::countNonZero(alpha),
+             WithinRel(cv::countNonZero(*in_memory.mask), 0.01));
+
+  // The tiles are blended separately and warped with interpolated maps
+  cv::Mat exported_bgr;
+  cv::cvtColor(exported, exported_bgr, cv::COLOR_BGRA2BGR);
+  auto mean_difference =
+      cv::norm(exported_bgr, *in_memory.pano, cv::NORM_L1) /
+      static_cast<double>(exported_bgr.total() * exported_bgr.channels());
+  CHECK(mean_difference < 3.0);
+  std::filesystem::remove(tmp_path);
+}
+
+TEST_CASE("Stitcher pipeline tiled JPEG export") {
+  const std::filesystem::path tmp_path =
+      xpano::tests::TmpPath().replace_extension("jpg");
+
+  xpano::pipeline::StitcherPipeline stitcher;
+  auto result = stitcher.RunLoading(kInputs, {}, {}).get();
+  REQUIRE(result.panos.size() == 2);
+
+  auto in_memory =
+      stitcher.RunStitching(result, {.pano_id = 1, .full_res = true}).get();
+  auto tiled =
+      stitcher
+          .RunStitching(result,
+                        {.pano_id = 1,
+                         .full_res = true,
+                         .export_path = tmp_path,
+                         .stitch_algorithm = {.tiled_export = true}})
+          .get();
+
+  REQUIRE(in_memory.pano.has_value());
+  REQUIRE(tiled.export_path.has_value());
+  CHECK(*tiled.export_path == tmp_path);
+
+  auto exported = cv::imread(tmp_path.string());
+  REQUIRE(exported.size() == in_memory.pano->size());
+  auto mean_difference =
+      cv::norm(exported, *in_memory.pano, cv::NORM_L1) /
+      static_cast<double>(exported.total() * exported.channels());
+  CHECK(mean_difference < 5.0);
+  std::filesystem::remove(tmp_path);
+}
+
+TEST_CASE("Stitcher pipeline batch export") {
+  const auto export_dir = xpano::tests::TmpPath();
+  std::filesystem::create_directories(export_dir);
+
+  xpano::pipeline::StitcherPipeline stitcher;
+  auto result = stitcher.RunLoading(kInputs, {}, {}).get();
+  REQUIRE(result.panos.size() == 2);
+
+  // The budget only fits one pano at a time
+  auto memory_budget = GENERATE(1, xpano::kDefaultBatchMemoryBudget);
+  auto exported = stitcher
+                      .RunBatchExport(result, {.export_dir = export_dir,
+                                               .memory_budget = memory_budget})
+                      .get();
+
+  REQUIRE(exported.size() == 2);
+  for (int pano_id = 0; pano_id < 2; pano_id++) {
+    const auto& pano = result.panos[pano_id];
+    CHECK(exported[pano_id].pano_id == pano_id);
+    CHECK(exported[pano_id].status == xpano::pipeline::BatchStatus::kDone);
+    REQUIRE(exported[pano_id].export_path.has_value());
+    CHECK(*exported[pano_id].export_path ==
+          export_dir / result.images[pano.ids[0]].PanoName());
+    CHECK(!cv::imread(exported[pano_id].export_path->string()).empty());
+  }
+
+  auto progress = stitcher.BatchProgress();
+  REQUIRE(progress.size() == 2);
+  for (const auto& pano_progress : progress) {
+    CHECK(pano_progress.status == xpano::pipeline::BatchStatus::kDone);
+  }
+  CHECK(stitcher.Progress().type ==
+        xpano::pipeline::ProgressType::kBatchExport);
+  CHECK(stitcher.Progress().tasks_done == 2);
+  std::filesystem::remove_all(export_dir);
+}
+
+TEST_CASE("Stitcher pipeline batch export cancel") {
+  const auto export_dir = xpano::tests::TmpPath();
+  std::filesystem::create_directories(export_dir);
+
+  xpano::pipeline::StitcherPipeline stitcher;
+  auto result = stitcher.RunLoading(kInputs, {}, {}).get();
+  REQUIRE(result.panos.size() == 2);
+
+  // One full resolution pano at a time, the second one is still queued
+  auto future = stitcher.RunBatchExport(
+      result,
+      {.export_dir = export_dir, .full_res = true, .memory_budget = 1});
+  while (stitcher.BatchProgress()[0].status ==
+         xpano::pipeline::BatchStatus::kQueued) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  stitcher.Cancel();
+  auto exported = future.get();
+
+  REQUIRE(exported.size() == 2);
+  CHECK(exported[1].status == xpano::pipeline::BatchStatus::kFailed);
+  for (const auto& pano_progress : stitcher.BatchProgress()) {
+    CHECK((pano_progress.status == xpano::pipeline::BatchStatus::kDone ||
+           pano_progress.status == xpano::pipeline::BatchStatus::kFailed));
+  }
+  std::filesystem::remove_all(export_dir);
+}
+
+TEST_CASE("Stitcher pipeline incremental loading") {
+  xpano::pipeline::StitcherPipeline stitcher;
+  const std::vector<std::filesystem::path> first_inputs(kInputs.begin(),
+                                                        kInputs.begin() + 4);
+  const std::vector<std::filesystem::path> next_inputs(kInputs.begin() + 4,
+                                                       kInputs.end());
+
+  auto first = stitcher.RunLoading(first_inputs, {}, {}).get();
+  REQUIRE(first.images.size() == 4);
+  CHECK(first.matches.size() == 5);
+
+  auto result =
+      stitcher.RunIncrementalLoading(first, next_inputs, {}, {}).get();
+  auto progress = stitcher.Progress();
+  CHECK(progress.tasks_done == progress.num_tasks);
+
+  // Only the pairs with a new image were matched
+  CHECK(progress.num_tasks == 12 + 1);
+  CHECK(result.images.size() == 10);
+  CHECK(result.matches.size() == 17);
+  CHECK(result.matching_stats.full == 17);
+  REQUIRE(result.panos.size() == 2);
+  REQUIRE_THAT(result.panos[0].ids, Equals<int>({1, 2, 3, 4, 5}));
+  REQUIRE_THAT(result.panos[1].ids, Equals<int>({6, 7, 8}));
+
+  // Starting from nothing
+  auto from_empty = stitcher.RunIncrementalLoading({}, kInputs, {}, {}).get();
+  CHECK(from_empty.matches.size() == 17);
+  REQUIRE(from_empty.panos.size() == 2);
+  REQUIRE_THAT(from_empty.panos[1].ids, Equals<int>({6, 7, 8}));
+}
+
+TEST_CASE("Stitcher pipeline precomputed matches") {
+  xpano::pipeline::StitcherPipeline stitcher;
+  auto result = stitcher.RunLoading(kInputs, {}, {}).get();
+  REQUIRE(result.panos.size() == 2);
+  auto pano = stitcher.RunStitching(result, {.pano_id = 1}).get().pano;
+  REQUIRE(pano.has_value());
+
+  // Same pano without the matches from the matching stage
+  auto unmatched = xpano::pipeline::StitcherData{
+      .images = result.images, .panos = {result.panos[1]}};
+  auto unmatched_pano =
+      stitcher.RunStitching(unmatched, {.pano_id = 0}).get().pano;
+  REQUIRE(unmatched_pano.has_value());
+
+  const float eps = 0.02;
+  CHECK_THAT(unmatched_pano->rows, WithinRel(pano->rows, eps));
+  CHECK_THAT(unmatched_pano->cols, WithinRel(pano->cols, eps));
+}
+
+TEST_CASE("Stitcher pipeline projection changes") {
+  xpano::pipeline::StitcherPipeline stitcher;
+  auto result = stitcher.RunLoading(kInputs, {}, {}).get();
+  REQUIRE(result.panos.size() == 2);
+
+  auto stitch = [&stitcher, &result](xpano::algorithm::ProjectionType type) {
+    return stitcher
+        .RunStitching(result,
+                      {.pano_id = 0,
+                       .stitch_algorithm = {.projection = {.type = type}}})
+        .get()
+        .pano;
+  };
+
+  using xpano::algorithm::ProjectionType;
+  auto spherical = stitch(ProjectionType::kSpherical);
+  auto cylindrical = stitch(ProjectionType::kCylindrical);
+  auto spherical_again = stitch(ProjectionType::kSpherical);
+
+  REQUIRE(spherical.has_value());
+  REQUIRE(cylindrical.has_value());
+  REQUIRE(spherical_again.has_value());
+  CHECK(spherical->size() != cylindrical->size());
+  // Composed from the same camera parameters
+  CHECK(spherical->size() == spherical_again->size());
+}
+
+TEST_CASE("Stitcher pipeline shares image features") {
+  xpano::pipeline::StitcherPipeline stitcher;
+  auto result =
+      stitcher.RunLoading(kInputs, {}, {.neighborhood_search_size = 10})
+          .get();
+  REQUIRE(result.images.size() == 10);
+
+  // Copies of an image, e.g. in the matching tasks, never copy the keypoints
+  auto copy = result;
+  for (int i = 0; i < result.images.size(); i++) {
+    auto keypoints = result.images[i].GetKeypoints();
+    CHECK(!keypoints.Empty());
+    CHECK(copy.images[i].GetKeypoints().x.data() == keypoints.x.data());
+    CHECK(copy.images[i].GetDescriptors().data ==
+          result.images[i].GetDescriptors().data);
+  }
+}
+
+// Counts the Mats allocated by OpenCV that are at least min_bytes large
+class CountingAllocator : public cv::MatAllocator {
+ public:
+  explicit CountingAllocator(std::size_t min_bytes) : min_bytes_(min_bytes) {}
+
+  cv::UMatData* allocate(int dims, const int* sizes, int type, void* data,
+                         std::size_t* step, cv::AccessFlag flags,
+                         cv::UMatUsageFlags usage_flags) const override {
+    std::size_t bytes = CV_ELEM_SIZE(type);
+    for (int i = 0; i < dims; i++) {
+      bytes *= sizes[i];
+    }
+    if (data == nullptr && bytes >= min_bytes_) {
+      large_allocations_++;
+    }
+    return std_->allocate(dims, sizes, type, data, step, flags, usage_flags);
+  }
+  bool allocate(cv::UMatData* data, cv::AccessFlag flags,
+                cv::UMatUsageFlags usage_flags) const override {
+    return std_->allocate(data, flags, usage_flags);
+  }
+  void deallocate(cv::UMatData* data) const override {
+    std_->deallocate(data);
+  }
+
+  [[nodiscard]] int LargeAllocations() const { return large_allocations_; }
+
+ private:
+  cv::MatAllocator* std_ = cv::Mat::getStdAllocator();
+  std::size_t min_bytes_;
+  mutable std::atomic<int> large_allocations_ = 0;
+};
+
+TEST_CASE("Matching shares image features") {
+  using xpano::algorithm::FeatureStore;
+  const auto matcher =
+      GENERATE(xpano::algorithm::MatcherType::kFlann,
+               xpano::algorithm::MatcherType::kBruteForce,
+               xpano::algorithm::MatcherType::kSimd);
+  const bool cross_check = GENERATE(false, true);
+
+  xpano::algorithm::Image image1("data/image01.jpg");
+  xpano::algorithm::Image image2("data/image02.jpg");
+  image1.Load({.preview_longer_side = 1024});
+  image2.Load({.preview_longer_side = 1024});
+  auto store1 = FeatureStore::Owner(image1.GetDescriptors());
+  auto store2 = FeatureStore::Owner(image2.GetDescriptors());
+  REQUIRE(store1 != nullptr);
+  REQUIRE(store2 != nullptr);
+
+  // A copy of the descriptors of either image would be at least this large
+  const std::size_t min_bytes = std::min(
+      image1.GetDescriptors().total() * image1.GetDescriptors().elemSize(),
+      image2.GetDescriptors().total() * image2.GetDescriptors().elemSize());
+  const auto use_count1 = store1.use_count();
+  const auto use_count2 = store2.use_count();
+  CountingAllocator allocator(min_bytes);
+  cv::Mat::setDefaultAllocator(&allocator);
+  auto matches = xpano::algorithm::MatchImages(
+      image1, image2, {.cross_check = cross_check, .matcher = matcher});
+  cv::Mat::setDefaultAllocator(nullptr);
+
+  CHECK(!matches.empty());
+  CHECK(allocator.LargeAllocations() == 0);
+  // Matching reads the descriptors in place and keeps no references to them
+  CHECK(FeatureStore::Owner(image1.GetDescriptors()) == store1);
+  CHECK(FeatureStore::Owner(image2.GetDescriptors()) == store2);
+  CHECK(store1.use_count() == use_count1);
+  CHECK(store2.use_count() == use_count2);
+}
+
+TEST_CASE("Stitcher pipeline cross check") {
+  xpano::pipeline::StitcherPipeline stitcher;
+  auto result = stitcher.RunLoading(kInputs, {}, {}).get();
+  auto cross_checked =
+      stitcher.RunLoading(kInputs, {}, {.cross_check = true}).get();
+  auto progress = stitcher.Progress();
+  CHECK(progress.tasks_done == progress.num_tasks);
+
+  // Cross checking only drops the matches that aren't mutual
+  auto counts = InlierCounts(result.matches);
+  int num_pairs_with_fewer_inliers = 0;
+  for (const auto& [pair, count] : InlierCounts(cross_checked.matches)) {
+    REQUIRE(counts.contains(pair));
+    CHECK(count <= counts[pair]);
+    if (count < counts[pair]) {
+      num_pairs_with_fewer_inliers++;
+    }
+  }
+  CHECK(num_pairs_with_fewer_inliers > 0);
+  REQUIRE(cross_checked.panos.size() == 2);
+  CHECK_THAT(cross_checked.panos[0].ids, Equals<int>({1, 2, 3, 4, 5}));
+  CHECK_THAT(cross_checked.panos[1].ids, Equals<int>({6, 7, 8}));
+}
+
 // Clang-tidy doesn't like the macros
 // NOLINTBEGIN(readability-function-cognitive-complexity)
 
+TEST_CASE("Stitcher pipeline early exit matching") {
+  xpano::pipeline::StitcherPipeline stitcher;
+
+  auto result = stitcher.RunLoading(kInputs, {}, {.early_exit = true}).get();
+  auto progress = stitcher.Progress();
+  CHECK(progress.tasks_done == progress.num_tasks);
+
+  CHECK(result.images.size() == 10);
+  CHECK(result.matches.size() == 17);
+  const auto& stats = result.matching_stats;
+  CHECK(stats.full + stats.early_accepts + stats.early_rejects == 17);
+  CHECK(stats.early_accepts + stats.early_rejects > 0);
+  REQUIRE(result.panos.size() == 2);
+  REQUIRE_THAT(result.panos[0].ids, Equals<int>({1, 2, 3, 4, 5}));
+  REQUIRE_THAT(result.panos[1].ids, Equals<int>({6, 7, 8}));
+}
+
 TEST_CASE("Stitcher pipeline single pano matching") {
   xpano::pipeline::StitcherPipeline stitcher;
   auto result =
@@ -106,7 +622,7 @@ TEST_CASE("Stitcher pipeline single pano matching") {
                Equals<int>({0, 1, 2, 3, 4, 5, 6, 7, 8, 9}));
 
   for (const auto& image : result.images) {
-    REQUIRE(image.GetKeypoints().empty());
+    REQUIRE(image.GetKeypoints().Empty());
     REQUIRE(image.GetDescriptors().empty());
   }
 }
@@ -125,7 +641,7 @@ TEST_CASE("Stitcher pipeline no matching") {
   REQUIRE(result.panos.empty());
 
   for (const auto& image : result.images) {
-    REQUIRE(image.GetKeypoints().empty());
+    REQUIRE(image.GetKeypoints().Empty());
     REQUIRE(image.GetDescriptors().empty());
   }
 }
@@ -161,6 +677,41 @@ TEST_CASE("Stitcher pipeline custom matching neighborhood") {
   REQUIRE_THAT(result.panos[1].ids, Equals<int>({1, 3, 6}));
 }
 
+TEST_CASE("Stitcher pipeline unordered matching") {
+  xpano::pipeline::StitcherPipeline stitcher;
+
+  auto result =
+      stitcher
+          .RunLoading(kShuffledInputs, {},
+                      {.type = xpano::pipeline::MatchingType::kRetrieval})
+          .get();
+  auto progress = stitcher.Progress();
+  CHECK(progress.tasks_done == progress.num_tasks);
+
+  CHECK(result.images.size() == 10);
+  // Fewer than all the 45 pairs
+  CHECK(result.matches.size() < 45);
+  REQUIRE(result.panos.size() == 2);
+  REQUIRE_THAT(result.panos[0].ids, Equals<int>({0, 2, 4, 7, 9}));
+  REQUIRE_THAT(result.panos[1].ids, Equals<int>({1, 3, 6}));
+
+  // The exact search proposes the same pairs on every run
+  xpano::pipeline::StitcherPipeline other_stitcher;
+  auto again =
+      other_stitcher
+          .RunLoading(kShuffledInputs, {},
+                      {.type = xpano::pipeline::MatchingType::kRetrieval})
+          .get();
+  auto pairs = [](const std::vector<xpano::algorithm::Match>& matches) {
+    std::vector<std::pair<int, int>> ids;
+    for (const auto& [pair, count] : InlierCounts(matches)) {
+      ids.push_back(pair);
+    }
+    return ids;
+  };
+  CHECK(pairs(again.matches) == pairs(result.matches));
+}
+
 // NOLINTBEGIN(readability-magic-numbers)
 
 TEST_CASE("Stitcher pipeline larger neighborhood size") {
@@ -239,6 +790,239 @@ TEST_CASE("Stitcher pipeline loading options") {
                        allowed_margin));
 }
 
+TEST_CASE("Stitcher pipeline memory budget") {
+  xpano::pipeline::StitcherPipeline stitcher;
+
+  // Fits about one preview, the rest is spilled to the disk
+  auto result = stitcher.RunLoading(kInputs, {.memory_budget = 5}, {}).get();
+  auto progress = stitcher.Progress();
+  CHECK(progress.tasks_done == progress.num_tasks);
+
+  CHECK(result.images.size() == 10);
+  CHECK(result.matches.size() == 17);
+  REQUIRE(result.panos.size() == 2);
+  REQUIRE_THAT(result.panos[0].ids, Equals<int>({1, 2, 3, 4, 5}));
+  REQUIRE_THAT(result.panos[1].ids, Equals<int>({6, 7, 8}));
+
+  xpano::pipeline::StitcherPipeline reference_stitcher;
+  auto reference = reference_stitcher.RunLoading(kInputs, {}, {}).get();
+  REQUIRE(reference.images.size() == 10);
+  for (int i = 0; i < result.images.size(); i++) {
+    const auto& image = result.images[i];
+    const auto& reference_image = reference.images[i];
+    // Spilled data is read back without any loss
+    CHECK(cv::norm(image.GetPreview(), reference_image.GetPreview(),
+                   cv::NORM_INF) == 0.0);
+    CHECK(image.GetKeypoints().Size() == reference_image.GetKeypoints().Size());
+    CHECK(image.GetDescriptors().rows == image.GetKeypoints().Size());
+    CHECK(image.GetDescriptorIndex() != nullptr);
+  }
+
+  auto pano = stitcher.RunStitching(result, {.pano_id = 0}).get().pano;
+  CHECK(pano.has_value());
+}
+
+TEST_CASE("Stitcher pipeline quantized descriptors") {
+  xpano::pipeline::StitcherPipeline stitcher;
+  const xpano::pipeline::MatchingOptions exact = {
+      .matcher = xpano::algorithm::MatcherType::kSimd};
+
+  auto reference = stitcher.RunLoading(kInputs, {}, exact).get();
+  auto result =
+      stitcher.RunLoading(kInputs, {.quantize_descriptors = true}, exact)
+          .get();
+  REQUIRE(result.images.size() == 10);
+  for (int i = 0; i < result.images.size(); i++) {
+    auto descriptors = result.images[i].GetDescriptors();
+    auto reference_descriptors = reference.images[i].GetDescriptors();
+    CHECK(descriptors.type() == CV_8U);
+    CHECK(descriptors.total() == reference_descriptors.total());
+    cv::Mat restored;
+    descriptors.convertTo(restored, CV_32F);
+    CHECK(cv::norm(restored, reference_descriptors, cv::NORM_INF) == 0.0);
+  }
+
+  // The quantization is lossless and both searches are exact
+  CHECK(InlierCounts(result.matches) == InlierCounts(reference.matches));
+  REQUIRE(result.panos.size() == 2);
+  CHECK_THAT(result.panos[0].ids, Equals<int>({1, 2, 3, 4, 5}));
+  CHECK_THAT(result.panos[1].ids, Equals<int>({6, 7, 8}));
+
+  // Default FLANN matcher, falls back to the exact search
+  auto flann =
+      stitcher.RunLoading(kInputs, {.quantize_descriptors = true}, {}).get();
+  CHECK(InlierCounts(flann.matches) == InlierCounts(reference.matches));
+}
+
+// Inliers of the approximate FLANN search over floats and of the exact search
+// over the quantized descriptors, for each matched pair of the test data
+TEST_CASE("Quantized descriptors accuracy report", "[.report]") {
+  xpano::pipeline::StitcherPipeline stitcher;
+  auto flann = stitcher.RunLoading(kInputs, {}, {}).get();
+  auto quantized =
+      stitcher.RunLoading(kInputs, {.quantize_descriptors = true}, {}).get();
+
+  auto flann_counts = InlierCounts(flann.matches);
+  auto quantized_counts = InlierCounts(quantized.matches);
+  int flann_total = 0;
+  int quantized_total = 0;
+  std::cout << "pair\tfloat (FLANN)\tuint8 (exact)\n";
+  for (const auto& [pair, count] : flann_counts) {
+    int quantized_count = quantized_counts[pair];
+    std::cout << pair.first << "-" << pair.second << "\t" << count << "\t"
+              << quantized_count << "\n";
+    flann_total += count;
+    quantized_total += quantized_count;
+  }
+  std::cout << "total\t" << flann_total << "\t" << quantized_total << "\n";
+  CHECK(quantized.panos.size() == flann.panos.size());
+}
+
+TEST_CASE("Stitcher pipeline reduced decode") {
+  xpano::pipeline::StitcherPipeline stitcher;
+
+  // 2048 x 1536 jpeg inputs, decoded at 1/8, 1/4 and 1/2 scale
+  for (int preview_size : {256, 512, 1024}) {
+    auto result = stitcher
+                      .RunLoading({"data/image05.jpg"},
+                                  {.preview_longer_side = preview_size},
+                                  {.type = xpano::pipeline::MatchingType::kNone})
+                      .get();
+    REQUIRE(result.images.size() == 1);
+    auto preview = result.images[0].GetPreview();
+    CHECK(preview.cols == preview_size);
+    CHECK(preview.rows == preview_size * 3 / 4);
+    // Known without the full decode
+    CHECK(result.images[0].GetFullResSize() == cv::Size(2048, 1536));
+  }
+}
+
+// NOLINTBEGIN(readability-magic-numbers)
+
+TEST_CASE("Stitcher pipeline feature cache") {
+  const auto cache_path = xpano::tests::TmpPath();
+  xpano::pipeline::StitcherPipeline stitcher(cache_path);
+
+  auto result = stitcher.RunLoading(kInputs, {}, {}).get();
+  auto progress = stitcher.Progress();
+  CHECK(progress.tasks_done == progress.num_tasks);
+  CHECK(progress.cache_hits == 0);
+  CHECK(progress.cache_misses == 10);
+
+  auto cached_result = stitcher.RunLoading(kInputs, {}, {}).get();
+  progress = stitcher.Progress();
+  CHECK(progress.tasks_done == progress.num_tasks);
+  CHECK(progress.cache_hits == 10);
+  CHECK(progress.cache_misses == 0);
+
+  REQUIRE(cached_result.images.size() == result.images.size());
+  for (int i = 0; i < result.images.size(); i++) {
+    const auto& image = result.images[i];
+    const auto& cached_image = cached_result.images[i];
+    CHECK(cached_image.GetKeypoints().Size() == image.GetKeypoints().Size());
+    CHECK(cached_image.GetPreview().size() == image.GetPreview().size());
+    CHECK(cached_image.GetThumbnail().size() == image.GetThumbnail().size());
+    CHECK(cv::norm(cached_image.GetDescriptors(), image.GetDescriptors(),
+                   cv::NORM_INF) == 0.0);
+  }
+
+  CHECK(cached_result.matches.size() == result.matches.size());
+  REQUIRE(cached_result.panos.size() == 2);
+  REQUIRE_THAT(cached_result.panos[0].ids, Equals<int>({1, 2, 3, 4, 5}));
+  REQUIRE_THAT(cached_result.panos[1].ids, Equals<int>({6, 7, 8}));
+
+  // Different loading options don't hit the cache
+  stitcher.RunLoading({"data/image01.jpg"}, {.preview_longer_side = 512}, {})
+      .get();
+  progress = stitcher.Progress();
+  CHECK(progress.cache_hits == 0);
+  CHECK(progress.cache_misses == 1);
+
+  std::filesystem::remove_all(cache_path);
+}
+
+TEST_CASE("Stitcher pipeline project") {
+  const auto project_path =
+      xpano::tests::TmpPath().replace_extension("xpano");
+  xpano::pipeline::StitcherPipeline stitcher;
+
+  auto result = stitcher.RunLoading(kInputs, {}, {}).get();
+  // Edited pano
+  result.panos[1].ids.push_back(9);
+  result.panos[1].exported = true;
+
+  auto saved_path = stitcher.RunProjectSave(result, project_path).get();
+  auto progress = stitcher.Progress();
+  CHECK(progress.type == xpano::pipeline::ProgressType::kSavingProject);
+  CHECK(progress.tasks_done == 10);
+  CHECK(progress.num_tasks == 10);
+  REQUIRE(saved_path);
+  CHECK(*saved_path == project_path);
+
+  auto loaded = stitcher.RunProjectLoading(project_path, {}).get();
+  progress = stitcher.Progress();
+  CHECK(progress.type == xpano::pipeline::ProgressType::kLoadingProject);
+  CHECK(progress.tasks_done == 10);
+  CHECK(progress.num_tasks == 10);
+
+  REQUIRE(loaded.images.size() == result.images.size());
+  for (int i = 0; i < result.images.size(); i++) {
+    const auto& image = result.images[i];
+    const auto& loaded_image = loaded.images[i];
+    CHECK(loaded_image.GetPath() ==
+          std::filesystem::absolute(image.GetPath()));
+    CHECK(loaded_image.GetKeypoints().Size() == image.GetKeypoints().Size());
+    CHECK(cv::norm(loaded_image.GetPreview(), image.GetPreview(),
+                   cv::NORM_INF) == 0.0);
+    CHECK(cv::norm(loaded_image.GetThumbnail(), image.GetThumbnail(),
+                   cv::NORM_INF) == 0.0);
+    CHECK(cv::norm(loaded_image.GetDescriptors(), image.GetDescriptors(),
+                   cv::NORM_INF) == 0.0);
+  }
+
+  REQUIRE(loaded.matches.size() == result.matches.size());
+  for (int i = 0; i < result.matches.size(); i++) {
+    CHECK(loaded.matches[i].id1 == result.matches[i].id1);
+    CHECK(loaded.matches[i].id2 == result.matches[i].id2);
+    CHECK(loaded.matches[i].matches.size() ==
+          result.matches[i].matches.size());
+  }
+  CHECK(loaded.matching_stats.full == 17);
+  REQUIRE(loaded.panos.size() == 2);
+  CHECK_THAT(loaded.panos[0].ids, Equals<int>({1, 2, 3, 4, 5}));
+  CHECK_FALSE(loaded.panos[0].exported);
+  CHECK_THAT(loaded.panos[1].ids, Equals<int>({6, 7, 8, 9}));
+  CHECK(loaded.panos[1].exported);
+
+  // Stitched from the restored matches, without touching the keypoints again
+  auto pano = stitcher.RunStitching(loaded, {.pano_id = 0}).get().pano;
+  REQUIRE(pano.has_value());
+
+  // Not a project
+  auto invalid = stitcher.RunProjectLoading(kInputs[0], {}).get();
+  CHECK(invalid.images.empty());
+
+  // Size of the first preview past the end of the file, rejected before
+  // allocating for it
+  {
+    const auto path_length =
+        std::filesystem::absolute(kInputs[0]).string().size();
+    std::fstream stream(project_path,
+                        std::ios::binary | std::ios::in | std::ios::out);
+    stream.seekp(static_cast<std::streamoff>(4 + 4 + 8 + 8 + 8 + path_length +
+                                             1 + 4));
+    const std::uint64_t preview_size = UINT32_MAX;
+    stream.write(reinterpret_cast<const char*>(&preview_size),
+                 sizeof(preview_size));
+  }
+  auto corrupted = stitcher.RunProjectLoading(project_path, {}).get();
+  CHECK(corrupted.images.empty());
+
+  std::filesystem::remove(project_path);
+}
+
+// NOLINTEND(readability-magic-numbers)
+
 const std::vector<std::filesystem::path> kVerticalPanoInputs = {
     "data/image10.jpg",
     "data/image11.jpg",
@@ -361,6 +1145,39 @@ TEST_CASE("ExportWithoutMetadata") {
   std::filesystem::remove(tmp_path);
 }
 
+// Progressive JPEGs are encoded by OpenCV in memory, the metadata is added
+// before the file is written
+TEST_CASE("ExportWithMetadata progressive") {
+  const std::filesystem::path tmp_path =
+      xpano::tests::TmpPath().replace_extension("jpg");
+
+  xpano::pipeline::StitcherPipeline stitcher;
+  auto data = stitcher.RunLoading(kInputsWithExifMetadata, {}, {}).get();
+  REQUIRE(data.panos.size() == 1);
+  auto result =
+      stitcher
+          .RunStitching(data, {.pano_id = 0,
+                               .export_path = tmp_path,
+                               .compression = {.jpeg_progressive = true}})
+          .get();
+  REQUIRE(result.export_path.has_value());
+
+  auto image = cv::imread(tmp_path.string());
+  REQUIRE(!image.empty());
+
+#ifdef XPANO_WITH_EXIV2
+  auto read_img = Exiv2::ImageFactory::open(tmp_path.string());
+  read_img->readMetadata();
+  auto exif = read_img->exifData();
+
+  auto software = exif["Exif.Image.Software"].toString();
+  REQUIRE(software.starts_with("Xpano"));
+  CHECK(exif["Exif.Photo.PixelXDimension"].toUint32() == image.cols);
+  CHECK(exif["Exif.Photo.PixelYDimension"].toUint32() == image.rows);
+#endif
+  std::filesystem::remove(tmp_path);
+}
+
 const std::vector<std::filesystem::path> kTiffInputs = {
     "data/8bit.tif",
     "data/16bit.tif",
@@ -382,6 +1199,33 @@ TEST_CASE("TIFF inputs") {
   CHECK(preview1.depth() == CV_8U);
 }
 
+TEST_CASE("TIFF depth conversion") {
+  xpano::pipeline::StitcherPipeline stitcher;
+  for (auto depth_conversion : xpano::algorithm::kDepthConversions) {
+    auto result =
+        stitcher
+            .RunLoading({"data/16bit.tif"},
+                        {.depth_conversion = depth_conversion},
+                        {.type = xpano::pipeline::MatchingType::kNone})
+            .get();
+    REQUIRE(result.images.size() == 1);
+    REQUIRE(result.images[0].IsRaw());
+    CHECK(result.images[0].GetPreview().depth() == CV_8U);
+
+    auto full_res = result.images[0].GetFullRes();
+    REQUIRE(full_res.depth() == CV_8U);
+    CHECK(full_res.channels() == 3);
+
+    if (depth_conversion == xpano::algorithm::DepthConversion::kAutoRange) {
+      double min_value = 0.0;
+      double max_value = 0.0;
+      cv::minMaxLoc(full_res.reshape(1), &min_value, &max_value);
+      CHECK(min_value == 0.0);
+      CHECK(max_value == 255.0);
+    }
+  }
+}
+
 const std::filesystem::path kMalformedInput = "data/malformed.jpg";
 
 TEST_CASE("Malformed input") {
@@ -395,6 +1239,49 @@ TEST_CASE("Malformed input") {
   REQUIRE(result.panos.empty());
 }
 
+TEST_CASE("Malformed input among valid inputs") {
+  xpano::pipeline::StitcherPipeline stitcher;
+  auto result = stitcher
+                    .RunLoading({"data/image01.jpg", "data/image02.jpg",
+                                 kMalformedInput, "data/image03.jpg"},
+                                {}, {})
+                    .get();
+  auto progress = stitcher.Progress();
+  CHECK(progress.tasks_done == progress.num_tasks);
+  CHECK(progress.images_loaded == 4);
+
+  // The neighborhood spans the loaded images only, the ids are renumbered
+  REQUIRE(result.images.size() == 3);
+  REQUIRE(result.matches.size() == 3);
+  CHECK(result.matches[0].id1 == 0);
+  CHECK(result.matches[0].id2 == 1);
+  CHECK(result.matches[1].id1 == 0);
+  CHECK(result.matches[1].id2 == 2);
+  CHECK(result.matches[2].id1 == 1);
+  CHECK(result.matches[2].id2 == 2);
+  REQUIRE(result.panos.size() == 1);
+  REQUIRE_THAT(result.panos[0].ids, Equals<int>({0, 1, 2}));
+}
+
+TEST_CASE("Malformed input between neighbors") {
+  xpano::pipeline::StitcherPipeline stitcher;
+  auto result = stitcher
+                    .RunLoading({"data/image01.jpg", "data/image02.jpg",
+                                 kMalformedInput, "data/image03.jpg"},
+                                {}, {.neighborhood_search_size = 1})
+                    .get();
+  auto progress = stitcher.Progress();
+  CHECK(progress.tasks_done == progress.num_tasks);
+
+  // The images on both sides of the malformed input are matched together
+  REQUIRE(result.images.size() == 3);
+  REQUIRE(result.matches.size() == 2);
+  CHECK(result.matches[1].id1 == 1);
+  CHECK(result.matches[1].id2 == 2);
+  REQUIRE(result.panos.size() == 1);
+  REQUIRE_THAT(result.panos[0].ids, Equals<int>({0, 1, 2}));
+}
+
 #ifdef XPANO_WITH_MULTIBLEND
 TEST_CASE("Stitcher pipeline Multiblend") {
   xpano::pipeline::StitcherPipeline stitcher;
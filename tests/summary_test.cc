@@ -0,0 +1,183 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/cli/summary.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include <cctype>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include <catch2/catch_test_macros.hpp>
+#include <spdlog/spdlog.h>
+
+#include "tests/utils.h"
+#include "xpano/log/logger.h"
+
+namespace {
+
+// Syntax check of a JSON document, values are not decoded
+class JsonParser {
+ public:
+  explicit JsonParser(std::string_view text) : text_(text) {}
+
+  bool Parse() {
+    bool valid = Value();
+    SkipSpace();
+    return valid && pos_ == text_.size();
+  }
+
+ private:
+  void SkipSpace() {
+    while (pos_ < text_.size() &&
+           std::isspace(static_cast<unsigned char>(text_[pos_])) != 0) {
+      pos_++;
+    }
+  }
+
+  bool Consume(char character) {
+    SkipSpace();
+    if (pos_ < text_.size() && text_[pos_] == character) {
+      pos_++;
+      return true;
+    }
+    return false;
+  }
+
+  bool Literal(std::string_view literal) {
+    if (text_.substr(pos_, literal.size()) != literal) {
+      return false;
+    }
+    pos_ += literal.size();
+    return true;
+  }
+
+  bool String() {
+    if (!Consume('"')) {
+      return false;
+    }
+    while (pos_ < text_.size() && text_[pos_] != '"') {
+      pos_ += text_[pos_] == '\\' ? 2 : 1;
+    }
+    return Consume('"');
+  }
+
+  bool Number() {
+    auto start = pos_;
+    while (pos_ < text_.size() &&
+           (std::isdigit(static_cast<unsigned char>(text_[pos_])) != 0 ||
+            std::string_view("+-.eE").find(text_[pos_]) !=
+                std::string_view::npos)) {
+      pos_++;
+    }
+    return pos_ > start;
+  }
+
+  template <typename TElement>
+  bool Sequence(char close, TElement element) {
+    if (Consume(close)) {
+      return true;
+    }
+    do {
+      if (!element()) {
+        return false;
+      }
+    } while (Consume(','));
+    return Consume(close);
+  }
+
+  bool Value() {
+    SkipSpace();
+    if (Consume('{')) {
+      return Sequence('}', [this]() {
+        return String() && Consume(':') && Value();
+      });
+    }
+    if (Consume('[')) {
+      return Sequence(']', [this]() { return Value(); });
+    }
+    if (pos_ < text_.size() && text_[pos_] == '"') {
+      return String();
+    }
+    return Literal("true") || Literal("false") || Literal("null") || Number();
+  }
+
+  std::string_view text_;
+  std::size_t pos_ = 0;
+};
+
+}  // namespace
+
+TEST_CASE("Summary empty") {
+  CHECK(xpano::cli::ToJson({}) ==
+        R"({"inputs":0,"images":0,"panos_found":0,"panos_exported":0,)"
+        R"("timings":{},"panos":[]})");
+}
+
+TEST_CASE("Summary panos") {
+  xpano::cli::Summary summary{
+      .num_inputs = 3,
+      .num_images = 2,
+      .timings = {{"loading", 1.5}, {"total", 2.25}},
+      .panos = {{.pano_id = 0,
+                 .num_images = 2,
+                 .export_path = "pano.jpg",
+                 .width = 10,
+                 .height = 5,
+                 .file_size = 1234,
+                 .seconds = 0.5},
+                {.pano_id = 1, .num_images = 1}}};
+
+  CHECK(xpano::cli::ToJson(summary) ==
+        R"({"inputs":3,"images":2,"panos_found":2,"panos_exported":1,)"
+        R"("timings":{"loading":1.500,"total":2.250},"panos":[)"
+        R"({"id":0,"images":2,"exported":true,"path":"pano.jpg","width":10,)"
+        R"("height":5,"file_size":1234,"seconds":0.500},)"
+        R"({"id":1,"images":1,"exported":false,"path":null,"width":0,)"
+        R"("height":0,"file_size":0,"seconds":0.000}]})");
+}
+
+TEST_CASE("Summary escaping") {
+  xpano::cli::Summary summary{
+      .panos = {{.export_path = "dir\\\"quoted\"\n.jpg"}}};
+
+  auto json = xpano::cli::ToJson(summary);
+  CHECK(json.find(R"("path":"dir\\\"quoted\"\n.jpg")") != std::string::npos);
+}
+
+#ifndef _WIN32
+TEST_CASE("Summary is the only output on stdout") {
+  const auto path = xpano::tests::TmpPath();
+  xpano::logger::RedirectSpdlogToCerr();
+
+  std::fflush(stdout);
+  int saved_stdout = dup(STDOUT_FILENO);
+  std::FILE* file = std::fopen(path.c_str(), "w");
+  REQUIRE(file != nullptr);
+  dup2(fileno(file), STDOUT_FILENO);
+  std::fclose(file);
+
+  spdlog::info("Logged while the summary is printed");
+  xpano::cli::WriteSummary(
+      {.num_inputs = 1, .panos = {{.export_path = "pano.jpg"}}},
+      /*print=*/true, std::nullopt);
+  std::fflush(stdout);
+  dup2(saved_stdout, STDOUT_FILENO);
+  close(saved_stdout);
+
+  std::ifstream stream(path);
+  std::string line;
+  REQUIRE(std::getline(stream, line));
+  CHECK(JsonParser(line).Parse());
+  CHECK(!std::getline(stream, line));
+  stream.close();
+  std::filesystem::remove(path);
+}
+#endif
@@ -0,0 +1,77 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/cli/watch.h"
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/matchers/catch_matchers_vector.hpp>
+
+#include "tests/utils.h"
+
+using Catch::Matchers::Equals;
+using Catch::Matchers::UnorderedEquals;
+using xpano::algorithm::Pano;
+using xpano::cli::watch::StabilityTracker;
+
+namespace {
+
+std::vector<std::vector<int>> Ids(const std::vector<Pano>& panos) {
+  std::vector<std::vector<int>> ids;
+  for (const auto& pano : panos) {
+    ids.push_back(pano.ids);
+  }
+  return ids;
+}
+
+void Touch(const std::filesystem::path& path) {
+  std::ofstream stream(path);
+  stream << "data";
+}
+
+}  // namespace
+
+TEST_CASE("Stability tracker") {
+  using std::chrono::seconds;
+  StabilityTracker tracker(seconds(10));
+  StabilityTracker::Clock::time_point start{};
+
+  tracker.Update({{{0, 1}}, {{3, 4}}}, start);
+  CHECK(tracker.TakeStable(start + seconds(5)).empty());
+
+  // The first pano grows, so it has to be stable again
+  tracker.Update({{{0, 1, 2}}, {{3, 4}}}, start + seconds(5));
+  CHECK_THAT(Ids(tracker.TakeStable(start + seconds(10))),
+             Equals(std::vector<std::vector<int>>{{3, 4}}));
+  CHECK(tracker.TakeStable(start + seconds(12)).empty());
+  CHECK_THAT(Ids(tracker.TakeStable(start + seconds(15))),
+             Equals(std::vector<std::vector<int>>{{0, 1, 2}}));
+  CHECK(tracker.TakeStable(start + seconds(100)).empty());
+}
+
+TEST_CASE("Directory watcher") {
+  const auto directory = xpano::tests::TmpPath();
+  std::filesystem::create_directories(directory);
+  Touch(directory / "existing.jpg");
+
+  {
+    xpano::cli::watch::DirectoryWatcher watcher(directory);
+    REQUIRE(watcher.IsValid());
+    CHECK_THAT(watcher.Poll(std::chrono::milliseconds(100)),
+               Equals(std::vector<std::filesystem::path>{directory /
+                                                         "existing.jpg"}));
+
+    Touch(directory / "new1.jpg");
+    Touch(directory / "new2.jpg");
+    std::filesystem::create_directories(directory / "subdir");
+    CHECK_THAT(watcher.Poll(std::chrono::milliseconds(1000)),
+               UnorderedEquals(std::vector<std::filesystem::path>{
+                   directory / "new1.jpg", directory / "new2.jpg"}));
+    CHECK(watcher.Poll(std::chrono::milliseconds(100)).empty());
+  }
+  std::filesystem::remove_all(directory);
+}
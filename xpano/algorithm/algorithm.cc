@@ -5,7 +5,9 @@
 #include "xpano/algorithm/algorithm.h"
 
 #include <algorithm>
+#include <cmath>
 #include <iterator>
+#include <limits>
 #include <numeric>
 #include <optional>
 #include <stdexcept>
@@ -18,14 +20,21 @@
 #include <opencv2/calib3d.hpp>
 #include <opencv2/core.hpp>
 #include <opencv2/features2d.hpp>
+#include <opencv2/imgproc.hpp>
 #include <opencv2/photo.hpp>
 #include <opencv2/stitching.hpp>
+#include <opencv2/stitching/detail/camera.hpp>
+#include <opencv2/stitching/detail/exposure_compensate.hpp>
 #include <opencv2/stitching/detail/matchers.hpp>
+#include <opencv2/stitching/detail/motion_estimators.hpp>
+#include <opencv2/stitching/detail/seam_finders.hpp>
 
 #include "xpano/algorithm/auto_crop.h"
 #include "xpano/algorithm/bundle_adjuster.h"
 #include "xpano/algorithm/image.h"
+#include "xpano/algorithm/matcher.h"
 #include "xpano/algorithm/multiblend.h"
+#include "xpano/constants.h"
 #include "xpano/utils/disjoint_set.h"
 #include "xpano/utils/rect.h"
 #include "xpano/utils/threadpool.h"
@@ -138,27 +147,78 @@ cv::Ptr<cv::detail::Blender> PickBlender(BlendingMethod blending_method,
   }
 }
 
-}  // namespace
+cv::Ptr<cv::Stitcher> CreateStitcher(
+    const StitchOptions& options,
+    const cv::Ptr<BundleAdjusterRayCustom>& bundle_adjuster) {
+  auto stitcher = cv::Stitcher::create(cv::Stitcher::PANORAMA);
+  stitcher->setWarper(PickWarper(options.projection));
+  stitcher->setFeaturesFinder(PickFeaturesFinder(options.feature));
+  stitcher->setFeaturesMatcher(cv::makePtr<cv::detail::BestOf2NearestMatcher>(
+      false, options.match_conf));
+  stitcher->setWaveCorrection(options.wave_correction !=
+                              WaveCorrectionType::kOff);
+  if (stitcher->waveCorrection()) {
+    stitcher->setWaveCorrectKind(PickWaveCorrectKind(options.wave_correction));
+  }
+  stitcher->setBundleAdjuster(bundle_adjuster);
+  return stitcher;
+}
 
-std::vector<cv::DMatch> MatchImages(const Image& img1, const Image& img2,
-                                    float match_conf) {
-  if (img1.GetKeypoints().empty() || img2.GetKeypoints().empty()) {
-    return {};
+void Rotate(WaveCorrectionType wave_correction,
+            cv::detail::WaveCorrectKind wave_correction_auto, cv::Mat* pano,
+            cv::Mat* mask) {
+  if (auto rotate = GetRotationFlags(wave_correction, wave_correction_auto);
+      rotate) {
+    cv::rotate(*pano, *pano, *rotate);
+    if (mask) {
+      cv::rotate(*mask, *mask, *rotate);
+    }
   }
+}
 
-  // KNN MATCH, K = 2
-  cv::FlannBasedMatcher matcher;
-  std::vector<std::vector<cv::DMatch>> matches;
-  matcher.knnMatch(img1.GetDescriptors(), img2.GetDescriptors(), matches, 2);
+void ScaleCamera(double scale, cv::detail::CameraParams* camera) {
+  camera->focal *= scale;
+  camera->ppx *= scale;
+  camera->ppy *= scale;
+}
 
-  // FILTER BY FIRST/SECOND RATIO
+std::vector<cv::DMatch> RatioTest(
+    const std::vector<NearestNeighbors>& neighbors, float match_conf) {
   std::vector<cv::DMatch> good_matches;
-  for (const auto& match : matches) {
-    if (match[0].distance < (1.0f - match_conf) * match[1].distance) {
-      good_matches.push_back(match[0]);
+  for (int row = 0; row < neighbors.size(); row++) {
+    const auto& match = neighbors[row];
+    if (match.best < 0 || match.second < 0) {
+      continue;
+    }
+    if (match.best_distance < (1.0f - match_conf) * match.second_distance) {
+      good_matches.emplace_back(row, match.best, match.best_distance);
     }
   }
+  return good_matches;
+}
 
+std::vector<cv::DMatch> RatioTestMatches(const Image& query,
+                                         const Image& train,
+                                         const MatchOptions& options) {
+  return RatioTest(KnnMatch(query, train, options.matcher),
+                   options.match_conf);
+}
+
+// Keeps the forward matches that are also the best backward matches
+void CrossCheck(const std::vector<cv::DMatch>& backward_matches,
+                int num_train_keypoints, std::vector<cv::DMatch>* matches) {
+  std::vector<int> backward(num_train_keypoints, -1);
+  for (const auto& match : backward_matches) {
+    backward[match.queryIdx] = match.trainIdx;
+  }
+  std::erase_if(*matches, [&backward](const cv::DMatch& match) {
+    return backward[match.trainIdx] != match.queryIdx;
+  });
+}
+
+std::vector<cv::DMatch> HomographyInliers(
+    const Image& img1, const Image& img2,
+    const std::vector<cv::DMatch>& good_matches) {
   if (good_matches.size() < 4) {
     return {};
   }
@@ -168,10 +228,12 @@ std::vector<cv::DMatch> MatchImages(const Image& img1, const Image& img2,
   cv::Mat src_points(1, num_good_matches, CV_32FC2);
   cv::Mat dst_points(1, num_good_matches, CV_32FC2);
   cv::Mat dst_points_proj;
+  auto keypoints1 = img1.GetKeypoints();
+  auto keypoints2 = img2.GetKeypoints();
   int idx = 0;
-  for (cv::DMatch& match : good_matches) {
-    src_points.at<cv::Vec2f>(0, idx) = img1.GetKeypoints()[match.queryIdx].pt;
-    dst_points.at<cv::Vec2f>(0, idx) = img2.GetKeypoints()[match.trainIdx].pt;
+  for (const cv::DMatch& match : good_matches) {
+    src_points.at<cv::Vec2f>(0, idx) = keypoints1.Point(match.queryIdx);
+    dst_points.at<cv::Vec2f>(0, idx) = keypoints2.Point(match.trainIdx);
     idx++;
   }
   cv::Mat h_mat = cv::findHomography(src_points, dst_points, cv::RANSAC, 3);
@@ -193,26 +255,501 @@ std::vector<cv::DMatch> MatchImages(const Image& img1, const Image& img2,
   return inliers;
 }
 
-std::vector<Pano> FindPanos(const std::vector<Match>& matches,
-                            int match_threshold) {
-  auto pano_ds = utils::DisjointSet();
+// Indices of the count keypoints with the highest detector response
+std::vector<int> StrongestKeypoints(const KeypointsView& keypoints,
+                                    int count) {
+  std::vector<int> ids(keypoints.Size());
+  std::iota(ids.begin(), ids.end(), 0);
+  std::partial_sort(ids.begin(), ids.begin() + count, ids.end(),
+                    [response = keypoints.response](int lhs, int rhs) {
+                      return response[lhs] > response[rhs];
+                    });
+  ids.resize(count);
+  return ids;
+}
+
+cv::Mat SelectRows(const cv::Mat& mat, const std::vector<int>& rows) {
+  cv::Mat result(static_cast<int>(rows.size()), mat.cols, mat.type());
+  for (int i = 0; i < rows.size(); i++) {
+    mat.row(rows[i]).copyTo(result.row(i));
+  }
+  return result;
+}
+
+// Inliers among the strongest keypoints only, with the indices of all the
+// keypoints. Empty optional when the images have too few keypoints to gain
+// anything.
+std::optional<std::vector<cv::DMatch>> MatchStrongestKeypoints(
+    const Image& img1, const Image& img2, const MatchOptions& options) {
+  if (img1.GetKeypoints().Size() <= kEarlyExitKeypoints ||
+      img2.GetKeypoints().Size() <= kEarlyExitKeypoints) {
+    return {};
+  }
 
-  std::unordered_set<int> images_in_panos;
+  auto ids1 = StrongestKeypoints(img1.GetKeypoints(), kEarlyExitKeypoints);
+  auto ids2 = StrongestKeypoints(img2.GetKeypoints(), kEarlyExitKeypoints);
+  cv::Mat descriptors1 = SelectRows(img1.GetDescriptors(), ids1);
+  cv::Mat descriptors2 = SelectRows(img2.GetDescriptors(), ids2);
+
+  // Exact search, building an index for a few hundred descriptors would
+  // cost more than it saves
+  auto good_matches =
+      RatioTest(SimdKnnMatch(descriptors1, descriptors2), options.match_conf);
+  if (options.cross_check) {
+    CrossCheck(RatioTest(SimdKnnMatch(descriptors2, descriptors1),
+                         options.match_conf),
+               kEarlyExitKeypoints, &good_matches);
+  }
+  for (auto& match : good_matches) {
+    match.queryIdx = ids1[match.queryIdx];
+    match.trainIdx = ids2[match.trainIdx];
+  }
+  return HomographyInliers(img1, img2, good_matches);
+}
+
+std::vector<cv::DMatch> MatchAllKeypoints(const Image& img1, const Image& img2,
+                                          const MatchOptions& options) {
+  // KNN MATCH, K = 2, FILTER BY FIRST/SECOND RATIO
+  auto good_matches = RatioTestMatches(img1, img2, options);
+  if (options.cross_check) {
+    CrossCheck(RatioTestMatches(img2, img1, options),
+               img2.GetKeypoints().Size(), &good_matches);
+  }
+  return HomographyInliers(img1, img2, good_matches);
+}
+
+cv::detail::ImageFeatures ToImageFeatures(const Image& image, int img_idx) {
+  cv::detail::ImageFeatures features;
+  features.img_idx = img_idx;
+  features.img_size = image.GetPreviewSize();
+  // Descriptors are only needed for matching, which has already been done
+  features.keypoints = image.GetKeypoints().ToKeyPoints();
+  return features;
+}
+
+// Same as cv::detail::BestOf2NearestMatcher, except for the matching itself.
+// The matches are already RANSAC inliers, so the "too close images" check of
+// OpenCV would reject most pairs and is left out.
+cv::detail::MatchesInfo ToMatchesInfo(
+    const cv::detail::ImageFeatures& features1,
+    const cv::detail::ImageFeatures& features2,
+    const std::vector<cv::DMatch>& matches) {
+  cv::detail::MatchesInfo matches_info;
+  matches_info.matches = matches;
+  if (static_cast<int>(matches.size()) < kMinMatchesForHomography) {
+    return matches_info;
+  }
+
+  // Homography in coordinates relative to the image centers
+  auto centered = [](const cv::detail::ImageFeatures& features, int idx) {
+    cv::Point2f point = features.keypoints[idx].pt;
+    point.x -= static_cast<float>(features.img_size.width) * 0.5f;
+    point.y -= static_cast<float>(features.img_size.height) * 0.5f;
+    return point;
+  };
+  std::vector<cv::Point2f> src_points;
+  std::vector<cv::Point2f> dst_points;
   for (const auto& match : matches) {
-    if (match.matches.size() > match_threshold) {
-      pano_ds.Union(match.id1, match.id2);
-      images_in_panos.insert(match.id1);
-      images_in_panos.insert(match.id2);
+    src_points.push_back(centered(features1, match.queryIdx));
+    dst_points.push_back(centered(features2, match.trainIdx));
+  }
+
+  matches_info.H = cv::findHomography(src_points, dst_points,
+                                      matches_info.inliers_mask, cv::RANSAC);
+  if (matches_info.H.empty() ||
+      std::abs(cv::determinant(matches_info.H)) <
+          std::numeric_limits<double>::epsilon()) {
+    return matches_info;
+  }
+
+  matches_info.num_inliers = static_cast<int>(
+      std::count(matches_info.inliers_mask.begin(),
+                 matches_info.inliers_mask.end(), static_cast<uchar>(1)));
+  // http://matthewalunbrown.com/papers/ijcv2007.pdf
+  matches_info.confidence =
+      matches_info.num_inliers / (8 + 0.3 * matches_info.matches.size());
+  if (matches_info.num_inliers < kMinMatchesForHomography) {
+    return matches_info;
+  }
+
+  // Refine the homography on the inliers only
+  src_points.clear();
+  dst_points.clear();
+  for (int i = 0; i < matches.size(); i++) {
+    if (matches_info.inliers_mask[i]) {
+      src_points.push_back(centered(features1, matches[i].queryIdx));
+      dst_points.push_back(centered(features2, matches[i].trainIdx));
+    }
+  }
+  matches_info.H = cv::findHomography(src_points, dst_points, cv::RANSAC);
+  return matches_info;
+}
+
+// Fills both directions of the pair, same as cv::detail::FeaturesMatcher
+void SetPairwiseMatches(
+    int num_images, int from, int to, cv::detail::MatchesInfo matches_info,
+    std::vector<cv::detail::MatchesInfo>* pairwise_matches) {
+  matches_info.src_img_idx = from;
+  matches_info.dst_img_idx = to;
+
+  auto dual = matches_info;
+  dual.src_img_idx = to;
+  dual.dst_img_idx = from;
+  if (!matches_info.H.empty()) {
+    dual.H = matches_info.H.inv();
+  }
+  for (auto& match : dual.matches) {
+    std::swap(match.queryIdx, match.trainIdx);
+  }
+
+  (*pairwise_matches)[from * num_images + to] = std::move(matches_info);
+  (*pairwise_matches)[to * num_images + from] = std::move(dual);
+}
+
+bool IsConnected(int num_images,
+                 const std::vector<cv::detail::MatchesInfo>& pairwise_matches) {
+  utils::DisjointSet components;
+  for (const auto& matches_info : pairwise_matches) {
+    if (matches_info.confidence > kPanoConfidenceThresh) {
+      components.Union(matches_info.src_img_idx, matches_info.dst_img_idx);
+    }
+  }
+  int root = components.Find(0);
+  for (int i = 1; i < num_images; i++) {
+    if (components.Find(i) != root) {
+      return false;
+    }
+  }
+  return true;
+}
+
+cv::Stitcher::Status CheckRegistration(const Registration& registration) {
+  if (registration.status != cv::Stitcher::OK) {
+    return registration.status;
+  }
+  if (registration.component.size() < 2 ||
+      registration.cameras.size() != registration.component.size()) {
+    return cv::Stitcher::ERR_NEED_MORE_IMGS;
+  }
+  return cv::Stitcher::OK;
+}
+
+// Seams and exposure, estimated on downscaled previews
+struct SeamEstimate {
+  cv::Ptr<cv::WarperCreator> warper_creator;
+  double warped_image_scale;
+  std::vector<cv::UMat> seam_masks;
+  cv::Ptr<cv::detail::ExposureCompensator> compensator;
+};
+
+SeamEstimate EstimateSeams(const std::vector<cv::Mat>& previews,
+                           const Registration& registration,
+                           const StitchOptions& options) {
+  const auto& component = registration.component;
+  int num_images = static_cast<int>(component.size());
+
+  std::vector<double> focals;
+  focals.reserve(num_images);
+  for (const auto& camera : registration.cameras) {
+    focals.push_back(camera.focal);
+  }
+  std::sort(focals.begin(), focals.end());
+  double warped_image_scale =
+      (num_images % 2 == 1)
+          ? focals[num_images / 2]
+          : (focals[num_images / 2 - 1] + focals[num_images / 2]) * 0.5;
+  auto warper_creator = PickWarper(options.projection);
+
+  const auto& first_preview = previews[component[0]];
+  double seam_scale = std::min(
+      1.0, std::sqrt(kSeamEstimationResol * kMegapixel /
+                     static_cast<double>(first_preview.size().area())));
+  auto seam_warper = warper_creator->create(
+      static_cast<float>(warped_image_scale * seam_scale));
+
+  std::vector<cv::Point> corners(num_images);
+  std::vector<cv::UMat> seam_images(num_images);
+  std::vector<cv::UMat> seam_masks(num_images);
+  for (int i = 0; i < num_images; i++) {
+    cv::Mat seam_image;
+    cv::resize(previews[component[i]], seam_image, cv::Size(), seam_scale,
+               seam_scale, cv::INTER_LINEAR_EXACT);
+    auto camera = registration.cameras[i];
+    ScaleCamera(seam_scale, &camera);
+    cv::Mat k_mat;
+    camera.K().convertTo(k_mat, CV_32F);
+
+    corners[i] =
+        seam_warper->warp(seam_image, k_mat, camera.R, cv::INTER_LINEAR,
+                          cv::BORDER_REFLECT, seam_images[i]);
+    cv::Mat mask(seam_image.size(), CV_8U,
+                 cv::Scalar::all(crop::kMaskValueOn));
+    seam_warper->warp(mask, k_mat, camera.R, cv::INTER_NEAREST,
+                      cv::BORDER_CONSTANT, seam_masks[i]);
+  }
+
+  auto compensator = cv::detail::ExposureCompensator::createDefault(
+      cv::detail::ExposureCompensator::GAIN_BLOCKS);
+  compensator->feed(corners, seam_images, seam_masks);
+
+  std::vector<cv::UMat> seam_images_f(num_images);
+  for (int i = 0; i < num_images; i++) {
+    seam_images[i].convertTo(seam_images_f[i], CV_32F);
+  }
+  cv::detail::GraphCutSeamFinder seam_finder(
+      cv::detail::GraphCutSeamFinderBase::COST_COLOR);
+  seam_finder.find(seam_images_f, corners, seam_masks);
+
+  return {warper_creator, warped_image_scale, std::move(seam_masks),
+          compensator};
+}
+
+// Full resolution cameras and warped image areas, shared by all the tiles
+struct TiledComposition {
+  std::vector<int> image_ids;
+  std::vector<cv::Size> image_sizes;
+  cv::Ptr<cv::detail::RotationWarper> warper;
+  std::vector<cv::Mat> k_mats;
+  std::vector<cv::Mat> rotations;
+  std::vector<cv::Rect> rois;
+  cv::Rect pano_roi;
+  // Gain maps and dilated seam masks at the seam estimation scale, these
+  // cover the whole warped images
+  std::vector<cv::Mat> gains;
+  std::vector<cv::Mat> seam_masks;
+};
+
+// Interpolation between the nodes of a sparse grid along one axis
+struct GridAxis {
+  std::vector<int> nodes;
+  std::vector<int> cells;
+  std::vector<float> weights;
+};
+
+GridAxis MakeGridAxis(int length) {
+  GridAxis axis;
+  for (int pos = 0; pos < length - 1; pos += kWarpGridStep) {
+    axis.nodes.push_back(pos);
+  }
+  axis.nodes.push_back(std::max(0, length - 1));
+  if (axis.nodes.size() == 1) {
+    axis.nodes.push_back(axis.nodes[0]);
+  }
+
+  int last_cell = static_cast<int>(axis.nodes.size()) - 2;
+  for (int pos = 0; pos < length; pos++) {
+    int cell = std::min(pos / kWarpGridStep, last_cell);
+    int span = axis.nodes[cell + 1] - axis.nodes[cell];
+    axis.cells.push_back(cell);
+    axis.weights.push_back(
+        span > 0 ? static_cast<float>(pos - axis.nodes[cell]) /
+                       static_cast<float>(span)
+                 : 0.0f);
+  }
+  return axis;
+}
+
+// Source image coordinates of a region of the warped image, for cv::remap.
+// The projection is evaluated on a sparse grid only, it is smooth enough for
+// the interpolation error to stay far below a pixel.
+void BackwardMaps(const TiledComposition& composition, int index,
+                  cv::Rect region, cv::Mat* xmap, cv::Mat* ymap) {
+  auto axis_x = MakeGridAxis(region.width);
+  auto axis_y = MakeGridAxis(region.height);
+
+  cv::Mat grid_x(static_cast<int>(axis_y.nodes.size()),
+                 static_cast<int>(axis_x.nodes.size()), CV_32F);
+  cv::Mat grid_y(grid_x.size(), CV_32F);
+  for (int node_y = 0; node_y < grid_x.rows; node_y++) {
+    for (int node_x = 0; node_x < grid_x.cols; node_x++) {
+      auto point = composition.warper->warpPointBackward(
+          cv::Point2f(static_cast<float>(region.x + axis_x.nodes[node_x]),
+                      static_cast<float>(region.y + axis_y.nodes[node_y])),
+          composition.k_mats[index], composition.rotations[index]);
+      grid_x.at<float>(node_y, node_x) = point.x;
+      grid_y.at<float>(node_y, node_x) = point.y;
+    }
+  }
+
+  xmap->create(region.size(), CV_32F);
+  ymap->create(region.size(), CV_32F);
+  for (int y = 0; y < region.height; y++) {
+    int cell_y = axis_y.cells[y];
+    float weight_y = axis_y.weights[y];
+    auto interpolate = [cell_y, weight_y](const cv::Mat& grid, int cell_x,
+                                          float weight_x) {
+      const auto* top = grid.ptr<float>(cell_y);
+      const auto* bottom = grid.ptr<float>(cell_y + 1);
+      float upper = top[cell_x] + (top[cell_x + 1] - top[cell_x]) * weight_x;
+      float lower =
+          bottom[cell_x] + (bottom[cell_x + 1] - bottom[cell_x]) * weight_x;
+      return upper + (lower - upper) * weight_y;
+    };
+    auto* xmap_row = xmap->ptr<float>(y);
+    auto* ymap_row = ymap->ptr<float>(y);
+    for (int x = 0; x < region.width; x++) {
+      xmap_row[x] = interpolate(grid_x, axis_x.cells[x], axis_x.weights[x]);
+      ymap_row[x] = interpolate(grid_y, axis_x.cells[x], axis_x.weights[x]);
+    }
+  }
+}
+
+// Region of a map covering the whole warped image, upscaled the same way as
+// cv::resize to the full warped image size would
+cv::Mat ResizeRegion(const cv::Mat& map, cv::Size full_size, cv::Rect region,
+                     int interpolation) {
+  double scale_x = static_cast<double>(map.cols) / full_size.width;
+  double scale_y = static_cast<double>(map.rows) / full_size.height;
+  cv::Matx23d transform(scale_x, 0.0, (region.x + 0.5) * scale_x - 0.5, 0.0,
+                        scale_y, (region.y + 0.5) * scale_y - 0.5);
+  cv::Mat result;
+  cv::warpAffine(map, result, transform, region.size(),
+                 interpolation | cv::WARP_INVERSE_MAP, cv::BORDER_REPLICATE);
+  return result;
+}
+
+// Composes the tile from the parts of the images overlapping it, same as
+// Compose does for the whole panorama
+std::pair<cv::Mat, cv::Mat> ComposeTile(const TiledComposition& composition,
+                                        const ImageLoader& load_image,
+                                        cv::Rect tile) {
+  // The pyramids near the tile edges depend on the pixels around the tile
+  cv::Rect area(tile.x - kTileBlendingMargin, tile.y - kTileBlendingMargin,
+                tile.width + 2 * kTileBlendingMargin,
+                tile.height + 2 * kTileBlendingMargin);
+  area &= composition.pano_roi;
+
+  cv::detail::MultiBandBlender blender;
+  blender.prepare(area);
+  bool any_image = false;
+  for (int i = 0; i < composition.rois.size(); i++) {
+    cv::Rect region = composition.rois[i] & area;
+    if (region.empty()) {
+      continue;
+    }
+    cv::Mat image = load_image(composition.image_ids[i]);
+    cv::Mat xmap;
+    cv::Mat ymap;
+    BackwardMaps(composition, i, region, &xmap, &ymap);
+
+    cv::Mat image_warped;
+    cv::remap(image, image_warped, xmap, ymap, cv::INTER_LINEAR,
+              cv::BORDER_REFLECT);
+    // Same as warping a mask of the whole image with cv::INTER_NEAREST
+    cv::Mat inside_x;
+    cv::Mat inside_y;
+    cv::inRange(xmap, -0.5, image.cols - 0.5, inside_x);
+    cv::inRange(ymap, -0.5, image.rows - 0.5, inside_y);
+    cv::Mat mask_warped = inside_x & inside_y;
+    xmap.release();
+    ymap.release();
+
+    auto roi_size = composition.rois[i].size();
+    auto local_region = region - composition.rois[i].tl();
+    cv::Mat gain = ResizeRegion(composition.gains[i], roi_size, local_region,
+                                cv::INTER_LINEAR);
+    if (gain.channels() != image_warped.channels()) {
+      std::vector<cv::Mat> gain_channels(image_warped.channels(), gain);
+      cv::merge(gain_channels, gain);
+    }
+    cv::multiply(image_warped, gain, image_warped, 1, image_warped.type());
+
+    cv::Mat image_warped_s;
+    image_warped.convertTo(image_warped_s, CV_16S);
+    image_warped.release();
+
+    cv::Mat seam_mask = ResizeRegion(composition.seam_masks[i], roi_size,
+                                     local_region, cv::INTER_LINEAR);
+    mask_warped = seam_mask & mask_warped;
+
+    blender.feed(image_warped_s, mask_warped, region.tl());
+    any_image = true;
+  }
+
+  auto tile_in_area = tile - area.tl();
+  if (!any_image) {
+    return {cv::Mat::zeros(tile.size(), CV_8UC3),
+            cv::Mat::zeros(tile.size(), CV_8U)};
+  }
+  cv::Mat result;
+  cv::Mat result_mask;
+  blender.blend(result, result_mask);
+
+  cv::Mat pano;
+  result(tile_in_area).convertTo(pano, CV_8U);
+  return {pano, result_mask(tile_in_area).clone()};
+}
+
+}  // namespace
+
+std::vector<cv::DMatch> MatchImages(const Image& img1, const Image& img2,
+                                    const MatchOptions& options,
+                                    MatchPath* path) {
+  auto set_path = [path](MatchPath value) {
+    if (path != nullptr) {
+      *path = value;
+    }
+  };
+  set_path(MatchPath::kFull);
+  if (img1.GetKeypoints().Empty() || img2.GetKeypoints().Empty()) {
+    return {};
+  }
+
+  int threshold = options.early_exit_threshold;
+  if (auto inliers = threshold > 0
+                         ? MatchStrongestKeypoints(img1, img2, options)
+                         : std::nullopt;
+      inliers) {
+    if (inliers->size() > threshold) {
+      set_path(MatchPath::kEarlyAccept);
+      return *inliers;
+    }
+    // The strongest keypoints are the most repeatable ones, so scaling up
+    // their inliers overestimates the inliers of the full matching
+    auto num_keypoints =
+        std::min(img1.GetKeypoints().Size(), img2.GetKeypoints().Size());
+    double projected_inliers = static_cast<double>(inliers->size()) *
+                               static_cast<double>(num_keypoints) /
+                               kEarlyExitKeypoints;
+    if (projected_inliers < kEarlyRejectRatio * threshold) {
+      set_path(MatchPath::kEarlyReject);
+      return {};
     }
   }
 
-  if (images_in_panos.empty()) {
+  return MatchAllKeypoints(img1, img2, options);
+}
+
+std::vector<Pano> FindPanos(const std::vector<Match>& matches,
+                            int match_threshold) {
+  PanoGrouping grouping(match_threshold);
+  for (const auto& match : matches) {
+    grouping.Add(match);
+  }
+  return grouping.Panos();
+}
+
+PanoGrouping::PanoGrouping(int match_threshold)
+    : match_threshold_(match_threshold) {}
+
+bool PanoGrouping::Add(const Match& match) {
+  if (match.matches.size() <= match_threshold_) {
+    return false;
+  }
+  pano_ds_.Union(match.id1, match.id2);
+  images_in_panos_.insert(match.id1);
+  images_in_panos_.insert(match.id2);
+  return true;
+}
+
+std::vector<Pano> PanoGrouping::Panos() {
+  if (images_in_panos_.empty()) {
     return {};
   }
 
   std::unordered_map<int, Pano> pano_map;
-  for (auto image_id : images_in_panos) {
-    int root = pano_ds.Find(image_id);
+  for (auto image_id : images_in_panos_) {
+    int root = pano_ds_.Find(image_id);
     if (auto pano = pano_map.find(root); pano != pano_map.end()) {
       InsertInOrder(image_id, &pano->second.ids);
     } else {
@@ -231,21 +768,10 @@ std::vector<Pano> FindPanos(const std::vector<Match>& matches,
 
 StitchResult Stitch(const std::vector<cv::Mat>& images, StitchOptions options,
                     bool return_pano_mask, utils::mt::Threadpool* threadpool) {
-  auto stitcher = cv::Stitcher::create(cv::Stitcher::PANORAMA);
-  stitcher->setWarper(PickWarper(options.projection));
-  stitcher->setFeaturesFinder(PickFeaturesFinder(options.feature));
-  stitcher->setFeaturesMatcher(cv::makePtr<cv::detail::BestOf2NearestMatcher>(
-      false, options.match_conf));
-  stitcher->setWaveCorrection(options.wave_correction !=
-                              WaveCorrectionType::kOff);
-  if (stitcher->waveCorrection()) {
-    stitcher->setWaveCorrectKind(PickWaveCorrectKind(options.wave_correction));
-  }
-
   // Using a modified BundleAdjuster to save detected WaveCorrectionKind, since
   // it isn't available otherwise.
   auto bundle_adjuster = cv::makePtr<BundleAdjusterRayCustom>();
-  stitcher->setBundleAdjuster(bundle_adjuster);
+  auto stitcher = CreateStitcher(options, bundle_adjuster);
   stitcher->setBlender(PickBlender(options.blending_method, threadpool));
 
   cv::Mat pano;
@@ -260,16 +786,293 @@ StitchResult Stitch(const std::vector<cv::Mat>& images, StitchOptions options,
     stitcher->resultMask().copyTo(mask);
   }
 
-  if (auto rotate = GetRotationFlags(options.wave_correction,
-                                     bundle_adjuster->WaveCorrectionKind());
-      rotate) {
-    cv::rotate(pano, pano, *rotate);
-    if (return_pano_mask) {
-      cv::rotate(mask, mask, *rotate);
+  Rotate(options.wave_correction, bundle_adjuster->WaveCorrectionKind(), &pano,
+         return_pano_mask ? &mask : nullptr);
+  return {status, pano, mask};
+}
+
+Registration Register(const std::vector<cv::Mat>& images,
+                      const StitchOptions& options) {
+  auto bundle_adjuster = cv::makePtr<BundleAdjusterRayCustom>();
+  auto stitcher = CreateStitcher(options, bundle_adjuster);
+
+  auto status = stitcher->estimateTransform(images);
+  if (status != cv::Stitcher::OK) {
+    return {status};
+  }
+
+  // Cameras are estimated on images downscaled to the registration
+  // resolution, convert them to the pixel units of the inputs
+  auto cameras = stitcher->cameras();
+  double work_scale = stitcher->workScale();
+  for (auto& camera : cameras) {
+    ScaleCamera(1.0 / work_scale, &camera);
+  }
+  return {status, cameras, stitcher->component(),
+          bundle_adjuster->WaveCorrectionKind()};
+}
+
+Registration Register(const std::vector<Image>& images,
+                      const std::vector<int>& ids,
+                      const std::vector<Match>& matches,
+                      const StitchOptions& options) {
+  int num_images = static_cast<int>(ids.size());
+  if (num_images < 2) {
+    return {cv::Stitcher::ERR_NEED_MORE_IMGS};
+  }
+
+  std::unordered_map<int, int> local_ids;
+  std::vector<cv::detail::ImageFeatures> features;
+  for (int i = 0; i < num_images; i++) {
+    local_ids[ids[i]] = i;
+    features.push_back(ToImageFeatures(images[ids[i]], i));
+  }
+
+  std::vector<cv::detail::MatchesInfo> pairwise_matches(num_images *
+                                                        num_images);
+  for (const auto& match : matches) {
+    auto left = local_ids.find(match.id1);
+    auto right = local_ids.find(match.id2);
+    if (left == local_ids.end() || right == local_ids.end()) {
+      continue;
     }
+    SetPairwiseMatches(
+        num_images, left->second, right->second,
+        ToMatchesInfo(features[left->second], features[right->second],
+                      match.matches),
+        &pairwise_matches);
   }
 
-  return {status, pano, mask};
+  // Panos not found by the auto detection (e.g. selected by the user) might
+  // lack some of the matches, match the remaining pairs
+  if (!IsConnected(num_images, pairwise_matches)) {
+    for (int i = 0; i < num_images; i++) {
+      for (int j = i + 1; j < num_images; j++) {
+        if (pairwise_matches[i * num_images + j].src_img_idx >= 0) {
+          continue;
+        }
+        auto image_matches =
+            MatchImages(images[ids[i]], images[ids[j]],
+                        {.match_conf = options.match_conf});
+        SetPairwiseMatches(
+            num_images, i, j,
+            ToMatchesInfo(features[i], features[j], image_matches),
+            &pairwise_matches);
+      }
+    }
+  }
+
+  // The rest follows cv::Stitcher::estimateTransform
+  auto component = cv::detail::leaveBiggestComponent(
+      features, pairwise_matches, kPanoConfidenceThresh);
+  if (component.size() < 2) {
+    return {cv::Stitcher::ERR_NEED_MORE_IMGS};
+  }
+
+  std::vector<cv::detail::CameraParams> cameras;
+  cv::detail::HomographyBasedEstimator estimator;
+  if (!estimator(features, pairwise_matches, cameras)) {
+    return {cv::Stitcher::ERR_HOMOGRAPHY_EST_FAIL};
+  }
+  for (auto& camera : cameras) {
+    cv::Mat rotation;
+    camera.R.convertTo(rotation, CV_32F);
+    camera.R = rotation;
+  }
+
+  BundleAdjusterRayCustom bundle_adjuster;
+  bundle_adjuster.setConfThresh(kPanoConfidenceThresh);
+  if (!bundle_adjuster(features, pairwise_matches, cameras)) {
+    return {cv::Stitcher::ERR_CAMERA_PARAMS_ADJUST_FAIL};
+  }
+
+  auto wave_correct_kind = bundle_adjuster.WaveCorrectionKind();
+  if (options.wave_correction != WaveCorrectionType::kOff) {
+    if (options.wave_correction != WaveCorrectionType::kAuto) {
+      wave_correct_kind = PickWaveCorrectKind(options.wave_correction);
+    }
+    std::vector<cv::Mat> rotations;
+    std::transform(cameras.begin(), cameras.end(),
+                   std::back_inserter(rotations),
+                   [](const auto& camera) { return camera.R.clone(); });
+    cv::detail::waveCorrect(rotations, wave_correct_kind);
+    for (int i = 0; i < cameras.size(); i++) {
+      cameras[i].R = rotations[i];
+    }
+  }
+
+  return {cv::Stitcher::OK, cameras, component, wave_correct_kind};
+}
+
+StitchResult Compose(const std::vector<cv::Mat>& previews,
+                     const std::vector<cv::Mat>& images,
+                     const Registration& registration,
+                     const StitchOptions& options, bool return_pano_mask,
+                     utils::mt::Threadpool* threadpool) {
+  if (auto status = CheckRegistration(registration);
+      status != cv::Stitcher::OK) {
+    return {status, {}, {}};
+  }
+
+  const auto& component = registration.component;
+  int num_images = static_cast<int>(component.size());
+  auto seams = EstimateSeams(previews, registration, options);
+
+  // Compose at the resolution of the inputs, the warper scale follows the
+  // first image, same as cv::Stitcher does
+  double compose_scale = static_cast<double>(images[component[0]].cols) /
+                         previews[component[0]].cols;
+  auto warper = seams.warper_creator->create(
+      static_cast<float>(seams.warped_image_scale * compose_scale));
+
+  std::vector<cv::Point> corners(num_images);
+  std::vector<cv::Size> sizes(num_images);
+  std::vector<cv::detail::CameraParams> cameras = registration.cameras;
+  for (int i = 0; i < num_images; i++) {
+    const auto& image = images[component[i]];
+    ScaleCamera(static_cast<double>(image.cols) / previews[component[i]].cols,
+                &cameras[i]);
+    cv::Mat k_mat;
+    cameras[i].K().convertTo(k_mat, CV_32F);
+    auto roi = warper->warpRoi(image.size(), k_mat, cameras[i].R);
+    corners[i] = roi.tl();
+    sizes[i] = roi.size();
+  }
+
+  auto blender = PickBlender(options.blending_method, threadpool);
+  blender->prepare(corners, sizes);
+  for (int i = 0; i < num_images; i++) {
+    const auto& image = images[component[i]];
+    cv::Mat k_mat;
+    cameras[i].K().convertTo(k_mat, CV_32F);
+
+    cv::Mat image_warped;
+    warper->warp(image, k_mat, cameras[i].R, cv::INTER_LINEAR,
+                 cv::BORDER_REFLECT, image_warped);
+    cv::Mat mask(image.size(), CV_8U, cv::Scalar::all(crop::kMaskValueOn));
+    cv::Mat mask_warped;
+    warper->warp(mask, k_mat, cameras[i].R, cv::INTER_NEAREST,
+                 cv::BORDER_CONSTANT, mask_warped);
+
+    seams.compensator->apply(i, corners[i], image_warped, mask_warped);
+
+    cv::Mat image_warped_s;
+    image_warped.convertTo(image_warped_s, CV_16S);
+    image_warped.release();
+
+    cv::Mat dilated_mask;
+    cv::Mat seam_mask;
+    cv::dilate(seams.seam_masks[i], dilated_mask, cv::Mat());
+    cv::resize(dilated_mask, seam_mask, mask_warped.size(), 0, 0,
+               cv::INTER_LINEAR_EXACT);
+    mask_warped = seam_mask & mask_warped;
+
+    blender->feed(image_warped_s, mask_warped, corners[i]);
+  }
+
+  cv::Mat result;
+  cv::Mat result_mask;
+  blender->blend(result, result_mask);
+
+  cv::Mat pano;
+  result.convertTo(pano, CV_8U);
+  cv::Mat mask;
+  if (return_pano_mask) {
+    mask = result_mask;
+  }
+
+  Rotate(options.wave_correction, registration.wave_correct_kind, &pano,
+         return_pano_mask ? &mask : nullptr);
+  return {cv::Stitcher::OK, pano, mask};
+}
+
+cv::Stitcher::Status ComposeTiled(const std::vector<cv::Mat>& previews,
+                                  const std::vector<cv::Size>& image_sizes,
+                                  const ImageLoader& load_image,
+                                  const Registration& registration,
+                                  const StitchOptions& options, int tile_size,
+                                  TileWriter* writer) {
+  if (auto status = CheckRegistration(registration);
+      status != cv::Stitcher::OK) {
+    return status;
+  }
+
+  const auto& component = registration.component;
+  int num_images = static_cast<int>(component.size());
+  auto seams = EstimateSeams(previews, registration, options);
+
+  TiledComposition composition;
+  composition.image_ids = component;
+  // The images are only requested for the tiles they overlap
+  for (int img_id : component) {
+    auto image_size = image_sizes[img_id];
+    if (image_size.empty()) {
+      return cv::Stitcher::ERR_NEED_MORE_IMGS;
+    }
+    composition.image_sizes.push_back(image_size);
+  }
+
+  double compose_scale =
+      static_cast<double>(composition.image_sizes[0].width) /
+      previews[component[0]].cols;
+  composition.warper = seams.warper_creator->create(
+      static_cast<float>(seams.warped_image_scale * compose_scale));
+
+  seams.compensator->getMatGains(composition.gains);
+  for (int i = 0; i < num_images; i++) {
+    auto camera = registration.cameras[i];
+    ScaleCamera(static_cast<double>(composition.image_sizes[i].width) /
+                    previews[component[i]].cols,
+                &camera);
+    cv::Mat k_mat;
+    camera.K().convertTo(k_mat, CV_32F);
+    composition.k_mats.push_back(k_mat);
+    composition.rotations.push_back(camera.R);
+    composition.rois.push_back(composition.warper->warpRoi(
+        composition.image_sizes[i], k_mat, camera.R));
+    composition.pano_roi = i == 0 ? composition.rois[0]
+                                  : composition.pano_roi | composition.rois[i];
+
+    cv::Mat dilated_mask;
+    cv::dilate(seams.seam_masks[i], dilated_mask, cv::Mat());
+    composition.seam_masks.push_back(dilated_mask);
+  }
+
+  // Tiles are laid out on the final, possibly rotated, panorama
+  const auto& pano_roi = composition.pano_roi;
+  auto rotation =
+      GetRotationFlags(options.wave_correction, registration.wave_correct_kind);
+  cv::Size output_size = rotation
+                             ? cv::Size(pano_roi.height, pano_roi.width)
+                             : pano_roi.size();
+  if (!writer->Open(output_size, {tile_size, tile_size})) {
+    return kErrWriteFailed;
+  }
+
+  for (int out_y = 0; out_y < output_size.height; out_y += tile_size) {
+    for (int out_x = 0; out_x < output_size.width; out_x += tile_size) {
+      cv::Rect out_tile(out_x, out_y,
+                        std::min(tile_size, output_size.width - out_x),
+                        std::min(tile_size, output_size.height - out_y));
+      // The same tile before cv::ROTATE_90_CLOCKWISE
+      cv::Rect tile =
+          rotation ? cv::Rect(pano_roi.x + out_tile.y,
+                              pano_roi.y + pano_roi.height - out_tile.x -
+                                  out_tile.width,
+                              out_tile.height, out_tile.width)
+                   : out_tile + pano_roi.tl();
+
+      auto [pano, mask] = ComposeTile(composition, load_image, tile);
+      if (rotation) {
+        cv::rotate(pano, pano, *rotation);
+        cv::rotate(mask, mask, *rotation);
+      }
+      if (!writer->Write(pano, mask)) {
+        return kErrWriteFailed;
+      }
+    }
+  }
+  return cv::Stitcher::OK;
 }
 
 std::string ToString(cv::Stitcher::Status& status) {
@@ -282,6 +1085,8 @@ std::string ToString(cv::Stitcher::Status& status) {
       return "ERR_HOMOGRAPHY_EST_FAIL";
     case cv::Stitcher::ERR_CAMERA_PARAMS_ADJUST_FAIL:
       return "ERR_CAMERA_PARAMS_ADJUST_FAIL";
+    case kErrWriteFailed:
+      return "ERR_WRITE_FAILED";
     default:
       return "ERR_UNKNOWN";
   }
@@ -5,8 +5,10 @@
 #pragma once
 
 #include <array>
+#include <functional>
 #include <optional>
 #include <string>
+#include <unordered_set>
 #include <vector>
 
 #include <opencv2/core.hpp>
@@ -15,6 +17,7 @@
 #include "xpano/algorithm/image.h"
 #include "xpano/algorithm/options.h"
 #include "xpano/constants.h"
+#include "xpano/utils/disjoint_set.h"
 #include "xpano/utils/rect.h"
 #include "xpano/utils/threadpool.h"
 
@@ -33,12 +36,38 @@ struct Match {
 
 Pano SinglePano(int size);
 
+// How MatchImages arrived at its result
+enum class MatchPath {
+  kFull,
+  // Enough inliers among the strongest keypoints, only these are returned
+  kEarlyAccept,
+  // Too few inliers among the strongest keypoints to ever pass the threshold
+  kEarlyReject,
+};
+
 std::vector<cv::DMatch> MatchImages(const Image& img1, const Image& img2,
-                                    float match_conf);
+                                    const MatchOptions& options,
+                                    MatchPath* path = nullptr);
 
 std::vector<Pano> FindPanos(const std::vector<Match>& matches,
                             int match_threshold);
 
+// Incremental FindPanos, the matches can be added one by one in any order
+// and the panos found so far are available at any time
+class PanoGrouping {
+ public:
+  explicit PanoGrouping(int match_threshold);
+
+  // Returns true when the images of the match end up in the same pano
+  bool Add(const Match& match);
+  [[nodiscard]] std::vector<Pano> Panos();
+
+ private:
+  int match_threshold_;
+  utils::DisjointSet pano_ds_;
+  std::unordered_set<int> images_in_panos_;
+};
+
 struct StitchResult {
   cv::Stitcher::Status status;
   cv::Mat pano;
@@ -48,6 +77,76 @@ struct StitchResult {
 StitchResult Stitch(const std::vector<cv::Mat>& images, StitchOptions options,
                     bool return_pano_mask, utils::mt::Threadpool* threadpool);
 
+// Camera parameters of a registered panorama, in pixel units of the images
+// passed to Register
+struct Registration {
+  cv::Stitcher::Status status;
+  std::vector<cv::detail::CameraParams> cameras;
+  // Indices of the registered images, the other images were dropped
+  std::vector<int> component;
+  cv::detail::WaveCorrectKind wave_correct_kind =
+      cv::detail::WAVE_CORRECT_HORIZ;
+};
+
+Registration Register(const std::vector<cv::Mat>& images,
+                      const StitchOptions& options);
+
+// Registers the previews of images[ids], reusing the keypoints detected by
+// Image::Load and the matches from MatchImages. The component indices refer
+// to the positions in ids.
+Registration Register(const std::vector<Image>& images,
+                      const std::vector<int>& ids,
+                      const std::vector<Match>& matches,
+                      const StitchOptions& options);
+
+// Composes the panorama from images of arbitrary resolution, reusing a
+// registration computed on the previews. Only warping, exposure compensation,
+// seam finding and blending is done, seams and exposure are estimated on the
+// previews.
+StitchResult Compose(const std::vector<cv::Mat>& previews,
+                     const std::vector<cv::Mat>& images,
+                     const Registration& registration,
+                     const StitchOptions& options, bool return_pano_mask,
+                     utils::mt::Threadpool* threadpool);
+
+// Receives the panorama composed by ComposeTiled one tile at a time, in row
+// major order
+class TileWriter {
+ public:
+  TileWriter() = default;
+  virtual ~TileWriter() = default;
+  TileWriter(const TileWriter&) = delete;
+  TileWriter& operator=(const TileWriter&) = delete;
+  TileWriter(TileWriter&&) = delete;
+  TileWriter& operator=(TileWriter&&) = delete;
+
+  // Called once, before the first tile
+  virtual bool Open(cv::Size pano_size, cv::Size tile_size) = 0;
+  // 8-bit pano tile with its mask, the tiles on the right and bottom edges
+  // may be smaller than the tile size
+  virtual bool Write(const cv::Mat& pano, const cv::Mat& mask) = 0;
+};
+
+// Returns the full resolution image at the given index of the previews
+using ImageLoader = std::function<cv::Mat(int)>;
+
+// Not an OpenCV status, returned by ComposeTiled when the writer fails
+constexpr auto kErrWriteFailed = static_cast<cv::Stitcher::Status>(-1);
+
+// Same as Compose, but the panorama is composed and handed to the writer tile
+// by tile, so that the memory needed doesn't depend on the panorama size. The
+// full resolution image_sizes are given at the indices of the previews, the
+// images are requested from the loader only for the tiles they overlap and
+// the loader is expected to cache them. Always blends with OpenCV, Multiblend
+// needs the whole panorama at once. Returns kErrWriteFailed at the first tile
+// the writer fails to write.
+cv::Stitcher::Status ComposeTiled(const std::vector<cv::Mat>& previews,
+                                  const std::vector<cv::Size>& image_sizes,
+                                  const ImageLoader& load_image,
+                                  const Registration& registration,
+                                  const StitchOptions& options, int tile_size,
+                                  TileWriter* writer);
+
 std::string ToString(cv::Stitcher::Status& status);
 
 std::optional<utils::RectRRf> FindLargestCrop(const cv::Mat& mask);
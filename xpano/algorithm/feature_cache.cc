@@ -0,0 +1,209 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/algorithm/feature_cache.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <new>
+#include <optional>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <spdlog/fmt/fmt.h>
+#include <spdlog/spdlog.h>
+
+#include "xpano/algorithm/image.h"
+#include "xpano/constants.h"
+#include "xpano/utils/binary.h"
+
+namespace xpano::algorithm {
+
+namespace {
+
+constexpr std::uint32_t kMagic = 0x43465058;  // "XPFC"
+
+// Bump when the output of Image::Load changes
+constexpr std::uint32_t kVersion = 3;
+
+std::optional<std::string> CacheKey(const std::filesystem::path& path,
+                                    const ImageLoadOptions& options) {
+  std::error_code error;
+  auto absolute_path = std::filesystem::absolute(path, error);
+  if (error) {
+    return {};
+  }
+  auto file_size = std::filesystem::file_size(path, error);
+  if (error) {
+    return {};
+  }
+  auto modified = std::filesystem::last_write_time(path, error);
+  if (error) {
+    return {};
+  }
+  return fmt::format("{}|{}|{}|{}|{}|{}|{}", absolute_path.string(),
+                     file_size, modified.time_since_epoch().count(),
+                     options.preview_longer_side,
+                     static_cast<int>(options.depth_conversion), kNumFeatures,
+                     options.quantize_descriptors);
+}
+
+std::filesystem::path EntryPath(const std::filesystem::path& cache_dir,
+                                const std::string& key) {
+  return cache_dir /
+         fmt::format("{:016x}.bin", std::hash<std::string>{}(key));
+}
+
+std::vector<unsigned char> Encode(const cv::Mat& image) {
+  // Lossless, a cached preview is stitched exactly like a decoded one
+  std::vector<unsigned char> buffer;
+  cv::imencode(".png", image, buffer,
+               {cv::IMWRITE_PNG_COMPRESSION, kFeatureCachePngCompression});
+  return buffer;
+}
+
+cv::Mat Decode(const std::vector<unsigned char>& buffer) {
+  return cv::imdecode(buffer, cv::IMREAD_UNCHANGED);
+}
+
+bool WriteEntry(std::ostream& stream, const std::string& key,
+                const Image& image) {
+  auto keypoints = image.GetKeypoints().ToKeyPoints();
+  return utils::binary::Write(stream, kMagic) &&
+         utils::binary::Write(stream, kVersion) &&
+         utils::binary::WriteString(stream, key) &&
+         utils::binary::Write(stream,
+                              static_cast<std::uint8_t>(image.IsRaw())) &&
+         utils::binary::WriteVector(stream, Encode(image.GetPreview())) &&
+         utils::binary::WriteVector(stream, Encode(image.GetThumbnail())) &&
+         utils::binary::WriteVector(stream, keypoints) &&
+         utils::binary::WriteMat(stream, image.GetDescriptors());
+}
+
+std::optional<ImageData> ReadEntry(std::istream& stream,
+                                   const std::string& key) {
+  std::uint32_t magic = 0;
+  std::uint32_t version = 0;
+  std::string entry_key;
+  if (!utils::binary::Read(stream, &magic) || magic != kMagic ||
+      !utils::binary::Read(stream, &version) || version != kVersion ||
+      !utils::binary::ReadString(stream, &entry_key) || entry_key != key) {
+    return {};
+  }
+
+  std::uint8_t is_raw = 0;
+  std::vector<unsigned char> preview;
+  std::vector<unsigned char> thumbnail;
+  ImageData data;
+  if (!utils::binary::Read(stream, &is_raw) ||
+      !utils::binary::ReadVector(stream, &preview) ||
+      !utils::binary::ReadVector(stream, &thumbnail) ||
+      !utils::binary::ReadVector(stream, &data.keypoints) ||
+      !utils::binary::ReadMat(stream, &data.descriptors)) {
+    return {};
+  }
+
+  data.is_raw = is_raw != 0;
+  data.preview = Decode(preview);
+  data.thumbnail = Decode(thumbnail);
+  if (data.preview.empty() || data.thumbnail.empty()) {
+    return {};
+  }
+  return data;
+}
+
+}  // namespace
+
+FeatureCache::FeatureCache(std::filesystem::path cache_dir)
+    : cache_dir_(std::move(cache_dir)) {
+  std::error_code error;
+  std::filesystem::create_directories(cache_dir_, error);
+  if (error) {
+    spdlog::warn("Failed to create feature cache directory {}: {}",
+                 cache_dir_.string(), error.message());
+  }
+}
+
+std::optional<Image> FeatureCache::Load(
+    const std::filesystem::path& path, const ImageLoadOptions& options) const {
+  auto key = CacheKey(path, options);
+  if (!key) {
+    return {};
+  }
+
+  std::ifstream stream(EntryPath(cache_dir_, *key), std::ios::binary);
+  if (!stream) {
+    return {};
+  }
+
+  std::optional<ImageData> data;
+  try {
+    data = ReadEntry(stream, *key);
+  } catch (const cv::Exception& e) {
+    spdlog::warn("Corrupted feature cache entry for {}: {}", path.string(),
+                 e.what());
+    return {};
+  } catch (const std::bad_alloc&) {
+    spdlog::warn("Corrupted feature cache entry for {}: out of memory",
+                 path.string());
+    return {};
+  }
+  if (!data) {
+    return {};
+  }
+
+  data->depth_conversion = options.depth_conversion;
+  if (!options.compute_keypoints) {
+    data->keypoints.clear();
+    data->descriptors = cv::Mat();
+  }
+  return Image(path, std::move(*data));
+}
+
+void FeatureCache::Store(const Image& image,
+                         const ImageLoadOptions& options) const {
+  if (!image.IsLoaded() || !options.compute_keypoints) {
+    return;
+  }
+
+  auto key = CacheKey(image.GetPath(), options);
+  if (!key) {
+    return;
+  }
+
+  // Write to a temporary file first, concurrent readers should never see a
+  // partially written entry
+  auto entry_path = EntryPath(cache_dir_, *key);
+  auto tmp_path = entry_path;
+  tmp_path += fmt::format(
+      ".{:x}.tmp", std::hash<std::thread::id>{}(std::this_thread::get_id()));
+
+  {
+    std::ofstream stream(tmp_path, std::ios::binary);
+    if (!stream || !WriteEntry(stream, *key, image)) {
+      spdlog::warn("Failed to write feature cache entry {}",
+                   tmp_path.string());
+      stream.close();
+      std::error_code error;
+      std::filesystem::remove(tmp_path, error);
+      return;
+    }
+  }
+
+  std::error_code error;
+  std::filesystem::rename(tmp_path, entry_path, error);
+  if (error) {
+    spdlog::warn("Failed to store feature cache entry {}: {}",
+                 entry_path.string(), error.message());
+    std::filesystem::remove(tmp_path, error);
+  }
+}
+
+}  // namespace xpano::algorithm
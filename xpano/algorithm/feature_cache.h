@@ -0,0 +1,29 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <filesystem>
+#include <optional>
+
+#include "xpano/algorithm/image.h"
+
+namespace xpano::algorithm {
+
+// On-disk cache of loaded images: preview, thumbnail, keypoints and
+// descriptors. Entries are keyed on the file path, size, modification time
+// and the loading options, so reopening an unchanged file skips both the
+// decoding and the keypoint detection.
+class FeatureCache {
+ public:
+  explicit FeatureCache(std::filesystem::path cache_dir);
+
+  [[nodiscard]] std::optional<Image> Load(
+      const std::filesystem::path& path, const ImageLoadOptions& options) const;
+  void Store(const Image& image, const ImageLoadOptions& options) const;
+
+ private:
+  std::filesystem::path cache_dir_;
+};
+
+}  // namespace xpano::algorithm
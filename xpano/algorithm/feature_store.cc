@@ -0,0 +1,379 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/algorithm/feature_store.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <optional>
+#include <ostream>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <spdlog/spdlog.h>
+
+#include "xpano/constants.h"
+#include "xpano/utils/mmap.h"
+
+namespace xpano::algorithm {
+
+namespace {
+
+constexpr std::uint32_t kMagic = 0x53465058;  // "XPFS"
+constexpr int kNumFields = 5;
+constexpr std::size_t kHeaderBytes = 2 * sizeof(std::uint32_t) +
+                                     sizeof(std::uint64_t) +
+                                     2 * sizeof(std::int32_t);
+
+std::size_t AlignUp(std::size_t offset) {
+  return (offset + kFeatureStoreAlignment - 1) / kFeatureStoreAlignment *
+         kFeatureStoreAlignment;
+}
+
+std::array<std::span<const float>, kNumFields> Fields(
+    const KeypointsView& keypoints) {
+  return {keypoints.x, keypoints.y, keypoints.size, keypoints.angle,
+          keypoints.response};
+}
+
+FeatureStore::Layout MakeLayout(std::uint32_t num_images,
+                                std::uint64_t num_keypoints,
+                                std::int32_t descriptor_type,
+                                std::int32_t descriptor_cols) {
+  FeatureStore::Layout layout{.num_images = num_images,
+                              .num_keypoints = num_keypoints,
+                              .descriptor_type = descriptor_type,
+                              .descriptor_cols = descriptor_cols};
+  layout.starts = kHeaderBytes;
+  layout.arrays =
+      layout.starts + (std::size_t{num_images} + 1) * sizeof(std::uint64_t);
+  layout.descriptors =
+      AlignUp(layout.arrays + kNumFields * num_keypoints * sizeof(float));
+  layout.size_bytes =
+      layout.descriptors + num_keypoints * descriptor_cols *
+                               CV_ELEM_SIZE(descriptor_type);
+  return layout;
+}
+
+std::optional<FeatureStore::Layout> Plan(
+    const std::vector<FeatureSource>& images) {
+  std::uint64_t num_keypoints = 0;
+  int descriptor_type = CV_32F;
+  int descriptor_cols = 0;
+  for (const auto& image : images) {
+    for (const auto& field : Fields(image.keypoints)) {
+      if (static_cast<int>(field.size()) != image.keypoints.Size()) {
+        spdlog::error("Keypoint arrays of different lengths");
+        return {};
+      }
+    }
+    num_keypoints += image.keypoints.Size();
+    if (image.descriptors.empty()) {
+      continue;
+    }
+    if (image.descriptors.rows != image.keypoints.Size() ||
+        image.descriptors.channels() != 1) {
+      spdlog::error("Expected one descriptor per keypoint");
+      return {};
+    }
+    if (descriptor_cols == 0) {
+      descriptor_type = image.descriptors.type();
+      descriptor_cols = image.descriptors.cols;
+    } else if (image.descriptors.type() != descriptor_type ||
+               image.descriptors.cols != descriptor_cols) {
+      spdlog::error("Descriptors of different types can't be stored together");
+      return {};
+    }
+  }
+  if (descriptor_cols > 0) {
+    for (const auto& image : images) {
+      if (image.descriptors.empty() && !image.keypoints.Empty()) {
+        spdlog::error("Missing descriptors");
+        return {};
+      }
+    }
+  }
+  return MakeLayout(static_cast<std::uint32_t>(images.size()), num_keypoints,
+                    descriptor_type, descriptor_cols);
+}
+
+// Writes the block in order, the sink is called with consecutive chunks
+template <typename TSink>
+void Emit(const std::vector<FeatureSource>& images,
+          const FeatureStore::Layout& layout, TSink sink) {
+  sink(&kMagic, sizeof(kMagic));
+  sink(&layout.num_images, sizeof(layout.num_images));
+  sink(&layout.num_keypoints, sizeof(layout.num_keypoints));
+  sink(&layout.descriptor_type, sizeof(layout.descriptor_type));
+  sink(&layout.descriptor_cols, sizeof(layout.descriptor_cols));
+
+  std::uint64_t start = 0;
+  sink(&start, sizeof(start));
+  for (const auto& image : images) {
+    start += image.keypoints.Size();
+    sink(&start, sizeof(start));
+  }
+
+  for (int field = 0; field < kNumFields; field++) {
+    for (const auto& image : images) {
+      auto array = Fields(image.keypoints)[field];
+      sink(array.data(), array.size_bytes());
+    }
+  }
+
+  const std::array<std::byte, kFeatureStoreAlignment> padding{};
+  std::size_t written =
+      layout.arrays + kNumFields * layout.num_keypoints * sizeof(float);
+  sink(padding.data(), layout.descriptors - written);
+
+  if (layout.descriptor_cols == 0) {
+    return;
+  }
+  for (const auto& image : images) {
+    const auto& descriptors = image.descriptors;
+    for (int row = 0; row < descriptors.rows; row++) {
+      sink(descriptors.ptr(row), descriptors.cols * descriptors.elemSize());
+    }
+  }
+}
+
+// Hands out Mats pointing into a store, the UMatData holds a reference to the
+// store for as long as any Mat shares it
+class StoreAllocator : public cv::MatAllocator {
+ public:
+  cv::UMatData* allocate(int dims, const int* sizes, int type, void* data,
+                         size_t* step, cv::AccessFlag flags,
+                         cv::UMatUsageFlags usage_flags) const override {
+    return cv::Mat::getDefaultAllocator()->allocate(dims, sizes, type, data,
+                                                    step, flags, usage_flags);
+  }
+
+  bool allocate(cv::UMatData* data, cv::AccessFlag access_flags,
+                cv::UMatUsageFlags usage_flags) const override {
+    return cv::Mat::getDefaultAllocator()->allocate(data, access_flags,
+                                                    usage_flags);
+  }
+
+  void deallocate(cv::UMatData* data) const override {
+    if (data == nullptr) {
+      return;
+    }
+    delete static_cast<std::shared_ptr<const void>*>(data->userdata);
+    delete data;
+  }
+};
+
+StoreAllocator& Allocator() {
+  static StoreAllocator allocator;
+  return allocator;
+}
+
+template <typename TValue>
+TValue ReadValue(const std::byte* data, std::size_t offset) {
+  TValue value;
+  std::memcpy(&value, data + offset, sizeof(value));
+  return value;
+}
+
+}  // namespace
+
+std::vector<cv::KeyPoint> KeypointsView::ToKeyPoints() const {
+  std::vector<cv::KeyPoint> keypoints;
+  keypoints.reserve(x.size());
+  for (int i = 0; i < Size(); i++) {
+    keypoints.emplace_back(x[i], y[i], size[i], angle[i], response[i]);
+  }
+  return keypoints;
+}
+
+FeatureStore::FeatureStore(std::shared_ptr<const void> memory,
+                           const std::byte* data, const Layout& layout)
+    : memory_(std::move(memory)), data_(data), layout_(layout) {}
+
+std::shared_ptr<const FeatureStore> FeatureStore::Pack(
+    const std::vector<FeatureSource>& images) {
+  auto layout = Plan(images);
+  if (!layout) {
+    return nullptr;
+  }
+
+  // The descriptor slab is aligned in memory the same as in a mapped file
+  auto* data = static_cast<std::byte*>(::operator new[](
+      layout->size_bytes, std::align_val_t{kFeatureStoreAlignment}));
+  std::shared_ptr<std::byte> memory(data, [](std::byte* ptr) {
+    ::operator delete[](ptr, std::align_val_t{kFeatureStoreAlignment});
+  });
+  std::size_t offset = 0;
+  Emit(images, *layout, [data, &offset](const void* chunk, std::size_t bytes) {
+    if (bytes > 0) {
+      std::memcpy(data + offset, chunk, bytes);
+      offset += bytes;
+    }
+  });
+  return std::shared_ptr<const FeatureStore>(
+      new FeatureStore(std::move(memory), data, *layout));
+}
+
+std::shared_ptr<const FeatureStore> FeatureStore::Pack(
+    const std::vector<cv::KeyPoint>& keypoints, const cv::Mat& descriptors) {
+  std::array<std::vector<float>, kNumFields> fields;
+  for (auto& field : fields) {
+    field.reserve(keypoints.size());
+  }
+  for (const auto& keypoint : keypoints) {
+    fields[0].push_back(keypoint.pt.x);
+    fields[1].push_back(keypoint.pt.y);
+    fields[2].push_back(keypoint.size);
+    fields[3].push_back(keypoint.angle);
+    fields[4].push_back(keypoint.response);
+  }
+  return Pack({FeatureSource{.keypoints = {fields[0], fields[1], fields[2],
+                                           fields[3], fields[4]},
+                             .descriptors = descriptors}});
+}
+
+bool FeatureStore::Write(std::ostream& stream,
+                         const std::vector<FeatureSource>& images) {
+  auto layout = Plan(images);
+  if (!layout) {
+    return false;
+  }
+  Emit(images, *layout, [&stream](const void* chunk, std::size_t bytes) {
+    stream.write(static_cast<const char*>(chunk),
+                 static_cast<std::streamsize>(bytes));
+  });
+  return static_cast<bool>(stream);
+}
+
+std::shared_ptr<const FeatureStore> FeatureStore::View(
+    std::shared_ptr<const utils::mmap::MappedFile> file, std::size_t offset) {
+  if (!file || offset % kFeatureStoreAlignment != 0 ||
+      offset > file->Size() || file->Size() - offset < kHeaderBytes) {
+    spdlog::error("Feature store out of bounds of the file");
+    return nullptr;
+  }
+  const std::byte* data = file->Data() + offset;
+  std::size_t available = file->Size() - offset;
+
+  std::size_t position = 0;
+  auto next = [data, &position]<typename TValue>(TValue* value) {
+    *value = ReadValue<TValue>(data, position);
+    position += sizeof(TValue);
+  };
+  std::uint32_t magic = 0;
+  Layout header;
+  next(&magic);
+  next(&header.num_images);
+  next(&header.num_keypoints);
+  next(&header.descriptor_type);
+  next(&header.descriptor_cols);
+  if (magic != kMagic) {
+    spdlog::error("Not a feature store");
+    return nullptr;
+  }
+
+  // Checked before computing the layout, so that it can't overflow
+  bool valid_type = header.descriptor_type >= 0 &&
+                    CV_MAT_CN(header.descriptor_type) == 1 &&
+                    header.descriptor_type <= CV_64F;
+  if (!valid_type || header.descriptor_cols < 0 ||
+      header.num_images > available / sizeof(std::uint64_t) ||
+      header.num_keypoints > available / sizeof(float)) {
+    spdlog::error("Corrupted feature store header");
+    return nullptr;
+  }
+  auto layout = MakeLayout(header.num_images, header.num_keypoints,
+                           header.descriptor_type, header.descriptor_cols);
+  if (layout.size_bytes > available) {
+    spdlog::error("Truncated feature store");
+    return nullptr;
+  }
+
+  std::uint64_t previous = 0;
+  for (std::uint32_t i = 0; i <= layout.num_images; i++) {
+    auto start = ReadValue<std::uint64_t>(
+        data, layout.starts + i * sizeof(std::uint64_t));
+    if (start < previous || start > layout.num_keypoints ||
+        (i == 0 && start != 0)) {
+      spdlog::error("Corrupted feature store index");
+      return nullptr;
+    }
+    previous = start;
+  }
+  if (previous != layout.num_keypoints) {
+    spdlog::error("Corrupted feature store index");
+    return nullptr;
+  }
+
+  return std::shared_ptr<const FeatureStore>(
+      new FeatureStore(std::move(file), data, layout));
+}
+
+int FeatureStore::NumImages() const {
+  return static_cast<int>(layout_.num_images);
+}
+
+std::uint64_t FeatureStore::Start(int image) const {
+  return ReadValue<std::uint64_t>(
+      data_, layout_.starts + image * sizeof(std::uint64_t));
+}
+
+const float* FeatureStore::Array(int field) const {
+  // The arrays start 8 byte aligned, the floats can be used in place
+  return reinterpret_cast<const float*>(data_ + layout_.arrays) +
+         field * layout_.num_keypoints;
+}
+
+KeypointsView FeatureStore::Keypoints(int image) const {
+  std::uint64_t start = Start(image);
+  auto count = static_cast<std::size_t>(Start(image + 1) - start);
+  auto span = [this, start, count](int field) {
+    return std::span<const float>(Array(field) + start, count);
+  };
+  return {span(0), span(1), span(2), span(3), span(4)};
+}
+
+cv::Mat FeatureStore::Descriptors(int image) const {
+  std::uint64_t start = Start(image);
+  auto rows = static_cast<int>(Start(image + 1) - start);
+  if (layout_.descriptor_cols == 0 || rows == 0) {
+    return {};
+  }
+  std::size_t row_bytes =
+      layout_.descriptor_cols * CV_ELEM_SIZE(layout_.descriptor_type);
+  // The OpenCV API takes a mutable pointer, the rows are never written to
+  auto* rows_data = const_cast<std::byte*>(data_ + layout_.descriptors +
+                                           start * row_bytes);
+  cv::Mat descriptors(rows, layout_.descriptor_cols, layout_.descriptor_type,
+                      rows_data);
+
+  auto* data = new cv::UMatData(&Allocator());
+  data->data = data->origdata = reinterpret_cast<uchar*>(rows_data);
+  data->size = rows * row_bytes;
+  data->userdata = new std::shared_ptr<const void>(shared_from_this());
+  descriptors.u = data;
+  descriptors.allocator = &Allocator();
+  descriptors.addref();
+  return descriptors;
+}
+
+std::shared_ptr<const FeatureStore> FeatureStore::Owner(
+    const cv::Mat& descriptors) {
+  if (descriptors.u == nullptr ||
+      descriptors.u->currAllocator != &Allocator()) {
+    return nullptr;
+  }
+  const auto& owner =
+      *static_cast<std::shared_ptr<const void>*>(descriptors.u->userdata);
+  return std::static_pointer_cast<const FeatureStore>(owner);
+}
+
+std::size_t FeatureStore::SizeBytes() const { return layout_.size_bytes; }
+
+}  // namespace xpano::algorithm
@@ -0,0 +1,99 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <span>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "xpano/utils/mmap.h"
+
+namespace xpano::algorithm {
+
+// Keypoints of one image of a FeatureStore as a structure of arrays. Only
+// valid while the store is alive.
+struct KeypointsView {
+  std::span<const float> x;
+  std::span<const float> y;
+  std::span<const float> size;
+  std::span<const float> angle;
+  std::span<const float> response;
+
+  [[nodiscard]] int Size() const { return static_cast<int>(x.size()); }
+  [[nodiscard]] bool Empty() const { return x.empty(); }
+  [[nodiscard]] cv::Point2f Point(int index) const {
+    return {x[index], y[index]};
+  }
+  // For the OpenCV functions taking cv::KeyPoint, the octave is not stored
+  [[nodiscard]] std::vector<cv::KeyPoint> ToKeyPoints() const;
+};
+
+// Keypoints and descriptors of one image, with one descriptor row per keypoint
+struct FeatureSource {
+  KeypointsView keypoints;
+  cv::Mat descriptors;
+};
+
+// Features of a set of images in a single contiguous block, laid out as a
+// structure of arrays: the x, y, size, angle and response of all the
+// keypoints, followed by one slab with all the descriptor rows. The layout is
+// the same in memory and on disk, so a store mapped from a file is used in
+// place without any copies. Immutable, safe to share between threads.
+class FeatureStore : public std::enable_shared_from_this<FeatureStore> {
+ public:
+  // All the descriptors have to be of the same type and width
+  static std::shared_ptr<const FeatureStore> Pack(
+      const std::vector<FeatureSource>& images);
+  // Features detected on a single image
+  static std::shared_ptr<const FeatureStore> Pack(
+      const std::vector<cv::KeyPoint>& keypoints, const cv::Mat& descriptors);
+
+  // Same block as Pack, written without packing it in memory first
+  static bool Write(std::ostream& stream,
+                    const std::vector<FeatureSource>& images);
+  // Block written by Write at the offset of the file, which has to be a
+  // multiple of kFeatureStoreAlignment. nullptr when it isn't valid.
+  static std::shared_ptr<const FeatureStore> View(
+      std::shared_ptr<const utils::mmap::MappedFile> file,
+      std::size_t offset);
+
+  [[nodiscard]] int NumImages() const;
+  [[nodiscard]] KeypointsView Keypoints(int image) const;
+  // Rows of the slab without a copy, the returned Mat keeps the store alive
+  [[nodiscard]] cv::Mat Descriptors(int image) const;
+  // Store the rows returned by Descriptors point into, nullptr for other Mats
+  static std::shared_ptr<const FeatureStore> Owner(const cv::Mat& descriptors);
+  [[nodiscard]] std::size_t SizeBytes() const;
+
+  struct Layout {
+    std::uint32_t num_images = 0;
+    std::uint64_t num_keypoints = 0;
+    std::int32_t descriptor_type = 0;
+    std::int32_t descriptor_cols = 0;
+    // Byte offsets from the start of the block
+    std::size_t starts = 0;
+    std::size_t arrays = 0;
+    std::size_t descriptors = 0;
+    std::size_t size_bytes = 0;
+  };
+
+ private:
+  FeatureStore(std::shared_ptr<const void> memory, const std::byte* data,
+               const Layout& layout);
+
+  [[nodiscard]] const float* Array(int field) const;
+  [[nodiscard]] std::uint64_t Start(int image) const;
+
+  // Keeps the block alive, either an allocated buffer or the mapped file
+  std::shared_ptr<const void> memory_;
+  const std::byte* data_;
+  Layout layout_;
+};
+
+}  // namespace xpano::algorithm
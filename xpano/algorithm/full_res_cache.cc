@@ -0,0 +1,78 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/algorithm/full_res_cache.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <system_error>
+
+#include <opencv2/core.hpp>
+#include <spdlog/fmt/fmt.h>
+#include <spdlog/spdlog.h>
+
+#include "xpano/algorithm/image.h"
+#include "xpano/constants.h"
+
+namespace xpano::algorithm {
+
+namespace {
+
+// Modified files are decoded again
+std::string CacheKey(const Image& image) {
+  auto path = image.GetPath();
+  std::error_code error;
+  auto modified = std::filesystem::last_write_time(path, error);
+  return fmt::format("{}|{}|{}", path.string(),
+                     error ? 0 : modified.time_since_epoch().count(),
+                     static_cast<int>(image.GetDepthConversion()));
+}
+
+}  // namespace
+
+FullResCache::FullResCache(std::int64_t capacity_bytes)
+    : cache_(capacity_bytes) {}
+
+cv::Mat FullResCache::Get(const Image& image) {
+  auto key = CacheKey(image);
+  {
+    std::lock_guard lock(mutex_);
+    if (auto full_res = cache_.Get(key); full_res) {
+      return *full_res;
+    }
+  }
+
+  // Decoding outside of the lock, other images can be served meanwhile
+  cv::Mat full_res = image.GetFullRes();
+  if (full_res.empty()) {
+    return full_res;
+  }
+  auto size_bytes =
+      static_cast<std::int64_t>(full_res.total() * full_res.elemSize());
+  std::lock_guard lock(mutex_);
+  cache_.Put(key, full_res, size_bytes);
+  return full_res;
+}
+
+void FullResCache::Clear() {
+  std::lock_guard lock(mutex_);
+  cache_.Clear();
+}
+
+utils::LruStats FullResCache::Stats() const {
+  std::lock_guard lock(mutex_);
+  return cache_.Stats();
+}
+
+void FullResCache::LogStats() const {
+  auto stats = Stats();
+  spdlog::info(
+      "Full resolution cache: {} hits, {} misses, {} evictions, {} images, "
+      "{:.1f} MB",
+      stats.hits, stats.misses, stats.evictions, stats.num_entries,
+      static_cast<double>(stats.size_bytes) / kMegabyte);
+}
+
+}  // namespace xpano::algorithm
@@ -0,0 +1,35 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+#include <opencv2/core.hpp>
+
+#include "xpano/algorithm/image.h"
+#include "xpano/utils/lru_cache.h"
+
+namespace xpano::algorithm {
+
+// Decoded full resolution images, bounded by their total size in bytes. The
+// returned images are shared with the cache and must not be modified.
+// Thread safe.
+class FullResCache {
+ public:
+  explicit FullResCache(std::int64_t capacity_bytes);
+
+  // Decodes the image on a cache miss
+  [[nodiscard]] cv::Mat Get(const Image& image);
+  void Clear();
+  [[nodiscard]] utils::LruStats Stats() const;
+  void LogStats() const;
+
+ private:
+  mutable std::mutex mutex_;
+  utils::LruCache<std::string, cv::Mat> cache_;
+};
+
+}  // namespace xpano::algorithm
@@ -4,18 +4,26 @@
 #include "xpano/algorithm/image.h"
 
 #include <algorithm>
+#include <cmath>
+#include <cstdint>
 #include <filesystem>
+#include <fstream>
+#include <memory>
 #include <optional>
 #include <string>
+#include <system_error>
 #include <utility>
 #include <vector>
 
 #include <opencv2/core.hpp>
 #include <opencv2/features2d.hpp>
+#include <opencv2/flann.hpp>
 #include <opencv2/imgcodecs.hpp>
 #include <opencv2/imgproc.hpp>
 #include <spdlog/spdlog.h>
 
+#include "xpano/algorithm/feature_store.h"
+#include "xpano/algorithm/options.h"
 #include "xpano/constants.h"
 
 namespace xpano::algorithm {
@@ -37,74 +45,409 @@ std::optional<cv::Size> PreviewSize(const cv::Size& full_size,
                         preview_longer_side);
 }
 
+bool IsSofMarker(std::uint8_t marker) {
+  // SOF0 - SOF15, except for DHT, JPG and DAC
+  return marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 &&
+         marker != 0xC8 && marker != 0xCC;
+}
+
+bool IsStandaloneMarker(std::uint8_t marker) {
+  // SOI, TEM, RST0 - RST7
+  return marker == 0xD8 || marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7);
+}
+
+}  // namespace
+
+std::optional<cv::Size> ReadJpegSize(const std::filesystem::path& path) {
+  std::ifstream stream(path, std::ios::binary);
+  auto read_byte = [&stream]() -> std::optional<std::uint8_t> {
+    char byte = 0;
+    if (!stream.get(byte)) {
+      return {};
+    }
+    return static_cast<std::uint8_t>(byte);
+  };
+  auto read_word = [&read_byte]() -> std::optional<int> {
+    auto high = read_byte();
+    auto low = read_byte();
+    if (!high || !low) {
+      return {};
+    }
+    return (*high << 8) | *low;
+  };
+
+  if (read_word() != 0xFFD8) {
+    return {};
+  }
+
+  while (stream) {
+    auto byte = read_byte();
+    if (!byte || *byte != 0xFF) {
+      return {};
+    }
+    auto marker = read_byte();
+    while (marker == 0xFF) {
+      marker = read_byte();
+    }
+    if (!marker) {
+      return {};
+    }
+    if (IsStandaloneMarker(*marker)) {
+      continue;
+    }
+    // EOI or SOS before any SOF
+    if (*marker == 0xD9 || *marker == 0xDA) {
+      return {};
+    }
+
+    auto length = read_word();
+    if (!length || *length < 2) {
+      return {};
+    }
+    if (IsSofMarker(*marker)) {
+      auto precision = read_byte();
+      auto height = read_word();
+      auto width = read_word();
+      if (!precision || !height || !width) {
+        return {};
+      }
+      return cv::Size(*width, *height);
+    }
+    stream.seekg(*length - 2, std::ios::cur);
+  }
+  return {};
+}
+
+namespace {
+
+// Largest DCT domain downscaling factor supported by libjpeg, which still
+// yields an image at least as large as the requested preview
+int ReducedDecodeScale(const cv::Size& full_size, int preview_longer_side) {
+  if (preview_longer_side <= 0) {
+    return 1;
+  }
+  int longer_side = std::max(full_size.width, full_size.height);
+  for (int scale : {8, 4, 2}) {
+    // libjpeg rounds the scaled dimensions up
+    if ((longer_side + scale - 1) / scale >= preview_longer_side) {
+      return scale;
+    }
+  }
+  return 1;
+}
+
+int ReducedDecodeFlags(int scale) {
+  switch (scale) {
+    case 2:
+      return cv::IMREAD_REDUCED_COLOR_2;
+    case 4:
+      return cv::IMREAD_REDUCED_COLOR_4;
+    case 8:
+      return cv::IMREAD_REDUCED_COLOR_8;
+    default:
+      return cv::IMREAD_COLOR;
+  }
+}
+
+// The header size is before the EXIF orientation cv::imread applies, swapped
+// when the decoded image is turned the other way
+cv::Size Oriented(cv::Size header_size, cv::Size decoded_size) {
+  if ((header_size.width > header_size.height) !=
+      (decoded_size.width > decoded_size.height)) {
+    return {header_size.height, header_size.width};
+  }
+  return header_size;
+}
+
+cv::Mat ReadPreview(const std::filesystem::path& path, int preview_longer_side,
+                    cv::Size* full_size) {
+  // Only JPEG decoders can natively decode at a reduced size, for other
+  // formats OpenCV would do a full decode and resize the result anyway.
+  if (auto jpeg_size = ReadJpegSize(path); jpeg_size) {
+    if (int scale = ReducedDecodeScale(*jpeg_size, preview_longer_side);
+        scale > 1) {
+      spdlog::info("Decoding {} at 1/{} scale", path.string(), scale);
+      cv::Mat reduced = cv::imread(path.string(), ReducedDecodeFlags(scale));
+      *full_size = Oriented(*jpeg_size, reduced.size());
+      return reduced;
+    }
+  }
+  cv::Mat full_res =
+      cv::imread(path.string(), cv::IMREAD_COLOR | cv::IMREAD_ANYDEPTH);
+  *full_size = full_res.size();
+  return full_res;
+}
+
+struct PixelRange {
+  double min = 0.0;
+  double max = 1.0;
+};
+
+PixelRange TypeRange(int depth) {
+  switch (depth) {
+    case CV_8U:
+      return {0.0, UINT8_MAX};
+    case CV_8S:
+      return {INT8_MIN, INT8_MAX};
+    case CV_16U:
+      return {0.0, UINT16_MAX};
+    case CV_16S:
+      return {INT16_MIN, INT16_MAX};
+    case CV_32S:
+      return {INT32_MIN, INT32_MAX};
+    default:
+      // Floating point images are expected to be normalized
+      return {0.0, 1.0};
+  }
+}
+
+// Input range mapped to 0 - 255. Should be computed on the full resolution
+// image, so that the previews match the full resolution output.
+PixelRange ConversionRange(const cv::Mat& image, DepthConversion conversion) {
+  if (conversion == DepthConversion::kScale) {
+    return TypeRange(image.depth());
+  }
+  PixelRange range;
+  cv::minMaxLoc(image.reshape(1), &range.min, &range.max);
+  if (range.max <= range.min) {
+    return TypeRange(image.depth());
+  }
+  return range;
+}
+
+cv::Mat ToEightBit(const cv::Mat& image, DepthConversion conversion,
+                   const PixelRange& range) {
+  double scale = 1.0 / (range.max - range.min);
+  cv::Mat result;
+  if (conversion != DepthConversion::kTonemap) {
+    image.convertTo(result, CV_8U, UINT8_MAX * scale,
+                    -range.min * UINT8_MAX * scale);
+    return result;
+  }
+
+  auto tonemap = [&range, scale](double value) {
+    double normalized = std::clamp((value - range.min) * scale, 0.0, 1.0);
+    return UINT8_MAX * std::pow(normalized, 1.0 / kTonemapGamma);
+  };
+
+  if (image.depth() == CV_16U) {
+    // Cheaper than evaluating the curve for each pixel of a large scan
+    std::vector<std::uint8_t> lut(UINT16_MAX + 1);
+    for (int i = 0; i <= UINT16_MAX; i++) {
+      lut[i] = cv::saturate_cast<std::uint8_t>(tonemap(i));
+    }
+    result.create(image.size(), CV_MAKETYPE(CV_8U, image.channels()));
+    int row_length = image.cols * image.channels();
+    for (int row = 0; row < image.rows; row++) {
+      const auto* src = image.ptr<std::uint16_t>(row);
+      auto* dst = result.ptr<std::uint8_t>(row);
+      for (int i = 0; i < row_length; i++) {
+        dst[i] = lut[src[i]];
+      }
+    }
+    return result;
+  }
+
+  cv::Mat normalized;
+  image.convertTo(normalized, CV_32F, scale, -range.min * scale);
+  normalized = cv::min(cv::max(normalized, 0.0), 1.0);
+  cv::pow(normalized, 1.0 / kTonemapGamma, normalized);
+  normalized.convertTo(result, CV_8U, UINT8_MAX);
+  return result;
+}
+
+std::shared_ptr<const Features> MakeFeatures(
+    std::shared_ptr<const FeatureStore> store, int id) {
+  if (!store || id < 0 || id >= store->NumImages()) {
+    return nullptr;
+  }
+  auto features = std::make_shared<Features>();
+  features->index = MakeDescriptorIndex(store->Descriptors(id));
+  features->store = std::move(store);
+  features->id = id;
+  return features;
+}
+
+std::shared_ptr<const Features> MakeFeatures(ImageData* data) {
+  if (data->feature_store) {
+    return MakeFeatures(std::move(data->feature_store),
+                        data->feature_store_id);
+  }
+  return MakeFeatures(FeatureStore::Pack(data->keypoints, data->descriptors),
+                      0);
+}
+
 }  // namespace
 
+std::shared_ptr<cv::flann::Index> MakeDescriptorIndex(
+    const cv::Mat& descriptors) {
+  // A KD-tree over a float copy would cost the memory saved by quantizing
+  if (descriptors.empty() || descriptors.depth() != CV_32F) {
+    return nullptr;
+  }
+  // The index only references the descriptors, so the returned pointer keeps
+  // them alive as well
+  struct IndexedDescriptors {
+    cv::Mat descriptors;
+    cv::flann::Index index;
+  };
+  auto indexed = std::make_shared<IndexedDescriptors>();
+  indexed->descriptors = descriptors;
+  indexed->index.build(descriptors, cv::flann::KDTreeIndexParams());
+  return {indexed, &indexed->index};
+}
+
 Image::Image(std::filesystem::path path) : path_(std::move(path)) {}
 
+Image::Image(std::filesystem::path path, ImageData data)
+    : path_(std::move(path)),
+      preview_(std::move(data.preview)),
+      preview_size_(preview_.size()),
+      thumbnail_(std::move(data.thumbnail)),
+      features_(MakeFeatures(&data)),
+      is_raw_(data.is_raw),
+      depth_conversion_(data.depth_conversion) {}
+
 void Image::Load(ImageLoadOptions options) {
-  cv::Mat tmp =
-      cv::imread(path_.string(), cv::IMREAD_COLOR | cv::IMREAD_ANYDEPTH);
-  if (!tmp.empty() && tmp.depth() != CV_8U) {
-    is_raw_ = true;
-    spdlog::warn("Image {} is not 8-bit, converting", path_.string());
-    tmp = cv::imread(path_.string());
-  }
+  depth_conversion_ = options.depth_conversion;
+  cv::Mat tmp = ReadPreview(path_, options.preview_longer_side, &full_size_);
   if (tmp.empty()) {
     spdlog::error("Failed to load image {}", path_.string());
     return;
   }
 
+  std::optional<PixelRange> range;
+  if (tmp.depth() != CV_8U) {
+    is_raw_ = true;
+    spdlog::warn("Image {} is not 8-bit, converting", path_.string());
+    range = ConversionRange(tmp, depth_conversion_);
+  }
+
   if (auto preview_size = PreviewSize(tmp.size(), options.preview_longer_side);
       preview_size) {
     cv::resize(tmp, preview_, *preview_size, 0.0, 0.0, cv::INTER_AREA);
   } else {
     preview_ = tmp;
   }
+  if (range) {
+    // Resizing first, the conversion is then done on the small preview only
+    preview_ = ToEightBit(preview_, depth_conversion_, *range);
+  }
+  preview_size_ = preview_.size();
 
   if (options.compute_keypoints) {
-    sift->detectAndCompute(preview_, cv::Mat(), keypoints_, descriptors_);
+    std::vector<cv::KeyPoint> keypoints;
+    cv::Mat descriptors;
+    sift->detectAndCompute(preview_, cv::Mat(), keypoints, descriptors);
+    if (options.quantize_descriptors) {
+      // Lossless, OpenCV rounds the SIFT descriptors to whole numbers in the
+      // 0 - 255 range even when returning floats
+      descriptors.convertTo(descriptors, CV_8U);
+    }
+    features_ = MakeFeatures(FeatureStore::Pack(keypoints, descriptors), 0);
   }
   cv::resize(preview_, thumbnail_, cv::Size(kThumbnailSize, kThumbnailSize), 0,
              0, cv::INTER_AREA);
 
-  spdlog::info("Loaded {}", path_.string());
+  // OpenCV reads the file itself, the file size is what a single decode reads
+  std::error_code error;
+  if (auto file_size = std::filesystem::file_size(path_, error); !error) {
+    spdlog::info("Loaded {}, file size {} bytes", path_.string(), file_size);
+  } else {
+    spdlog::info("Loaded {}", path_.string());
+  }
   if (options.compute_keypoints) {
     spdlog::info("Size: {} x {}, Keypoints: {}", preview_.size[1],
-                 preview_.size[0], keypoints_.size());
+                 preview_.size[0], GetKeypoints().Size());
   } else {
     spdlog::info("Size: {} x {}", preview_.size[1], preview_.size[0]);
   }
 }
 
-bool Image::IsLoaded() const { return !preview_.empty(); }
+void Image::MoveToStore(std::shared_ptr<ImageStore> store) {
+  if (!IsLoaded() || store_) {
+    return;
+  }
+  store_id_ = store->Add(std::move(preview_), GetDescriptors(),
+                         GetDescriptorIndex());
+  store_ = std::move(store);
+  if (features_) {
+    // The keypoints are repacked without the descriptors, so that the image
+    // store holds the only references to the slab and spilling frees it
+    features_ = MakeFeatures(
+        FeatureStore::Pack({FeatureSource{.keypoints = GetKeypoints()}}), 0);
+  }
+}
+
+bool Image::IsLoaded() const { return !preview_size_.empty(); }
 
 bool Image::IsRaw() const { return is_raw_; }
 
-cv::Mat Image::GetFullRes() const { return cv::imread(path_.string()); }
+DepthConversion Image::GetDepthConversion() const { return depth_conversion_; }
+
+cv::Size Image::GetFullResSize() const {
+  if (!full_size_.empty()) {
+    return full_size_;
+  }
+  // Restored without decoding, the JPEG header is still cheap to read
+  if (auto jpeg_size = ReadJpegSize(path_); jpeg_size && IsLoaded()) {
+    return Oriented(*jpeg_size, preview_size_);
+  }
+  return {};
+}
+
+cv::Mat Image::GetFullRes() const {
+  cv::Mat full_res =
+      cv::imread(path_.string(), cv::IMREAD_COLOR | cv::IMREAD_ANYDEPTH);
+  if (full_res.empty() || full_res.depth() == CV_8U) {
+    return full_res;
+  }
+  return ToEightBit(full_res, depth_conversion_,
+                    ConversionRange(full_res, depth_conversion_));
+}
+
 cv::Mat Image::GetThumbnail() const { return thumbnail_; }
-cv::Mat Image::GetPreview() const { return preview_; }
+cv::Mat Image::GetPreview() const {
+  return store_ ? store_->GetPreview(store_id_) : preview_;
+}
+
+cv::Size Image::GetPreviewSize() const { return preview_size_; }
 
 float Image::GetAspect() const {
-  auto width = static_cast<float>(preview_.size[1]);
-  auto height = static_cast<float>(preview_.size[0]);
+  auto width = static_cast<float>(preview_size_.width);
+  auto height = static_cast<float>(preview_size_.height);
   return width / height;
 }
 
 cv::Mat Image::Draw(bool show_debug) const {
   if (show_debug) {
     cv::Mat tmp;
-    cv::drawKeypoints(preview_, keypoints_, tmp, cv::Scalar::all(-1),
+    cv::drawKeypoints(GetPreview(), GetKeypoints().ToKeyPoints(), tmp,
+                      cv::Scalar::all(-1),
                       cv::DrawMatchesFlags::DRAW_RICH_KEYPOINTS);
     return tmp;
   }
-  return preview_;
+  return GetPreview();
 }
 
-const std::vector<cv::KeyPoint>& Image::GetKeypoints() const {
-  return keypoints_;
+KeypointsView Image::GetKeypoints() const {
+  return features_ ? features_->store->Keypoints(features_->id)
+                   : KeypointsView();
 }
 
-cv::Mat Image::GetDescriptors() const { return descriptors_; }
+cv::Mat Image::GetDescriptors() const {
+  if (store_) {
+    return store_->GetDescriptors(store_id_);
+  }
+  return features_ ? features_->store->Descriptors(features_->id) : cv::Mat();
+}
+
+std::shared_ptr<cv::flann::Index> Image::GetDescriptorIndex() const {
+  if (store_) {
+    return store_->GetDescriptorIndex(store_id_);
+  }
+  return features_ ? features_->index : nullptr;
+}
 
 std::filesystem::path Image::GetPath() const { return path_; }
 
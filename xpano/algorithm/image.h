@@ -4,45 +4,103 @@
 #pragma once
 
 #include <filesystem>
+#include <memory>
+#include <optional>
 #include <string>
 #include <vector>
 
 #include <opencv2/core.hpp>
+#include <opencv2/flann.hpp>
+
+#include "xpano/algorithm/feature_store.h"
+#include "xpano/algorithm/image_store.h"
+#include "xpano/algorithm/options.h"
 
 namespace xpano::algorithm {
 
 struct ImageLoadOptions {
   int preview_longer_side = 0;
   bool compute_keypoints = true;
+  DepthConversion depth_conversion = DepthConversion::kScale;
+  // Keeps the descriptors as CV_8U instead of CV_32F, a quarter of the memory
+  bool quantize_descriptors = false;
+};
+
+// Results of Image::Load, used to restore an image without decoding it again
+struct ImageData {
+  cv::Mat preview;
+  cv::Mat thumbnail;
+  std::vector<cv::KeyPoint> keypoints;
+  cv::Mat descriptors;
+  // Used instead of the keypoints and descriptors when set, without a copy
+  std::shared_ptr<const FeatureStore> feature_store;
+  int feature_store_id = 0;
+  bool is_raw = false;
+  DepthConversion depth_conversion = DepthConversion::kScale;
+};
+
+// Immutable after loading, shared between copies of an Image
+struct Features {
+  std::shared_ptr<const FeatureStore> store;
+  int id = 0;
+  // Search index over the descriptors, built once and reused in all the pairs
+  // the image is matched in. Searching is safe from multiple threads.
+  std::shared_ptr<cv::flann::Index> index;
 };
 
 class Image {
  public:
   Image() = default;
   explicit Image(std::filesystem::path path);
+  Image(std::filesystem::path path, ImageData data);
 
   void Load(ImageLoadOptions options);
+  // Hands the preview and the descriptors over to the store, which may move
+  // them to the disk. Shared by the copies made afterwards.
+  void MoveToStore(std::shared_ptr<ImageStore> store);
 
   [[nodiscard]] cv::Mat GetFullRes() const;
+  // Size of GetFullRes without decoding the image, empty when unknown
+  [[nodiscard]] cv::Size GetFullResSize() const;
   [[nodiscard]] cv::Mat GetThumbnail() const;
   [[nodiscard]] cv::Mat GetPreview() const;
+  // Without reloading a preview the image store moved to the disk
+  [[nodiscard]] cv::Size GetPreviewSize() const;
   [[nodiscard]] float GetAspect() const;
   [[nodiscard]] cv::Mat Draw(bool show_debug) const;
-  [[nodiscard]] const std::vector<cv::KeyPoint>& GetKeypoints() const;
+  // Valid as long as the image or a copy of it is alive
+  [[nodiscard]] KeypointsView GetKeypoints() const;
   [[nodiscard]] cv::Mat GetDescriptors() const;
+  [[nodiscard]] std::shared_ptr<cv::flann::Index> GetDescriptorIndex() const;
   [[nodiscard]] bool IsLoaded() const;
   [[nodiscard]] std::filesystem::path GetPath() const;
   [[nodiscard]] bool IsRaw() const;
+  [[nodiscard]] DepthConversion GetDepthConversion() const;
   [[nodiscard]] std::string PanoName() const;
 
  private:
   std::filesystem::path path_;
   cv::Mat preview_;
+  cv::Size preview_size_;
+  // Recorded by Load, not restored from ImageData
+  cv::Size full_size_;
   cv::Mat thumbnail_;
 
-  std::vector<cv::KeyPoint> keypoints_;
-  cv::Mat descriptors_;
+  std::shared_ptr<const Features> features_;
   bool is_raw_ = false;
+  DepthConversion depth_conversion_ = DepthConversion::kScale;
+
+  std::shared_ptr<ImageStore> store_;
+  int store_id_ = -1;
 };
 
+// Same index as the cv::FlannBasedMatcher default, nullptr without float
+// descriptors
+std::shared_ptr<cv::flann::Index> MakeDescriptorIndex(
+    const cv::Mat& descriptors);
+
+// Reads the image size from the JPEG header without decoding the image.
+// Returns an empty optional for other file formats.
+std::optional<cv::Size> ReadJpegSize(const std::filesystem::path& path);
+
 }  // namespace xpano::algorithm
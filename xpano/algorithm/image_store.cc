@@ -0,0 +1,243 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/algorithm/image_store.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/flann.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <spdlog/fmt/fmt.h>
+#include <spdlog/spdlog.h>
+
+#include "xpano/algorithm/image.h"
+#include "xpano/constants.h"
+#include "xpano/utils/binary.h"
+
+namespace xpano::algorithm {
+
+namespace {
+
+std::int64_t SizeBytes(const cv::Mat& mat) {
+  return static_cast<std::int64_t>(mat.total() * mat.elemSize());
+}
+
+// The index references the descriptors, only its trees are counted
+template <typename TData>
+std::int64_t SizeBytes(const TData& data) {
+  auto size_bytes = SizeBytes(data.preview) + SizeBytes(data.descriptors);
+  if (data.index) {
+    size_bytes += static_cast<std::int64_t>(data.descriptors.rows) *
+                  kDescriptorIndexBytesPerRow;
+  }
+  return size_bytes;
+}
+
+// SIFT descriptors are whole numbers in the 0 - 255 range stored as floats,
+// so they usually fit into a quarter of the space without any loss
+cv::Mat CompactDescriptors(const cv::Mat& descriptors) {
+  if (descriptors.empty() || descriptors.depth() != CV_32F) {
+    return descriptors;
+  }
+  cv::Mat compact;
+  descriptors.convertTo(compact, CV_8U);
+  cv::Mat restored;
+  compact.convertTo(restored, CV_32F);
+  return cv::norm(descriptors, restored, cv::NORM_INF) == 0.0 ? compact
+                                                               : descriptors;
+}
+
+double ToMegabytes(std::int64_t bytes) {
+  return static_cast<double>(bytes) / kMegabyte;
+}
+
+}  // namespace
+
+ImageStore::ImageStore(std::filesystem::path spill_dir,
+                       std::int64_t budget_bytes)
+    : spill_dir_(std::move(spill_dir)), resident_(budget_bytes) {
+  std::error_code error;
+  std::filesystem::create_directories(spill_dir_, error);
+  if (error) {
+    spdlog::warn("Failed to create spill directory {}: {}",
+                 spill_dir_.string(), error.message());
+  }
+}
+
+ImageStore::~ImageStore() {
+  std::error_code error;
+  std::filesystem::remove_all(spill_dir_, error);
+}
+
+int ImageStore::Add(cv::Mat preview, cv::Mat descriptors,
+                    std::shared_ptr<cv::flann::Index> index) {
+  ResidentData data{.preview = std::move(preview),
+                    .descriptors = std::move(descriptors),
+                    .index = std::move(index)};
+  int id = 0;
+  Evicted evicted;
+  {
+    std::lock_guard lock(mutex_);
+    id = static_cast<int>(spilled_.size());
+    spilled_.push_back(false);
+    reloading_.push_back(false);
+    evicted = Insert(id, std::move(data));
+  }
+  SpillEvicted(std::move(evicted));
+  return id;
+}
+
+cv::Mat ImageStore::GetPreview(int id) { return Get(id).preview; }
+
+cv::Mat ImageStore::GetDescriptors(int id) { return Get(id).descriptors; }
+
+std::shared_ptr<cv::flann::Index> ImageStore::GetDescriptorIndex(int id) {
+  return Get(id).index;
+}
+
+ImageStoreStats ImageStore::Stats() const {
+  std::lock_guard lock(mutex_);
+  auto lru_stats = resident_.Stats();
+  ImageStoreStats stats{
+      .resident_bytes = lru_stats.size_bytes,
+      .budget_bytes = resident_.Capacity(),
+      .num_images = static_cast<int>(spilled_.size()),
+      .num_resident = lru_stats.num_entries +
+                      static_cast<int>(pinned_.size() + spilling_.size()),
+      .num_spilled = static_cast<int>(
+          std::count(spilled_.begin(), spilled_.end(), true)),
+      .reloads = reloads_,
+      .evictions = lru_stats.evictions,
+  };
+  for (const auto* entries : {&pinned_, &spilling_}) {
+    for (const auto& [id, data] : *entries) {
+      stats.resident_bytes += SizeBytes(data);
+    }
+  }
+  return stats;
+}
+
+void ImageStore::LogStats() const {
+  auto stats = Stats();
+  spdlog::info(
+      "Image store: {} of {} images resident, {:.1f} MB of {:.1f} MB, {} "
+      "spilled to disk, {} reloads, {} evictions",
+      stats.num_resident, stats.num_images, ToMegabytes(stats.resident_bytes),
+      ToMegabytes(stats.budget_bytes), stats.num_spilled, stats.reloads,
+      stats.evictions);
+}
+
+ImageStore::ResidentData ImageStore::Get(int id) {
+  std::unique_lock lock(mutex_);
+  while (true) {
+    if (auto data = resident_.Get(id); data) {
+      return *data;
+    }
+    for (const auto* entries : {&pinned_, &spilling_}) {
+      if (auto entry = entries->find(id); entry != entries->end()) {
+        return entry->second;
+      }
+    }
+    if (!reloading_[id]) {
+      break;
+    }
+    reloaded_.wait(lock);
+  }
+
+  reloading_[id] = true;
+  lock.unlock();
+  auto data = Reload(id);
+  lock.lock();
+  reloading_[id] = false;
+  reloads_++;
+  auto evicted = Insert(id, data);
+  lock.unlock();
+  reloaded_.notify_all();
+  SpillEvicted(std::move(evicted));
+  return data;
+}
+
+ImageStore::Evicted ImageStore::Insert(int id, ResidentData data) {
+  auto size_bytes = SizeBytes(data);
+  Evicted to_spill;
+  for (auto& [evicted_id, evicted] :
+       resident_.Put(id, std::move(data), size_bytes)) {
+    // Entries are immutable, so an entry is written at most once
+    if (spilled_[evicted_id]) {
+      continue;
+    }
+    spilling_.emplace(evicted_id, evicted);
+    to_spill.emplace_back(evicted_id, std::move(evicted));
+  }
+  return to_spill;
+}
+
+void ImageStore::SpillEvicted(Evicted evicted) {
+  for (auto& [id, data] : evicted) {
+    bool spilled = Spill(id, data);
+    std::lock_guard lock(mutex_);
+    if (spilled) {
+      spilled_[id] = true;
+    } else {
+      spdlog::error("Failed to spill image {} to {}, keeping it in memory",
+                    id, spill_dir_.string());
+      pinned_.emplace(id, std::move(data));
+    }
+    spilling_.erase(id);
+  }
+}
+
+bool ImageStore::Spill(int id, const ResidentData& data) const {
+  // Lossless, the previews are used for stitching
+  std::vector<unsigned char> preview;
+  if (!data.preview.empty() &&
+      !cv::imencode(".png", data.preview, preview,
+                    {cv::IMWRITE_PNG_COMPRESSION, kSpillPngCompression})) {
+    return false;
+  }
+  std::ofstream stream(SpillPath(id), std::ios::binary);
+  return stream &&
+         utils::binary::Write(
+             stream, static_cast<std::int32_t>(data.descriptors.type())) &&
+         utils::binary::WriteVector(stream, preview) &&
+         utils::binary::WriteMat(stream, CompactDescriptors(data.descriptors));
+}
+
+ImageStore::ResidentData ImageStore::Reload(int id) const {
+  std::ifstream stream(SpillPath(id), std::ios::binary);
+  std::int32_t descriptors_type = 0;
+  std::vector<unsigned char> preview;
+  ResidentData data;
+  if (!stream || !utils::binary::Read(stream, &descriptors_type) ||
+      !utils::binary::ReadVector(stream, &preview) ||
+      !utils::binary::ReadMat(stream, &data.descriptors)) {
+    spdlog::error("Failed to reload image {} from {}", id,
+                  spill_dir_.string());
+    return {};
+  }
+  if (!preview.empty()) {
+    data.preview = cv::imdecode(preview, cv::IMREAD_UNCHANGED);
+  }
+  if (!data.descriptors.empty() &&
+      data.descriptors.type() != descriptors_type) {
+    data.descriptors.convertTo(data.descriptors, descriptors_type);
+  }
+  data.index = MakeDescriptorIndex(data.descriptors);
+  return data;
+}
+
+std::filesystem::path ImageStore::SpillPath(int id) const {
+  return spill_dir_ / fmt::format("{}.bin", id);
+}
+
+}  // namespace xpano::algorithm
@@ -0,0 +1,88 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/flann.hpp>
+
+#include "xpano/utils/lru_cache.h"
+
+namespace xpano::algorithm {
+
+struct ImageStoreStats {
+  std::int64_t resident_bytes = 0;
+  std::int64_t budget_bytes = 0;
+  int num_images = 0;
+  int num_resident = 0;
+  int num_spilled = 0;
+  int reloads = 0;
+  int evictions = 0;
+};
+
+// Previews and descriptors of the loaded images, kept in memory up to a byte
+// budget. The least recently used ones are written to a spill directory and
+// read back when accessed again. Thread safe, the disk access and the index
+// building are done without holding the lock.
+class ImageStore {
+ public:
+  ImageStore(std::filesystem::path spill_dir, std::int64_t budget_bytes);
+  ~ImageStore();
+  ImageStore(const ImageStore&) = delete;
+  ImageStore& operator=(const ImageStore&) = delete;
+  ImageStore(ImageStore&&) = delete;
+  ImageStore& operator=(ImageStore&&) = delete;
+
+  // Returns the id to access the data with
+  int Add(cv::Mat preview, cv::Mat descriptors,
+          std::shared_ptr<cv::flann::Index> index);
+
+  [[nodiscard]] cv::Mat GetPreview(int id);
+  [[nodiscard]] cv::Mat GetDescriptors(int id);
+  [[nodiscard]] std::shared_ptr<cv::flann::Index> GetDescriptorIndex(int id);
+
+  [[nodiscard]] ImageStoreStats Stats() const;
+  void LogStats() const;
+
+ private:
+  struct ResidentData {
+    cv::Mat preview;
+    cv::Mat descriptors;
+    std::shared_ptr<cv::flann::Index> index;
+  };
+
+  using Evicted = std::vector<std::pair<int, ResidentData>>;
+
+  ResidentData Get(int id);
+  // Called with the lock held, returns the evicted entries to be spilled
+  [[nodiscard]] Evicted Insert(int id, ResidentData data);
+  // Called without the lock
+  void SpillEvicted(Evicted evicted);
+  bool Spill(int id, const ResidentData& data) const;
+  [[nodiscard]] ResidentData Reload(int id) const;
+  [[nodiscard]] std::filesystem::path SpillPath(int id) const;
+
+  mutable std::mutex mutex_;
+  std::condition_variable reloaded_;
+  std::filesystem::path spill_dir_;
+  std::vector<bool> spilled_;
+  // Read back by another thread, which the others wait for
+  std::vector<bool> reloading_;
+  int reloads_ = 0;
+  utils::LruCache<int, ResidentData> resident_;
+  // Evicted entries while they are being written, still served from memory
+  std::unordered_map<int, ResidentData> spilling_;
+  // Entries that failed to spill, these stay in memory over the budget
+  std::unordered_map<int, ResidentData> pinned_;
+};
+
+}  // namespace xpano::algorithm
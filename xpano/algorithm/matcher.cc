@@ -0,0 +1,450 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/algorithm/matcher.h"
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/features2d.hpp>
+#include <opencv2/flann.hpp>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define XPANO_SIMD_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+// MSVC compiles the intrinsics without any extra flags
+#define XPANO_TARGET_AVX2
+#define XPANO_TARGET_AVX512
+#else
+#define XPANO_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define XPANO_TARGET_AVX512 __attribute__((target("avx512f")))
+#endif
+#else
+#define XPANO_SIMD_X86 0
+#endif
+
+#include "xpano/algorithm/image.h"
+#include "xpano/algorithm/options.h"
+
+namespace xpano::algorithm {
+
+namespace {
+
+enum class InstructionSet { kGeneric, kAvx2, kAvx512 };
+
+InstructionSet DetectInstructionSet() {
+#if XPANO_SIMD_X86
+#if defined(_MSC_VER) && !defined(__clang__)
+  constexpr int kOsxsaveBit = 1 << 27;
+  constexpr int kFmaBit = 1 << 12;
+  constexpr int kAvx2Bit = 1 << 5;
+  constexpr int kAvx512fBit = 1 << 16;
+  constexpr unsigned kYmmState = 0x06;
+  constexpr unsigned kZmmState = 0xE6;
+
+  std::array<int, 4> info;
+  __cpuid(info.data(), 1);
+  if ((info[2] & kOsxsaveBit) == 0) {
+    return InstructionSet::kGeneric;
+  }
+  bool has_fma = (info[2] & kFmaBit) != 0;
+  auto xcr0 = static_cast<unsigned>(_xgetbv(0));
+  __cpuidex(info.data(), 7, 0);
+  if ((info[1] & kAvx512fBit) != 0 && (xcr0 & kZmmState) == kZmmState) {
+    return InstructionSet::kAvx512;
+  }
+  if ((info[1] & kAvx2Bit) != 0 && has_fma &&
+      (xcr0 & kYmmState) == kYmmState) {
+    return InstructionSet::kAvx2;
+  }
+#else
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    return InstructionSet::kAvx512;
+  }
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    return InstructionSet::kAvx2;
+  }
+#endif
+#endif
+  return InstructionSet::kGeneric;
+}
+
+InstructionSet CpuInstructionSet() {
+  static const InstructionSet kInstructionSet = DetectInstructionSet();
+  return kInstructionSet;
+}
+
+// Distances are squared until the search is done
+void Update(int train_idx, float distance, NearestNeighbors* neighbors) {
+  if (distance < neighbors->best_distance) {
+    neighbors->second = neighbors->best;
+    neighbors->second_distance = neighbors->best_distance;
+    neighbors->best = train_idx;
+    neighbors->best_distance = distance;
+  } else if (distance < neighbors->second_distance) {
+    neighbors->second = train_idx;
+    neighbors->second_distance = distance;
+  }
+}
+
+float SquaredDistance(const float* left, const float* right, int begin,
+                      int end) {
+  float sum = 0.0f;
+  for (int i = begin; i < end; i++) {
+    float diff = left[i] - right[i];
+    sum += diff * diff;
+  }
+  return sum;
+}
+
+void KnnGeneric(const cv::Mat& query, const cv::Mat& train,
+                NearestNeighbors* result) {
+  for (int q = 0; q < query.rows; q++) {
+    const auto* query_row = query.ptr<float>(q);
+    NearestNeighbors neighbors;
+    for (int t = 0; t < train.rows; t++) {
+      Update(t, SquaredDistance(query_row, train.ptr<float>(t), 0, query.cols),
+             &neighbors);
+    }
+    result[q] = neighbors;
+  }
+}
+
+// Exact in integers, a SIFT descriptor sums up to at most 128 * 255^2
+std::int32_t SquaredDistance(const std::uint8_t* left,
+                             const std::uint8_t* right, int begin, int end) {
+  std::int32_t sum = 0;
+  for (int i = begin; i < end; i++) {
+    std::int32_t diff = left[i] - right[i];
+    sum += diff * diff;
+  }
+  return sum;
+}
+
+void KnnGenericU8(const cv::Mat& query, const cv::Mat& train,
+                  NearestNeighbors* result) {
+  for (int q = 0; q < query.rows; q++) {
+    const auto* query_row = query.ptr<std::uint8_t>(q);
+    NearestNeighbors neighbors;
+    for (int t = 0; t < train.rows; t++) {
+      auto distance = SquaredDistance(
+          query_row, train.ptr<std::uint8_t>(t), 0, query.cols);
+      Update(t, static_cast<float>(distance), &neighbors);
+    }
+    result[q] = neighbors;
+  }
+}
+
+#if XPANO_SIMD_X86
+
+XPANO_TARGET_AVX2 float HorizontalSum(__m256 value) {
+  __m128 sum = _mm_add_ps(_mm256_castps256_ps128(value),
+                          _mm256_extractf128_ps(value, 1));
+  sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+  sum = _mm_add_ss(sum, _mm_movehdup_ps(sum));
+  return _mm_cvtss_f32(sum);
+}
+
+// Four train descriptors at a time, to load each query chunk only once
+XPANO_TARGET_AVX2 void KnnAvx2(const cv::Mat& query, const cv::Mat& train,
+                               NearestNeighbors* result) {
+  constexpr int kLanes = 8;
+  constexpr int kBlock = 4;
+  int dims = query.cols;
+  int simd_dims = dims - dims % kLanes;
+  for (int q = 0; q < query.rows; q++) {
+    const auto* query_row = query.ptr<float>(q);
+    NearestNeighbors neighbors;
+    int t = 0;
+    for (; t + kBlock <= train.rows; t += kBlock) {
+      std::array<const float*, kBlock> rows;
+      __m256 acc[kBlock];  // NOLINT(modernize-avoid-c-arrays)
+      for (int k = 0; k < kBlock; k++) {
+        rows[k] = train.ptr<float>(t + k);
+        acc[k] = _mm256_setzero_ps();
+      }
+      for (int d = 0; d < simd_dims; d += kLanes) {
+        __m256 query_chunk = _mm256_loadu_ps(query_row + d);
+        for (int k = 0; k < kBlock; k++) {
+          __m256 diff =
+              _mm256_sub_ps(query_chunk, _mm256_loadu_ps(rows[k] + d));
+          acc[k] = _mm256_fmadd_ps(diff, diff, acc[k]);
+        }
+      }
+      for (int k = 0; k < kBlock; k++) {
+        float distance = HorizontalSum(acc[k]) +
+                         SquaredDistance(query_row, rows[k], simd_dims, dims);
+        Update(t + k, distance, &neighbors);
+      }
+    }
+    for (; t < train.rows; t++) {
+      const auto* train_row = train.ptr<float>(t);
+      __m256 acc = _mm256_setzero_ps();
+      for (int d = 0; d < simd_dims; d += kLanes) {
+        __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(query_row + d),
+                                    _mm256_loadu_ps(train_row + d));
+        acc = _mm256_fmadd_ps(diff, diff, acc);
+      }
+      float distance = HorizontalSum(acc) +
+                       SquaredDistance(query_row, train_row, simd_dims, dims);
+      Update(t, distance, &neighbors);
+    }
+    result[q] = neighbors;
+  }
+}
+
+XPANO_TARGET_AVX2 std::int32_t HorizontalSum(__m256i value) {
+  __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(value),
+                              _mm256_extracti128_si256(value, 1));
+  sum = _mm_add_epi32(sum, _mm_unpackhi_epi64(sum, sum));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 1));
+  return _mm_cvtsi128_si32(sum);
+}
+
+XPANO_TARGET_AVX2 __m256i LoadWidened(const std::uint8_t* data) {
+  return _mm256_cvtepu8_epi16(
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(data)));
+}
+
+// 16 dimensions per step widened to 16 bits, the squared differences are
+// summed in pairs into 32 bit lanes by madd. Also used with AVX-512, the wide
+// integer instructions would need AVX-512BW on top of AVX-512F.
+XPANO_TARGET_AVX2 void KnnAvx2U8(const cv::Mat& query, const cv::Mat& train,
+                                 NearestNeighbors* result) {
+  constexpr int kLanes = 16;
+  constexpr int kBlock = 4;
+  int dims = query.cols;
+  int simd_dims = dims - dims % kLanes;
+  for (int q = 0; q < query.rows; q++) {
+    const auto* query_row = query.ptr<std::uint8_t>(q);
+    NearestNeighbors neighbors;
+    int t = 0;
+    for (; t + kBlock <= train.rows; t += kBlock) {
+      std::array<const std::uint8_t*, kBlock> rows;
+      __m256i acc[kBlock];  // NOLINT(modernize-avoid-c-arrays)
+      for (int k = 0; k < kBlock; k++) {
+        rows[k] = train.ptr<std::uint8_t>(t + k);
+        acc[k] = _mm256_setzero_si256();
+      }
+      for (int d = 0; d < simd_dims; d += kLanes) {
+        __m256i query_chunk = LoadWidened(query_row + d);
+        for (int k = 0; k < kBlock; k++) {
+          __m256i diff =
+              _mm256_sub_epi16(query_chunk, LoadWidened(rows[k] + d));
+          acc[k] = _mm256_add_epi32(acc[k], _mm256_madd_epi16(diff, diff));
+        }
+      }
+      for (int k = 0; k < kBlock; k++) {
+        auto distance = HorizontalSum(acc[k]) +
+                        SquaredDistance(query_row, rows[k], simd_dims, dims);
+        Update(t + k, static_cast<float>(distance), &neighbors);
+      }
+    }
+    for (; t < train.rows; t++) {
+      const auto* train_row = train.ptr<std::uint8_t>(t);
+      __m256i acc = _mm256_setzero_si256();
+      for (int d = 0; d < simd_dims; d += kLanes) {
+        __m256i diff = _mm256_sub_epi16(LoadWidened(query_row + d),
+                                        LoadWidened(train_row + d));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(diff, diff));
+      }
+      auto distance = HorizontalSum(acc) +
+                      SquaredDistance(query_row, train_row, simd_dims, dims);
+      Update(t, static_cast<float>(distance), &neighbors);
+    }
+    result[q] = neighbors;
+  }
+}
+
+XPANO_TARGET_AVX512 void KnnAvx512(const cv::Mat& query, const cv::Mat& train,
+                                   NearestNeighbors* result) {
+  constexpr int kLanes = 16;
+  constexpr int kBlock = 4;
+  int dims = query.cols;
+  int simd_dims = dims - dims % kLanes;
+  for (int q = 0; q < query.rows; q++) {
+    const auto* query_row = query.ptr<float>(q);
+    NearestNeighbors neighbors;
+    int t = 0;
+    for (; t + kBlock <= train.rows; t += kBlock) {
+      std::array<const float*, kBlock> rows;
+      __m512 acc[kBlock];  // NOLINT(modernize-avoid-c-arrays)
+      for (int k = 0; k < kBlock; k++) {
+        rows[k] = train.ptr<float>(t + k);
+        acc[k] = _mm512_setzero_ps();
+      }
+      for (int d = 0; d < simd_dims; d += kLanes) {
+        __m512 query_chunk = _mm512_loadu_ps(query_row + d);
+        for (int k = 0; k < kBlock; k++) {
+          __m512 diff =
+              _mm512_sub_ps(query_chunk, _mm512_loadu_ps(rows[k] + d));
+          acc[k] = _mm512_fmadd_ps(diff, diff, acc[k]);
+        }
+      }
+      for (int k = 0; k < kBlock; k++) {
+        float distance = _mm512_reduce_add_ps(acc[k]) +
+                         SquaredDistance(query_row, rows[k], simd_dims, dims);
+        Update(t + k, distance, &neighbors);
+      }
+    }
+    for (; t < train.rows; t++) {
+      const auto* train_row = train.ptr<float>(t);
+      __m512 acc = _mm512_setzero_ps();
+      for (int d = 0; d < simd_dims; d += kLanes) {
+        __m512 diff = _mm512_sub_ps(_mm512_loadu_ps(query_row + d),
+                                    _mm512_loadu_ps(train_row + d));
+        acc = _mm512_fmadd_ps(diff, diff, acc);
+      }
+      float distance = _mm512_reduce_add_ps(acc) +
+                       SquaredDistance(query_row, train_row, simd_dims, dims);
+      Update(t, distance, &neighbors);
+    }
+    result[q] = neighbors;
+  }
+}
+
+#endif
+
+void KnnU8(const cv::Mat& query, const cv::Mat& train,
+           NearestNeighbors* result) {
+#if XPANO_SIMD_X86
+  if (CpuInstructionSet() != InstructionSet::kGeneric) {
+    KnnAvx2U8(query, train, result);
+    return;
+  }
+#endif
+  KnnGenericU8(query, train, result);
+}
+
+void TakeSquareRoot(std::vector<NearestNeighbors>* result) {
+  for (auto& neighbors : *result) {
+    neighbors.best_distance = std::sqrt(neighbors.best_distance);
+    neighbors.second_distance = std::sqrt(neighbors.second_distance);
+  }
+}
+
+std::vector<NearestNeighbors> FlannKnnMatch(const cv::Mat& query,
+                                            const Image& train) {
+  // Keeps the index alive even if the image store evicts it meanwhile
+  auto index = train.GetDescriptorIndex();
+  if (index == nullptr) {
+    return {};
+  }
+
+  cv::Mat indices;
+  cv::Mat dists;
+  index->knnSearch(query, indices, dists, 2, cv::flann::SearchParams());
+
+  std::vector<NearestNeighbors> result(indices.rows);
+  for (int row = 0; row < indices.rows; row++) {
+    result[row] = {indices.at<int>(row, 0), indices.at<int>(row, 1),
+                   dists.at<float>(row, 0), dists.at<float>(row, 1)};
+  }
+  // FLANN returns squared L2 distances
+  TakeSquareRoot(&result);
+  return result;
+}
+
+std::vector<NearestNeighbors> BruteForceKnnMatch(const cv::Mat& query,
+                                                 const cv::Mat& train) {
+  cv::BFMatcher matcher(cv::NORM_L2);
+  std::vector<std::vector<cv::DMatch>> matches;
+  matcher.knnMatch(query, train, matches, 2);
+
+  std::vector<NearestNeighbors> result(matches.size());
+  for (int row = 0; row < matches.size(); row++) {
+    const auto& match = matches[row];
+    if (!match.empty()) {
+      result[row].best = match[0].trainIdx;
+      result[row].best_distance = match[0].distance;
+    }
+    if (match.size() > 1) {
+      result[row].second = match[1].trainIdx;
+      result[row].second_distance = match[1].distance;
+    }
+  }
+  return result;
+}
+
+}  // namespace
+
+std::vector<NearestNeighbors> SimdKnnMatch(const cv::Mat& query,
+                                           const cv::Mat& train) {
+  CV_Assert((query.type() == CV_32F || query.type() == CV_8U) &&
+            query.type() == train.type() && query.cols == train.cols);
+  std::vector<NearestNeighbors> result(query.rows);
+  if (query.type() == CV_8U) {
+    KnnU8(query, train, result.data());
+    TakeSquareRoot(&result);
+    return result;
+  }
+  switch (CpuInstructionSet()) {
+#if XPANO_SIMD_X86
+    case InstructionSet::kAvx512:
+      KnnAvx512(query, train, result.data());
+      break;
+    case InstructionSet::kAvx2:
+      KnnAvx2(query, train, result.data());
+      break;
+#endif
+    default:
+      KnnGeneric(query, train, result.data());
+      break;
+  }
+  TakeSquareRoot(&result);
+  return result;
+}
+
+const char* SimdInstructionSet() {
+  switch (CpuInstructionSet()) {
+    case InstructionSet::kAvx512:
+      return "AVX-512";
+    case InstructionSet::kAvx2:
+      return "AVX2";
+    default:
+      return "Generic";
+  }
+}
+
+std::vector<NearestNeighbors> KnnMatch(const Image& query, const Image& train,
+                                       MatcherType matcher) {
+  // Fetched once, each access might go through the image store
+  cv::Mat query_descriptors = query.GetDescriptors();
+  cv::Mat train_descriptors = train.GetDescriptors();
+  if (query_descriptors.empty() || train_descriptors.empty()) {
+    return {};
+  }
+  // Images loaded with and without quantization, e.g. restored from the
+  // feature cache. The float SIFT descriptors are whole numbers, converting
+  // them to 8 bits is lossless.
+  if (query_descriptors.type() != train_descriptors.type()) {
+    auto* float_descriptors = query_descriptors.depth() == CV_8U
+                                  ? &train_descriptors
+                                  : &query_descriptors;
+    float_descriptors->convertTo(*float_descriptors, CV_8U);
+  }
+
+  switch (matcher) {
+    case MatcherType::kFlann:
+      // Quantized descriptors have no KD-tree, the exact search on 8-bit
+      // integers is cheap enough instead
+      if (query_descriptors.depth() == CV_8U) {
+        return SimdKnnMatch(query_descriptors, train_descriptors);
+      }
+      return FlannKnnMatch(query_descriptors, train);
+    case MatcherType::kBruteForce:
+      return BruteForceKnnMatch(query_descriptors, train_descriptors);
+    case MatcherType::kSimd:
+      return SimdKnnMatch(query_descriptors, train_descriptors);
+    default:
+      return {};
+  }
+}
+
+}  // namespace xpano::algorithm
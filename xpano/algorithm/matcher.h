@@ -0,0 +1,37 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <limits>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "xpano/algorithm/image.h"
+#include "xpano/algorithm/options.h"
+
+namespace xpano::algorithm {
+
+// Two nearest train descriptors of a query descriptor, with L2 distances
+struct NearestNeighbors {
+  int best = -1;
+  int second = -1;
+  float best_distance = std::numeric_limits<float>::max();
+  float second_distance = std::numeric_limits<float>::max();
+};
+
+// One entry per query descriptor, entries without two neighbors (e.g. a
+// single train descriptor) have the missing indices set to -1
+std::vector<NearestNeighbors> KnnMatch(const Image& query, const Image& train,
+                                       MatcherType matcher);
+
+// Exact brute force search over CV_32F or quantized CV_8U descriptors,
+// vectorized with the best instruction set supported by the CPU at runtime
+std::vector<NearestNeighbors> SimdKnnMatch(const cv::Mat& query,
+                                           const cv::Mat& train);
+
+// Instruction set picked by SimdKnnMatch, for logging
+const char* SimdInstructionSet();
+
+}  // namespace xpano::algorithm
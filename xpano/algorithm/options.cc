@@ -93,4 +93,30 @@ const char* Label(BlendingMethod blending_method) {
   }
 }
 
+const char* Label(DepthConversion depth_conversion) {
+  switch (depth_conversion) {
+    case DepthConversion::kScale:
+      return "Scale";
+    case DepthConversion::kAutoRange:
+      return "Auto range";
+    case DepthConversion::kTonemap:
+      return "Tone map";
+    default:
+      return "Unknown";
+  }
+}
+
+const char* Label(MatcherType matcher_type) {
+  switch (matcher_type) {
+    case MatcherType::kFlann:
+      return "FLANN";
+    case MatcherType::kBruteForce:
+      return "Brute force";
+    case MatcherType::kSimd:
+      return "SIMD";
+    default:
+      return "Unknown";
+  }
+}
+
 }  // namespace xpano::algorithm
@@ -35,11 +35,22 @@ enum class InpaintingMethod {
 
 enum class BlendingMethod { kOpenCV, kMultiblend };
 
+enum class MatcherType { kFlann, kBruteForce, kSimd };
+
+// Conversion of images with more than 8 bits per channel
+enum class DepthConversion {
+  kScale,      // full range of the pixel type
+  kAutoRange,  // darkest to brightest pixel of the image
+  kTonemap,    // auto range followed by a gamma curve, for linear scans
+};
+
 const char* Label(ProjectionType projection_type);
 const char* Label(FeatureType feature_type);
 const char* Label(WaveCorrectionType wave_correction_type);
 const char* Label(InpaintingMethod inpaint_method);
 const char* Label(BlendingMethod blending_method);
+const char* Label(DepthConversion depth_conversion);
+const char* Label(MatcherType matcher_type);
 
 bool HasAdvancedParameters(ProjectionType projection_type);
 
@@ -65,6 +76,13 @@ const auto kInpaintingMethods =
 const auto kBlendingMethods =
     std::array{BlendingMethod::kOpenCV, BlendingMethod::kMultiblend};
 
+const auto kMatcherTypes = std::array{
+    MatcherType::kFlann, MatcherType::kBruteForce, MatcherType::kSimd};
+
+const auto kDepthConversions =
+    std::array{DepthConversion::kScale, DepthConversion::kAutoRange,
+               DepthConversion::kTonemap};
+
 /*****************************************************************************/
 
 struct ProjectionOptions {
@@ -79,6 +97,22 @@ struct StitchOptions {
   WaveCorrectionType wave_correction = WaveCorrectionType::kAuto;
   float match_conf = kDefaultMatchConf;
   BlendingMethod blending_method = BlendingMethod::kOpenCV;
+  // Full resolution stitching reuses the camera parameters estimated on the
+  // previews instead of registering the full resolution images again
+  bool reuse_preview_registration = true;
+  // Full resolution exports are composed tile by tile and written straight to
+  // a BigTIFF file, for panoramas that don't fit into the memory
+  bool tiled_export = false;
+};
+
+struct MatchOptions {
+  float match_conf = kDefaultMatchConf;
+  // Keep only the matches found in both directions
+  bool cross_check = false;
+  MatcherType matcher = MatcherType::kFlann;
+  // Decide from the strongest keypoints first when the number of inliers is
+  // clearly above or below this threshold, 0 always matches all keypoints
+  int early_exit_threshold = 0;
 };
 
 struct InpaintingOptions {
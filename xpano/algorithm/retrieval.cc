@@ -0,0 +1,175 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/algorithm/retrieval.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <set>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/features2d.hpp>
+#include <spdlog/spdlog.h>
+
+#include "xpano/algorithm/image.h"
+#include "xpano/constants.h"
+
+namespace xpano::algorithm {
+
+namespace {
+
+// Fixed seed, so that repeated runs propose the same pairs
+constexpr std::uint64_t kVocabularySeed = 0x5850414e;  // "XPAN"
+
+// k-means and the word assignment need floats, quantized descriptors are
+// converted
+cv::Mat FloatDescriptors(const Image& image) {
+  cv::Mat descriptors = image.GetDescriptors();
+  if (!descriptors.empty() && descriptors.depth() != CV_32F) {
+    descriptors.convertTo(descriptors, CV_32F);
+  }
+  return descriptors;
+}
+
+cv::Mat SampleDescriptors(const std::vector<Image>& images) {
+  int samples_per_image = std::max(
+      1, std::min(kVocabularySamplesPerImage,
+                  kVocabularyMaxSamples /
+                      std::max(1, static_cast<int>(images.size()))));
+  cv::Mat samples;
+  for (const auto& image : images) {
+    auto descriptors = FloatDescriptors(image);
+    if (descriptors.empty()) {
+      continue;
+    }
+    int step = std::max(1, descriptors.rows / samples_per_image);
+    for (int row = 0; row < descriptors.rows; row += step) {
+      samples.push_back(descriptors.row(row));
+    }
+  }
+  return samples;
+}
+
+cv::Mat BuildVocabulary(const cv::Mat& samples) {
+  int vocabulary_size = std::min(kVocabularySize, samples.rows);
+  auto& rng = cv::theRNG();
+  auto rng_state = rng.state;
+  rng.state = kVocabularySeed;
+
+  cv::Mat labels;
+  cv::Mat centers;
+  cv::kmeans(samples, vocabulary_size, labels,
+             cv::TermCriteria(cv::TermCriteria::COUNT | cv::TermCriteria::EPS,
+                              kVocabularyKmeansIterations, 1e-3),
+             1, cv::KMEANS_PP_CENTERS, centers);
+
+  rng.state = rng_state;
+  return centers;
+}
+
+// One row per image, L2 normalized TF-IDF weighted visual word histograms
+cv::Mat ComputeImageDescriptors(const std::vector<Image>& images,
+                                const cv::Mat& vocabulary) {
+  // Exact nearest words, an approximate search could differ between runs
+  cv::BFMatcher word_matcher(cv::NORM_L2);
+  cv::Mat histograms = cv::Mat::zeros(static_cast<int>(images.size()),
+                                      vocabulary.rows, CV_32F);
+  for (int i = 0; i < images.size(); i++) {
+    auto descriptors = FloatDescriptors(images[i]);
+    if (descriptors.empty()) {
+      continue;
+    }
+    std::vector<cv::DMatch> words;
+    word_matcher.match(descriptors, vocabulary, words);
+    auto* histogram = histograms.ptr<float>(i);
+    float term_weight = 1.0f / static_cast<float>(words.size());
+    for (const auto& word : words) {
+      histogram[word.trainIdx] += term_weight;
+    }
+  }
+
+  // Words present in every image carry no information
+  for (int word = 0; word < vocabulary.rows; word++) {
+    cv::Mat column = histograms.col(word);
+    int num_images = cv::countNonZero(column);
+    float idf = num_images > 0
+                    ? std::log(static_cast<float>(images.size()) /
+                               static_cast<float>(num_images))
+                    : 0.0f;
+    column *= idf;
+  }
+  for (int i = 0; i < histograms.rows; i++) {
+    cv::Mat row = histograms.row(i);
+    auto norm = cv::norm(row);
+    if (norm > 0.0) {
+      row /= norm;
+    }
+  }
+  return histograms;
+}
+
+// Pairs image i with its num_candidates most similar images
+void AddMostSimilar(int i, const float* similarity, int num_images,
+                    int num_candidates, std::set<ImagePair>* pairs) {
+  // Images without any informative words are never similar
+  std::vector<int> candidates;
+  for (int j = 0; j < num_images; j++) {
+    if (j != i && similarity[j] > 0.0f) {
+      candidates.push_back(j);
+    }
+  }
+  // Ties broken by the index, so that the pairs are deterministic
+  auto num_neighbors =
+      std::min(static_cast<std::size_t>(num_candidates), candidates.size());
+  std::partial_sort(candidates.begin(), candidates.begin() + num_neighbors,
+                    candidates.end(), [similarity](int lhs, int rhs) {
+                      return similarity[lhs] > similarity[rhs] ||
+                             (similarity[lhs] == similarity[rhs] && lhs < rhs);
+                    });
+  for (std::size_t k = 0; k < num_neighbors; k++) {
+    int j = candidates[k];
+    pairs->emplace(std::min(i, j), std::max(i, j));
+  }
+}
+
+}  // namespace
+
+std::vector<ImagePair> RetrievePairs(const std::vector<Image>& images,
+                                     int num_candidates) {
+  std::set<ImagePair> pairs;
+  // Consecutive images are always candidates, most sets are shot in order
+  for (int i = 1; i < images.size(); i++) {
+    pairs.emplace(i - 1, i);
+  }
+
+  cv::Mat samples = SampleDescriptors(images);
+  if (images.size() < 3 || samples.rows < 2 || num_candidates <= 0) {
+    return {pairs.begin(), pairs.end()};
+  }
+
+  cv::Mat image_descriptors =
+      ComputeImageDescriptors(images, BuildVocabulary(samples));
+
+  // The histograms are unit vectors, so their dot products are the cosine
+  // similarities. Computed a block of rows at a time, only the most similar
+  // images of each row are kept.
+  int num_images = image_descriptors.rows;
+  cv::Mat transposed = image_descriptors.t();
+  for (int start = 0; start < num_images; start += kRetrievalBlockRows) {
+    int end = std::min(start + kRetrievalBlockRows, num_images);
+    cv::Mat similarities = image_descriptors.rowRange(start, end) * transposed;
+    for (int row = 0; row < similarities.rows; row++) {
+      AddMostSimilar(start + row, similarities.ptr<float>(row), num_images,
+                     num_candidates, &pairs);
+    }
+  }
+
+  spdlog::info("Retrieved {} candidate pairs from {} images", pairs.size(),
+               images.size());
+  return {pairs.begin(), pairs.end()};
+}
+
+}  // namespace xpano::algorithm
@@ -0,0 +1,24 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <utility>
+#include <vector>
+
+#include "xpano/algorithm/image.h"
+
+namespace xpano::algorithm {
+
+// Pair of image indices, first < second
+using ImagePair = std::pair<int, int>;
+
+// Proposes likely overlapping image pairs regardless of the image order.
+// Each image is described by a TF-IDF weighted bag of visual words, with the
+// vocabulary clustered from the SIFT descriptors of the images themselves.
+// Every image is paired with its num_candidates most similar images by the
+// cosine similarity of the histograms, found with an exact search.
+std::vector<ImagePair> RetrievePairs(const std::vector<Image>& images,
+                                     int num_candidates);
+
+}  // namespace xpano::algorithm
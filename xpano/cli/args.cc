@@ -4,6 +4,7 @@
 #include "xpano/cli/args.h"
 
 #include <filesystem>
+#include <string>
 #include <vector>
 
 #include <spdlog/fmt/fmt.h>
@@ -23,6 +24,14 @@ const std::string kGuiFlag = "--gui";
 const std::string kOutputFlag = "--output=";
 const std::string kHelpFlag = "--help";
 const std::string kVersionFlag = "--version";
+const std::string kAutoFlag = "--auto";
+const std::string kSummaryFlag = "--summary";
+const std::string kSummaryPathFlag = "--summary=";
+const std::string kServeFlag = "--serve=";
+const std::string kFeatureCacheFlag = "--feature-cache=";
+const std::string kQuantizeFlag = "--quantize";
+const std::string kWatchFlag = "--watch=";
+const std::string kStablePeriodFlag = "--stable-period=";
 
 void ParseArg(Args* result, const std::string& arg) {
   if (arg == kGuiFlag) {
@@ -31,6 +40,27 @@ void ParseArg(Args* result, const std::string& arg) {
     result->print_help = true;
   } else if (arg == kVersionFlag) {
     result->print_version = true;
+  } else if (arg == kAutoFlag) {
+    result->auto_detect = true;
+  } else if (arg == kQuantizeFlag) {
+    result->quantize_descriptors = true;
+  } else if (arg == kSummaryFlag) {
+    result->print_summary = true;
+  } else if (arg.starts_with(kSummaryPathFlag)) {
+    auto substr = arg.substr(kSummaryPathFlag.size());
+    result->summary_path = std::filesystem::path(substr);
+  } else if (arg.starts_with(kServeFlag)) {
+    auto substr = arg.substr(kServeFlag.size());
+    result->socket_path = std::filesystem::path(substr);
+  } else if (arg.starts_with(kFeatureCacheFlag)) {
+    auto substr = arg.substr(kFeatureCacheFlag.size());
+    result->feature_cache_dir = std::filesystem::path(substr);
+  } else if (arg.starts_with(kWatchFlag)) {
+    auto substr = arg.substr(kWatchFlag.size());
+    result->watch_dir = std::filesystem::path(substr);
+  } else if (arg.starts_with(kStablePeriodFlag)) {
+    auto substr = arg.substr(kStablePeriodFlag.size());
+    result->stable_period = std::stoi(substr);
   } else if (arg.starts_with(kOutputFlag)) {
     auto substr = arg.substr(kOutputFlag.size());
     result->output_path = std::filesystem::path(substr);
@@ -39,22 +69,32 @@ void ParseArg(Args* result, const std::string& arg) {
   }
 }
 
-Args ParseArgsRaw(int argc, char** argv) {
+Args ParseArgsRaw(const std::vector<std::string>& args) {
   Args result;
-  std::vector<std::filesystem::path> input_paths;
-  for (int i = 1; i < argc; ++i) {
-    std::string arg = argv[i];
+  for (const auto& arg : args) {
     ParseArg(&result, arg);
   }
   return result;
 }
 
 bool ValidateArgs(const Args& args) {
-  if (args.output_path && args.input_paths.empty()) {
+  if (args.output_path && args.input_paths.empty() && !args.watch_dir) {
     spdlog::error("No supported images provided");
     return false;
   }
-  if (args.output_path &&
+  if ((args.auto_detect || args.print_summary || args.summary_path) &&
+      args.input_paths.empty()) {
+    spdlog::error("No supported images provided");
+    return false;
+  }
+  if ((args.auto_detect || args.watch_dir) && args.output_path &&
+      std::filesystem::exists(*args.output_path) &&
+      !std::filesystem::is_directory(*args.output_path)) {
+    spdlog::error("Output path \"{}\" is not a directory",
+                  args.output_path->string());
+    return false;
+  }
+  if (!args.auto_detect && !args.watch_dir && args.output_path &&
       !utils::path::IsExtensionSupported(*args.output_path)) {
     spdlog::error("Unsupported output file extension: \"{}\"",
                   args.output_path->extension().string());
@@ -65,15 +105,53 @@ bool ValidateArgs(const Args& args) {
         "Specifying --gui and --output together is not yet supported.");
     return false;
   }
+  if (args.auto_detect && args.run_gui) {
+    spdlog::error("Specifying --gui and --auto together is not supported.");
+    return false;
+  }
+  if (args.socket_path) {
+#ifdef _WIN32
+    spdlog::error("--serve is not supported on Windows.");
+    return false;
+#else
+    if (!args.input_paths.empty() || args.output_path || args.run_gui) {
+      spdlog::error("With --serve, the inputs come from the requests.");
+      return false;
+    }
+#endif
+  }
+  if (args.watch_dir) {
+    if (!std::filesystem::is_directory(*args.watch_dir)) {
+      spdlog::error("Watched path \"{}\" is not a directory",
+                    args.watch_dir->string());
+      return false;
+    }
+    if (!args.input_paths.empty() || args.run_gui || args.socket_path) {
+      spdlog::error("--watch can't be combined with inputs, --gui or --serve.");
+      return false;
+    }
+  }
+  if (args.stable_period < 0) {
+    spdlog::error("Negative --stable-period");
+    return false;
+  }
   return true;
 }
 
 }  // namespace
 
 std::optional<Args> ParseArgs(int argc, char** argv) {
+  std::vector<std::string> args;
+  for (int i = 1; i < argc; ++i) {
+    args.emplace_back(argv[i]);
+  }
+  return ParseArgs(args);
+}
+
+std::optional<Args> ParseArgs(const std::vector<std::string>& raw_args) {
   Args args;
   try {
-    args = ParseArgsRaw(argc, argv);
+    args = ParseArgsRaw(raw_args);
   } catch (const std::exception& e) {
     spdlog::error("Error parsing arguments: {}", e.what());
     return {};
@@ -95,7 +173,17 @@ std::optional<Args> ParseArgs(int argc, char** argv) {
 
 void PrintHelp() {
   spdlog::info("Usage: Xpano [<input files>] [--output=<path>]");
-  spdlog::info("\t[--gui] [--help] [--version]");
+  spdlog::info("\t[--auto] [--summary[=<path>]] [--feature-cache=<dir>]");
+  spdlog::info("\t[--serve=<socket>] [--watch=<dir>] [--stable-period=<s>]");
+  spdlog::info("\t[--quantize] [--gui] [--help] [--version]");
+  spdlog::info("--auto: export each detected panorama into the directory");
+  spdlog::info("\tgiven by --output, named after its first image");
+  spdlog::info("--summary: JSON report with timings and output sizes");
+  spdlog::info("--serve: run jobs sent as lines of tab separated arguments");
+  spdlog::info("--watch: export the panoramas of the arriving images once");
+  spdlog::info("\tthey didn't change for --stable-period seconds");
+  spdlog::info("--quantize: keep the image descriptors as 8-bit integers,");
+  spdlog::info("\ta quarter of the memory with the same matches");
   spdlog::info("Supported formats: {}", fmt::join(kSupportedExtensions, ", "));
 }
 
@@ -5,19 +5,39 @@
 
 #include <filesystem>
 #include <optional>
+#include <string>
 #include <vector>
 
+#include "xpano/constants.h"
+
 namespace xpano::cli {
 
 struct Args {
   bool run_gui = false;
   bool print_help = false;
   bool print_version = false;
+  // Split the inputs into panos instead of stitching them all into one,
+  // output_path is then a directory
+  bool auto_detect = false;
+  // Print the JSON summary, or write it to summary_path
+  bool print_summary = false;
+  std::optional<std::filesystem::path> summary_path;
+  // Serve jobs over this Unix domain socket instead of running once
+  std::optional<std::filesystem::path> socket_path;
+  std::optional<std::filesystem::path> feature_cache_dir;
+  // Store the SIFT descriptors as 8-bit integers, see LoadingOptions
+  bool quantize_descriptors = false;
+  // Export the panos of the images arriving into this directory, once they
+  // didn't change for stable_period seconds
+  std::optional<std::filesystem::path> watch_dir;
+  int stable_period = kDefaultWatchStablePeriod;
   std::vector<std::filesystem::path> input_paths;
   std::optional<std::filesystem::path> output_path;
 };
 
 std::optional<Args> ParseArgs(int argc, char** argv);
+// Same as the command line arguments, without the program name
+std::optional<Args> ParseArgs(const std::vector<std::string>& args);
 
 void PrintHelp();
 
@@ -3,22 +3,37 @@
 
 #include "xpano/cli/pano_cli.h"
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <filesystem>
+#include <future>
+#include <optional>
+#include <set>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
 
 #include <spdlog/spdlog.h>
 
 #include "xpano/algorithm/algorithm.h"
 #include "xpano/cli/args.h"
 #include "xpano/cli/signal.h"
+#include "xpano/cli/summary.h"
+#include "xpano/cli/watch.h"
 #include "xpano/constants.h"
 #include "xpano/log/logger.h"
 #include "xpano/pipeline/stitcher_pipeline.h"
 #include "xpano/utils/future.h"
+#include "xpano/utils/path.h"
 #include "xpano/version_fmt.h"
 
 #ifdef _WIN32
 #include "xpano/cli/windows_console.h"
+#else
+#include "xpano/cli/server.h"
 #endif
 
 namespace xpano::cli {
@@ -44,73 +59,295 @@ void CancelHandler(int /*signal*/) { cancel.fetch_add(1); }
 
 void PrintVersion() { spdlog::info("Xpano version {}", version::Current()); }
 
-ResultType RunPipeline(const Args &args) {
-  pipeline::StitcherPipeline pipeline;
-
-  auto stitcher_data_future = pipeline.RunLoading(
-      args.input_paths, {.preview_longer_side = kMaxImageSizeForCLI},
-      {.type = pipeline::MatchingType::kSinglePano});
+using Clock = std::chrono::steady_clock;
 
-  pipeline::StitcherData stitcher_data;
+double SecondsSince(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
 
+template <typename TResult>
+std::optional<TResult> Wait(std::future<TResult> future,
+                            pipeline::StitcherPipeline *pipeline,
+                            const std::string &error_message) {
   try {
-    stitcher_data = utils::future::GetWithCancellation(
-        std::move(stitcher_data_future), cancel);
+    return utils::future::GetWithCancellation(std::move(future), cancel);
   } catch (const utils::future::Cancelled) {
     spdlog::info("Canceling, press CTRL+C again to force quit.");
-    pipeline.Cancel();
-    return ResultType::kError;
+    pipeline->Cancel();
   } catch (const std::exception &e) {
-    spdlog::error("Failed to load images: {}", e.what());
-    return ResultType::kError;
+    spdlog::error("{}: {}", error_message, e.what());
   }
+  return {};
+}
 
-  if (stitcher_data.images.empty()) {
-    spdlog::error("Failed to load any images");
-    return ResultType::kError;
-  }
+std::uintmax_t FileSize(const std::filesystem::path &path) {
+  std::error_code error;
+  auto size = std::filesystem::file_size(path, error);
+  return error ? 0 : size;
+}
 
+ResultType ExportSinglePano(const Args &args,
+                            const pipeline::StitcherData &stitcher_data,
+                            pipeline::StitcherPipeline *pipeline,
+                            Summary *summary) {
   auto export_path =
       args.output_path
           ? *args.output_path
           : std::filesystem::path(stitcher_data.images[0].PanoName());
 
-  auto stitching_result_future = pipeline.RunStitching(
-      stitcher_data, {.pano_id = 0, .export_path = export_path});
+  auto start = Clock::now();
+  auto stitching_result = Wait(
+      pipeline->RunStitching(stitcher_data,
+                             {.pano_id = 0, .export_path = export_path}),
+      pipeline, "Failed to stitch panorama");
+  if (!stitching_result) {
+    return ResultType::kError;
+  }
+  summary->timings.emplace_back("stitching", SecondsSince(start));
+
+  PanoSummary pano_summary{
+      .pano_id = 0,
+      .num_images = static_cast<int>(stitcher_data.panos[0].ids.size()),
+      .export_path = stitching_result->export_path,
+      .seconds = summary->timings.back().second};
+  if (stitching_result->pano) {
+    pano_summary.width = stitching_result->pano->cols;
+    pano_summary.height = stitching_result->pano->rows;
+  }
+  if (stitching_result->export_path) {
+    pano_summary.file_size = FileSize(*stitching_result->export_path);
+  }
+  summary->panos.push_back(pano_summary);
 
-  pipeline::StitchingResult stitching_result;
+  if (!stitching_result->pano) {
+    spdlog::error("Failed to stitch panorama: {}",
+                  algorithm::ToString(stitching_result->status));
+    return ResultType::kError;
+  }
 
-  try {
-    stitching_result = utils::future::GetWithCancellation(
-        std::move(stitching_result_future), cancel);
-  } catch (const utils::future::Cancelled) {
-    spdlog::info("Canceling, press CTRL+C again to force quit.");
-    pipeline.Cancel();
+  if (!stitching_result->export_path) {
+    spdlog::error("Failed to export panorama to file: {}",
+                  export_path.string());
     return ResultType::kError;
-  } catch (const std::exception &e) {
-    spdlog::error("Failed to stitch panorama: {}", e.what());
+  }
+
+  spdlog::info("Successfully exported to {}",
+               stitching_result->export_path->string());
+  spdlog::info("Size: {} x {}", stitching_result->pano->cols,
+               stitching_result->pano->rows);
+
+  return ResultType::kSuccess;
+}
+
+ResultType ExportAllPanos(const Args &args,
+                          const pipeline::StitcherData &stitcher_data,
+                          pipeline::StitcherPipeline *pipeline,
+                          Summary *summary) {
+  if (stitcher_data.panos.empty()) {
+    spdlog::error("No panoramas found");
+    return ResultType::kError;
+  }
+  spdlog::info("Found {} panoramas", stitcher_data.panos.size());
+
+  auto export_dir = args.output_path.value_or(".");
+  std::error_code error;
+  std::filesystem::create_directories(export_dir, error);
+  if (error) {
+    spdlog::error("Failed to create directory {}: {}", export_dir.string(),
+                  error.message());
     return ResultType::kError;
   }
 
-  if (!stitching_result.pano) {
-    spdlog::error("Failed to stitch panorama: {}",
-                  algorithm::ToString(stitching_result.status));
+  // Same as the single pano mode, the previews are stitched
+  auto start = Clock::now();
+  auto results = Wait(pipeline->RunBatchExport(
+                          stitcher_data,
+                          {.export_dir = export_dir, .full_res = false}),
+                      pipeline, "Failed to export panoramas");
+  if (!results) {
+    return ResultType::kError;
+  }
+  summary->timings.emplace_back("stitching", SecondsSince(start));
+
+  auto result_type = ResultType::kSuccess;
+  for (const auto &result : *results) {
+    PanoSummary pano_summary{
+        .pano_id = result.pano_id,
+        .num_images =
+            static_cast<int>(stitcher_data.panos[result.pano_id].ids.size()),
+        .width = result.pano_size.width,
+        .height = result.pano_size.height,
+        .seconds = result.seconds};
+    if (result.status == pipeline::BatchStatus::kDone) {
+      pano_summary.export_path = result.export_path;
+      pano_summary.file_size = FileSize(*result.export_path);
+      spdlog::info("Exported panorama {} to {}", result.pano_id,
+                   result.export_path->string());
+    } else {
+      spdlog::error("Failed to export panorama {}", result.pano_id);
+      result_type = ResultType::kError;
+    }
+    summary->panos.push_back(pano_summary);
+  }
+  return result_type;
+}
+
+ResultType LoadAndExport(const Args &args, pipeline::StitcherPipeline *pipeline,
+                         Summary *summary) {
+  auto start = Clock::now();
+  auto matching_type = args.auto_detect ? pipeline::MatchingType::kAuto
+                                        : pipeline::MatchingType::kSinglePano;
+  auto stitcher_data = Wait(
+      pipeline->RunLoading(
+          args.input_paths,
+          {.preview_longer_side = kMaxImageSizeForCLI,
+           .quantize_descriptors = args.quantize_descriptors},
+          {.type = matching_type}),
+      pipeline, "Failed to load images");
+  if (!stitcher_data) {
+    return ResultType::kError;
+  }
+  summary->timings.emplace_back("loading", SecondsSince(start));
+  summary->num_images = static_cast<int>(stitcher_data->images.size());
+
+  if (stitcher_data->images.empty()) {
+    spdlog::error("Failed to load any images");
     return ResultType::kError;
   }
 
-  if (!stitching_result.export_path) {
+  if (args.auto_detect) {
+    return ExportAllPanos(args, *stitcher_data, pipeline, summary);
+  }
+  return ExportSinglePano(args, *stitcher_data, pipeline, summary);
+}
+
+ResultType RunJob(const Args &args, pipeline::StitcherPipeline *pipeline,
+                  Summary *summary) {
+  summary->num_inputs = static_cast<int>(args.input_paths.size());
+  auto start = Clock::now();
+  auto result = LoadAndExport(args, pipeline, summary);
+  summary->timings.emplace_back("total", SecondsSince(start));
+  return result;
+}
+
+ResultType RunPipeline(const Args &args) {
+  pipeline::StitcherPipeline pipeline(args.feature_cache_dir);
+  Summary summary;
+  auto result = RunJob(args, &pipeline, &summary);
+  WriteSummary(summary, args.print_summary, args.summary_path);
+  return result;
+}
+
+// Compared with the paths reported by the directory watcher
+std::filesystem::path Normalized(const std::filesystem::path &path) {
+  std::error_code error;
+  auto normalized = std::filesystem::weakly_canonical(path, error);
+  return error ? path : normalized;
+}
+
+void ExportWatchedPano(const algorithm::Pano &pano,
+                       const pipeline::StitcherData &stitcher_data,
+                       const std::filesystem::path &export_path,
+                       pipeline::StitcherPipeline *pipeline) {
+  auto found = std::find_if(
+      stitcher_data.panos.begin(), stitcher_data.panos.end(),
+      [&pano](const auto &other) { return other.ids == pano.ids; });
+  auto pano_id = static_cast<int>(found - stitcher_data.panos.begin());
+  auto stitching_result = Wait(
+      pipeline->RunStitching(stitcher_data,
+                             {.pano_id = pano_id, .export_path = export_path}),
+      pipeline, "Failed to stitch panorama");
+  if (stitching_result && stitching_result->export_path) {
+    spdlog::info("Exported panorama of {} images to {}", pano.ids.size(),
+                 stitching_result->export_path->string());
+  } else {
     spdlog::error("Failed to export panorama to file: {}",
                   export_path.string());
+  }
+}
+
+// New images are matched only with their neighbors among the images loaded
+// so far, a pano is exported once it didn't change for the stable period
+ResultType RunWatch(const Args &args) {
+  watch::DirectoryWatcher watcher(*args.watch_dir);
+  if (!watcher.IsValid()) {
+    return ResultType::kError;
+  }
+  auto export_dir = args.output_path.value_or(".");
+  std::error_code error;
+  std::filesystem::create_directories(export_dir, error);
+  if (error) {
+    spdlog::error("Failed to create directory {}: {}", export_dir.string(),
+                  error.message());
     return ResultType::kError;
   }
 
-  spdlog::info("Successfully exported to {}",
-               stitching_result.export_path->string());
-  spdlog::info("Size: {} x {}", stitching_result.pano->cols,
-               stitching_result.pano->rows);
+  pipeline::StitcherPipeline pipeline(args.feature_cache_dir);
+  pipeline::StitcherData stitcher_data;
+  watch::StabilityTracker tracker(std::chrono::seconds(args.stable_period));
+  // Exported panos are known too, in case they land in the watched directory
+  std::set<std::filesystem::path> known_files;
+  std::vector<std::filesystem::path> new_files;
+  auto last_arrival = Clock::now();
+  spdlog::info("Watching {}, press CTRL+C to stop.", args.watch_dir->string());
+
+  while (cancel == 0) {
+    auto files = utils::path::KeepSupported(watcher.Poll(kWatchPollInterval));
+    for (auto &file : files) {
+      if (known_files.insert(Normalized(file)).second) {
+        new_files.push_back(std::move(file));
+        last_arrival = Clock::now();
+      }
+    }
+
+    if (!new_files.empty() && Clock::now() - last_arrival >= kWatchSettleTime) {
+      std::sort(new_files.begin(), new_files.end());
+      spdlog::info("Loading {} new images", new_files.size());
+      auto updated_data = Wait(
+          pipeline.RunIncrementalLoading(
+              stitcher_data, new_files,
+              {.preview_longer_side = kMaxImageSizeForCLI,
+               .quantize_descriptors = args.quantize_descriptors},
+              {.type = pipeline::MatchingType::kAuto}),
+          &pipeline, "Failed to load images");
+      new_files.clear();
+      if (updated_data) {
+        stitcher_data = std::move(*updated_data);
+        tracker.Update(stitcher_data.panos, Clock::now());
+      }
+    }
 
+    for (const auto &pano : tracker.TakeStable(Clock::now())) {
+      auto export_path =
+          export_dir / stitcher_data.images[pano.ids[0]].PanoName();
+      known_files.insert(Normalized(export_path));
+      ExportWatchedPano(pano, stitcher_data, export_path, &pipeline);
+    }
+  }
+
+  spdlog::info("Stopped watching {}", args.watch_dir->string());
   return ResultType::kSuccess;
 }
+
+#ifndef _WIN32
+// The pipeline is shared between the jobs, the jobs on the same inputs reuse
+// its caches. --quantize applies to all the jobs when given to the server.
+ResultType RunServer(const Args &args) {
+  pipeline::StitcherPipeline pipeline(args.feature_cache_dir);
+  return server::Serve(
+      *args.socket_path,
+      {.run_job =
+           [&pipeline, quantize = args.quantize_descriptors](
+               Args job_args, Summary *summary) {
+             job_args.quantize_descriptors =
+                 job_args.quantize_descriptors || quantize;
+             return RunJob(job_args, &pipeline, summary);
+           },
+       .progress = [&pipeline]() { return pipeline.Progress(); },
+       .cancel = [&pipeline]() { pipeline.Cancel(); }},
+      cancel);
+}
+#endif
 }  // namespace
 
 std::pair<ResultType, std::optional<Args>> Run(int argc, char **argv) {
@@ -136,6 +373,22 @@ std::pair<ResultType, std::optional<Args>> Run(int argc, char **argv) {
     return {ResultType::kSuccess, std::nullopt};
   }
 
+  if (args->print_summary) {
+    logger::RedirectSpdlogToCerr();
+  }
+
+  if (args->watch_dir) {
+    signal::RegisterInterruptHandler(CancelHandler);
+    return {RunWatch(*args), args};
+  }
+
+#ifndef _WIN32
+  if (args->socket_path) {
+    signal::RegisterInterruptHandler(CancelHandler);
+    return {RunServer(*args), args};
+  }
+#endif
+
   if (args->run_gui || args->input_paths.empty()) {
     return {ResultType::kForwardToGui, args};
   }
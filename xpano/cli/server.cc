@@ -0,0 +1,310 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/cli/server.h"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <filesystem>
+#include <future>
+#include <optional>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <spdlog/fmt/fmt.h>
+#include <spdlog/spdlog.h>
+
+#include "xpano/constants.h"
+
+namespace xpano::cli::server {
+
+namespace {
+
+const std::string kShutdownRequest = "shutdown";
+
+class Socket {
+ public:
+  explicit Socket(int fd) : fd_(fd) {}
+  ~Socket() {
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+  }
+  Socket(const Socket&) = delete;
+  Socket& operator=(const Socket&) = delete;
+  Socket(Socket&&) = delete;
+  Socket& operator=(Socket&&) = delete;
+
+  [[nodiscard]] int Get() const { return fd_; }
+
+ private:
+  int fd_;
+};
+
+// False once cancelled or on errors
+bool WaitReadable(int fd, const std::atomic_int& cancel) {
+  pollfd poll_fd{.fd = fd, .events = POLLIN, .revents = 0};
+  auto timeout = static_cast<int>(kCancellationTimeout.count());
+  while (cancel == 0) {
+    int result = poll(&poll_fd, 1, timeout);
+    if (result > 0) {
+      return true;
+    }
+    if (result < 0 && errno != EINTR) {
+      return false;
+    }
+  }
+  return false;
+}
+
+bool SendLine(int fd, const std::string& line) {
+  std::string data = line + "\n";
+  std::size_t sent = 0;
+  while (sent < data.size()) {
+    auto result = send(fd, data.data() + sent, data.size() - sent, 0);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result <= 0) {
+      return false;
+    }
+    sent += static_cast<std::size_t>(result);
+  }
+  return true;
+}
+
+class LineReader {
+ public:
+  explicit LineReader(int fd) : fd_(fd) {}
+
+  // Empty once the client disconnects or sends a line over the size limit
+  std::optional<std::string> Next(const std::atomic_int& cancel) {
+    while (true) {
+      if (auto newline = buffer_.find('\n'); newline != std::string::npos) {
+        auto line = buffer_.substr(0, newline);
+        buffer_.erase(0, newline + 1);
+        if (!line.empty() && line.back() == '\r') {
+          line.pop_back();
+        }
+        return line;
+      }
+      if (buffer_.size() > static_cast<std::size_t>(kServerMaxRequestSize)) {
+        spdlog::warn("Request over {} bytes", kServerMaxRequestSize);
+        return {};
+      }
+      if (!WaitReadable(fd_, cancel)) {
+        return {};
+      }
+      std::array<char, 4096> chunk;
+      auto received = recv(fd_, chunk.data(), chunk.size(), 0);
+      if (received < 0 && errno == EINTR) {
+        continue;
+      }
+      if (received <= 0) {
+        return {};
+      }
+      buffer_.append(chunk.data(), static_cast<std::size_t>(received));
+    }
+  }
+
+ private:
+  int fd_;
+  std::string buffer_;
+};
+
+std::vector<std::string> SplitArgs(const std::string& line) {
+  std::vector<std::string> args;
+  std::size_t start = 0;
+  while (start <= line.size()) {
+    auto end = line.find('\t', start);
+    if (end == std::string::npos) {
+      end = line.size();
+    }
+    if (end > start) {
+      args.push_back(line.substr(start, end - start));
+    }
+    start = end + 1;
+  }
+  return args;
+}
+
+const char* ProgressName(pipeline::ProgressType type) {
+  switch (type) {
+    case pipeline::ProgressType::kLoadingImages:
+      return "loading_images";
+    case pipeline::ProgressType::kStitchingPano:
+      return "stitching_pano";
+    case pipeline::ProgressType::kAutoCrop:
+      return "auto_crop";
+    case pipeline::ProgressType::kDetectingKeypoints:
+      return "detecting_keypoints";
+    case pipeline::ProgressType::kMatchingImages:
+      return "matching_images";
+    case pipeline::ProgressType::kLoadingAndMatching:
+      return "loading_and_matching";
+    case pipeline::ProgressType::kExport:
+      return "export";
+    case pipeline::ProgressType::kInpainting:
+      return "inpainting";
+    case pipeline::ProgressType::kBatchExport:
+      return "batch_export";
+    case pipeline::ProgressType::kLoadingProject:
+      return "loading_project";
+    case pipeline::ProgressType::kSavingProject:
+      return "saving_project";
+    default:
+      return "none";
+  }
+}
+
+std::string ToJson(const pipeline::ProgressReport& progress) {
+  return fmt::format(R"({{"progress":{{"type":"{}","done":{},"total":{}}}}})",
+                     ProgressName(progress.type), progress.tasks_done,
+                     progress.num_tasks);
+}
+
+bool SameProgress(const pipeline::ProgressReport& lhs,
+                  const pipeline::ProgressReport& rhs) {
+  return lhs.type == rhs.type && lhs.tasks_done == rhs.tasks_done &&
+         lhs.num_tasks == rhs.num_tasks;
+}
+
+// False once the client is gone
+bool RunJob(int fd, const Args& args, const Handlers& handlers) {
+  Summary summary;
+  auto job = std::async(std::launch::async, [&handlers, &args, &summary]() {
+    return handlers.run_job(args, &summary);
+  });
+
+  bool connected = true;
+  std::optional<pipeline::ProgressReport> last_progress;
+  while (job.wait_for(kServerProgressInterval) != std::future_status::ready) {
+    if (!connected) {
+      handlers.cancel();
+      continue;
+    }
+    auto progress = handlers.progress();
+    if (last_progress && SameProgress(*last_progress, progress)) {
+      continue;
+    }
+    last_progress = progress;
+    connected = SendLine(fd, ToJson(progress));
+    if (!connected) {
+      spdlog::warn("Client disconnected, cancelling the job");
+      handlers.cancel();
+    }
+  }
+
+  auto result = job.get();
+  return connected &&
+         SendLine(fd, fmt::format(R"({{"result":"{}","summary":{}}})",
+                                  result == ResultType::kSuccess ? "success"
+                                                                 : "error",
+                                  ToJson(summary)));
+}
+
+bool IsJob(const std::optional<Args>& args) {
+  return args && !args->input_paths.empty() && !args->run_gui &&
+         !args->print_help && !args->print_version && !args->socket_path;
+}
+
+// True once the client asks for a shutdown
+bool ServeClient(int fd, const Handlers& handlers,
+                 const std::atomic_int& cancel) {
+  LineReader reader(fd);
+  while (auto line = reader.Next(cancel)) {
+    if (line->empty()) {
+      continue;
+    }
+    if (*line == kShutdownRequest) {
+      SendLine(fd, R"({"result":"shutdown"})");
+      return true;
+    }
+    auto args = ParseArgs(SplitArgs(*line));
+    if (!IsJob(args)) {
+      spdlog::warn("Invalid request: {}", *line);
+      if (!SendLine(fd, R"({"error":"invalid request"})")) {
+        return false;
+      }
+      continue;
+    }
+    if (!RunJob(fd, *args, handlers)) {
+      return false;
+    }
+  }
+  return false;
+}
+
+// Removes a socket left behind by a server that didn't shut down cleanly
+bool RemoveStaleSocket(const std::filesystem::path& socket_path,
+                       const sockaddr_un& address) {
+  std::error_code error;
+  if (!std::filesystem::is_socket(socket_path, error)) {
+    return true;
+  }
+  Socket probe(socket(AF_UNIX, SOCK_STREAM, 0));
+  if (connect(probe.Get(), reinterpret_cast<const sockaddr*>(&address),
+              sizeof(address)) == 0) {
+    spdlog::error("Another server is listening on {}", socket_path.string());
+    return false;
+  }
+  std::filesystem::remove(socket_path, error);
+  return true;
+}
+
+}  // namespace
+
+ResultType Serve(const std::filesystem::path& socket_path,
+                 const Handlers& handlers, const std::atomic_int& cancel) {
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  auto path = socket_path.string();
+  if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+    spdlog::error("Invalid socket path: \"{}\"", path);
+    return ResultType::kError;
+  }
+  std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+  if (!RemoveStaleSocket(socket_path, address)) {
+    return ResultType::kError;
+  }
+  Socket listener(socket(AF_UNIX, SOCK_STREAM, 0));
+  if (listener.Get() < 0 ||
+      bind(listener.Get(), reinterpret_cast<const sockaddr*>(&address),
+           sizeof(address)) != 0 ||
+      listen(listener.Get(), kServerBacklog) != 0) {
+    spdlog::error("Failed to listen on {}: {}", path, std::strerror(errno));
+    return ResultType::kError;
+  }
+  // Disconnected clients are detected from the failed writes
+  std::signal(SIGPIPE, SIG_IGN);
+  spdlog::info("Listening on {}", path);
+
+  bool shutdown = false;
+  while (!shutdown && WaitReadable(listener.Get(), cancel)) {
+    Socket client(accept(listener.Get(), nullptr, nullptr));
+    if (client.Get() < 0) {
+      continue;
+    }
+    spdlog::info("Client connected");
+    shutdown = ServeClient(client.Get(), handlers, cancel);
+    spdlog::info("Client disconnected");
+  }
+
+  std::error_code error;
+  std::filesystem::remove(socket_path, error);
+  spdlog::info("Server stopped");
+  return ResultType::kSuccess;
+}
+
+}  // namespace xpano::cli::server
@@ -0,0 +1,35 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <atomic>
+#include <filesystem>
+#include <functional>
+
+#include "xpano/cli/args.h"
+#include "xpano/cli/pano_cli.h"
+#include "xpano/cli/summary.h"
+#include "xpano/pipeline/stitcher_pipeline.h"
+
+namespace xpano::cli::server {
+
+struct Handlers {
+  // Runs on a separate thread, while the progress is polled
+  std::function<ResultType(const Args&, Summary*)> run_job;
+  std::function<pipeline::ProgressReport()> progress;
+  // Called from the serving thread while run_job runs, once the client
+  // disconnects and then repeatedly until the job returns, so that the stages
+  // the job starts afterwards are cancelled too
+  std::function<void()> cancel;
+};
+
+// Serves clients of a Unix domain socket one at a time, until cancel is set
+// or a client sends "shutdown". Each request is a line of tab separated
+// arguments, the same as on the command line. The job replies with lines of
+// JSON, {"progress": ...} while it runs and {"result": ...} with the summary
+// once it's done.
+ResultType Serve(const std::filesystem::path& socket_path,
+                 const Handlers& handlers, const std::atomic_int& cancel);
+
+}  // namespace xpano::cli::server
@@ -0,0 +1,102 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/cli/summary.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <spdlog/fmt/fmt.h>
+#include <spdlog/spdlog.h>
+
+namespace xpano::cli {
+
+namespace {
+
+std::string Quote(const std::string& text) {
+  std::string result = "\"";
+  for (char character : text) {
+    switch (character) {
+      case '"':
+        result += "\\\"";
+        break;
+      case '\\':
+        result += "\\\\";
+        break;
+      case '\n':
+        result += "\\n";
+        break;
+      case '\r':
+        result += "\\r";
+        break;
+      case '\t':
+        result += "\\t";
+        break;
+      default:
+        if (static_cast<unsigned char>(character) < 0x20) {
+          result += fmt::format("\\u{:04x}", static_cast<int>(character));
+        } else {
+          result += character;
+        }
+    }
+  }
+  result += "\"";
+  return result;
+}
+
+std::string ToJson(const PanoSummary& pano) {
+  auto path = pano.export_path ? Quote(pano.export_path->string()) : "null";
+  return fmt::format(
+      R"({{"id":{},"images":{},"exported":{},"path":{},"width":{},)"
+      R"("height":{},"file_size":{},"seconds":{:.3f}}})",
+      pano.pano_id, pano.num_images, pano.export_path.has_value(), path,
+      pano.width, pano.height, pano.file_size, pano.seconds);
+}
+
+}  // namespace
+
+std::string ToJson(const Summary& summary) {
+  std::vector<std::string> timings;
+  for (const auto& [stage, seconds] : summary.timings) {
+    timings.push_back(fmt::format("{}:{:.3f}", Quote(stage), seconds));
+  }
+  std::vector<std::string> panos;
+  std::transform(summary.panos.begin(), summary.panos.end(),
+                 std::back_inserter(panos),
+                 [](const PanoSummary& pano) { return ToJson(pano); });
+  auto num_exported =
+      std::count_if(summary.panos.begin(), summary.panos.end(),
+                    [](const PanoSummary& pano) {
+                      return pano.export_path.has_value();
+                    });
+
+  return fmt::format(
+      R"({{"inputs":{},"images":{},"panos_found":{},"panos_exported":{},)"
+      R"("timings":{{{}}},"panos":[{}]}})",
+      summary.num_inputs, summary.num_images, summary.panos.size(),
+      num_exported, fmt::join(timings, ","), fmt::join(panos, ","));
+}
+
+void WriteSummary(const Summary& summary, bool print,
+                  const std::optional<std::filesystem::path>& path) {
+  auto json = ToJson(summary);
+  if (print) {
+    fmt::print("{}\n", json);
+    std::fflush(stdout);
+  }
+  if (path) {
+    std::ofstream stream(*path);
+    stream << json << "\n";
+    if (!stream) {
+      spdlog::error("Failed to write summary to {}", path->string());
+    }
+  }
+}
+
+}  // namespace xpano::cli
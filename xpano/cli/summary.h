@@ -0,0 +1,42 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace xpano::cli {
+
+struct PanoSummary {
+  int pano_id = 0;
+  int num_images = 0;
+  // Empty when the pano failed to stitch or to export
+  std::optional<std::filesystem::path> export_path;
+  int width = 0;
+  int height = 0;
+  std::uintmax_t file_size = 0;
+  double seconds = 0.0;
+};
+
+// Report of a CLI run for scripts
+struct Summary {
+  int num_inputs = 0;
+  int num_images = 0;
+  // Stage name and its duration in seconds, in the order of execution
+  std::vector<std::pair<std::string, double>> timings;
+  std::vector<PanoSummary> panos;
+};
+
+std::string ToJson(const Summary& summary);
+
+// Prints the summary as a single line of JSON to stdout when print is set,
+// and writes it to the path if there is one
+void WriteSummary(const Summary& summary, bool print,
+                  const std::optional<std::filesystem::path>& path);
+
+}  // namespace xpano::cli
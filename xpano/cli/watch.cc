@@ -0,0 +1,154 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/cli/watch.h"
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <map>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <spdlog/spdlog.h>
+
+#include "xpano/algorithm/algorithm.h"
+
+namespace xpano::cli::watch {
+
+namespace {
+
+std::vector<std::filesystem::path> ListFiles(
+    const std::filesystem::path& directory) {
+  std::vector<std::filesystem::path> files;
+  std::error_code error;
+  for (const auto& entry :
+       std::filesystem::directory_iterator(directory, error)) {
+    if (entry.is_regular_file(error)) {
+      files.push_back(entry.path());
+    }
+  }
+  return files;
+}
+
+}  // namespace
+
+#ifdef __linux__
+
+DirectoryWatcher::DirectoryWatcher(std::filesystem::path directory)
+    : directory_(std::move(directory)),
+      inotify_fd_(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) {
+  if (inotify_fd_ < 0 ||
+      inotify_add_watch(inotify_fd_, directory_.c_str(),
+                        IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+    spdlog::error("Failed to watch {}: {}", directory_.string(),
+                  std::strerror(errno));
+    if (inotify_fd_ >= 0) {
+      close(inotify_fd_);
+      inotify_fd_ = -1;
+    }
+  }
+  // Listed after the watch is added, so that no file is missed
+  existing_ = ListFiles(directory_);
+}
+
+DirectoryWatcher::~DirectoryWatcher() {
+  if (inotify_fd_ >= 0) {
+    close(inotify_fd_);
+  }
+}
+
+bool DirectoryWatcher::IsValid() const { return inotify_fd_ >= 0; }
+
+std::vector<std::filesystem::path> DirectoryWatcher::Poll(
+    std::chrono::milliseconds timeout) {
+  if (!existing_.empty()) {
+    return std::exchange(existing_, {});
+  }
+  pollfd poll_fd{.fd = inotify_fd_, .events = POLLIN, .revents = 0};
+  if (poll(&poll_fd, 1, static_cast<int>(timeout.count())) <= 0) {
+    return {};
+  }
+
+  std::vector<std::filesystem::path> files;
+  alignas(inotify_event) std::array<char, 4096> buffer;
+  ssize_t length = 0;
+  while ((length = read(inotify_fd_, buffer.data(), buffer.size())) > 0) {
+    for (ssize_t offset = 0; offset < length;) {
+      const auto* event =
+          reinterpret_cast<const inotify_event*>(buffer.data() + offset);
+      if (event->len > 0 && (event->mask & IN_ISDIR) == 0) {
+        files.push_back(directory_ / event->name);
+      }
+      offset += static_cast<ssize_t>(sizeof(inotify_event) + event->len);
+    }
+  }
+  return files;
+}
+
+#else
+
+DirectoryWatcher::DirectoryWatcher(std::filesystem::path directory)
+    : directory_(std::move(directory)) {}
+
+DirectoryWatcher::~DirectoryWatcher() = default;
+
+bool DirectoryWatcher::IsValid() const {
+  return std::filesystem::is_directory(directory_);
+}
+
+// Without write notifications, files still being copied are picked up once
+// they show up in the listing
+std::vector<std::filesystem::path> DirectoryWatcher::Poll(
+    std::chrono::milliseconds timeout) {
+  if (listed_) {
+    std::this_thread::sleep_for(timeout);
+  }
+  listed_ = true;
+  std::vector<std::filesystem::path> files;
+  for (auto& file : ListFiles(directory_)) {
+    if (seen_.insert(file).second) {
+      files.push_back(std::move(file));
+    }
+  }
+  return files;
+}
+
+#endif
+
+StabilityTracker::StabilityTracker(Clock::duration stable_period)
+    : stable_period_(stable_period) {}
+
+void StabilityTracker::Update(const std::vector<algorithm::Pano>& panos,
+                              Clock::time_point now) {
+  std::map<std::vector<int>, Entry> updated;
+  for (const auto& pano : panos) {
+    auto entry = panos_.find(pano.ids);
+    updated[pano.ids] = entry != panos_.end() ? entry->second : Entry{now};
+  }
+  panos_ = std::move(updated);
+}
+
+std::vector<algorithm::Pano> StabilityTracker::TakeStable(
+    Clock::time_point now) {
+  std::vector<algorithm::Pano> stable;
+  for (auto& [ids, entry] : panos_) {
+    if (!entry.taken && now - entry.changed >= stable_period_) {
+      entry.taken = true;
+      stable.push_back({ids});
+    }
+  }
+  return stable;
+}
+
+}  // namespace xpano::cli::watch
@@ -0,0 +1,66 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <chrono>
+#include <filesystem>
+#include <map>
+#include <set>
+#include <vector>
+
+#include "xpano/algorithm/algorithm.h"
+
+namespace xpano::cli::watch {
+
+// Files closed after writing or moved into a directory, the files already
+// there are returned by the first Poll. Uses inotify on Linux, elsewhere the
+// directory is listed on each Poll.
+class DirectoryWatcher {
+ public:
+  explicit DirectoryWatcher(std::filesystem::path directory);
+  ~DirectoryWatcher();
+  DirectoryWatcher(const DirectoryWatcher&) = delete;
+  DirectoryWatcher& operator=(const DirectoryWatcher&) = delete;
+  DirectoryWatcher(DirectoryWatcher&&) = delete;
+  DirectoryWatcher& operator=(DirectoryWatcher&&) = delete;
+
+  [[nodiscard]] bool IsValid() const;
+  // New files since the previous call, waits up to the timeout for some
+  std::vector<std::filesystem::path> Poll(std::chrono::milliseconds timeout);
+
+ private:
+  std::filesystem::path directory_;
+#ifdef __linux__
+  int inotify_fd_ = -1;
+  std::vector<std::filesystem::path> existing_;
+#else
+  std::set<std::filesystem::path> seen_;
+  bool listed_ = false;
+#endif
+};
+
+// Panos are identified by their images, a pano that gains an image is a new
+// pano and has to be stable again
+class StabilityTracker {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  explicit StabilityTracker(Clock::duration stable_period);
+
+  void Update(const std::vector<algorithm::Pano>& panos,
+              Clock::time_point now);
+  // Panos unchanged for the stable period, each one is returned only once
+  std::vector<algorithm::Pano> TakeStable(Clock::time_point now);
+
+ private:
+  struct Entry {
+    Clock::time_point changed;
+    bool taken = false;
+  };
+
+  Clock::duration stable_period_;
+  std::map<std::vector<int>, Entry> panos_;
+};
+
+}  // namespace xpano::cli::watch
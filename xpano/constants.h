@@ -35,6 +35,10 @@ const std::array<std::string, 6> kSupportedExtensions = {"jpg", "jpeg", "tiff",
 const std::array<std::string, 4> kMetadataSupportedExtensions = {"jpg", "jpeg",
                                                                  "tiff", "tif"};
 
+const std::array<std::string, 2> kTiffExtensions = {"tiff", "tif"};
+
+const std::array<std::string, 2> kJpegExtensions = {"jpg", "jpeg"};
+
 const std::string kLogFilename = "logs/xpano.log";
 constexpr int kMaxLogSize = 5 * 1024 * 1024;
 constexpr int kMaxLogFiles = 5;
@@ -70,16 +74,58 @@ constexpr int kDefaultPreviewLongerSide = 1024;
 constexpr int kMinPreviewLongerSide = 512;
 constexpr int kMaxPreviewLongerSide = 2048;
 constexpr int kStepPreviewLongerSide = 256;
+constexpr double kTonemapGamma = 2.2;
 
 constexpr float kDefaultPaniniA = 2.0f;
 constexpr float kDefaultPaniniB = 1.0f;
 constexpr float kDefaultMatchConf = 0.25f;
 constexpr float kMinMatchConf = 0.1f;
 constexpr float kMaxMatchConf = 0.4f;
+// Same as the cv::Stitcher defaults
+constexpr double kSeamEstimationResol = 0.1;  // megapixels
+constexpr double kPanoConfidenceThresh = 1.0;
+constexpr int kMinMatchesForHomography = 6;
+constexpr int kEarlyExitKeypoints = 500;
+constexpr double kEarlyRejectRatio = 0.5;
+
+// Tiled compositing, the tile size has to be a multiple of 16 for TIFF
+constexpr int kCompositingTileSize = 2048;
+constexpr int kTileBlendingMargin = 256;
+constexpr int kWarpGridStep = 16;
+
+// Streaming JPEG export, rows encoded as one task, a multiple of 16
+constexpr int kJpegStripRows = 256;
+
+constexpr int kVocabularySize = 256;
+constexpr int kVocabularySamplesPerImage = 200;
+// Of all the images together, k-means time grows with the number of samples
+constexpr int kVocabularyMaxSamples = 50000;
+// Images whose similarities to all the others are computed at once
+constexpr int kRetrievalBlockRows = 256;
+constexpr int kVocabularyKmeansIterations = 20;
 
 const std::string kAppConfigFilename = "app_config.alpaca";
 const std::string kUserConfigFilename = "user_config.alpaca";
 const std::string kChangelogFilename = "CHANGELOG.md";
+const std::string kFeatureCacheDirname = "feature_cache";
+constexpr int kFeatureCachePngCompression = 1;
+const std::string kProjectExtension = "xpano";
+const std::string kDefaultProjectFilename = "project.xpano";
+constexpr int kProjectPngCompression = 1;
+// Of the descriptor slab of a feature store, a cache line
+constexpr int kFeatureStoreAlignment = 64;
+constexpr int kSpillPngCompression = 1;
+// Four trees of the default FLANN KD-tree index, each with an index and two
+// nodes per descriptor
+constexpr int kDescriptorIndexBytesPerRow = 208;
+constexpr int kMaxMemoryBudget = 65536;  // megabytes
+constexpr int kStepMemoryBudget = 256;
+constexpr double kMegabyte = 1024.0 * 1024.0;
+constexpr int kFullResCacheSize = 1024;  // megabytes
+// Batch export, the estimated footprint of a full resolution stitch is the
+// size of its decoded inputs times this factor
+constexpr int kDefaultBatchMemoryBudget = 4096;  // megabytes
+constexpr int kBatchFootprintFactor = 4;
 
 constexpr int kCropEdgeTolerance = 10;
 constexpr int kAutoCropSamplingDistance = 512;
@@ -91,6 +137,13 @@ constexpr float kMegapixel = 1'000'000;
 
 const std::string kDefaultPanoSuffix = "_pano";
 constexpr int kMaxImageSizeForCLI = 8192;
+constexpr auto kServerProgressInterval = std::chrono::milliseconds(100);
+constexpr int kServerMaxRequestSize = 1024 * 1024;
+constexpr int kServerBacklog = 4;
+constexpr int kDefaultWatchStablePeriod = 30;  // seconds
+constexpr auto kWatchPollInterval = std::chrono::milliseconds(500);
+// New files are loaded together once none arrived for this long
+constexpr auto kWatchSettleTime = std::chrono::seconds(2);
 
 constexpr int kExifDefaultOrientation = 1;
 
@@ -17,17 +17,22 @@ enum class ActionType {
   kToggleCrop,
   kDisableHighlight,
   kExport,
+  kExportAll,
   kInpaint,
   kLoadFiles,
+  kLoadProject,
   kOpenDirectory,
   kOpenFiles,
+  kOpenProject,
   kShowAbout,
   kShowBugReport,
   kShowImage,
   kShowMatch,
   kShowPano,
+  kShowPartialPano,
   kModifyPano,
   kRecomputePano,
+  kSaveProject,
   kQuit,
   kToggleDebugLog,
   kWarnInputConversion,
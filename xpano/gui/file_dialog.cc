@@ -77,7 +77,7 @@ utils::Expected<std::vector<std::filesystem::path>, Error> MultifileOpen() {
   return results;
 }
 
-utils::Expected<std::vector<std::filesystem::path>, Error> DirectoryOpen() {
+utils::Expected<std::filesystem::path, Error> PickFolder() {
   NFD::UniquePath out_path;
   auto nfd_result = NFD::PickFolder(out_path);
 
@@ -93,9 +93,17 @@ utils::Expected<std::vector<std::filesystem::path>, Error> DirectoryOpen() {
     return MakeUnexpected(ErrorType::kTargetNotDirectory, dir_path.string());
   }
   spdlog::info("Selected directory {}", dir_path.string());
+  return dir_path;
+}
+
+utils::Expected<std::vector<std::filesystem::path>, Error> DirectoryOpen() {
+  auto dir_path = PickFolder();
+  if (!dir_path) {
+    return utils::Unexpected<Error>(dir_path.error());
+  }
 
   std::vector<std::filesystem::path> results;
-  for (const auto& file : std::filesystem::directory_iterator(dir_path)) {
+  for (const auto& file : std::filesystem::directory_iterator(*dir_path)) {
     results.emplace_back(file.path());
   }
   std::sort(results.begin(), results.end());
@@ -117,6 +125,10 @@ utils::Expected<std::vector<std::filesystem::path>, Error> Open(
   return MakeUnexpected(ErrorType::kUnknownAction);
 }
 
+utils::Expected<std::filesystem::path, Error> SaveDirectory() {
+  return PickFolder();
+}
+
 utils::Expected<std::filesystem::path, Error> Save(
     const std::string& default_name) {
   NFD::UniquePath out_path;
@@ -142,4 +154,45 @@ utils::Expected<std::filesystem::path, Error> Save(
   return result_path;
 }
 
+utils::Expected<std::filesystem::path, Error> OpenProject() {
+  NFD::UniquePath out_path;
+  auto filter_item =
+      std::array{nfdfilteritem_t{"Xpano project", kProjectExtension.c_str()}};
+  auto nfd_result = NFD::OpenDialog(out_path, filter_item.data(), 1);
+
+  if (nfd_result == NFD_CANCEL) {
+    return MakeUnexpected(ErrorType::kUserCancelled);
+  }
+  if (nfd_result == NFD_ERROR) {
+    return MakeUnexpected(ErrorType::kUnknownError, NFD::GetError());
+  }
+
+  auto result_path = std::filesystem::path(out_path.get());
+  spdlog::info("Selected project {}", result_path.string());
+  return result_path;
+}
+
+utils::Expected<std::filesystem::path, Error> SaveProject(
+    const std::string& default_name) {
+  NFD::UniquePath out_path;
+  auto filter_item =
+      std::array{nfdfilteritem_t{"Xpano project", kProjectExtension.c_str()}};
+  auto nfd_result = NFD::SaveDialog(out_path, filter_item.data(), 1, nullptr,
+                                    default_name.c_str());
+
+  if (nfd_result == NFD_CANCEL) {
+    return MakeUnexpected(ErrorType::kUserCancelled);
+  }
+  if (nfd_result == NFD_ERROR) {
+    return MakeUnexpected(ErrorType::kUnknownError, NFD::GetError());
+  }
+
+  auto result_path = std::filesystem::path(out_path.get());
+  if (result_path.extension() != "." + kProjectExtension) {
+    result_path += "." + kProjectExtension;
+  }
+  spdlog::info("Picked project file {}", result_path.string());
+  return result_path;
+}
+
 }  // namespace xpano::gui::file_dialog
@@ -34,6 +34,14 @@ utils::Expected<std::vector<std::filesystem::path>, Error> Open(
 utils::Expected<std::filesystem::path, Error> Save(
     const std::string& default_name);
 
+utils::Expected<std::filesystem::path, Error> SaveDirectory();
+
+utils::Expected<std::filesystem::path, Error> OpenProject();
+
+// The project extension is appended when missing
+utils::Expected<std::filesystem::path, Error> SaveProject(
+    const std::string& default_name);
+
 }  // namespace xpano::gui::file_dialog
 
 template <>
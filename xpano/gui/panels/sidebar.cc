@@ -44,8 +44,16 @@ std::string ProgressLabel(pipeline::ProgressType type) {
       return "Detecting keypoints";
     case pipeline::ProgressType::kMatchingImages:
       return "Matching images";
+    case pipeline::ProgressType::kLoadingAndMatching:
+      return "Detecting keypoints and matching images";
     case pipeline::ProgressType::kExport:
       return "Exporting pano";
+    case pipeline::ProgressType::kBatchExport:
+      return "Exporting panos";
+    case pipeline::ProgressType::kLoadingProject:
+      return "Opening project";
+    case pipeline::ProgressType::kSavingProject:
+      return "Saving project";
     case pipeline::ProgressType::kInpainting:
       return "Auto fill";
   }
@@ -60,9 +68,19 @@ Action DrawFileMenu() {
     if (ImGui::MenuItem("Open directory")) {
       action |= {ActionType::kOpenDirectory};
     }
+    if (ImGui::MenuItem("Open project")) {
+      action |= {ActionType::kOpenProject};
+    }
+    if (ImGui::MenuItem("Save project")) {
+      action |= {ActionType::kSaveProject};
+    }
+    ImGui::Separator();
     if (ImGui::MenuItem("Export", Label(ShortcutType::kExport))) {
       action |= {ActionType::kExport};
     }
+    if (ImGui::MenuItem("Export all")) {
+      action |= {ActionType::kExportAll};
+    }
     ImGui::Separator();
     if (ImGui::MenuItem("Quit")) {
       action |= {ActionType::kQuit};
@@ -133,6 +151,37 @@ void DrawLoadingOptionsMenu(pipeline::LoadingOptions* loading_options) {
         "Size of the preview image's longer side in pixels.\n - decrease to "
         "get faster loading times.\n - increase to get nicer preview images\n "
         "- increase to get more precision for panorama detection.");
+    ImGui::Separator();
+    ImGui::Text("High bit depth images:");
+    utils::imgui::ComboBox(&loading_options->depth_conversion,
+                           algorithm::kDepthConversions, "##depth_conversion");
+    ImGui::SameLine();
+    utils::imgui::InfoMarker(
+        "(?)",
+        "Conversion of 16-bit and floating point images to 8 bits per "
+        "channel.\n - Scale: maps the full range of the pixel type.\n - Auto "
+        "range: stretches the darkest and brightest pixel of each image.\n - "
+        "Tone map: auto range followed by a gamma curve, for linear scans.");
+    ImGui::Separator();
+    if (ImGui::InputInt("Memory budget (MB)", &loading_options->memory_budget,
+                        kStepMemoryBudget, kStepMemoryBudget)) {
+      loading_options->memory_budget =
+          std::clamp(loading_options->memory_budget, 0, kMaxMemoryBudget);
+    }
+    ImGui::SameLine();
+    utils::imgui::InfoMarker(
+        "(?)",
+        "Memory for the previews and keypoint descriptors of the loaded "
+        "images, 0 for no limit.\nImages over the budget are moved to a "
+        "temporary directory and read back when needed.");
+    ImGui::Checkbox("Quantize descriptors",
+                    &loading_options->quantize_descriptors);
+    ImGui::SameLine();
+    utils::imgui::InfoMarker(
+        "(?)",
+        "Keep the keypoint descriptors as 8-bit integers, a quarter of the "
+        "memory without any loss of precision.\nMatched with an exact "
+        "search, the FLANN matcher has no index for them.");
     ImGui::EndMenu();
   }
 }
@@ -166,11 +215,13 @@ void DrawMatchingOptionsMenu(pipeline::MatchingOptions* matching_options,
     ImGui::SameLine();
     utils::imgui::RadioBox(&matching_options->type, pipeline::kMatchingTypes);
     utils::imgui::InfoMarker("(?)",
-                             "(1) Autodetect panoramas\n(2) Put all images in "
-                             "a single panorama\n(3) No groups are created "
-                             "(useful for manual image selection)");
+                             "(1) Autodetect panoramas\n(2) Autodetect "
+                             "panoramas in images shot out of order\n(3) Put "
+                             "all images in a single panorama\n(4) No groups "
+                             "are created (useful for manual image "
+                             "selection)");
 
-    if (matching_options->type == pipeline::MatchingType::kAuto) {
+    if (pipeline::ComputesKeypoints(matching_options->type)) {
       ImGui::Separator();
       ImGui::Spacing();
       ImGui::Text(
@@ -184,7 +235,8 @@ void DrawMatchingOptionsMenu(pipeline::MatchingOptions* matching_options,
       utils::imgui::InfoMarker("(?)",
                                "Select how many neighboring images will be "
                                "considered for panorama "
-                               "auto detection.");
+                               "auto detection. In the unordered mode, these "
+                               "are the most similar images.");
       ImGui::SliderInt("Matching threshold", &matching_options->match_threshold,
                        kMinMatchThreshold, kMaxMatchThreshold);
       ImGui::SameLine();
@@ -195,6 +247,19 @@ void DrawMatchingOptionsMenu(pipeline::MatchingOptions* matching_options,
       if (debug_enabled) {
         ImGui::SeparatorText("Debug");
         DrawMatchConf(&matching_options->match_conf);
+        ImGui::Text("Matcher:");
+        utils::imgui::ComboBox(&matching_options->matcher,
+                               algorithm::kMatcherTypes, "##matcher_type");
+        ImGui::Checkbox("Cross check", &matching_options->cross_check);
+        ImGui::SameLine();
+        utils::imgui::InfoMarker(
+            "(?)", "Keep only the matches found in both directions.");
+        ImGui::Checkbox("Early exit", &matching_options->early_exit);
+        ImGui::SameLine();
+        utils::imgui::InfoMarker(
+            "(?)",
+            "Match the strongest keypoints first and skip the full matching "
+            "of pairs that clearly pass or fail the matching threshold.");
       }
     }
     ImGui::EndMenu();
@@ -278,6 +343,30 @@ Action DrawBlendingOptions(pipeline::StitchAlgorithmOptions* stitch_options) {
   return action;
 }
 
+void DrawRegistrationOptions(
+    pipeline::StitchAlgorithmOptions* stitch_options) {
+  ImGui::Checkbox("Reuse preview alignment",
+                  &stitch_options->reuse_preview_registration);
+  ImGui::SameLine();
+  utils::imgui::InfoMarker(
+      "(?)",
+      "Full resolution panoramas reuse the image alignment computed on the "
+      "previews, which is much faster.\nUncheck to align the full resolution "
+      "images from scratch.");
+}
+
+void DrawTiledExportOptions(pipeline::StitchAlgorithmOptions* stitch_options) {
+  ImGui::Checkbox("Tiled export", &stitch_options->tiled_export);
+  ImGui::SameLine();
+  utils::imgui::InfoMarker(
+      "(?)",
+      "Full resolution panoramas are composed tile by tile and written "
+      "straight to a BigTIFF file, so that huge panoramas fit into the "
+      "memory.\nBaseline JPEGs of up to 65535 pixels per side are encoded "
+      "while the panorama is being composed.\nOnly a preview of the result "
+      "is shown afterwards.");
+}
+
 Action DrawStitchOptionsMenu(pipeline::StitchAlgorithmOptions* stitch_options,
                              bool debug_enabled) {
   Action action{};
@@ -285,6 +374,8 @@ Action DrawStitchOptionsMenu(pipeline::StitchAlgorithmOptions* stitch_options,
     action |= DrawProjectionOptions(stitch_options);
     action |= DrawWaveCorrectionOptions(stitch_options);
     action |= DrawBlendingOptions(stitch_options);
+    DrawRegistrationOptions(stitch_options);
+    DrawTiledExportOptions(stitch_options);
 
     if (debug_enabled) {
       ImGui::SeparatorText("Debug");
@@ -372,9 +463,42 @@ void DrawProgressBar(pipeline::ProgressReport progress) {
           ? "100%"
           : fmt::format("{}: {:.0f}%", ProgressLabel(progress.type),
                         progress_ratio * max_percent);
+  if (progress.type == pipeline::ProgressType::kLoadingAndMatching &&
+      progress.tasks_done < progress.num_tasks) {
+    label += fmt::format(" ({} images loaded)", progress.images_loaded);
+  }
+  bool is_loading =
+      progress.type == pipeline::ProgressType::kDetectingKeypoints ||
+      progress.type == pipeline::ProgressType::kLoadingAndMatching;
+  if (is_loading && progress.cache_hits > 0 &&
+      progress.tasks_done < progress.num_tasks) {
+    label += fmt::format(" ({} cached)", progress.cache_hits);
+  }
   ImGui::ProgressBar(progress_ratio, ImVec2(-1.0f, 0.f), label.c_str());
 }
 
+void DrawBatchProgress(const std::vector<pipeline::PanoProgress>& panos) {
+  for (const auto& pano : panos) {
+    auto label = fmt::format("Pano {}", pano.pano_id);
+    switch (pano.status) {
+      case pipeline::BatchStatus::kQueued:
+        ImGui::BulletText("%s: queued", label.c_str());
+        break;
+      case pipeline::BatchStatus::kRunning:
+        ImGui::BulletText("%s:", label.c_str());
+        ImGui::SameLine();
+        DrawProgressBar(pano.progress);
+        break;
+      case pipeline::BatchStatus::kDone:
+        ImGui::BulletText("%s: done", label.c_str());
+        break;
+      case pipeline::BatchStatus::kFailed:
+        ImGui::BulletText("%s: failed", label.c_str());
+        break;
+    }
+  }
+}
+
 cv::Mat DrawMatches(const algorithm::Match& match,
                     const std::vector<algorithm::Image>& images) {
   cv::Mat out;
@@ -384,9 +508,10 @@ cv::Mat DrawMatches(const algorithm::Match& match,
   const auto match_color = cv::Scalar(0, 255, 0);
   const auto single_point_color = cv::Scalar::all(-1);
   const auto matches_mask = std::vector<char>();
-  cv::drawMatches(img1.GetPreview(), img1.GetKeypoints(), img2.GetPreview(),
-                  img2.GetKeypoints(), match.matches, out, match_thickness,
-                  match_color, single_point_color, matches_mask,
+  cv::drawMatches(img1.GetPreview(), img1.GetKeypoints().ToKeyPoints(),
+                  img2.GetPreview(), img2.GetKeypoints().ToKeyPoints(),
+                  match.matches, out, match_thickness, match_color,
+                  single_point_color, matches_mask,
                   cv::DrawMatchesFlags::NOT_DRAW_SINGLE_POINTS);
   return out;
 }
@@ -475,6 +600,30 @@ Action DrawPanosMenu(const std::vector<algorithm::Pano>& panos,
   return action;
 }
 
+Action DrawPartialPanosMenu(const std::vector<algorithm::Pano>& panos) {
+  Action action{};
+  if (panos.empty()) {
+    return action;
+  }
+  ImGui::TextUnformatted("Panoramas found so far:");
+  ImGui::SameLine();
+  utils::imgui::InfoMarker(
+      "(?)",
+      "The list is final once all the images are matched, the previews use "
+      "the images matched so far");
+  for (int i = 0; i < panos.size(); i++) {
+    auto string = fmt::format("{}", fmt::join(panos[i].ids, ","));
+    ImGui::BulletText("%s", string.c_str());
+    ImGui::SameLine();
+    ImGui::PushID(i);
+    if (ImGui::SmallButton("Preview")) {
+      action = {.type = ActionType::kShowPartialPano, .target_id = i};
+    }
+    ImGui::PopID();
+  }
+  return action;
+}
+
 Action DrawMenu(pipeline::Options* options, bool debug_enabled) {
   Action action{};
   if (ImGui::BeginMenuBar()) {
@@ -19,6 +19,9 @@ namespace xpano::gui {
 
 void DrawProgressBar(pipeline::ProgressReport progress);
 
+// Status of each pano of a running batch export
+void DrawBatchProgress(const std::vector<pipeline::PanoProgress>& panos);
+
 cv::Mat DrawMatches(const algorithm::Match& match,
                     const std::vector<algorithm::Image>& images);
 
@@ -28,6 +31,8 @@ Action DrawMatchesMenu(const std::vector<algorithm::Match>& matches,
 Action DrawPanosMenu(const std::vector<algorithm::Pano>& panos,
                      const ThumbnailPane& thumbnail_pane, int highlight_id);
 
+Action DrawPartialPanosMenu(const std::vector<algorithm::Pano>& panos);
+
 Action DrawMenu(pipeline::Options* options, bool debug_enabled);
 
 void DrawWelcomeTextPart1();
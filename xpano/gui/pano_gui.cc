@@ -6,6 +6,7 @@
 #include "xpano/gui/pano_gui.h"
 
 #include <algorithm>
+#include <filesystem>
 #include <future>
 #include <optional>
 #include <string>
@@ -149,6 +150,27 @@ auto ResolveStitcherDataFuture(
   return stitcher_data;
 }
 
+void ResolveProjectSaveFuture(
+    std::future<std::optional<std::filesystem::path>> project_future,
+    StatusMessage* status_message) {
+  std::optional<std::filesystem::path> project_path;
+  try {
+    project_path = project_future.get();
+  } catch (const std::exception& e) {
+    *status_message = {"Failed to save project", e.what()};
+    spdlog::error(*status_message);
+    return;
+  }
+  if (!project_path) {
+    *status_message = {"Failed to save project",
+                       "Please check the log for details"};
+    spdlog::error(*status_message);
+    return;
+  }
+  *status_message = {"Saved project", project_path->string()};
+  spdlog::info(*status_message);
+}
+
 auto ResolveStitchingResultFuture(
     std::future<pipeline::StitchingResult> pano_future, PreviewPane* plot_pane,
     StatusMessage* status_message)
@@ -218,6 +240,31 @@ auto ResolveExportFuture(std::future<pipeline::ExportResult> export_future,
   return {};
 }
 
+// Returns the ids of the exported panos
+auto ResolveBatchExportFuture(
+    std::future<std::vector<pipeline::BatchExportResult>> batch_future,
+    StatusMessage* status_message) -> std::vector<int> {
+  std::vector<pipeline::BatchExportResult> results;
+  try {
+    results = batch_future.get();
+  } catch (const std::exception& e) {
+    *status_message = {"Failed to export panos", e.what()};
+    spdlog::error(*status_message);
+    return {};
+  }
+
+  std::vector<int> exported;
+  for (const auto& result : results) {
+    if (result.status == pipeline::BatchStatus::kDone) {
+      exported.push_back(result.pano_id);
+    }
+  }
+  *status_message = {
+      fmt::format("Exported {} of {} panos", exported.size(), results.size())};
+  spdlog::info(*status_message);
+  return exported;
+}
+
 auto ResolveInpaintingResultFuture(
     std::future<pipeline::InpaintingResult> inpainting_future,
     PreviewPane* plot_pane, StatusMessage* status_message) -> void {
@@ -256,6 +303,14 @@ WarningType GetWarningType(utils::config::LoadingStatus loading_status) {
   }
 }
 
+std::optional<std::filesystem::path> FeatureCacheDir(
+    const std::optional<std::filesystem::path>& app_data_path) {
+  if (!app_data_path) {
+    return {};
+  }
+  return *app_data_path / kFeatureCacheDirname;
+}
+
 algorithm::Image const* FirstImage(const pipeline::StitcherData& stitcher_data,
                                    int pano_id) {
   const auto& pano = stitcher_data.panos.at(pano_id);
@@ -266,13 +321,15 @@ algorithm::Image const* FirstImage(const pipeline::StitcherData& stitcher_data,
 
 PanoGui::PanoGui(backends::Base* backend, logger::Logger* logger,
                  const utils::config::Config& config,
-                 std::future<utils::Texts> licenses, const cli::Args& args)
+                 std::future<utils::Texts> licenses, const cli::Args& args,
+                 const std::optional<std::filesystem::path>& app_data_path)
     : options_(config.user_options),
       log_pane_(logger),
       about_pane_(std::move(licenses)),
       bugreport_pane_(logger),
       plot_pane_(backend),
-      thumbnail_pane_(backend) {
+      thumbnail_pane_(backend),
+      stitcher_pipeline_(FeatureCacheDir(app_data_path)) {
   if (config.app_state.xpano_version != version::Current()) {
     warning_pane_.QueueNewVersion(config.app_state.xpano_version,
                                   about_pane_.GetText(kChangelogFilename));
@@ -340,6 +397,9 @@ Action PanoGui::DrawSidebar() {
     ImGui::SameLine();
   }
   DrawInfoMessage(status_message_);
+  if (batch_future_.valid()) {
+    DrawBatchProgress(stitcher_pipeline_.BatchProgress());
+  }
 
   ImGui::Separator();
   ImGui::BeginChild("Panos");
@@ -355,6 +415,8 @@ Action PanoGui::DrawSidebar() {
       action |= DrawMatchesMenu(stitcher_data_->matches, thumbnail_pane_,
                                 highlight_id);
     }
+  } else if (stitcher_data_future_.valid()) {
+    action |= DrawPartialPanosMenu(stitcher_pipeline_.PartialPanos());
   }
 
   ImGui::EndChild();
@@ -371,6 +433,7 @@ void PanoGui::Reset() {
   // Order of the following two lines is important
   stitcher_pipeline_.Cancel();
   stitcher_data_.reset();
+  batch_future_ = {};
 }
 
 Action PanoGui::PerformAction(const Action& action) {
@@ -396,6 +459,12 @@ Action PanoGui::PerformAction(const Action& action) {
       }
       break;
     }
+    case ActionType::kExportAll: {
+      if (stitcher_data_ && !stitcher_data_->panos.empty()) {
+        PerformExportAllAction();
+      }
+      break;
+    }
     case ActionType::kInpaint: {
       if (plot_pane_.Type() == ImageType::kPanoFullRes && pano_mask_) {
         spdlog::info("Auto fill pano {}", selection_.target_id);
@@ -428,6 +497,31 @@ Action PanoGui::PerformAction(const Action& action) {
       }
       break;
     }
+    case ActionType::kOpenProject: {
+      auto project = file_dialog::OpenProject();
+      if (!project) {
+        spdlog::warn(project.error());
+        warning_pane_.QueueFilePickerError(project.error());
+        break;
+      }
+      return {.type = ActionType::kLoadProject,
+              .delayed = true,
+              .extra = LoadFilesExtra{*project}};
+    }
+    case ActionType::kLoadProject: {
+      if (auto files = ValueOrDefault<LoadFilesExtra>(action); !files.empty()) {
+        Reset();
+        stitcher_data_future_ =
+            stitcher_pipeline_.RunProjectLoading(files[0], options_.loading);
+      }
+      break;
+    }
+    case ActionType::kSaveProject: {
+      if (stitcher_data_) {
+        PerformSaveProjectAction();
+      }
+      break;
+    }
     case ActionType::kShowMatch: {
       selection_ = {SelectionType::kMatch, action.target_id};
       spdlog::info("Clicked match {}", action.target_id);
@@ -454,6 +548,13 @@ Action PanoGui::PerformAction(const Action& action) {
       }
       break;
     }
+    case ActionType::kShowPartialPano: {
+      spdlog::info("Calculating preview of partial pano {}", action.target_id);
+      status_message_ = {};
+      pano_future_ = stitcher_pipeline_.RunPartialStitching(action.target_id,
+                                                            options_.stitch);
+      break;
+    }
     case ActionType::kModifyPano: {
       return ModifyPano(action.target_id, &selection_, &stitcher_data_->panos);
     }
@@ -538,6 +639,39 @@ void PanoGui::PerformExportAction(int pano_id) {
   }
 }
 
+void PanoGui::PerformExportAllAction() {
+  spdlog::info("Exporting all panos");
+  status_message_ = {};
+
+  auto export_dir = file_dialog::SaveDirectory();
+  if (!export_dir) {
+    spdlog::warn(export_dir.error());
+    warning_pane_.QueueFilePickerError(export_dir.error());
+    return;
+  }
+
+  batch_future_ = stitcher_pipeline_.RunBatchExport(
+      *stitcher_data_, {.export_dir = *export_dir,
+                        .metadata = options_.metadata,
+                        .compression = options_.compression,
+                        .stitch_algorithm = options_.stitch});
+}
+
+void PanoGui::PerformSaveProjectAction() {
+  spdlog::info("Saving project");
+  status_message_ = {};
+
+  auto project_path = file_dialog::SaveProject(kDefaultProjectFilename);
+  if (!project_path) {
+    spdlog::warn(project_path.error());
+    warning_pane_.QueueFilePickerError(project_path.error());
+    return;
+  }
+
+  project_future_ =
+      stitcher_pipeline_.RunProjectSave(*stitcher_data_, *project_path);
+}
+
 MultiAction PanoGui::ResolveFutures() {
   MultiAction actions;
   if (utils::future::IsReady(stitcher_data_future_)) {
@@ -574,6 +708,18 @@ MultiAction PanoGui::ResolveFutures() {
     }
   }
 
+  if (utils::future::IsReady(batch_future_)) {
+    auto exported_pano_ids =
+        ResolveBatchExportFuture(std::move(batch_future_), &status_message_);
+    for (int pano_id : exported_pano_ids) {
+      stitcher_data_->panos[pano_id].exported = true;
+    }
+  }
+
+  if (utils::future::IsReady(project_future_)) {
+    ResolveProjectSaveFuture(std::move(project_future_), &status_message_);
+  }
+
   if (utils::future::IsReady(inpaint_future_)) {
     ResolveInpaintingResultFuture(std::move(inpaint_future_), &plot_pane_,
                                   &status_message_);
@@ -5,9 +5,11 @@
 
 #pragma once
 
+#include <filesystem>
 #include <future>
 #include <optional>
 #include <string>
+#include <vector>
 
 #include <opencv2/core.hpp>
 
@@ -49,7 +51,8 @@ class PanoGui {
  public:
   PanoGui(backends::Base* backend, logger::Logger* logger,
           const utils::config::Config& config,
-          std::future<utils::Texts> licenses, const cli::Args& args);
+          std::future<utils::Texts> licenses, const cli::Args& args,
+          const std::optional<std::filesystem::path>& app_data_path);
 
   bool Run();
   pipeline::Options GetOptions() const;
@@ -60,6 +63,8 @@ class PanoGui {
   MultiAction ResolveFutures();
   Action PerformAction(const Action& action);
   void PerformExportAction(int pano_id);
+  void PerformExportAllAction();
+  void PerformSaveProjectAction();
   void Reset();
   bool IsDebugEnabled() const;
 
@@ -84,7 +89,9 @@ class PanoGui {
   std::future<pipeline::StitcherData> stitcher_data_future_;
   std::future<pipeline::StitchingResult> pano_future_;
   std::future<pipeline::ExportResult> export_future_;
+  std::future<std::vector<pipeline::BatchExportResult>> batch_future_;
   std::future<pipeline::InpaintingResult> inpaint_future_;
+  std::future<std::optional<std::filesystem::path>> project_future_;
 
   // Used for inpainting
   std::optional<cv::Mat> pano_mask_;
@@ -6,8 +6,10 @@
 
 #include <algorithm>
 #include <iterator>
+#include <memory>
 #include <mutex>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <SDL.h>
@@ -53,6 +55,12 @@ void CustomLog(void * /*userdata*/, int /*category*/, SDL_LogPriority priority,
       break;
   }
 }
+
+void SetConsoleLogger(std::shared_ptr<spdlog::logger> logger) {
+  logger->flush_on(spdlog::level::info);
+  logger->set_pattern("%l: %v");
+  spdlog::set_default_logger(std::move(logger));
+}
 }  // namespace
 
 std::vector<std::string> BufferSinkMt::LastFormatted() {
@@ -117,10 +125,12 @@ std::optional<std::string> Logger::GetLogDirPath() { return log_dir_path_; }
 void RedirectSDLOutput() { SDL_LogSetOutputFunction(CustomLog, nullptr); }
 
 void RedirectSpdlogToCout() {
-  auto logger = spdlog::stdout_logger_mt("console");
-  logger->flush_on(spdlog::level::info);
-  logger->set_pattern("%l: %v");
-  spdlog::set_default_logger(logger);
-};
+  SetConsoleLogger(spdlog::stdout_logger_mt("console"));
+}
+
+void RedirectSpdlogToCerr() {
+  spdlog::drop("console");
+  SetConsoleLogger(spdlog::stderr_logger_mt("console"));
+}
 
 }  // namespace xpano::logger
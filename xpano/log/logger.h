@@ -56,4 +56,7 @@ void RedirectSDLOutput();
 
 void RedirectSpdlogToCout();
 
+// Keeps stdout free for output meant to be parsed
+void RedirectSpdlogToCerr();
+
 }  // namespace xpano::logger
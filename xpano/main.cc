@@ -128,7 +128,7 @@ int main(int argc, char** argv) {
                  xpano::kLicensePath);
 
   xpano::gui::PanoGui gui(&backend, &logger, config, std::move(license_texts),
-                          *args);
+                          *args, app_data_path);
 
   auto window_manager =
       xpano::utils::sdl::DetermineWindowManager(has_wayland_support);
@@ -26,9 +26,15 @@ const char *Label(MatchingType type) {
       return "Single pano";
     case MatchingType::kAuto:
       return "Auto";
+    case MatchingType::kRetrieval:
+      return "Auto (unordered)";
     default:
       return "Unknown";
   }
 }
 
+bool ComputesKeypoints(MatchingType type) {
+  return type == MatchingType::kAuto || type == MatchingType::kRetrieval;
+}
+
 }  // namespace xpano::pipeline
@@ -15,7 +15,7 @@ namespace xpano::pipeline {
 //  - Major changes can be auto detected by alpaca reflection, but e.g.
 //    modifying the enums cannot, so bump the version number in this case.
 //  - Will result in reloading the default values when loading the config.
-constexpr int kOptionsVersion = 1;
+constexpr int kOptionsVersion = 10;
 
 enum class ChromaSubsampling {
   k444,
@@ -28,12 +28,15 @@ const char *Label(ChromaSubsampling subsampling);
 const auto kSubsamplingModes = std::array{
     ChromaSubsampling::k444, ChromaSubsampling::k422, ChromaSubsampling::k420};
 
-enum class MatchingType { kNone, kSinglePano, kAuto };
+enum class MatchingType { kNone, kSinglePano, kAuto, kRetrieval };
 
 const char *Label(MatchingType type);
 
-const auto kMatchingTypes = std::array{
-    MatchingType::kAuto, MatchingType::kSinglePano, MatchingType::kNone};
+const auto kMatchingTypes =
+    std::array{MatchingType::kAuto, MatchingType::kRetrieval,
+               MatchingType::kSinglePano, MatchingType::kNone};
+
+[[nodiscard]] bool ComputesKeypoints(MatchingType type);
 
 /*****************************************************************************/
 
@@ -51,6 +54,11 @@ struct CompressionOptions {
 
 struct LoadingOptions {
   int preview_longer_side = kDefaultPreviewLongerSide;
+  algorithm::DepthConversion depth_conversion =
+      algorithm::DepthConversion::kScale;
+  // Megabytes of previews and descriptors kept in memory, 0 for no limit
+  int memory_budget = 0;
+  bool quantize_descriptors = false;
 };
 
 using InpaintingOptions = algorithm::InpaintingOptions;
@@ -60,6 +68,10 @@ struct MatchingOptions {
   int neighborhood_search_size = kDefaultNeighborhoodSearchSize;
   int match_threshold = kDefaultMatchThreshold;
   float match_conf = kDefaultMatchConf;
+  bool cross_check = false;
+  algorithm::MatcherType matcher = algorithm::MatcherType::kFlann;
+  // Skip the full matching of pairs clearly above or below match_threshold
+  bool early_exit = false;
 };
 
 using StitchAlgorithmOptions = algorithm::StitchOptions;
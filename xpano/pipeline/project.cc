@@ -0,0 +1,434 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/pipeline/project.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <memory>
+#include <new>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <spdlog/spdlog.h>
+
+#include "xpano/algorithm/algorithm.h"
+#include "xpano/algorithm/feature_store.h"
+#include "xpano/algorithm/image.h"
+#include "xpano/constants.h"
+#include "xpano/pipeline/stitcher_pipeline.h"
+#include "xpano/utils/binary.h"
+#include "xpano/utils/mmap.h"
+#include "xpano/utils/threadpool.h"
+
+namespace xpano::pipeline::project {
+
+namespace {
+
+constexpr std::uint32_t kMagic = 0x4A505058;  // "XPPJ"
+
+// Bump when the layout changes
+constexpr std::uint32_t kVersion = 3;
+
+// Upper bounds of the counts, to reject corrupted files before allocating
+constexpr std::uint64_t kMaxImages = 1 << 20;
+constexpr std::uint64_t kMaxPathLength = 1 << 16;
+
+// Image with its preview and thumbnail encoded, ready to be written. The
+// features of all the images are written together in a feature store at the
+// end of the file.
+struct EncodedImage {
+  std::string path;
+  std::uint8_t is_raw = 0;
+  std::int32_t depth_conversion = 0;
+  std::vector<unsigned char> preview;
+  std::vector<unsigned char> thumbnail;
+};
+
+std::vector<unsigned char> Encode(const cv::Mat& image) {
+  // Lossless, a reopened project stitches exactly like the saved one
+  std::vector<unsigned char> buffer;
+  cv::imencode(".png", image, buffer,
+               {cv::IMWRITE_PNG_COMPRESSION, kProjectPngCompression});
+  return buffer;
+}
+
+cv::Mat Decode(const std::vector<unsigned char>& buffer) {
+  return cv::imdecode(buffer, cv::IMREAD_UNCHANGED);
+}
+
+EncodedImage EncodeImage(const algorithm::Image& image) {
+  std::error_code error;
+  auto path = std::filesystem::absolute(image.GetPath(), error);
+  return {
+      .path = (error ? image.GetPath() : path).string(),
+      .is_raw = static_cast<std::uint8_t>(image.IsRaw()),
+      .depth_conversion = static_cast<std::int32_t>(image.GetDepthConversion()),
+      .preview = Encode(image.GetPreview()),
+      .thumbnail = Encode(image.GetThumbnail()),
+  };
+}
+
+std::optional<algorithm::Image> DecodeImage(
+    EncodedImage encoded,
+    std::shared_ptr<const algorithm::FeatureStore> feature_store, int id) {
+  algorithm::ImageData data{
+      .preview = Decode(encoded.preview),
+      .thumbnail = Decode(encoded.thumbnail),
+      .feature_store = std::move(feature_store),
+      .feature_store_id = id,
+      .is_raw = encoded.is_raw != 0,
+      .depth_conversion =
+          static_cast<algorithm::DepthConversion>(encoded.depth_conversion),
+  };
+  if (data.preview.empty() || data.thumbnail.empty()) {
+    spdlog::error("Failed to decode the preview of {}", encoded.path);
+    return {};
+  }
+  return algorithm::Image(encoded.path, std::move(data));
+}
+
+// False once cancelled, the pool is paused then and the pending tasks might
+// never run
+template <typename TFuture>
+bool WaitUnlessCancelled(TFuture* future, const std::atomic<bool>& cancel) {
+  while (future->wait_for(kTaskCancellationTimeout) !=
+         std::future_status::ready) {
+    if (cancel) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool WriteImage(std::ostream& stream, const EncodedImage& image) {
+  return utils::binary::WriteString(stream, image.path) &&
+         utils::binary::Write(stream, image.is_raw) &&
+         utils::binary::Write(stream, image.depth_conversion) &&
+         utils::binary::WriteVector(stream, image.preview) &&
+         utils::binary::WriteVector(stream, image.thumbnail);
+}
+
+bool ReadImage(std::istream& stream, EncodedImage* image) {
+  return utils::binary::ReadString(stream, &image->path, kMaxPathLength) &&
+         utils::binary::Read(stream, &image->is_raw) &&
+         utils::binary::Read(stream, &image->depth_conversion) &&
+         utils::binary::ReadVector(stream, &image->preview) &&
+         utils::binary::ReadVector(stream, &image->thumbnail);
+}
+
+bool WriteMatch(std::ostream& stream, const algorithm::Match& match) {
+  return utils::binary::Write(stream, static_cast<std::int32_t>(match.id1)) &&
+         utils::binary::Write(stream, static_cast<std::int32_t>(match.id2)) &&
+         utils::binary::WriteVector(stream, match.matches);
+}
+
+bool ReadMatch(std::istream& stream, int num_images, algorithm::Match* match) {
+  std::int32_t id1 = 0;
+  std::int32_t id2 = 0;
+  if (!utils::binary::Read(stream, &id1) ||
+      !utils::binary::Read(stream, &id2) ||
+      !utils::binary::ReadVector(stream, &match->matches)) {
+    return false;
+  }
+  match->id1 = id1;
+  match->id2 = id2;
+  return id1 >= 0 && id1 < num_images && id2 >= 0 && id2 < num_images;
+}
+
+bool WritePano(std::ostream& stream, const algorithm::Pano& pano) {
+  return utils::binary::WriteVector(stream, pano.ids) &&
+         utils::binary::Write(stream,
+                              static_cast<std::uint8_t>(pano.exported));
+}
+
+bool ReadPano(std::istream& stream, int num_images, algorithm::Pano* pano) {
+  std::uint8_t exported = 0;
+  if (!utils::binary::ReadVector(stream, &pano->ids) ||
+      !utils::binary::Read(stream, &exported)) {
+    return false;
+  }
+  pano->exported = exported != 0;
+  return !pano->ids.empty() &&
+         std::all_of(pano->ids.begin(), pano->ids.end(), [num_images](int id) {
+           return id >= 0 && id < num_images;
+         });
+}
+
+// Feature store written at an aligned offset, so that it can be used in place
+// once the file is mapped
+bool WriteFeatures(std::ostream& stream, const StitcherData& data,
+                   std::uint64_t* offset) {
+  auto position = static_cast<std::uint64_t>(stream.tellp());
+  *offset = (position + kFeatureStoreAlignment - 1) / kFeatureStoreAlignment *
+            kFeatureStoreAlignment;
+  const std::vector<char> padding(*offset - position, 0);
+  stream.write(padding.data(), static_cast<std::streamsize>(padding.size()));
+
+  std::vector<algorithm::FeatureSource> features;
+  features.reserve(data.images.size());
+  for (const auto& image : data.images) {
+    features.push_back({.keypoints = image.GetKeypoints(),
+                        .descriptors = image.GetDescriptors()});
+  }
+  return stream && algorithm::FeatureStore::Write(stream, features);
+}
+
+std::shared_ptr<const algorithm::FeatureStore> MapFeatures(
+    const std::filesystem::path& path, std::uint64_t offset) {
+  auto store =
+      algorithm::FeatureStore::View(utils::mmap::MappedFile::Open(path),
+                                    static_cast<std::size_t>(offset));
+#ifdef _WIN32
+  // Windows can't replace a mapped file, saving over the opened project
+  // would fail while the images hold the mapping
+  if (store) {
+    std::vector<algorithm::FeatureSource> features;
+    for (int i = 0; i < store->NumImages(); i++) {
+      features.push_back({.keypoints = store->Keypoints(i),
+                          .descriptors = store->Descriptors(i)});
+    }
+    store = algorithm::FeatureStore::Pack(features);
+  }
+#endif
+  return store;
+}
+
+bool WriteProject(std::ostream& stream, const StitcherData& data,
+                  std::vector<std::future<EncodedImage>>* encoded_images,
+                  ProgressMonitor* progress, const std::atomic<bool>& cancel) {
+  if (!utils::binary::Write(stream, kMagic) ||
+      !utils::binary::Write(stream, kVersion)) {
+    return false;
+  }
+  // Known only once everything else is written
+  auto offset_position = stream.tellp();
+  std::uint64_t features_offset = 0;
+  if (!utils::binary::Write(stream, features_offset) ||
+      !utils::binary::Write(stream,
+                            static_cast<std::uint64_t>(data.images.size()))) {
+    return false;
+  }
+  // Written in order as soon as each image is encoded
+  for (auto& future : *encoded_images) {
+    if (!WaitUnlessCancelled(&future, cancel) ||
+        !WriteImage(stream, future.get())) {
+      return false;
+    }
+    progress->NotifyTaskDone();
+  }
+
+  if (!utils::binary::Write(stream,
+                            static_cast<std::uint64_t>(data.matches.size()))) {
+    return false;
+  }
+  for (const auto& match : data.matches) {
+    if (!WriteMatch(stream, match)) {
+      return false;
+    }
+  }
+
+  if (!utils::binary::Write(stream,
+                            static_cast<std::uint64_t>(data.panos.size()))) {
+    return false;
+  }
+  for (const auto& pano : data.panos) {
+    if (!WritePano(stream, pano)) {
+      return false;
+    }
+  }
+  if (!utils::binary::Write(stream, data.matching_stats) ||
+      !WriteFeatures(stream, data, &features_offset)) {
+    return false;
+  }
+  stream.seekp(offset_position);
+  return utils::binary::Write(stream, features_offset);
+}
+
+std::optional<StitcherData> ReadProject(const std::filesystem::path& path,
+                                        std::istream& stream,
+                                        utils::mt::Threadpool* pool,
+                                        ProgressMonitor* progress,
+                                        const std::atomic<bool>& cancel) {
+  std::uint32_t magic = 0;
+  std::uint32_t version = 0;
+  std::uint64_t features_offset = 0;
+  std::uint64_t num_images = 0;
+  if (!utils::binary::Read(stream, &magic) || magic != kMagic) {
+    spdlog::error("Not an Xpano project");
+    return {};
+  }
+  if (!utils::binary::Read(stream, &version) || version != kVersion) {
+    spdlog::error("Unsupported project version {}, expected {}", version,
+                  kVersion);
+    return {};
+  }
+  if (!utils::binary::Read(stream, &features_offset) ||
+      !utils::binary::Read(stream, &num_images) || num_images > kMaxImages) {
+    return {};
+  }
+  progress->SetNumTasks(static_cast<int>(num_images));
+
+  // The keypoints and descriptors are used in place, without reading them
+  auto feature_store = MapFeatures(path, features_offset);
+  if (!feature_store ||
+      static_cast<std::uint64_t>(feature_store->NumImages()) != num_images) {
+    spdlog::error("Failed to map the features of the project");
+    return {};
+  }
+
+  // Decoded on the pool while the next images are being read
+  utils::mt::MultiFuture<std::optional<algorithm::Image>> decoding_future;
+  for (std::uint64_t i = 0; i < num_images; i++) {
+    EncodedImage encoded;
+    if (!ReadImage(stream, &encoded)) {
+      return {};
+    }
+    decoding_future.push_back(pool->submit(
+        [encoded = std::move(encoded), feature_store, id = static_cast<int>(i),
+         progress]() mutable {
+          auto image = DecodeImage(std::move(encoded), feature_store, id);
+          progress->NotifyTaskDone();
+          return image;
+        }));
+  }
+
+  if (!WaitUnlessCancelled(&decoding_future, cancel)) {
+    return {};
+  }
+  StitcherData data;
+  for (auto& image : decoding_future.get()) {
+    if (!image) {
+      return {};
+    }
+    data.images.push_back(std::move(*image));
+  }
+
+  auto num_ids = static_cast<int>(data.images.size());
+  std::uint64_t num_matches = 0;
+  if (!utils::binary::Read(stream, &num_matches)) {
+    return {};
+  }
+  for (std::uint64_t i = 0; i < num_matches; i++) {
+    algorithm::Match match{};
+    if (!ReadMatch(stream, num_ids, &match)) {
+      return {};
+    }
+    data.matches.push_back(std::move(match));
+  }
+
+  std::uint64_t num_panos = 0;
+  if (!utils::binary::Read(stream, &num_panos)) {
+    return {};
+  }
+  for (std::uint64_t i = 0; i < num_panos; i++) {
+    algorithm::Pano pano;
+    if (!ReadPano(stream, num_ids, &pano)) {
+      return {};
+    }
+    data.panos.push_back(std::move(pano));
+  }
+
+  if (!utils::binary::Read(stream, &data.matching_stats)) {
+    return {};
+  }
+  return data;
+}
+
+}  // namespace
+
+bool Save(const std::filesystem::path& path, const StitcherData& data,
+          utils::mt::Threadpool* pool, ProgressMonitor* progress,
+          const std::atomic<bool>& cancel) {
+  progress->SetNumTasks(static_cast<int>(data.images.size()));
+  std::vector<std::future<EncodedImage>> encoded_images;
+  for (const auto& image : data.images) {
+    encoded_images.push_back(
+        pool->submit([image]() { return EncodeImage(image); }));
+  }
+
+  // Write to a temporary file first, a failed save should never leave a
+  // partially written project behind
+  auto tmp_path = path;
+  tmp_path += ".tmp";
+  bool written = false;
+  {
+    std::ofstream stream(tmp_path, std::ios::binary);
+    written = stream &&
+              WriteProject(stream, data, &encoded_images, progress, cancel);
+  }
+
+  std::error_code error;
+  if (!written) {
+    spdlog::error("Failed to write project {}", tmp_path.string());
+    std::filesystem::remove(tmp_path, error);
+    return false;
+  }
+  std::filesystem::rename(tmp_path, path, error);
+  if (error) {
+    spdlog::error("Failed to save project {}: {}", path.string(),
+                  error.message());
+    std::filesystem::remove(tmp_path, error);
+    return false;
+  }
+  spdlog::info("Saved project with {} images, {} matches and {} panos to {}",
+               data.images.size(), data.matches.size(), data.panos.size(),
+               path.string());
+  return true;
+}
+
+std::optional<StitcherData> Load(const std::filesystem::path& path,
+                                 utils::mt::Threadpool* pool,
+                                 ProgressMonitor* progress,
+                                 const std::atomic<bool>& cancel) {
+  std::ifstream stream(path, std::ios::binary);
+  if (!stream) {
+    spdlog::error("Failed to open project {}", path.string());
+    return {};
+  }
+
+  std::optional<StitcherData> data;
+  try {
+    data = ReadProject(path, stream, pool, progress, cancel);
+  } catch (const cv::Exception& e) {
+    spdlog::error("Corrupted project {}: {}", path.string(), e.what());
+    return {};
+  } catch (const std::bad_alloc&) {
+    spdlog::error("Corrupted project {}: out of memory", path.string());
+    return {};
+  }
+  if (!data) {
+    spdlog::error("Failed to read project {}", path.string());
+    return {};
+  }
+
+  int num_missing = 0;
+  for (const auto& image : data->images) {
+    std::error_code error;
+    if (!std::filesystem::exists(image.GetPath(), error)) {
+      num_missing++;
+    }
+  }
+  if (num_missing > 0) {
+    spdlog::warn(
+        "{} images of the project are missing, full resolution stitching "
+        "will fail for their panos",
+        num_missing);
+  }
+  spdlog::info("Loaded project with {} images, {} matches and {} panos",
+               data->images.size(), data->matches.size(), data->panos.size());
+  return data;
+}
+
+}  // namespace xpano::pipeline::project
@@ -0,0 +1,31 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <atomic>
+#include <filesystem>
+#include <optional>
+
+#include "xpano/pipeline/stitcher_pipeline.h"
+#include "xpano/utils/threadpool.h"
+
+namespace xpano::pipeline::project {
+
+// Single file with everything needed to continue working on a set of images:
+// the input paths, the previews and thumbnails, the keypoints and descriptors
+// detected on the previews, the matches and the panos, including the edits
+// made to them. Reopening it skips the decoding of the inputs, the keypoint
+// detection and the matching.
+
+// The previews are encoded and the images decoded on the pool, one task per
+// image is reported to the progress monitor. Both give up once cancelled.
+[[nodiscard]] bool Save(const std::filesystem::path& path,
+                        const StitcherData& data, utils::mt::Threadpool* pool,
+                        ProgressMonitor* progress,
+                        const std::atomic<bool>& cancel);
+[[nodiscard]] std::optional<StitcherData> Load(
+    const std::filesystem::path& path, utils::mt::Threadpool* pool,
+    ProgressMonitor* progress, const std::atomic<bool>& cancel);
+
+}  // namespace xpano::pipeline::project
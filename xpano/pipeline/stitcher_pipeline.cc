@@ -5,26 +5,48 @@
 #include "xpano/pipeline/stitcher_pipeline.h"
 
 #include <algorithm>
+#include <array>
 #include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
 #include <filesystem>
+#include <fstream>
 #include <future>
+#include <iterator>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <random>
+#include <set>
 #include <string>
+#include <system_error>
+#include <tuple>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
 #include <opencv2/core.hpp>
 #include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
 #include <opencv2/stitching.hpp>
+#include <spdlog/fmt/fmt.h>
 #include <spdlog/spdlog.h>
 
 #include "xpano/algorithm/algorithm.h"
+#include "xpano/algorithm/full_res_cache.h"
 #include "xpano/algorithm/image.h"
+#include "xpano/algorithm/image_store.h"
+#include "xpano/algorithm/matcher.h"
+#include "xpano/algorithm/retrieval.h"
 #include "xpano/constants.h"
+#include "xpano/pipeline/project.h"
+#include "xpano/utils/bigtiff.h"
 #include "xpano/utils/exiv2.h"
+#include "xpano/utils/jpeg.h"
 #include "xpano/utils/opencv.h"
+#include "xpano/utils/path.h"
 #include "xpano/utils/threadpool.h"
-#include "xpano/utils/vec_opencv.h"
 
 namespace xpano::pipeline {
 namespace {
@@ -59,12 +81,496 @@ std::vector<int> CompressionParameters(const CompressionOptions &options) {
   };
 }
 
+// Each image with the num_neighbors images preceding it in the input order
+std::vector<algorithm::ImagePair> NeighborPairs(int num_images,
+                                                int num_neighbors) {
+  std::vector<algorithm::ImagePair> pairs;
+  for (int j = 0; j < num_images; j++) {
+    for (int i = std::max(0, j - num_neighbors); i < j; i++) {
+      pairs.emplace_back(i, j);
+    }
+  }
+  return pairs;
+}
+
+// Everything the cached registrations and decoded images depend on, modified
+// files are loaded again
+std::vector<std::string> CacheKey(
+    const std::vector<std::filesystem::path> &inputs,
+    const LoadingOptions &options) {
+  std::vector<std::string> key = {
+      fmt::format("{}|{}|{}", options.preview_longer_side,
+                  static_cast<int>(options.depth_conversion),
+                  options.quantize_descriptors)};
+  for (const auto &input : inputs) {
+    std::error_code error;
+    auto modified = std::filesystem::last_write_time(input, error);
+    key.push_back(fmt::format("{}|{}", input.string(),
+                              error ? 0 : modified.time_since_epoch().count()));
+  }
+  return key;
+}
+
+// Stitched without the registration cache, for the partial panos whose
+// matches keep changing while the loading runs
+constexpr int kUncachedPanoId = -1;
+
+// FNV-1a of the matches between the images of the pano, independent of the
+// order the matching tasks finished in
+std::uint64_t MatchesFingerprint(
+    const algorithm::Pano &pano, const std::vector<algorithm::Match> &matches) {
+  constexpr std::uint64_t kFnvOffsetBasis = 0xcbf29ce484222325;
+  constexpr std::uint64_t kFnvPrime = 0x100000001b3;
+
+  std::set<int> ids(pano.ids.begin(), pano.ids.end());
+  std::vector<std::array<int, 4>> entries;
+  for (const auto &match : matches) {
+    if (!ids.contains(match.id1) || !ids.contains(match.id2)) {
+      continue;
+    }
+    for (const auto &dmatch : match.matches) {
+      entries.push_back(
+          {match.id1, match.id2, dmatch.queryIdx, dmatch.trainIdx});
+    }
+  }
+  std::sort(entries.begin(), entries.end());
+
+  std::uint64_t hash = kFnvOffsetBasis;
+  for (const auto &entry : entries) {
+    for (int value : entry) {
+      hash ^= static_cast<std::uint32_t>(value);
+      hash *= kFnvPrime;
+    }
+  }
+  return hash;
+}
+
+// Previews and descriptors over the budget are spilled to a temporary
+// directory, which is removed once the last image referencing it is gone
+std::shared_ptr<algorithm::ImageStore> MakeImageStore(int memory_budget) {
+  if (memory_budget <= 0) {
+    return nullptr;
+  }
+  std::error_code error;
+  auto temp_dir = std::filesystem::temp_directory_path(error);
+  if (error) {
+    spdlog::warn("No temporary directory for spilling images: {}",
+                 error.message());
+    return nullptr;
+  }
+  auto spill_dir =
+      temp_dir / fmt::format("xpano_spill_{:08x}", std::random_device{}());
+  spdlog::info("Image memory budget: {} MB, spilling to {}", memory_budget,
+               spill_dir.string());
+  return std::make_shared<algorithm::ImageStore>(
+      spill_dir, static_cast<std::int64_t>(memory_budget * kMegabyte));
+}
+
+algorithm::MatchOptions PrepareMatchOptions(const MatchingOptions &options) {
+  spdlog::info("Matching with the {} matcher",
+               algorithm::Label(options.matcher));
+  if (options.matcher == algorithm::MatcherType::kSimd) {
+    spdlog::info("SIMD instruction set: {}", algorithm::SimdInstructionSet());
+  }
+  return {
+      .match_conf = options.match_conf,
+      .cross_check = options.cross_check,
+      .matcher = options.matcher,
+      .early_exit_threshold = options.early_exit ? options.match_threshold : 0,
+  };
+}
+
+// Loaded images and the matching tasks scheduled so far, shared with the
+// tasks, which might outlive RunStreamingPipeline when cancelled
+struct StreamingState {
+  explicit StreamingState(int num_images)
+      : images(num_images), done(num_images, false) {}
+
+  // Pairs of loaded images at most num_neighbors apart in the order of the
+  // loaded images, the same as the neighbors of a RunMatchingPipeline. A pair
+  // is known once every input between its images finished loading, these
+  // are the pairs across input j, the last of them to finish.
+  [[nodiscard]] std::vector<algorithm::ImagePair> NewPairs(
+      int j, int num_neighbors) const {
+    int num_images = static_cast<int>(images.size());
+    std::deque<int> window;
+    if (images[j].IsLoaded()) {
+      window.push_back(j);
+    }
+    for (int i = j - 1, num_left = 0;
+         i >= 0 && done[i] && num_left < num_neighbors; i--) {
+      if (images[i].IsLoaded()) {
+        window.push_front(i);
+        num_left++;
+      }
+    }
+    for (int i = j + 1, num_right = 0;
+         i < num_images && done[i] && num_right < num_neighbors; i++) {
+      if (images[i].IsLoaded()) {
+        window.push_back(i);
+        num_right++;
+      }
+    }
+
+    std::vector<algorithm::ImagePair> pairs;
+    int window_size = static_cast<int>(window.size());
+    for (int p = 0; p < window_size && window[p] <= j; p++) {
+      for (int q = p + 1; q < window_size && q - p <= num_neighbors; q++) {
+        if (window[q] >= j) {
+          pairs.emplace_back(window[p], window[q]);
+        }
+      }
+    }
+    return pairs;
+  }
+
+  std::mutex mutex;
+  std::vector<algorithm::Image> images;
+  std::vector<bool> done;  // Loading finished, successfully or not
+  int num_failed = 0;
+  utils::mt::MultiFuture<algorithm::Match> matches;
+};
+
+utils::jpeg::Subsampling ToJpegSubsampling(
+    const ChromaSubsampling &subsampling) {
+  switch (subsampling) {
+    case ChromaSubsampling::k444:
+      return utils::jpeg::Subsampling::k444;
+    case ChromaSubsampling::k420:
+      return utils::jpeg::Subsampling::k420;
+    default:
+      return utils::jpeg::Subsampling::k422;
+  }
+}
+
+// The streaming encoder writes baseline JPEGs with the standard Huffman
+// tables, progressive and optimized ones are left to OpenCV
+bool CanStreamJpeg(const std::filesystem::path &path,
+                   const CompressionOptions &options, cv::Size image_size,
+                   int image_type) {
+  return utils::path::IsJpegExtension(path) && image_type == CV_8UC3 &&
+         !options.jpeg_progressive && !options.jpeg_optimize &&
+         utils::jpeg::StripEncoder::IsSupported(image_size);
+}
+
+// Encodes the strips of an image on the thread pool as they arrive and
+// appends them to the file in order. The number of strips in flight is
+// bounded, so that the encoded data doesn't pile up in memory.
+class JpegStripWriter {
+ public:
+  JpegStripWriter(const std::filesystem::path &path, cv::Size image_size,
+                  const CompressionOptions &options,
+                  const utils::exiv2::ExifBlob &exif,
+                  utils::mt::Threadpool *pool)
+      : stream_(path, std::ios::binary),
+        encoder_(image_size, options.jpeg_quality,
+                 ToJpegSubsampling(options.jpeg_subsampling)),
+        image_height_(image_size.height),
+        pool_(pool),
+        max_pending_(2 * static_cast<int>(pool->get_thread_count())) {
+    if (static_cast<int>(exif.size()) > utils::jpeg::kMaxExifSize) {
+      spdlog::warn("Exif data too large for {}, skipping", path.string());
+      WriteBytes(encoder_.Header());
+    } else {
+      WriteBytes(encoder_.Header(exif));
+    }
+  }
+
+  // The encoding tasks reference the encoder
+  ~JpegStripWriter() {
+    for (auto &segment : pending_) {
+      segment.wait();
+    }
+  }
+  JpegStripWriter(const JpegStripWriter &) = delete;
+  JpegStripWriter &operator=(const JpegStripWriter &) = delete;
+  JpegStripWriter(JpegStripWriter &&) = delete;
+  JpegStripWriter &operator=(JpegStripWriter &&) = delete;
+
+  [[nodiscard]] bool IsOpen() const { return stream_.is_open() && stream_; }
+
+  // The 8-bit BGR rows following the previous strip, the data has to stay
+  // unchanged until Close
+  bool Write(const cv::Mat &strip) {
+    for (int row = 0; row < strip.rows; row += kJpegStripRows) {
+      cv::Mat segment =
+          strip.rowRange(row, std::min(row + kJpegStripRows, strip.rows));
+      pending_.push_back(
+          pool_->submit([this, segment, first_row = next_row_ + row]() {
+            return encoder_.Encode(segment, first_row);
+          }));
+      if (static_cast<int>(pending_.size()) > max_pending_) {
+        WriteNext();
+      }
+    }
+    next_row_ += strip.rows;
+    return IsOpen();
+  }
+
+  bool Close() {
+    while (!pending_.empty()) {
+      WriteNext();
+    }
+    WriteBytes(utils::jpeg::StripEncoder::Trailer());
+    bool complete = next_row_ == image_height_ && IsOpen();
+    stream_.close();
+    return complete && !stream_.fail();
+  }
+
+ private:
+  void WriteNext() {
+    WriteBytes(pending_.front().get());
+    pending_.pop_front();
+  }
+
+  void WriteBytes(const std::vector<unsigned char> &bytes) {
+    stream_.write(reinterpret_cast<const char *>(bytes.data()),
+                  static_cast<std::streamsize>(bytes.size()));
+  }
+
+  std::ofstream stream_;
+  utils::jpeg::StripEncoder encoder_;
+  int image_height_;
+  utils::mt::Threadpool *pool_;
+  int max_pending_;
+  int next_row_ = 0;
+  std::deque<std::future<std::vector<unsigned char>>> pending_;
+};
+
+// Metadata to write into the export, empty without Exiv2 or if the format
+// doesn't support it
+utils::exiv2::ExifBlob ExportExif(
+    const std::filesystem::path &export_path,
+    const std::optional<utils::exiv2::ExifBlob> &source_exif,
+    cv::Size pano_size) {
+  if (!utils::exiv2::Enabled() ||
+      !utils::path::IsMetadataExtensionSupported(export_path)) {
+    return {};
+  }
+  return utils::exiv2::PanoExif(source_exif,
+                                {pano_size.width, pano_size.height});
+}
+
+// Encoded in memory when there is metadata to add, so that the file is
+// written only once
+bool WriteEncoded(const std::filesystem::path &path, const cv::Mat &image,
+                  const CompressionOptions &options,
+                  const utils::exiv2::ExifBlob &exif) {
+  if (exif.empty()) {
+    return cv::imwrite(path.string(), image, CompressionParameters(options));
+  }
+  std::vector<unsigned char> encoded;
+  if (!cv::imencode(path.extension().string(), image, encoded,
+                    CompressionParameters(options))) {
+    return false;
+  }
+  utils::exiv2::EmbedExif(exif, &encoded);
+  std::ofstream stream(path, std::ios::binary);
+  stream.write(reinterpret_cast<const char *>(encoded.data()),
+               static_cast<std::streamsize>(encoded.size()));
+  return static_cast<bool>(stream);
+}
+
+// Tiled exports are BigTIFF unless they can be streamed as JPEG
+std::filesystem::path TiledExportPath(std::filesystem::path path) {
+  if (!utils::path::IsTiffExtension(path)) {
+    path.replace_extension("tif");
+    spdlog::warn(
+        "Tiled export is only supported as TIFF or baseline JPEG of up to {} "
+        "pixels per side, exporting to {}",
+        utils::jpeg::kMaxDimension, path.string());
+  }
+  return path;
+}
+
+// Writes the tiles of algorithm::ComposeTiled straight to the export file.
+// JPEGs are encoded a row of tiles at a time, while the next row is being
+// composed, with the metadata in their header. Everything else goes to a
+// BigTIFF with the pano mask in the alpha channel, without metadata.
+class ExportTileWriter : public algorithm::TileWriter {
+ public:
+  ExportTileWriter(std::filesystem::path path,
+                   const CompressionOptions &compression,
+                   std::optional<utils::exiv2::ExifBlob> source_exif,
+                   ProgressMonitor *progress, utils::mt::Threadpool *pool)
+      : path_(std::move(path)),
+        compression_(compression),
+        source_exif_(std::move(source_exif)),
+        progress_(progress),
+        pool_(pool) {}
+
+  bool Open(cv::Size pano_size, cv::Size tile_size) override {
+    int tiles_across =
+        (pano_size.width + tile_size.width - 1) / tile_size.width;
+    int tiles_down =
+        (pano_size.height + tile_size.height - 1) / tile_size.height;
+    progress_->SetNumTasks(progress_->Progress().num_tasks +
+                           tiles_across * tiles_down);
+
+    if (CanStreamJpeg(path_, compression_, pano_size, CV_8UC3)) {
+      pano_width_ = pano_size.width;
+      jpeg_.emplace(path_, pano_size, compression_,
+                    ExportExif(path_, source_exif_, pano_size), pool_);
+      return jpeg_->IsOpen();
+    }
+    path_ = TiledExportPath(path_);
+    tiff_.emplace(path_, pano_size, tile_size, 4);
+    return tiff_->IsOpen();
+  }
+
+  bool Write(const cv::Mat &pano, const cv::Mat &mask) override {
+    progress_->NotifyTaskDone();
+    if (jpeg_) {
+      return WriteToStrip(pano, mask);
+    }
+    cv::Mat tile;
+    cv::cvtColor(pano, tile, cv::COLOR_BGR2RGBA);
+    cv::mixChannels(mask, tile, {0, 3});
+    return tiff_->Write(tile);
+  }
+
+  bool Close() {
+    if (jpeg_) {
+      return jpeg_->Close();
+    }
+    return tiff_ && tiff_->Close();
+  }
+
+  [[nodiscard]] const std::filesystem::path &Path() const { return path_; }
+
+ private:
+  // The strip is handed over once the last tile of the row arrives, a new
+  // one is allocated for the next row while the encoder still reads it
+  bool WriteToStrip(const cv::Mat &pano, const cv::Mat &mask) {
+    if (strip_x_ == 0) {
+      strip_ = cv::Mat::zeros(pano.rows, pano_width_, CV_8UC3);
+    }
+    pano.copyTo(strip_(cv::Rect(strip_x_, 0, pano.cols, pano.rows)), mask);
+    strip_x_ += pano.cols;
+    if (strip_x_ < pano_width_) {
+      return true;
+    }
+    strip_x_ = 0;
+    return jpeg_->Write(strip_);
+  }
+
+  std::filesystem::path path_;
+  CompressionOptions compression_;
+  std::optional<utils::exiv2::ExifBlob> source_exif_;
+  ProgressMonitor *progress_;
+  utils::mt::Threadpool *pool_;
+  std::optional<utils::bigtiff::TiledWriter> tiff_;
+  std::optional<JpegStripWriter> jpeg_;
+  int pano_width_ = 0;
+  int strip_x_ = 0;
+  cv::Mat strip_;
+};
+
+// Size of the decoded full resolution image. Only JPEG headers have the
+// dimensions at hand, other formats are assumed to be as large as their files.
+std::int64_t DecodedBytes(const std::filesystem::path &path) {
+  if (auto size = algorithm::ReadJpegSize(path); size) {
+    return static_cast<std::int64_t>(size->width) * size->height * 3;
+  }
+  std::error_code error;
+  auto file_size = std::filesystem::file_size(path, error);
+  return error ? 0 : static_cast<std::int64_t>(file_size);
+}
+
+std::int64_t EstimateFootprint(const algorithm::Pano &pano,
+                               const std::vector<algorithm::Image> &images,
+                               const BatchExportOptions &options) {
+  // The previews are in memory already
+  if (!options.full_res) {
+    return 0;
+  }
+  std::int64_t input_bytes = 0;
+  for (int img_id : pano.ids) {
+    input_bytes += DecodedBytes(images[img_id].GetPath());
+  }
+  // Tiled compositing keeps only a few tiles besides the inputs
+  if (options.stitch_algorithm.tiled_export) {
+    return input_bytes;
+  }
+  return input_bytes * kBatchFootprintFactor;
+}
+
+std::vector<std::filesystem::path> BatchExportPaths(
+    const StitcherData &data, const std::filesystem::path &export_dir) {
+  std::unordered_map<std::string, int> name_counts;
+  for (const auto &pano : data.panos) {
+    name_counts[data.images[pano.ids[0]].PanoName()]++;
+  }
+  std::vector<std::filesystem::path> paths;
+  for (int pano_id = 0; pano_id < static_cast<int>(data.panos.size());
+       pano_id++) {
+    std::filesystem::path name =
+        data.images[data.panos[pano_id].ids[0]].PanoName();
+    if (name_counts[name.string()] > 1) {
+      name = fmt::format("{}_{}{}", name.stem().string(), pano_id,
+                         name.extension().string());
+    }
+    paths.push_back(export_dir / name);
+  }
+  return paths;
+}
+
+algorithm::Registration RegisterPano(
+    const algorithm::Pano &pano, const std::vector<algorithm::Image> &images,
+    const std::vector<algorithm::Match> &matches,
+    const std::vector<cv::Mat> &previews,
+    const StitchAlgorithmOptions &options) {
+  // The keypoints from loading are SIFT only and are not computed at all
+  // without auto matching
+  bool has_keypoints =
+      std::all_of(pano.ids.begin(), pano.ids.end(), [&images](int img_id) {
+        return !images[img_id].GetKeypoints().Empty();
+      });
+  if (options.feature == algorithm::FeatureType::kSift && has_keypoints) {
+    return algorithm::Register(images, pano.ids, matches, options);
+  }
+  return algorithm::Register(previews, options);
+}
+
 }  // namespace
 
+struct BatchState {
+  explicit BatchState(int num_panos)
+      : monitors(num_panos), results(num_panos) {}
+
+  // Called with the mutex held, the panos cancelled before they finished
+  // count as failed
+  void Finish() {
+    finished = true;
+    queued.clear();
+    for (auto &result : results) {
+      if (result.status == BatchStatus::kQueued ||
+          result.status == BatchStatus::kRunning) {
+        result.status = BatchStatus::kFailed;
+      }
+    }
+    promise.set_value(results);
+  }
+
+  std::mutex mutex;
+  std::deque<ProgressMonitor> monitors;
+  std::vector<BatchExportResult> results;
+  std::vector<std::filesystem::path> export_paths;
+  std::vector<std::int64_t> footprints;
+  std::deque<int> queued;
+  std::int64_t budget_bytes = 0;
+  std::int64_t running_bytes = 0;
+  int num_running = 0;
+  int max_running = 1;
+  bool finished = false;
+  std::promise<std::vector<BatchExportResult>> promise;
+};
+
 void ProgressMonitor::Reset(ProgressType type, int num_tasks) {
   type_ = type;
   done_ = 0;
   num_tasks_ = num_tasks;
+  images_loaded_ = 0;
 }
 
 void ProgressMonitor::SetTaskType(ProgressType type) { type_ = type; }
@@ -72,11 +578,30 @@ void ProgressMonitor::SetTaskType(ProgressType type) { type_ = type; }
 void ProgressMonitor::SetNumTasks(int num_tasks) { num_tasks_ = num_tasks; }
 
 ProgressReport ProgressMonitor::Progress() const {
-  return {type_, done_, num_tasks_};
+  return {type_, done_, num_tasks_, cache_hits_, cache_misses_,
+          images_loaded_};
 }
 
 void ProgressMonitor::NotifyTaskDone() { done_++; }
 
+void ProgressMonitor::NotifyImageLoaded() { images_loaded_++; }
+
+void ProgressMonitor::ResetCacheStats() {
+  cache_hits_ = 0;
+  cache_misses_ = 0;
+}
+
+void ProgressMonitor::NotifyCacheHit() { cache_hits_++; }
+
+void ProgressMonitor::NotifyCacheMiss() { cache_misses_++; }
+
+StitcherPipeline::StitcherPipeline(
+    const std::optional<std::filesystem::path> &feature_cache_dir) {
+  if (feature_cache_dir) {
+    feature_cache_.emplace(*feature_cache_dir);
+  }
+}
+
 StitcherPipeline::~StitcherPipeline() { Cancel(); }
 
 void StitcherPipeline::Cancel() {
@@ -90,61 +615,169 @@ void StitcherPipeline::Cancel() {
 
     pool_.cancel_tasks();
     pool_.unpause();
+    FinishBatch();
     progress_.Reset(ProgressType::kNone, 0);
     spdlog::info("Done");
   }
+  ResetPartialPanos({});
 }
 
 std::future<StitcherData> StitcherPipeline::RunLoading(
     const std::vector<std::filesystem::path> &inputs,
     const LoadingOptions &loading_options,
     const MatchingOptions &matching_options) {
-  return pool_.submit([this, loading_options, matching_options, inputs]() {
-    auto images = RunLoadingPipeline(
-        inputs, loading_options,
-        /*compute_keypoints=*/matching_options.type == MatchingType::kAuto);
-    return RunMatchingPipeline(images, matching_options);
+  // Loading the same inputs again keeps the registrations and the decoded
+  // images, e.g. between the jobs of the server
+  if (auto cache_key = CacheKey(inputs, loading_options);
+      cache_key != cache_key_) {
+    ClearCaches();
+    cache_key_ = std::move(cache_key);
+  }
+  ResetPartialPanos(matching_options.match_threshold);
+  image_store_ = MakeImageStore(loading_options.memory_budget);
+  return pool_.submit([this, loading_options, matching_options, inputs,
+                       image_store = image_store_]() {
+    StitcherData data;
+    if (matching_options.type == MatchingType::kAuto) {
+      data = RunStreamingPipeline(inputs, loading_options, matching_options,
+                                  image_store);
+    } else {
+      auto images = RunLoadingPipeline(
+          inputs, loading_options,
+          /*compute_keypoints=*/ComputesKeypoints(matching_options.type),
+          image_store);
+      data = RunMatchingPipeline(std::move(images), matching_options);
+    }
+    if (image_store) {
+      image_store->LogStats();
+    }
+    CacheExif(data);
+    return data;
+  });
+}
+
+std::future<StitcherData> StitcherPipeline::RunIncrementalLoading(
+    StitcherData data, const std::vector<std::filesystem::path> &inputs,
+    const LoadingOptions &loading_options,
+    const MatchingOptions &matching_options) {
+  return pool_.submit([this, data = std::move(data), loading_options,
+                       matching_options, inputs,
+                       image_store = image_store_]() mutable {
+    auto images =
+        RunLoadingPipeline(inputs, loading_options,
+                           /*compute_keypoints=*/true, image_store);
+    auto result = RunIncrementalMatchingPipeline(
+        std::move(data), std::move(images), matching_options);
+    CacheExif(result);
+    return result;
+  });
+}
+
+std::future<StitcherData> StitcherPipeline::RunProjectLoading(
+    const std::filesystem::path &project_path,
+    const LoadingOptions &loading_options) {
+  ClearCaches();
+  cache_key_.clear();
+  image_store_ = MakeImageStore(loading_options.memory_budget);
+  return pool_.submit([this, project_path, image_store = image_store_]() {
+    progress_.Reset(ProgressType::kLoadingProject, 0);
+    auto data = project::Load(project_path, &pool_, &progress_, cancel_tasks_);
+    if (!data) {
+      return StitcherData{};
+    }
+    if (image_store) {
+      for (auto &image : data->images) {
+        image.MoveToStore(image_store);
+      }
+      image_store->LogStats();
+    }
+    CacheExif(*data);
+    return std::move(*data);
+  });
+}
+
+std::future<std::optional<std::filesystem::path>>
+StitcherPipeline::RunProjectSave(StitcherData data,
+                                 const std::filesystem::path &project_path) {
+  return pool_.submit([this, data = std::move(data), project_path]()
+                          -> std::optional<std::filesystem::path> {
+    progress_.Reset(ProgressType::kSavingProject, 0);
+    if (!project::Save(project_path, data, &pool_, &progress_,
+                       cancel_tasks_)) {
+      return {};
+    }
+    return project_path;
   });
 }
 
 std::future<StitchingResult> StitcherPipeline::RunStitching(
     const StitcherData &data, const StitchingOptions &options) {
   auto pano = data.panos[options.pano_id];
-  return pool_.submit([pano, &images = data.images, options, this]() {
-    return RunStitchingPipeline(pano, images, options);
+  return pool_.submit([pano, &images = data.images, &matches = data.matches,
+                       options, image_store = image_store_, this]() {
+    auto result =
+        RunStitchingPipeline(pano, images, matches, options, &progress_);
+    if (image_store) {
+      image_store->LogStats();
+    }
+    return result;
   });
 }
 
 StitchingResult StitcherPipeline::RunStitchingPipeline(
     const algorithm::Pano &pano, const std::vector<algorithm::Image> &images,
-    const StitchingOptions &options) {
+    const std::vector<algorithm::Match> &matches,
+    const StitchingOptions &options, ProgressMonitor *progress) {
+  if (options.full_res && options.export_path &&
+      options.stitch_algorithm.tiled_export) {
+    return RunTiledStitchingPipeline(pano, images, matches, options,
+                                     progress);
+  }
+
   int num_tasks = static_cast<int>(pano.ids.size()) + 1 +
                   static_cast<int>(options.export_path.has_value()) +
                   static_cast<int>(options.full_res);
-  progress_.Reset(ProgressType::kLoadingImages, num_tasks);
-  std::vector<cv::Mat> imgs;
+  progress->Reset(ProgressType::kLoadingImages, num_tasks);
+  std::vector<cv::Mat> previews;
+  for (int img_id : pano.ids) {
+    previews.push_back(images[img_id].GetPreview());
+    if (!options.full_res) {
+      progress->NotifyTaskDone();
+    }
+  }
+
+  std::vector<cv::Mat> imgs = previews;
   if (options.full_res) {
     utils::mt::MultiFuture<cv::Mat> imgs_future;
     for (const auto &img_id : pano.ids) {
       imgs_future.push_back(pool_.submit([this, &image = images[img_id]]() {
-        auto full_res_image = image.GetFullRes();
-        progress_.NotifyTaskDone();
+        auto full_res_image = full_res_cache_.Get(image);
+        progress->NotifyTaskDone();
         return full_res_image;
       }));
     }
     imgs = imgs_future.get();
-  } else {
-    for (int img_id : pano.ids) {
-      imgs.push_back(images[img_id].GetPreview());
-      progress_.NotifyTaskDone();
-    }
+    full_res_cache_.LogStats();
   }
 
-  progress_.SetTaskType(ProgressType::kStitchingPano);
-  auto [status, result, mask] =
-      algorithm::Stitch(imgs, options.stitch_algorithm,
-                        /*return_pano_mask=*/options.full_res, &pool_);
-  progress_.NotifyTaskDone();
+  progress->SetTaskType(ProgressType::kStitchingPano);
+  algorithm::StitchResult stitch_result;
+  if (!options.full_res ||
+      options.stitch_algorithm.reuse_preview_registration) {
+    auto registration =
+        CachedRegisterPano(options.pano_id, pano, images, matches, previews,
+                           options.stitch_algorithm);
+    stitch_result = algorithm::Compose(previews, imgs, registration,
+                                       options.stitch_algorithm,
+                                       /*return_pano_mask=*/options.full_res,
+                                       &pool_);
+  } else {
+    stitch_result =
+        algorithm::Stitch(imgs, options.stitch_algorithm,
+                          /*return_pano_mask=*/options.full_res, &pool_);
+  }
+  auto [status, result, mask] = stitch_result;
+  progress->NotifyTaskDone();
 
   if (status != cv::Stitcher::OK) {
     return StitchingResult{
@@ -158,9 +791,9 @@ StitchingResult StitcherPipeline::RunStitchingPipeline(
   std::optional<cv::Mat> pano_mask;
   if (options.full_res) {
     pano_mask = mask;
-    progress_.SetTaskType(ProgressType::kAutoCrop);
+    progress->SetTaskType(ProgressType::kAutoCrop);
     auto_crop = algorithm::FindLargestCrop(mask);
-    progress_.NotifyTaskDone();
+    progress->NotifyTaskDone();
   }
 
   std::optional<std::filesystem::path> export_path;
@@ -172,9 +805,11 @@ StitchingResult StitcherPipeline::RunStitchingPipeline(
     }
 
     export_path =
-        RunExportPipeline(result, {.export_path = *options.export_path,
-                                   .metadata_path = metadata_path,
-                                   .compression = options.compression})
+        RunExportPipeline(result,
+                          {.export_path = *options.export_path,
+                           .metadata_path = metadata_path,
+                           .compression = options.compression},
+                          progress)
             .export_path;
   }
 
@@ -182,34 +817,353 @@ StitchingResult StitcherPipeline::RunStitchingPipeline(
                          auto_crop,       export_path,      pano_mask};
 }
 
+StitchingResult StitcherPipeline::RunTiledStitchingPipeline(
+    const algorithm::Pano &pano, const std::vector<algorithm::Image> &images,
+    const std::vector<algorithm::Match> &matches,
+    const StitchingOptions &options, ProgressMonitor *progress) {
+  // One task per tile, added once the size of the pano is known, and one for
+  // the preview
+  progress->Reset(ProgressType::kStitchingPano, 1);
+  std::vector<cv::Mat> previews;
+  std::vector<cv::Size> image_sizes;
+  for (int img_id : pano.ids) {
+    const auto &image = images[img_id];
+    previews.push_back(image.GetPreview());
+    // Decoded here only when neither the loading nor the header knows it
+    auto image_size = image.GetFullResSize();
+    if (image_size.empty()) {
+      image_size = full_res_cache_.Get(image).size();
+    }
+    image_sizes.push_back(image_size);
+  }
+
+  const auto &stitch_options = options.stitch_algorithm;
+  if (!stitch_options.reuse_preview_registration) {
+    spdlog::info("Tiled export always reuses the preview alignment");
+  }
+  if (stitch_options.blending_method != algorithm::BlendingMethod::kOpenCV) {
+    spdlog::warn("Tiled export always blends with OpenCV");
+  }
+  auto registration = CachedRegisterPano(options.pano_id, pano, images,
+                                         matches, previews, stitch_options);
+
+  std::optional<utils::exiv2::ExifBlob> source_exif;
+  if (options.metadata.copy_from_first_image) {
+    source_exif = SourceExif(images[pano.ids[0]].GetPath());
+  }
+  ExportTileWriter writer(*options.export_path, options.compression,
+                          std::move(source_exif), progress, &pool_);
+  auto status = algorithm::ComposeTiled(
+      previews, image_sizes,
+      [this, &images, &pano](int index) {
+        return full_res_cache_.Get(images[pano.ids[index]]);
+      },
+      registration, stitch_options, kCompositingTileSize, &writer);
+  full_res_cache_.LogStats();
+  if (status == algorithm::kErrWriteFailed) {
+    spdlog::error("Failed to write {}", writer.Path().string());
+    writer.Close();
+    std::error_code error;
+    std::filesystem::remove(writer.Path(), error);
+  }
+  if (status != cv::Stitcher::OK) {
+    return StitchingResult{
+        .pano_id = options.pano_id,
+        .full_res = options.full_res,
+        .status = status,
+    };
+  }
+
+  std::optional<std::filesystem::path> written_path;
+  if (writer.Close()) {
+    written_path = writer.Path();
+  } else {
+    spdlog::error("Failed to write {}", writer.Path().string());
+    std::error_code error;
+    std::filesystem::remove(writer.Path(), error);
+  }
+
+  // The full resolution pano is only on the disk, show the preview instead
+  auto preview = algorithm::Compose(previews, previews, registration,
+                                    stitch_options,
+                                    /*return_pano_mask=*/false, &pool_);
+  progress->NotifyTaskDone();
+  std::optional<cv::Mat> preview_pano;
+  if (preview.status == cv::Stitcher::OK) {
+    preview_pano = preview.pano;
+  }
+  return StitchingResult{.pano_id = options.pano_id,
+                         .full_res = false,
+                         .status = status,
+                         .pano = preview_pano,
+                         .export_path = written_path};
+}
+
+void StitcherPipeline::ClearCaches() {
+  {
+    std::lock_guard lock(registration_cache_mutex_);
+    registration_cache_.clear();
+  }
+  full_res_cache_.Clear();
+  {
+    std::lock_guard lock(exif_cache_mutex_);
+    exif_cache_.clear();
+  }
+}
+
+void StitcherPipeline::CacheExif(const StitcherData &data) {
+  if (!utils::exiv2::Enabled()) {
+    return;
+  }
+  for (const auto &pano : data.panos) {
+    SourceExif(data.images[pano.ids[0]].GetPath());
+  }
+}
+
+std::optional<utils::exiv2::ExifBlob> StitcherPipeline::SourceExif(
+    const std::filesystem::path &path) {
+  if (!utils::exiv2::Enabled()) {
+    return {};
+  }
+  {
+    std::lock_guard lock(exif_cache_mutex_);
+    if (auto cached = exif_cache_.find(path.string());
+        cached != exif_cache_.end()) {
+      return cached->second;
+    }
+  }
+  auto exif = utils::exiv2::ReadExif(path);
+  std::lock_guard lock(exif_cache_mutex_);
+  exif_cache_[path.string()] = exif;
+  return exif;
+}
+
+algorithm::Registration StitcherPipeline::CachedRegisterPano(
+    int pano_id, const algorithm::Pano &pano,
+    const std::vector<algorithm::Image> &images,
+    const std::vector<algorithm::Match> &matches,
+    const std::vector<cv::Mat> &previews,
+    const StitchAlgorithmOptions &options) {
+  std::vector<std::filesystem::path> inputs;
+  for (int img_id : pano.ids) {
+    inputs.push_back(images[img_id].GetPath());
+  }
+  if (pano_id == kUncachedPanoId) {
+    return RegisterPano(pano, images, matches, previews, options);
+  }
+
+  // Matching the same images with other options gives other matches
+  auto matches_fingerprint = MatchesFingerprint(pano, matches);
+  auto is_valid = [&](const CachedRegistration &cached) {
+    return cached.inputs == inputs &&
+           cached.matches_fingerprint == matches_fingerprint &&
+           cached.feature == options.feature &&
+           cached.wave_correction == options.wave_correction &&
+           cached.match_conf == options.match_conf;
+  };
+
+  {
+    std::lock_guard lock(registration_cache_mutex_);
+    if (auto cached = registration_cache_.find(pano_id);
+        cached != registration_cache_.end() && is_valid(cached->second)) {
+      spdlog::info("Reusing camera parameters of pano {}", pano_id);
+      return cached->second.registration;
+    }
+  }
+
+  auto registration = RegisterPano(pano, images, matches, previews, options);
+  num_registrations_++;
+  if (registration.status == cv::Stitcher::OK) {
+    std::lock_guard lock(registration_cache_mutex_);
+    registration_cache_[pano_id] = {inputs,
+                                    matches_fingerprint,
+                                    options.feature,
+                                    options.wave_correction,
+                                    options.match_conf,
+                                    registration};
+  }
+  return registration;
+}
+
 std::future<ExportResult> StitcherPipeline::RunExport(
     cv::Mat pano, const ExportOptions &options) {
   return pool_.submit([pano = std::move(pano), options, this]() {
-    return RunExportPipeline(pano, options);
+    return RunExportPipeline(pano, options, &progress_);
   });
 }
 
+std::future<std::vector<BatchExportResult>> StitcherPipeline::RunBatchExport(
+    const StitcherData &data, const BatchExportOptions &options) {
+  int num_panos = static_cast<int>(data.panos.size());
+  auto batch = std::make_shared<BatchState>(num_panos);
+  batch->budget_bytes =
+      static_cast<std::int64_t>(options.memory_budget * kMegabyte);
+  // Running panos wait for their own tasks, which need free threads
+  batch->max_running =
+      std::max(1, static_cast<int>(pool_.get_thread_count()) / 2);
+  batch->export_paths = BatchExportPaths(data, options.export_dir);
+  for (int pano_id = 0; pano_id < num_panos; pano_id++) {
+    batch->results[pano_id].pano_id = pano_id;
+    batch->footprints.push_back(
+        EstimateFootprint(data.panos[pano_id], data.images, options));
+    batch->queued.push_back(pano_id);
+  }
+  auto future = batch->promise.get_future();
+  {
+    std::lock_guard lock(batch_mutex_);
+    batch_ = batch;
+  }
+
+  spdlog::info("Exporting {} panos to {}", num_panos,
+               options.export_dir.string());
+  progress_.Reset(ProgressType::kBatchExport, num_panos);
+  StartBatchTasks(batch, data, options);
+  return future;
+}
+
+void StitcherPipeline::StartBatchTasks(
+    const std::shared_ptr<BatchState> &batch, const StitcherData &data,
+    const BatchExportOptions &options) {
+  std::lock_guard lock(batch->mutex);
+  if (cancel_tasks_) {
+    batch->queued.clear();
+  }
+  while (!batch->queued.empty() && batch->num_running < batch->max_running) {
+    int pano_id = batch->queued.front();
+    auto footprint = batch->footprints[pano_id];
+    if (batch->num_running > 0 && batch->budget_bytes > 0 &&
+        batch->running_bytes + footprint > batch->budget_bytes) {
+      break;
+    }
+    batch->queued.pop_front();
+    batch->num_running++;
+    batch->running_bytes += footprint;
+    batch->results[pano_id].status = BatchStatus::kRunning;
+    pool_.push_task([this, batch, &data, options, pano_id]() {
+      RunBatchTask(batch, data, options, pano_id);
+    });
+  }
+  if (batch->queued.empty() && batch->num_running == 0 && !batch->finished) {
+    batch->Finish();
+  }
+}
+
+void StitcherPipeline::RunBatchTask(const std::shared_ptr<BatchState> &batch,
+                                    const StitcherData &data,
+                                    const BatchExportOptions &options,
+                                    int pano_id) {
+  auto start = std::chrono::steady_clock::now();
+  std::optional<std::filesystem::path> exported;
+  cv::Size pano_size;
+  try {
+    auto result =
+        RunStitchingPipeline(data.panos[pano_id], data.images, data.matches,
+                             {.pano_id = pano_id,
+                              .full_res = options.full_res,
+                              .export_path = batch->export_paths[pano_id],
+                              .metadata = options.metadata,
+                              .compression = options.compression,
+                              .stitch_algorithm = options.stitch_algorithm},
+                             &batch->monitors[pano_id]);
+    if (result.status != cv::Stitcher::OK) {
+      spdlog::warn("Failed to stitch pano {}: {}", pano_id,
+                   algorithm::ToString(result.status));
+    }
+    exported = result.export_path;
+    // Tiled export keeps only the preview
+    if (result.pano && result.full_res == options.full_res) {
+      pano_size = result.pano->size();
+    }
+  } catch (const std::exception &e) {
+    spdlog::error("Failed to export pano {}: {}", pano_id, e.what());
+  }
+
+  {
+    std::lock_guard lock(batch->mutex);
+    auto &result = batch->results[pano_id];
+    result.status = exported ? BatchStatus::kDone : BatchStatus::kFailed;
+    result.export_path = exported;
+    result.pano_size = pano_size;
+    result.seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    batch->num_running--;
+    batch->running_bytes -= batch->footprints[pano_id];
+  }
+  progress_.NotifyTaskDone();
+  StartBatchTasks(batch, data, options);
+}
+
+// The tasks of the panos still queued in the thread pool were dropped by
+// Cancel, these would never finish the batch on their own
+void StitcherPipeline::FinishBatch() {
+  std::shared_ptr<BatchState> batch;
+  {
+    std::lock_guard lock(batch_mutex_);
+    batch = batch_;
+  }
+  if (!batch) {
+    return;
+  }
+  std::lock_guard lock(batch->mutex);
+  if (!batch->finished) {
+    batch->Finish();
+  }
+}
+
+std::vector<PanoProgress> StitcherPipeline::BatchProgress() const {
+  std::shared_ptr<BatchState> batch;
+  {
+    std::lock_guard lock(batch_mutex_);
+    batch = batch_;
+  }
+  if (!batch) {
+    return {};
+  }
+  std::lock_guard lock(batch->mutex);
+  std::vector<PanoProgress> progress;
+  for (int pano_id = 0; pano_id < static_cast<int>(batch->results.size());
+       pano_id++) {
+    progress.push_back({pano_id, batch->results[pano_id].status,
+                        batch->monitors[pano_id].Progress()});
+  }
+  return progress;
+}
+
 ExportResult StitcherPipeline::RunExportPipeline(cv::Mat pano,
-                                                 const ExportOptions &options) {
+                                                 const ExportOptions &options,
+                                                 ProgressMonitor *progress) {
   int num_tasks = 2;
-  progress_.Reset(ProgressType::kExport, num_tasks);
+  progress->Reset(ProgressType::kExport, num_tasks);
 
   if (options.crop) {
     auto crop_rect = utils::GetCvRect(pano, *options.crop);
     pano = pano(crop_rect);
   }
 
+  std::optional<utils::exiv2::ExifBlob> source_exif;
+  if (options.metadata_path) {
+    source_exif = SourceExif(*options.metadata_path);
+  }
+  auto exif = ExportExif(options.export_path, source_exif, pano.size());
+  progress->NotifyTaskDone();
+
+  bool written = false;
+  if (CanStreamJpeg(options.export_path, options.compression, pano.size(),
+                    pano.type())) {
+    JpegStripWriter writer(options.export_path, pano.size(),
+                           options.compression, exif, &pool_);
+    written = writer.Write(pano) && writer.Close();
+  } else {
+    written =
+        WriteEncoded(options.export_path, pano, options.compression, exif);
+  }
+
   std::optional<std::filesystem::path> export_path;
-  if (cv::imwrite(options.export_path.string(), pano,
-                  CompressionParameters(options.compression))) {
+  if (written) {
     export_path = options.export_path;
   }
-  progress_.NotifyTaskDone();
-  if (export_path && utils::exiv2::Enabled()) {
-    auto pano_size = utils::ToIntVec(pano.size);
-    utils::exiv2::CreateExif(options.metadata_path, *export_path, pano_size);
-  }
-  progress_.NotifyTaskDone();
+  progress->NotifyTaskDone();
   return ExportResult{options.pano_id, export_path};
 }
 
@@ -232,22 +1186,181 @@ std::future<InpaintingResult> StitcherPipeline::RunInpainting(
   });
 }
 
+void StitcherPipeline::ResetMatchingStats() {
+  full_matches_ = 0;
+  early_accepts_ = 0;
+  early_rejects_ = 0;
+}
+
+void StitcherPipeline::CountMatch(algorithm::MatchPath path) {
+  switch (path) {
+    case algorithm::MatchPath::kEarlyAccept:
+      early_accepts_++;
+      break;
+    case algorithm::MatchPath::kEarlyReject:
+      early_rejects_++;
+      break;
+    default:
+      full_matches_++;
+      break;
+  }
+}
+
+MatchingStats StitcherPipeline::LogMatchingStats() const {
+  auto stats = MatchingStats{full_matches_, early_accepts_, early_rejects_};
+  spdlog::info("Matched pairs: {} fully, {} accepted early, {} rejected early",
+               stats.full, stats.early_accepts, stats.early_rejects);
+  return stats;
+}
+
+utils::LruStats StitcherPipeline::FullResCacheStats() const {
+  return full_res_cache_.Stats();
+}
+
+int StitcherPipeline::NumRegistrations() const { return num_registrations_; }
+
+std::vector<algorithm::Pano> StitcherPipeline::PartialPanos() const {
+  std::lock_guard lock(partial_panos_mutex_);
+  auto panos = partial_panos_;
+  for (auto &pano : panos) {
+    for (int &id : pano.ids) {
+      id -= static_cast<int>(std::distance(failed_inputs_.begin(),
+                                           failed_inputs_.lower_bound(id)));
+    }
+  }
+  return panos;
+}
+
+std::future<StitchingResult> StitcherPipeline::RunPartialStitching(
+    int partial_pano_id, const StitchAlgorithmOptions &options) {
+  auto stitch_options = options;
+  stitch_options.blending_method = algorithm::BlendingMethod::kOpenCV;
+  return partial_pool_.submit([this, partial_pano_id, stitch_options,
+                               data = PartialPanoData(partial_pano_id)]() {
+    if (data.panos.empty()) {
+      return StitchingResult{.pano_id = partial_pano_id,
+                             .status = cv::Stitcher::ERR_NEED_MORE_IMGS};
+    }
+    ProgressMonitor progress;
+    auto result = RunStitchingPipeline(
+        data.panos[0], data.images, data.matches,
+        {.pano_id = kUncachedPanoId, .stitch_algorithm = stitch_options},
+        &progress);
+    result.pano_id = partial_pano_id;
+    return result;
+  });
+}
+
+void StitcherPipeline::ResetPartialPanos(std::optional<int> match_threshold) {
+  std::lock_guard lock(partial_panos_mutex_);
+  partial_panos_.clear();
+  partial_images_.clear();
+  partial_matches_.clear();
+  failed_inputs_.clear();
+  pano_grouping_.reset();
+  if (match_threshold) {
+    pano_grouping_.emplace(*match_threshold);
+  }
+}
+
+void StitcherPipeline::AddPartialImage(int id, const algorithm::Image &image) {
+  std::lock_guard lock(partial_panos_mutex_);
+  if (!pano_grouping_) {
+    return;
+  }
+  if (image.IsLoaded()) {
+    partial_images_.emplace(id, image);
+  } else {
+    failed_inputs_.insert(id);
+  }
+}
+
+void StitcherPipeline::AddPartialMatch(const algorithm::Match &match) {
+  std::lock_guard lock(partial_panos_mutex_);
+  if (!pano_grouping_) {
+    return;
+  }
+  if (!match.matches.empty()) {
+    partial_matches_.push_back(match);
+  }
+  if (pano_grouping_->Add(match)) {
+    partial_panos_ = pano_grouping_->Panos();
+  }
+}
+
+StitcherData StitcherPipeline::PartialPanoData(int partial_pano_id) const {
+  std::lock_guard lock(partial_panos_mutex_);
+  if (partial_pano_id < 0 ||
+      partial_pano_id >= static_cast<int>(partial_panos_.size())) {
+    return {};
+  }
+  StitcherData data;
+  std::unordered_map<int, int> local_ids;
+  for (int id : partial_panos_[partial_pano_id].ids) {
+    auto image = partial_images_.find(id);
+    if (image == partial_images_.end()) {
+      return {};
+    }
+    local_ids[id] = static_cast<int>(data.images.size());
+    data.images.push_back(image->second);
+  }
+  for (const auto &match : partial_matches_) {
+    auto id1 = local_ids.find(match.id1);
+    auto id2 = local_ids.find(match.id2);
+    if (id1 != local_ids.end() && id2 != local_ids.end()) {
+      data.matches.push_back({id1->second, id2->second, match.matches});
+    }
+  }
+  data.panos = {algorithm::SinglePano(static_cast<int>(data.images.size()))};
+  return data;
+}
+
 ProgressReport StitcherPipeline::Progress() const {
   return progress_.Progress();
 }
 
+algorithm::Image StitcherPipeline::LoadImage(
+    const std::filesystem::path &input,
+    const algorithm::ImageLoadOptions &options) {
+  if (!feature_cache_) {
+    algorithm::Image image(input);
+    image.Load(options);
+    return image;
+  }
+
+  if (auto image = feature_cache_->Load(input, options); image) {
+    progress_.NotifyCacheHit();
+    spdlog::info("Loaded {} from cache", input.string());
+    return *image;
+  }
+
+  progress_.NotifyCacheMiss();
+  algorithm::Image image(input);
+  image.Load(options);
+  feature_cache_->Store(image, options);
+  return image;
+}
+
 std::vector<algorithm::Image> StitcherPipeline::RunLoadingPipeline(
     const std::vector<std::filesystem::path> &inputs,
-    const LoadingOptions &options, bool compute_keypoints) {
+    const LoadingOptions &options, bool compute_keypoints,
+    const std::shared_ptr<algorithm::ImageStore> &image_store) {
   int num_tasks = static_cast<int>(inputs.size());
   progress_.Reset(ProgressType::kDetectingKeypoints, num_tasks);
+  progress_.ResetCacheStats();
   utils::mt::MultiFuture<algorithm::Image> loading_future;
   for (const auto &input : inputs) {
     loading_future.push_back(
-        pool_.submit([this, options, input, compute_keypoints]() {
-          algorithm::Image image(input);
-          image.Load({.preview_longer_side = options.preview_longer_side,
-                      .compute_keypoints = compute_keypoints});
+        pool_.submit([this, options, input, compute_keypoints, image_store]() {
+          auto image = LoadImage(
+              input,
+              {.preview_longer_side = options.preview_longer_side,
+               .compute_keypoints = compute_keypoints,
+               .depth_conversion = options.depth_conversion,
+               .quantize_descriptors = options.quantize_descriptors});
+          if (image_store) {
+            image.MoveToStore(image_store);
+          }
           progress_.NotifyTaskDone();
           return image;
         }));
@@ -262,6 +1375,12 @@ std::vector<algorithm::Image> StitcherPipeline::RunLoadingPipeline(
   }
   auto images = loading_future.get();
 
+  if (feature_cache_) {
+    auto progress = progress_.Progress();
+    spdlog::info("Feature cache: {} hits, {} misses", progress.cache_hits,
+                 progress.cache_misses);
+  }
+
   auto num_erased =
       std::erase_if(images, [](const auto &img) { return !img.IsLoaded(); });
   if (num_erased > 0) {
@@ -270,6 +1389,195 @@ std::vector<algorithm::Image> StitcherPipeline::RunLoadingPipeline(
   return images;
 }
 
+StitcherData StitcherPipeline::RunStreamingPipeline(
+    const std::vector<std::filesystem::path> &inputs,
+    const LoadingOptions &loading_options, const MatchingOptions &options,
+    const std::shared_ptr<algorithm::ImageStore> &image_store) {
+  int num_inputs = static_cast<int>(inputs.size());
+  if (num_inputs == 0) {
+    progress_.Reset(ProgressType::kLoadingAndMatching, 0);
+    return {};
+  }
+
+  int num_neighbors = options.neighborhood_search_size;
+  // + FindPanos, updated when an input fails to load and has no neighbors
+  auto num_tasks = [num_inputs, num_neighbors](int num_failed) {
+    return num_inputs +
+           static_cast<int>(
+               NeighborPairs(num_inputs - num_failed, num_neighbors).size()) +
+           1;
+  };
+  progress_.Reset(ProgressType::kLoadingAndMatching, num_tasks(0));
+  progress_.ResetCacheStats();
+  auto match_options = PrepareMatchOptions(options);
+  ResetMatchingStats();
+
+  auto state = std::make_shared<StreamingState>(num_inputs);
+  auto match_task = [this, state, match_options](int i, int j) {
+    const auto &left = state->images[i];
+    const auto &right = state->images[j];
+    auto match = algorithm::Match{i, j};
+    if (left.IsLoaded() && right.IsLoaded()) {
+      algorithm::MatchPath path;
+      match.matches = MatchImages(left, right, match_options, &path);
+      CountMatch(path);
+    }
+    AddPartialMatch(match);
+    progress_.NotifyTaskDone();
+    return match;
+  };
+
+  utils::mt::MultiFuture<void> loading_future;
+  for (int j = 0; j < num_inputs; j++) {
+    loading_future.push_back(pool_.submit([this, state, match_task, j,
+                                           loading_options, num_neighbors,
+                                           num_tasks, image_store,
+                                           input = inputs[j]]() {
+      auto image = LoadImage(
+          input,
+          {.preview_longer_side = loading_options.preview_longer_side,
+           .compute_keypoints = true,
+           .depth_conversion = loading_options.depth_conversion,
+           .quantize_descriptors = loading_options.quantize_descriptors});
+      if (image_store) {
+        image.MoveToStore(image_store);
+      }
+      AddPartialImage(j, image);
+      progress_.NotifyImageLoaded();
+      progress_.NotifyTaskDone();
+
+      // The neighbors of a failed input are matched across it, so that it
+      // doesn't split the pano
+      std::lock_guard lock(state->mutex);
+      if (!image.IsLoaded()) {
+        progress_.SetNumTasks(num_tasks(++state->num_failed));
+      }
+      state->images[j] = std::move(image);
+      state->done[j] = true;
+      for (auto [id1, id2] : state->NewPairs(j, num_neighbors)) {
+        state->matches.push_back(pool_.submit(
+            [match_task, id1, id2]() { return match_task(id1, id2); }));
+      }
+    }));
+  }
+
+  std::future_status status;
+  while ((status = loading_future.wait_for(kTaskCancellationTimeout)) !=
+         std::future_status::ready) {
+    if (cancel_tasks_) {
+      return {};
+    }
+  }
+  // Every pair is scheduled by now, nobody else touches the futures
+  auto matches_future = std::move(state->matches);
+  while ((status = matches_future.wait_for(kTaskCancellationTimeout)) !=
+         std::future_status::ready) {
+    if (cancel_tasks_) {
+      return {};
+    }
+  }
+  auto matches = matches_future.get();
+
+  if (feature_cache_) {
+    auto progress = progress_.Progress();
+    spdlog::info("Feature cache: {} hits, {} misses", progress.cache_hits,
+                 progress.cache_misses);
+  }
+
+  // Drop the images that failed to load and shift the match ids accordingly
+  std::vector<algorithm::Image> images;
+  std::vector<int> new_ids(num_inputs, -1);
+  for (int i = 0; i < num_inputs; i++) {
+    if (state->images[i].IsLoaded()) {
+      new_ids[i] = static_cast<int>(images.size());
+      images.push_back(std::move(state->images[i]));
+    }
+  }
+  if (int num_failed = num_inputs - static_cast<int>(images.size());
+      num_failed > 0) {
+    spdlog::warn("Failed to load {} images", num_failed);
+  }
+  std::erase_if(matches, [&new_ids](const auto &match) {
+    return new_ids[match.id1] < 0 || new_ids[match.id2] < 0;
+  });
+  for (auto &match : matches) {
+    match.id1 = new_ids[match.id1];
+    match.id2 = new_ids[match.id2];
+  }
+  // Same order as RunMatchingPipeline, regardless of the completion order
+  std::sort(matches.begin(), matches.end(),
+            [](const auto &lhs, const auto &rhs) {
+              return std::tie(lhs.id2, lhs.id1) < std::tie(rhs.id2, rhs.id1);
+            });
+
+  auto panos = FindPanos(matches, options.match_threshold);
+  progress_.NotifyTaskDone();
+  return StitcherData{std::move(images), std::move(matches), std::move(panos),
+                      LogMatchingStats()};
+}
+
+StitcherData StitcherPipeline::RunIncrementalMatchingPipeline(
+    StitcherData data, std::vector<algorithm::Image> new_images,
+    const MatchingOptions &options) {
+  if (cancel_tasks_ || new_images.empty()) {
+    return data;
+  }
+
+  int num_previous = static_cast<int>(data.images.size());
+  std::move(new_images.begin(), new_images.end(),
+            std::back_inserter(data.images));
+  auto pairs = NeighborPairs(static_cast<int>(data.images.size()),
+                             options.neighborhood_search_size);
+  std::erase_if(pairs, [num_previous](const algorithm::ImagePair &pair) {
+    return pair.second < num_previous;
+  });
+  progress_.Reset(ProgressType::kMatchingImages,
+                  1 + static_cast<int>(pairs.size()));  // + FindPanos
+
+  auto match_options = PrepareMatchOptions(options);
+  ResetMatchingStats();
+
+  // Shared with the tasks, which might outlive this function when cancelled
+  auto shared_images =
+      std::make_shared<std::vector<algorithm::Image>>(std::move(data.images));
+  utils::mt::MultiFuture<algorithm::Match> matches_future;
+  for (const auto &[i, j] : pairs) {
+    matches_future.push_back(
+        pool_.submit([this, i = i, j = j, shared_images, match_options]() {
+          algorithm::MatchPath path;
+          auto match = algorithm::Match{
+              i, j,
+              MatchImages((*shared_images)[i], (*shared_images)[j],
+                          match_options, &path)};
+          CountMatch(path);
+          progress_.NotifyTaskDone();
+          return match;
+        }));
+  }
+
+  std::future_status status;
+  while ((status = matches_future.wait_for(kTaskCancellationTimeout)) !=
+         std::future_status::ready) {
+    if (cancel_tasks_) {
+      return {};
+    }
+  }
+  auto matches = matches_future.get();
+  std::move(matches.begin(), matches.end(), std::back_inserter(data.matches));
+
+  auto stats = LogMatchingStats();
+  data.matching_stats.full += stats.full;
+  data.matching_stats.early_accepts += stats.early_accepts;
+  data.matching_stats.early_rejects += stats.early_rejects;
+  data.images = std::move(*shared_images);
+  data.panos = FindPanos(data.matches, options.match_threshold);
+  progress_.NotifyTaskDone();
+  int num_new = static_cast<int>(data.images.size()) - num_previous;
+  spdlog::info("Matched {} new images, {} pairs, {} panos", num_new,
+               pairs.size(), data.panos.size());
+  return data;
+}
+
 StitcherData StitcherPipeline::RunMatchingPipeline(
     std::vector<algorithm::Image> images, const MatchingOptions &options) {
   if (images.empty()) {
@@ -285,27 +1593,39 @@ StitcherData StitcherPipeline::RunMatchingPipeline(
     return StitcherData{std::move(images), {}, {pano}};
   }
 
-  int num_images = static_cast<int>(images.size());
-  int num_neighbors =
-      std::min(options.neighborhood_search_size, num_images - 1);
-  int num_tasks =
-      1 +                                             // FindPanos
-      (num_images - num_neighbors) * num_neighbors +  // full n-tuples
-      ((num_neighbors - 1) * num_neighbors) / 2;      // non-full (j - i < 0)
+  auto pairs = options.type == MatchingType::kRetrieval
+                   ? algorithm::RetrievePairs(images,
+                                              options.neighborhood_search_size)
+                   : NeighborPairs(static_cast<int>(images.size()),
+                                   options.neighborhood_search_size);
+  int num_tasks = 1 +  // FindPanos
+                  static_cast<int>(pairs.size());
 
   progress_.Reset(ProgressType::kMatchingImages, num_tasks);
+
+  auto match_options = PrepareMatchOptions(options);
+  ResetMatchingStats();
+
+  for (int i = 0; i < static_cast<int>(images.size()); i++) {
+    AddPartialImage(i, images[i]);
+  }
+  // Shared with the tasks, which might outlive this function when cancelled
+  auto shared_images =
+      std::make_shared<std::vector<algorithm::Image>>(std::move(images));
   utils::mt::MultiFuture<algorithm::Match> matches_future;
-  for (int j = 0; j < images.size(); j++) {
-    for (int i = std::max(0, j - num_neighbors); i < j; i++) {
-      matches_future.push_back(
-          pool_.submit([this, i, j, left = images[i], right = images[j],
-                        match_conf = options.match_conf]() {
-            auto match =
-                algorithm::Match{i, j, MatchImages(left, right, match_conf)};
-            progress_.NotifyTaskDone();
-            return match;
-          }));
-    }
+  for (const auto &[i, j] : pairs) {
+    matches_future.push_back(
+        pool_.submit([this, i = i, j = j, shared_images, match_options]() {
+          const auto &left = (*shared_images)[i];
+          const auto &right = (*shared_images)[j];
+          algorithm::MatchPath path;
+          auto match = algorithm::Match{
+              i, j, MatchImages(left, right, match_options, &path)};
+          CountMatch(path);
+          AddPartialMatch(match);
+          progress_.NotifyTaskDone();
+          return match;
+        }));
   }
 
   std::future_status status;
@@ -319,7 +1639,9 @@ StitcherData StitcherPipeline::RunMatchingPipeline(
 
   auto panos = FindPanos(matches, options.match_threshold);
   progress_.NotifyTaskDone();
-  return StitcherData{images, matches, panos};
+  // All tasks are done, nobody else accesses the images anymore
+  return StitcherData{std::move(*shared_images), std::move(matches),
+                      std::move(panos), LogMatchingStats()};
 }
 
 }  // namespace xpano::pipeline
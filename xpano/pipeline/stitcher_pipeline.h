@@ -6,20 +6,30 @@
 
 #include <algorithm>
 #include <atomic>
+#include <cstdint>
 #include <filesystem>
 #include <future>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <set>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include <opencv2/core.hpp>
 #include <opencv2/stitching.hpp>
 
 #include "xpano/algorithm/algorithm.h"
+#include "xpano/algorithm/feature_cache.h"
+#include "xpano/algorithm/full_res_cache.h"
 #include "xpano/algorithm/image.h"
+#include "xpano/algorithm/image_store.h"
 #include "xpano/constants.h"
 #include "xpano/pipeline/options.h"
+#include "xpano/utils/exiv2.h"
+#include "xpano/utils/lru_cache.h"
 #include "xpano/utils/rect.h"
 #include "xpano/utils/threadpool.h"
 
@@ -42,10 +52,31 @@ struct ExportOptions {
   std::optional<utils::RectRRf> crop;
 };
 
+struct BatchExportOptions {
+  // Each pano is exported here, named after its first image. Panos that
+  // would share a name get their id appended.
+  std::filesystem::path export_dir;
+  bool full_res = true;
+  MetadataOptions metadata;
+  CompressionOptions compression;
+  StitchAlgorithmOptions stitch_algorithm;
+  // Megabytes of the estimated footprint of the panos stitched at once, 0
+  // for no limit. A pano over the budget is stitched alone.
+  int memory_budget = kDefaultBatchMemoryBudget;
+};
+
+// Number of matched pairs per algorithm::MatchPath
+struct MatchingStats {
+  int full = 0;
+  int early_accepts = 0;
+  int early_rejects = 0;
+};
+
 struct StitcherData {
   std::vector<algorithm::Image> images;
   std::vector<algorithm::Match> matches;
   std::vector<algorithm::Pano> panos;
+  MatchingStats matching_stats;
 };
 
 struct InpaintingResult {
@@ -68,6 +99,20 @@ struct ExportResult {
   std::optional<std::filesystem::path> export_path;
 };
 
+enum class BatchStatus { kQueued, kRunning, kDone, kFailed };
+
+// The panos themselves are dropped as soon as they are exported, to keep the
+// memory bounded
+struct BatchExportResult {
+  int pano_id = 0;
+  BatchStatus status = BatchStatus::kQueued;
+  std::optional<std::filesystem::path> export_path;
+  // Empty when only a preview of the exported pano was kept
+  cv::Size pano_size;
+  // Time spent stitching and exporting
+  double seconds = 0.0;
+};
+
 enum class ProgressType {
   kNone,
   kLoadingImages,
@@ -75,14 +120,22 @@ enum class ProgressType {
   kAutoCrop,
   kDetectingKeypoints,
   kMatchingImages,
+  kLoadingAndMatching,
   kExport,
   kInpainting,
+  kBatchExport,
+  kLoadingProject,
+  kSavingProject,
 };
 
 struct ProgressReport {
   ProgressType type;
   int tasks_done;
   int num_tasks;
+  int cache_hits = 0;
+  int cache_misses = 0;
+  // Only counted with kLoadingAndMatching, where both stages run concurrently
+  int images_loaded = 0;
 };
 
 class ProgressMonitor {
@@ -92,49 +145,208 @@ class ProgressMonitor {
   void SetTaskType(ProgressType type);
   [[nodiscard]] ProgressReport Progress() const;
   void NotifyTaskDone();
+  void NotifyImageLoaded();
+
+  // Feature cache statistics survive Reset() to be available after loading
+  void ResetCacheStats();
+  void NotifyCacheHit();
+  void NotifyCacheMiss();
 
  private:
   std::atomic<ProgressType> type_{ProgressType::kNone};
   std::atomic<int> done_ = 0;
   std::atomic<int> num_tasks_ = 0;
+  std::atomic<int> cache_hits_ = 0;
+  std::atomic<int> cache_misses_ = 0;
+  std::atomic<int> images_loaded_ = 0;
 };
 
+struct PanoProgress {
+  int pano_id = 0;
+  BatchStatus status = BatchStatus::kQueued;
+  ProgressReport progress;
+};
+
+// Panos of a running batch export, shared with its tasks
+struct BatchState;
+
 class StitcherPipeline {
  public:
   StitcherPipeline() = default;
+  explicit StitcherPipeline(
+      const std::optional<std::filesystem::path> &feature_cache_dir);
   ~StitcherPipeline();
   std::future<StitcherData> RunLoading(
       const std::vector<std::filesystem::path> &inputs,
       const LoadingOptions &loading_options,
       const MatchingOptions &matching_options);
+  // Adds the inputs to the images of a previous RunLoading, keeping the
+  // caches. Only the pairs with a new image within the neighborhood search
+  // size are matched, the panos are then found again from all the matches.
+  std::future<StitcherData> RunIncrementalLoading(
+      StitcherData data, const std::vector<std::filesystem::path> &inputs,
+      const LoadingOptions &loading_options,
+      const MatchingOptions &matching_options);
+  // Restores a project saved by RunProjectSave, neither the inputs are
+  // decoded nor the keypoints detected and matched again
+  std::future<StitcherData> RunProjectLoading(
+      const std::filesystem::path &project_path,
+      const LoadingOptions &loading_options);
+  // Returns the path of the saved project, empty on errors
+  std::future<std::optional<std::filesystem::path>> RunProjectSave(
+      StitcherData data, const std::filesystem::path &project_path);
   std::future<StitchingResult> RunStitching(const StitcherData &data,
                                             const StitchingOptions &options);
 
   std::future<ExportResult> RunExport(cv::Mat pano,
                                       const ExportOptions &options);
+  // Stitches and exports all the panos, as many at once as fit into the
+  // memory budget. The results are in the order of data.panos.
+  std::future<std::vector<BatchExportResult>> RunBatchExport(
+      const StitcherData &data, const BatchExportOptions &options);
   std::future<InpaintingResult> RunInpainting(cv::Mat pano, cv::Mat mask,
                                               const InpaintingOptions &options);
   ProgressReport Progress() const;
+  // Of each pano of the last RunBatchExport, Progress() counts the panos
+  std::vector<PanoProgress> BatchProgress() const;
+  // Panos found so far by a running RunLoading, available before all the
+  // pairs are matched. The ids are those of the loaded images, the same as in
+  // the final StitcherData once the loading is done. With the auto matching,
+  // an input failing to load shifts the ids of the inputs after it.
+  std::vector<algorithm::Pano> PartialPanos() const;
+  // Preview of the pano at the index of PartialPanos(), stitched from the
+  // images and matches available so far. Runs on a thread of its own while
+  // the thread pool is busy loading, always blends with OpenCV.
+  std::future<StitchingResult> RunPartialStitching(
+      int partial_pano_id, const StitchAlgorithmOptions &options);
+  utils::LruStats FullResCacheStats() const;
+  // Registrations estimated so far, the cached ones reused don't count
+  int NumRegistrations() const;
 
+  // Safe to call from another thread while the futures of the pipeline are
+  // waited on. The running tasks return early with partial results, the
+  // futures of the tasks that didn't start yet throw std::future_error.
   void Cancel();
 
  private:
   std::vector<algorithm::Image> RunLoadingPipeline(
       const std::vector<std::filesystem::path> &inputs,
-      const LoadingOptions &loading_options, bool compute_keypoints);
+      const LoadingOptions &loading_options, bool compute_keypoints,
+      const std::shared_ptr<algorithm::ImageStore> &image_store);
   StitcherData RunMatchingPipeline(std::vector<algorithm::Image> images,
                                    const MatchingOptions &options);
+  StitcherData RunIncrementalMatchingPipeline(
+      StitcherData data, std::vector<algorithm::Image> new_images,
+      const MatchingOptions &options);
+  // Loading and matching with the neighborhood search, a pair is matched as
+  // soon as both of its images are loaded
+  StitcherData RunStreamingPipeline(
+      const std::vector<std::filesystem::path> &inputs,
+      const LoadingOptions &loading_options, const MatchingOptions &options,
+      const std::shared_ptr<algorithm::ImageStore> &image_store);
   StitchingResult RunStitchingPipeline(
       const algorithm::Pano &pano, const std::vector<algorithm::Image> &images,
-      const StitchingOptions &options);
+      const std::vector<algorithm::Match> &matches,
+      const StitchingOptions &options, ProgressMonitor *progress);
+  // Full resolution export with algorithm::ComposeTiled, only a preview sized
+  // pano is returned
+  StitchingResult RunTiledStitchingPipeline(
+      const algorithm::Pano &pano, const std::vector<algorithm::Image> &images,
+      const std::vector<algorithm::Match> &matches,
+      const StitchingOptions &options, ProgressMonitor *progress);
+
+  ExportResult RunExportPipeline(cv::Mat pano, const ExportOptions &options,
+                                 ProgressMonitor *progress);
+
+  // Starts the queued panos of the batch that fit into the budget, called
+  // again whenever a pano is done
+  void StartBatchTasks(const std::shared_ptr<BatchState> &batch,
+                       const StitcherData &data,
+                       const BatchExportOptions &options);
+  void RunBatchTask(const std::shared_ptr<BatchState> &batch,
+                    const StitcherData &data,
+                    const BatchExportOptions &options, int pano_id);
+  void FinishBatch();
+
+  // Of the inputs loaded so far, called before loading new ones
+  void ClearCaches();
+
+  algorithm::Image LoadImage(const std::filesystem::path &input,
+                             const algorithm::ImageLoadOptions &options);
+
+  void ResetMatchingStats();
+  void CountMatch(algorithm::MatchPath path);
+  MatchingStats LogMatchingStats() const;
 
-  ExportResult RunExportPipeline(cv::Mat pano, const ExportOptions &options);
+  void ResetPartialPanos(std::optional<int> match_threshold);
+  void AddPartialImage(int id, const algorithm::Image &image);
+  void AddPartialMatch(const algorithm::Match &match);
+  // Images and matches of a partial pano, renumbered as a single pano
+  StitcherData PartialPanoData(int partial_pano_id) const;
+
+  // Metadata of the first image of each pano, read at the end of loading so
+  // that exports don't have to open the inputs again
+  void CacheExif(const StitcherData &data);
+  std::optional<utils::exiv2::ExifBlob> SourceExif(
+      const std::filesystem::path &path);
+
+  algorithm::Registration CachedRegisterPano(
+      int pano_id, const algorithm::Pano &pano,
+      const std::vector<algorithm::Image> &images,
+      const std::vector<algorithm::Match> &matches,
+      const std::vector<cv::Mat> &previews,
+      const StitchAlgorithmOptions &options);
+
+  // Camera parameters don't depend on the projection nor on the blending, so
+  // changing these only needs the panorama to be composed again
+  struct CachedRegistration {
+    std::vector<std::filesystem::path> inputs;
+    // The registration is estimated from the matches between the images
+    std::uint64_t matches_fingerprint;
+    algorithm::FeatureType feature;
+    algorithm::WaveCorrectionType wave_correction;
+    float match_conf;
+    algorithm::Registration registration;
+  };
 
   ProgressMonitor progress_;
+  std::optional<algorithm::FeatureCache> feature_cache_;
+  // Store of the images from the last RunLoading, if it has a memory budget
+  std::shared_ptr<algorithm::ImageStore> image_store_;
+  // Repeated full resolution stitches of the same images skip the decoding
+  algorithm::FullResCache full_res_cache_{
+      static_cast<std::int64_t>(kFullResCacheSize * kMegabyte)};
+
+  std::atomic<int> full_matches_ = 0;
+  std::atomic<int> early_accepts_ = 0;
+  std::atomic<int> early_rejects_ = 0;
+
+  // By the ids of the running matching, the input ids with the auto matching
+  mutable std::mutex partial_panos_mutex_;
+  std::optional<algorithm::PanoGrouping> pano_grouping_;
+  std::vector<algorithm::Pano> partial_panos_;
+  std::unordered_map<int, algorithm::Image> partial_images_;
+  std::vector<algorithm::Match> partial_matches_;
+  std::set<int> failed_inputs_;
+
+  mutable std::mutex batch_mutex_;
+  std::shared_ptr<BatchState> batch_;
+
+  std::mutex exif_cache_mutex_;
+  std::unordered_map<std::string, std::optional<utils::exiv2::ExifBlob>>
+      exif_cache_;
+
+  std::mutex registration_cache_mutex_;
+  std::unordered_map<int, CachedRegistration> registration_cache_;
+  std::atomic<int> num_registrations_ = 0;
+  // Inputs and options of the last RunLoading the caches are valid for
+  std::vector<std::string> cache_key_;
 
   std::atomic<bool> cancel_tasks_ = false;
   utils::mt::Threadpool pool_ = {
       std::max(2U, std::thread::hardware_concurrency())};
+  // Destroyed first, its tasks use the rest of the pipeline
+  utils::mt::Threadpool partial_pool_ = {1};
 };
 
 }  // namespace xpano::pipeline
@@ -0,0 +1,208 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/utils/bigtiff.h"
+
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "xpano/utils/binary.h"
+
+namespace xpano::utils::bigtiff {
+
+namespace {
+
+constexpr std::uint16_t kVersion = 43;
+constexpr std::uint16_t kOffsetBytes = 8;
+constexpr int kTileAlignment = 16;
+// After the byte order, version, offset size and padding
+constexpr std::streamoff kDirectoryOffsetPosition = 8;
+
+// Field types
+constexpr std::uint16_t kShort = 3;
+constexpr std::uint16_t kLong = 4;
+constexpr std::uint16_t kLong8 = 16;
+
+// Tags, the directory has to list them in ascending order
+constexpr std::uint16_t kImageWidth = 256;
+constexpr std::uint16_t kImageLength = 257;
+constexpr std::uint16_t kBitsPerSample = 258;
+constexpr std::uint16_t kCompression = 259;
+constexpr std::uint16_t kPhotometricInterpretation = 262;
+constexpr std::uint16_t kSamplesPerPixel = 277;
+constexpr std::uint16_t kPlanarConfiguration = 284;
+constexpr std::uint16_t kTileWidth = 322;
+constexpr std::uint16_t kTileLength = 323;
+constexpr std::uint16_t kTileOffsets = 324;
+constexpr std::uint16_t kTileByteCounts = 325;
+constexpr std::uint16_t kExtraSamples = 338;
+
+constexpr std::uint16_t kNoCompression = 1;
+constexpr std::uint16_t kPhotometricRgb = 2;
+constexpr std::uint16_t kPlanarContiguous = 1;
+constexpr std::uint16_t kUnassociatedAlpha = 2;
+
+// Values of up to 8 bytes are stored in the entry itself, longer ones are
+// referenced by their offset
+struct Entry {
+  std::uint16_t tag;
+  std::uint16_t type;
+  std::uint64_t count;
+  std::array<char, 8> value{};
+};
+
+template <typename TType>
+Entry InlineEntry(std::uint16_t tag, std::uint16_t type,
+                  const std::vector<TType>& values) {
+  Entry entry{.tag = tag, .type = type, .count = values.size()};
+  CV_Assert(values.size() * sizeof(TType) <= entry.value.size());
+  std::memcpy(entry.value.data(), values.data(),
+              values.size() * sizeof(TType));
+  return entry;
+}
+
+bool Align(std::ofstream& stream) {
+  while (stream && stream.tellp() % kOffsetBytes != 0) {
+    stream.put(0);
+  }
+  return static_cast<bool>(stream);
+}
+
+bool WriteEntry(std::ofstream& stream, const Entry& entry) {
+  return binary::Write(stream, entry.tag) &&
+         binary::Write(stream, entry.type) &&
+         binary::Write(stream, entry.count) &&
+         binary::Write(stream, entry.value);
+}
+
+// Inline when it fits, otherwise written at the current position
+Entry Long8Entry(std::ofstream& stream, std::uint16_t tag,
+                 const std::vector<std::uint64_t>& values) {
+  if (values.size() == 1) {
+    return InlineEntry(tag, kLong8, values);
+  }
+  Align(stream);
+  auto offset = static_cast<std::uint64_t>(stream.tellp());
+  for (auto value : values) {
+    binary::Write(stream, value);
+  }
+  auto entry = InlineEntry(tag, kLong8, std::vector{offset});
+  entry.count = values.size();
+  return entry;
+}
+
+}  // namespace
+
+TiledWriter::TiledWriter(const std::filesystem::path& path,
+                         cv::Size image_size, cv::Size tile_size, int channels)
+    : stream_(path, std::ios::binary),
+      image_size_(image_size),
+      tile_size_(tile_size),
+      channels_(channels) {
+  CV_Assert(tile_size.width % kTileAlignment == 0 &&
+            tile_size.height % kTileAlignment == 0);
+  CV_Assert(channels == 3 || channels == 4);
+  int tiles_across = (image_size.width + tile_size.width - 1) / tile_size.width;
+  int tiles_down =
+      (image_size.height + tile_size.height - 1) / tile_size.height;
+  num_tiles_ = tiles_across * tiles_down;
+  tile_offsets_.reserve(num_tiles_);
+  tile_byte_counts_.reserve(num_tiles_);
+
+  // Native byte order, the offset of the directory is filled in by Close
+  const char* byte_order =
+      std::endian::native == std::endian::little ? "II" : "MM";
+  stream_.write(byte_order, 2);
+  binary::Write(stream_, kVersion);
+  binary::Write(stream_, kOffsetBytes);
+  binary::Write(stream_, std::uint16_t{0});
+  binary::Write(stream_, std::uint64_t{0});
+}
+
+bool TiledWriter::IsOpen() const { return stream_.is_open() && stream_; }
+
+bool TiledWriter::Write(const cv::Mat& tile) {
+  if (!IsOpen() || static_cast<int>(tile_offsets_.size()) >= num_tiles_) {
+    return false;
+  }
+  CV_Assert(tile.type() == CV_8UC(channels_) &&
+            tile.cols <= tile_size_.width && tile.rows <= tile_size_.height);
+
+  // All tiles have the same size, the edge ones are padded
+  cv::Mat padded = tile;
+  if (tile.size() != tile_size_) {
+    padded = cv::Mat::zeros(tile_size_, tile.type());
+    tile.copyTo(padded(cv::Rect(cv::Point(0, 0), tile.size())));
+  }
+
+  auto offset = static_cast<std::uint64_t>(stream_.tellp());
+  auto row_bytes = static_cast<std::streamsize>(padded.cols * channels_);
+  for (int row = 0; row < padded.rows; row++) {
+    stream_.write(padded.ptr<char>(row), row_bytes);
+  }
+  tile_offsets_.push_back(offset);
+  tile_byte_counts_.push_back(static_cast<std::uint64_t>(row_bytes) *
+                              padded.rows);
+  return static_cast<bool>(stream_);
+}
+
+bool TiledWriter::Close() {
+  if (!IsOpen()) {
+    return false;
+  }
+  bool complete = static_cast<int>(tile_offsets_.size()) == num_tiles_ &&
+                  WriteDirectory();
+  stream_.close();
+  return complete && !stream_.fail();
+}
+
+bool TiledWriter::WriteDirectory() {
+  std::vector<Entry> entries = {
+      InlineEntry(kImageWidth, kLong,
+                  std::vector{static_cast<std::uint32_t>(image_size_.width)}),
+      InlineEntry(kImageLength, kLong,
+                  std::vector{static_cast<std::uint32_t>(image_size_.height)}),
+      InlineEntry(kBitsPerSample, kShort,
+                  std::vector<std::uint16_t>(channels_, 8)),
+      InlineEntry(kCompression, kShort, std::vector{kNoCompression}),
+      InlineEntry(kPhotometricInterpretation, kShort,
+                  std::vector{kPhotometricRgb}),
+      InlineEntry(kSamplesPerPixel, kShort,
+                  std::vector{static_cast<std::uint16_t>(channels_)}),
+      InlineEntry(kPlanarConfiguration, kShort,
+                  std::vector{kPlanarContiguous}),
+      InlineEntry(kTileWidth, kLong,
+                  std::vector{static_cast<std::uint32_t>(tile_size_.width)}),
+      InlineEntry(kTileLength, kLong,
+                  std::vector{static_cast<std::uint32_t>(tile_size_.height)}),
+      Long8Entry(stream_, kTileOffsets, tile_offsets_),
+      Long8Entry(stream_, kTileByteCounts, tile_byte_counts_),
+  };
+  if (channels_ == 4) {
+    entries.push_back(
+        InlineEntry(kExtraSamples, kShort, std::vector{kUnassociatedAlpha}));
+  }
+
+  if (!Align(stream_)) {
+    return false;
+  }
+  auto directory_offset = static_cast<std::uint64_t>(stream_.tellp());
+  binary::Write(stream_, static_cast<std::uint64_t>(entries.size()));
+  for (const auto& entry : entries) {
+    WriteEntry(stream_, entry);
+  }
+  binary::Write(stream_, std::uint64_t{0});  // No next directory
+
+  stream_.seekp(kDirectoryOffsetPosition);
+  binary::Write(stream_, directory_offset);
+  return static_cast<bool>(stream_);
+}
+
+}  // namespace xpano::utils::bigtiff
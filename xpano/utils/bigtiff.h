@@ -0,0 +1,44 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+namespace xpano::utils::bigtiff {
+
+// Uncompressed tiled BigTIFF, written one tile at a time so that the whole
+// image never has to be in memory. BigTIFF has 64-bit offsets, the size of
+// the image is not limited to 4 GB.
+class TiledWriter {
+ public:
+  // Tile dimensions have to be multiples of 16
+  TiledWriter(const std::filesystem::path& path, cv::Size image_size,
+              cv::Size tile_size, int channels);
+
+  [[nodiscard]] bool IsOpen() const;
+
+  // 8-bit RGB or RGBA tiles in row major order. The tiles on the right and
+  // bottom edges may be smaller than the tile size.
+  bool Write(const cv::Mat& tile);
+  // Writes the image directory, the file is not valid before
+  bool Close();
+
+ private:
+  bool WriteDirectory();
+
+  std::ofstream stream_;
+  cv::Size image_size_;
+  cv::Size tile_size_;
+  int channels_;
+  std::vector<std::uint64_t> tile_offsets_;
+  std::vector<std::uint64_t> tile_byte_counts_;
+  int num_tiles_;
+};
+
+}  // namespace xpano::utils::bigtiff
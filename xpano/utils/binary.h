@@ -0,0 +1,130 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <cstdint>
+#include <istream>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+namespace xpano::utils::binary {
+
+// Minimal helpers for compact binary files with a fixed layout, for data
+// that doesn't fit the alpaca based utils::serialize (opencv types, large
+// arrays).
+
+// Bytes left to read in a seekable stream, sizes read from a corrupted file
+// are checked against it before allocating
+inline std::optional<std::uint64_t> RemainingBytes(std::istream& stream) {
+  auto position = stream.tellg();
+  if (position < 0 || !stream.seekg(0, std::ios::end)) {
+    return {};
+  }
+  auto end = stream.tellg();
+  if (!stream.seekg(position) || end < position) {
+    return {};
+  }
+  return static_cast<std::uint64_t>(end - position);
+}
+
+template <typename TType>
+requires std::is_trivially_copyable_v<TType>
+bool Write(std::ostream& stream, const TType& value) {
+  return static_cast<bool>(
+      stream.write(reinterpret_cast<const char*>(&value), sizeof(TType)));
+}
+
+template <typename TType>
+requires std::is_trivially_copyable_v<TType>
+bool Read(std::istream& stream, TType* value) {
+  return static_cast<bool>(
+      stream.read(reinterpret_cast<char*>(value), sizeof(TType)));
+}
+
+template <typename TType>
+requires std::is_trivially_copyable_v<TType>
+bool WriteVector(std::ostream& stream, const std::vector<TType>& values) {
+  auto size = static_cast<std::uint64_t>(values.size());
+  return Write(stream, size) &&
+         stream.write(reinterpret_cast<const char*>(values.data()),
+                      static_cast<std::streamsize>(size * sizeof(TType)));
+}
+
+template <typename TType>
+requires std::is_trivially_copyable_v<TType>
+bool ReadVector(std::istream& stream, std::vector<TType>* values,
+                std::uint64_t max_size = UINT32_MAX) {
+  std::uint64_t size = 0;
+  if (!Read(stream, &size) || size > max_size) {
+    return false;
+  }
+  auto remaining = RemainingBytes(stream);
+  if (!remaining || size > *remaining / sizeof(TType)) {
+    return false;
+  }
+  values->resize(size);
+  return static_cast<bool>(
+      stream.read(reinterpret_cast<char*>(values->data()),
+                  static_cast<std::streamsize>(size * sizeof(TType))));
+}
+
+inline bool WriteString(std::ostream& stream, const std::string& value) {
+  auto size = static_cast<std::uint64_t>(value.size());
+  return Write(stream, size) &&
+         stream.write(value.data(), static_cast<std::streamsize>(size));
+}
+
+inline bool ReadString(std::istream& stream, std::string* value,
+                       std::uint64_t max_size = UINT16_MAX) {
+  std::uint64_t size = 0;
+  if (!Read(stream, &size) || size > max_size) {
+    return false;
+  }
+  auto remaining = RemainingBytes(stream);
+  if (!remaining || size > *remaining) {
+    return false;
+  }
+  value->resize(size);
+  return static_cast<bool>(
+      stream.read(value->data(), static_cast<std::streamsize>(size)));
+}
+
+inline bool WriteMat(std::ostream& stream, const cv::Mat& mat) {
+  cv::Mat continuous = mat.isContinuous() ? mat : mat.clone();
+  auto rows = static_cast<std::int32_t>(continuous.rows);
+  auto cols = static_cast<std::int32_t>(continuous.cols);
+  auto type = static_cast<std::int32_t>(continuous.type());
+  auto num_bytes =
+      static_cast<std::streamsize>(continuous.total() * continuous.elemSize());
+  return Write(stream, rows) && Write(stream, cols) && Write(stream, type) &&
+         stream.write(reinterpret_cast<const char*>(continuous.data),
+                      num_bytes);
+}
+
+inline bool ReadMat(std::istream& stream, cv::Mat* mat) {
+  std::int32_t rows = 0;
+  std::int32_t cols = 0;
+  std::int32_t type = 0;
+  if (!Read(stream, &rows) || !Read(stream, &cols) || !Read(stream, &type) ||
+      rows < 0 || cols < 0 || type != CV_MAT_TYPE(type)) {
+    return false;
+  }
+  auto num_bytes = static_cast<std::uint64_t>(rows) *
+                   static_cast<std::uint64_t>(cols) * CV_ELEM_SIZE(type);
+  auto remaining = RemainingBytes(stream);
+  if (!remaining || num_bytes > *remaining) {
+    return false;
+  }
+  mat->create(rows, cols, type);
+  return static_cast<bool>(
+      stream.read(reinterpret_cast<char*>(mat->data),
+                  static_cast<std::streamsize>(num_bytes)));
+}
+
+}  // namespace xpano::utils::binary
@@ -1,6 +1,8 @@
 // SPDX-FileCopyrightText: 2023 Tomas Krupka
 // SPDX-License-Identifier: GPL-3.0-or-later
 
+#pragma once
+
 #include <vector>
 
 namespace xpano::utils {
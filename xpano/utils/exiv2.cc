@@ -3,6 +3,10 @@
 
 #include "xpano/utils/exiv2.h"
 
+#include <filesystem>
+#include <optional>
+#include <vector>
+
 #ifdef XPANO_WITH_EXIV2
 #include <exiv2/exiv2.hpp>
 #endif
@@ -51,43 +55,80 @@ void EraseThumbnail(Exiv2::ExifData& exif_data) {
 #endif
 }  // namespace
 
-void CreateExif(const std::optional<std::filesystem::path>& from_path,
-                const std::filesystem::path& to_path, const Vec2i& image_size) {
+std::optional<ExifBlob> ReadExif(const std::filesystem::path& path) {
 #ifdef XPANO_WITH_EXIV2
-  if (from_path && !path::IsMetadataExtensionSupported(*from_path)) {
-    spdlog::info("Reading metadata is not supported for {}",
-                 from_path->string());
-    return;
+  if (!path::IsMetadataExtensionSupported(path)) {
+    spdlog::info("Reading metadata is not supported for {}", path.string());
+    return {};
   }
-  if (!path::IsMetadataExtensionSupported(to_path)) {
-    spdlog::warn("Writing metadata is not supported for {}", to_path.string());
-    return;
+
+  try {
+    auto image = Exiv2::ImageFactory::open(path.string());
+    image->readMetadata();
+    auto& exif_data = image->exifData();
+    EraseThumbnail(exif_data);
+    Exiv2::Blob blob;
+    Exiv2::ExifParser::encode(blob, image->byteOrder(), exif_data);
+    return ExifBlob(blob.begin(), blob.end());
+  } catch (const Exiv2::Error&) {
+    spdlog::warn("Could not read Exif data from {}", path.string());
+    return {};
   }
+#else
+  spdlog::error("Exiv2 support is not enabled");
+  return {};
+#endif
+}
 
+ExifBlob PanoExif(const std::optional<ExifBlob>& source_exif,
+                  const Vec2i& image_size) {
+#ifdef XPANO_WITH_EXIV2
   try {
-    auto write_img = Exiv2::ImageFactory::open(to_path.string());
-
-    if (from_path) {
-      auto read_img = Exiv2::ImageFactory::open(from_path->string());
-      read_img->readMetadata();
-      write_img->setExifData(read_img->exifData());
-
-      UpdateImageSize(write_img->exifData(), image_size);
-      UpdateOrientation(write_img->exifData(), kExifDefaultOrientation);
-      EraseThumbnail(write_img->exifData());
-      AddSoftwareTag(write_img->exifData());
-    } else {
-      Exiv2::ExifData data;
-      AddSoftwareTag(data);
-      write_img->setExifData(data);
+    Exiv2::ExifData exif_data;
+    auto byte_order = Exiv2::littleEndian;
+    if (source_exif && !source_exif->empty()) {
+      byte_order = Exiv2::ExifParser::decode(exif_data, source_exif->data(),
+                                             source_exif->size());
+      UpdateImageSize(exif_data, image_size);
+      UpdateOrientation(exif_data, kExifDefaultOrientation);
+      EraseThumbnail(exif_data);
     }
+    AddSoftwareTag(exif_data);
 
+    Exiv2::Blob blob;
+    Exiv2::ExifParser::encode(blob, byte_order, exif_data);
+    return {blob.begin(), blob.end()};
+  } catch (const Exiv2::Error&) {
+    spdlog::warn("Could not prepare Exif data");
+    return {};
+  }
+#else
+  spdlog::error("Exiv2 support is not enabled");
+  return {};
+#endif
+}
+
+bool EmbedExif(const ExifBlob& exif, std::vector<unsigned char>* image) {
+#ifdef XPANO_WITH_EXIV2
+  try {
+    auto write_img = Exiv2::ImageFactory::open(image->data(), image->size());
+    Exiv2::ExifData exif_data;
+    Exiv2::ExifParser::decode(exif_data, exif.data(), exif.size());
+    write_img->setExifData(exif_data);
     write_img->writeMetadata();
+
+    auto& io = write_img->io();
+    io.seek(0, Exiv2::BasicIo::beg);
+    auto data = io.read(io.size());
+    image->assign(data.c_data(), data.c_data() + data.size());
+    return true;
   } catch (const Exiv2::Error&) {
-    spdlog::warn("Could not write Exif data to {}", to_path.string());
+    spdlog::warn("Could not write Exif data");
+    return false;
   }
 #else
   spdlog::error("Exiv2 support is not enabled");
+  return false;
 #endif
 }
 
@@ -5,6 +5,7 @@
 
 #include <filesystem>
 #include <optional>
+#include <vector>
 
 #include "xpano/utils/vec.h"
 
@@ -18,7 +19,20 @@ constexpr bool Enabled() {
 #endif
 }
 
-void CreateExif(const std::optional<std::filesystem::path>& from_path,
-                const std::filesystem::path& to_path, const Vec2i& image_size);
+// Exif metadata serialized in the TIFF layout, the way it is stored in the
+// APP1 segment of a JPEG after the "Exif" identifier
+using ExifBlob = std::vector<unsigned char>;
+
+// Metadata of the image without its thumbnail, to be kept around until the
+// pano is exported. Only reads the file header.
+std::optional<ExifBlob> ReadExif(const std::filesystem::path& path);
+
+// Metadata of an exported pano: source_exif with the size and orientation
+// updated, or just the software tag without a source
+ExifBlob PanoExif(const std::optional<ExifBlob>& source_exif,
+                  const Vec2i& image_size);
+
+// Replaces the metadata of an image encoded in memory
+bool EmbedExif(const ExifBlob& exif, std::vector<unsigned char>* image);
 
 }  // namespace xpano::utils::exiv2
@@ -0,0 +1,465 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/utils/jpeg.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <numbers>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+namespace xpano::utils::jpeg {
+
+namespace {
+
+constexpr int kBlockSize = 8;
+constexpr int kNumComponents = 3;
+constexpr int kMaxAcValue = 1023;
+
+// Markers
+constexpr unsigned char kSoi = 0xD8;
+constexpr unsigned char kEoi = 0xD9;
+constexpr unsigned char kApp0 = 0xE0;
+constexpr unsigned char kApp1 = 0xE1;
+constexpr unsigned char kDqt = 0xDB;
+constexpr unsigned char kSof0 = 0xC0;
+constexpr unsigned char kDht = 0xC4;
+constexpr unsigned char kDri = 0xDD;
+constexpr unsigned char kSos = 0xDA;
+constexpr unsigned char kRst0 = 0xD0;
+constexpr int kNumRestartMarkers = 8;
+
+// Position in the natural order of the i-th coefficient in the zigzag order
+constexpr std::array<int, 64> kZigzag = {
+    0,  1,  8,  16, 9,  2,  3,  10, 17, 24, 32, 25, 18, 11, 4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6,  7,  14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63};
+
+// Example tables from Annex K of the JPEG standard, in the natural order
+constexpr std::array<int, 64> kLumaQuantization = {
+    16, 11, 10, 16, 24,  40,  51,  61,  12, 12, 14, 19, 26,  58,  60,  55,
+    14, 13, 16, 24, 40,  57,  69,  56,  14, 17, 22, 29, 51,  87,  80,  62,
+    18, 22, 37, 56, 68,  109, 103, 77,  24, 35, 55, 64, 81,  104, 113, 92,
+    49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103, 99};
+
+constexpr std::array<int, 64> kChromaQuantization = {
+    17, 18, 24, 47, 99, 99, 99, 99, 18, 21, 26, 66, 99, 99, 99, 99,
+    24, 26, 56, 99, 99, 99, 99, 99, 47, 66, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99};
+
+// Number of codes of each length from 1 to 16, followed by the symbols
+constexpr std::array<std::uint8_t, 16> kLumaDcBits = {0, 1, 5, 1, 1, 1, 1, 1,
+                                                      1, 0, 0, 0, 0, 0, 0, 0};
+constexpr std::array<std::uint8_t, 12> kLumaDcValues = {0, 1, 2, 3, 4,  5,
+                                                        6, 7, 8, 9, 10, 11};
+
+constexpr std::array<std::uint8_t, 16> kChromaDcBits = {0, 3, 1, 1, 1, 1, 1, 1,
+                                                        1, 1, 1, 0, 0, 0, 0, 0};
+constexpr std::array<std::uint8_t, 12> kChromaDcValues = {0, 1, 2, 3, 4,  5,
+                                                          6, 7, 8, 9, 10, 11};
+
+constexpr std::array<std::uint8_t, 16> kLumaAcBits = {
+    0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d};
+constexpr std::array<std::uint8_t, 162> kLumaAcValues = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06,
+    0x13, 0x51, 0x61, 0x07, 0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08,
+    0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0, 0x24, 0x33, 0x62, 0x72,
+    0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45,
+    0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+    0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75,
+    0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3,
+    0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6,
+    0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9,
+    0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4,
+    0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa};
+
+constexpr std::array<std::uint8_t, 16> kChromaAcBits = {
+    0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77};
+constexpr std::array<std::uint8_t, 162> kChromaAcValues = {
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41,
+    0x51, 0x07, 0x61, 0x71, 0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91,
+    0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0, 0x15, 0x62, 0x72, 0xd1,
+    0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+    0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44,
+    0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+    0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74,
+    0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a,
+    0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4,
+    0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7,
+    0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4,
+    0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa};
+
+struct HuffmanCode {
+  std::uint16_t code = 0;
+  std::uint8_t length = 0;
+};
+
+using HuffmanTable = std::array<HuffmanCode, 256>;
+
+// Canonical codes as in Annex C of the standard
+template <std::size_t NValues>
+HuffmanTable BuildHuffmanTable(
+    const std::array<std::uint8_t, 16>& bits,
+    const std::array<std::uint8_t, NValues>& values) {
+  HuffmanTable table{};
+  std::uint16_t code = 0;
+  int index = 0;
+  for (int length = 1; length <= 16; length++) {
+    for (int i = 0; i < bits[length - 1]; i++) {
+      table[values[index++]] = {code++, static_cast<std::uint8_t>(length)};
+    }
+    code <<= 1;
+  }
+  return table;
+}
+
+struct HuffmanTables {
+  HuffmanTable dc;
+  HuffmanTable ac;
+};
+
+const std::array<HuffmanTables, 2>& StandardHuffmanTables() {
+  static const std::array<HuffmanTables, 2> kTables = {
+      HuffmanTables{BuildHuffmanTable(kLumaDcBits, kLumaDcValues),
+                    BuildHuffmanTable(kLumaAcBits, kLumaAcValues)},
+      HuffmanTables{BuildHuffmanTable(kChromaDcBits, kChromaDcValues),
+                    BuildHuffmanTable(kChromaAcBits, kChromaAcValues)}};
+  return kTables;
+}
+
+// Rows are the DCT basis functions, scaled so that M * block * M^T is the
+// 2D DCT from the standard
+const std::array<float, 64>& DctMatrix() {
+  static const std::array<float, 64> kMatrix = [] {
+    std::array<float, 64> matrix{};
+    for (int u = 0; u < kBlockSize; u++) {
+      double scale = u == 0 ? std::numbers::sqrt2 / 4.0 : 0.5;
+      for (int x = 0; x < kBlockSize; x++) {
+        matrix[u * kBlockSize + x] = static_cast<float>(
+            scale * std::cos((2 * x + 1) * u * std::numbers::pi / 16.0));
+      }
+    }
+    return matrix;
+  }();
+  return kMatrix;
+}
+
+// Same scaling of the example tables as libjpeg does
+std::array<std::uint8_t, 64> ScaleQuantization(
+    const std::array<int, 64>& table, int quality) {
+  quality = std::clamp(quality, 1, 100);
+  int scale = quality < 50 ? 5000 / quality : 200 - 2 * quality;
+  std::array<std::uint8_t, 64> result{};
+  for (int i = 0; i < 64; i++) {
+    result[i] = static_cast<std::uint8_t>(
+        std::clamp((table[i] * scale + 50) / 100, 1, 255));
+  }
+  return result;
+}
+
+// Appends bits most significant first, with a zero byte stuffed after each
+// 0xFF byte
+class BitWriter {
+ public:
+  explicit BitWriter(std::vector<unsigned char>* out) : out_(out) {}
+
+  void Write(std::uint32_t bits, int length) {
+    buffer_ = (buffer_ << length) | (bits & ((1u << length) - 1));
+    num_bits_ += length;
+    while (num_bits_ >= 8) {
+      num_bits_ -= 8;
+      auto byte = static_cast<unsigned char>(buffer_ >> num_bits_);
+      out_->push_back(byte);
+      if (byte == 0xFF) {
+        out_->push_back(0);
+      }
+    }
+    buffer_ &= (1u << num_bits_) - 1;
+  }
+
+  void Write(const HuffmanCode& code) { Write(code.code, code.length); }
+
+  // Pads the last byte with ones
+  void Flush() {
+    if (num_bits_ > 0) {
+      Write(0x7F, 8 - num_bits_);
+    }
+  }
+
+ private:
+  std::vector<unsigned char>* out_;
+  std::uint32_t buffer_ = 0;
+  int num_bits_ = 0;
+};
+
+int Category(int value) {
+  return std::bit_width(static_cast<unsigned>(std::abs(value)));
+}
+
+// Negative values are stored as one's complement of their magnitude
+std::uint32_t ValueBits(int value, int category) {
+  return static_cast<std::uint32_t>(value > 0 ? value
+                                              : value + (1 << category) - 1);
+}
+
+void Forward(const float* block, int stride, std::array<float, 64>* result) {
+  const auto& matrix = DctMatrix();
+  std::array<float, 64> temp{};
+  // Rows first, then columns
+  for (int y = 0; y < kBlockSize; y++) {
+    for (int u = 0; u < kBlockSize; u++) {
+      float sum = 0.0f;
+      for (int x = 0; x < kBlockSize; x++) {
+        sum += matrix[u * kBlockSize + x] * block[y * stride + x];
+      }
+      temp[y * kBlockSize + u] = sum;
+    }
+  }
+  for (int v = 0; v < kBlockSize; v++) {
+    for (int u = 0; u < kBlockSize; u++) {
+      float sum = 0.0f;
+      for (int y = 0; y < kBlockSize; y++) {
+        sum += matrix[v * kBlockSize + y] * temp[y * kBlockSize + u];
+      }
+      (*result)[v * kBlockSize + u] = sum;
+    }
+  }
+}
+
+void EncodeBlock(const float* block, int stride,
+                 const std::array<float, 64>& quant_scale,
+                 const HuffmanTables& tables, int* dc_prediction,
+                 BitWriter* writer) {
+  std::array<float, 64> coefficients{};
+  Forward(block, stride, &coefficients);
+
+  std::array<int, 64> quantized{};
+  for (int i = 0; i < 64; i++) {
+    int natural = kZigzag[i];
+    quantized[i] = static_cast<int>(
+        std::lround(coefficients[natural] * quant_scale[natural]));
+  }
+
+  int dc_diff = quantized[0] - *dc_prediction;
+  *dc_prediction = quantized[0];
+  int dc_category = Category(dc_diff);
+  writer->Write(tables.dc[dc_category]);
+  if (dc_category > 0) {
+    writer->Write(ValueBits(dc_diff, dc_category), dc_category);
+  }
+
+  constexpr int kZeroRunLength = 0xF0;
+  constexpr int kEndOfBlock = 0x00;
+  constexpr int kMaxRun = 16;
+  int run = 0;
+  for (int i = 1; i < 64; i++) {
+    int value = std::clamp(quantized[i], -kMaxAcValue, kMaxAcValue);
+    if (value == 0) {
+      run++;
+      continue;
+    }
+    for (; run >= kMaxRun; run -= kMaxRun) {
+      writer->Write(tables.ac[kZeroRunLength]);
+    }
+    int category = Category(value);
+    writer->Write(tables.ac[(run << 4) | category]);
+    writer->Write(ValueBits(value, category), category);
+    run = 0;
+  }
+  if (run > 0) {
+    writer->Write(tables.ac[kEndOfBlock]);
+  }
+}
+
+void AppendSegment(unsigned char marker,
+                   const std::vector<unsigned char>& payload,
+                   std::vector<unsigned char>* out) {
+  auto length = static_cast<std::uint16_t>(payload.size() + 2);
+  out->insert(out->end(),
+              {0xFF, marker, static_cast<unsigned char>(length >> 8),
+               static_cast<unsigned char>(length & 0xFF)});
+  out->insert(out->end(), payload.begin(), payload.end());
+}
+
+void AppendUint16(std::uint16_t value, std::vector<unsigned char>* out) {
+  out->push_back(static_cast<unsigned char>(value >> 8));
+  out->push_back(static_cast<unsigned char>(value & 0xFF));
+}
+
+template <std::size_t NValues>
+void AppendHuffmanTable(unsigned char table_class_and_id,
+                        const std::array<std::uint8_t, 16>& bits,
+                        const std::array<std::uint8_t, NValues>& values,
+                        std::vector<unsigned char>* out) {
+  out->push_back(table_class_and_id);
+  out->insert(out->end(), bits.begin(), bits.end());
+  out->insert(out->end(), values.begin(), values.end());
+}
+
+}  // namespace
+
+StripEncoder::StripEncoder(cv::Size image_size, int quality,
+                           Subsampling subsampling)
+    : image_size_(image_size),
+      h_sampling_(subsampling == Subsampling::k444 ? 1 : 2),
+      v_sampling_(subsampling == Subsampling::k420 ? 2 : 1),
+      quant_tables_({ScaleQuantization(kLumaQuantization, quality),
+                     ScaleQuantization(kChromaQuantization, quality)}) {
+  CV_Assert(IsSupported(image_size));
+  int mcu_width = kBlockSize * h_sampling_;
+  int mcu_height = kBlockSize * v_sampling_;
+  mcus_across_ = (image_size.width + mcu_width - 1) / mcu_width;
+  mcus_down_ = (image_size.height + mcu_height - 1) / mcu_height;
+  for (int table = 0; table < 2; table++) {
+    for (int i = 0; i < 64; i++) {
+      quant_scales_[table][i] = 1.0f / quant_tables_[table][i];
+    }
+  }
+}
+
+bool StripEncoder::IsSupported(cv::Size image_size) {
+  return image_size.width > 0 && image_size.height > 0 &&
+         image_size.width <= kMaxDimension &&
+         image_size.height <= kMaxDimension;
+}
+
+int StripEncoder::McuHeight() const { return kBlockSize * v_sampling_; }
+
+std::vector<unsigned char> StripEncoder::Header(
+    const std::vector<unsigned char>& exif) const {
+  std::vector<unsigned char> header = {0xFF, kSoi};
+
+  if (exif.empty()) {
+    // JFIF 1.01 without units and without a thumbnail
+    AppendSegment(kApp0, {'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0},
+                  &header);
+  } else {
+    CV_Assert(static_cast<int>(exif.size()) <= kMaxExifSize);
+    std::vector<unsigned char> app1 = {'E', 'x', 'i', 'f', 0, 0};
+    app1.insert(app1.end(), exif.begin(), exif.end());
+    AppendSegment(kApp1, app1, &header);
+  }
+
+  std::vector<unsigned char> quantization;
+  for (int table = 0; table < 2; table++) {
+    quantization.push_back(static_cast<unsigned char>(table));
+    for (int natural : kZigzag) {
+      quantization.push_back(quant_tables_[table][natural]);
+    }
+  }
+  AppendSegment(kDqt, quantization, &header);
+
+  std::vector<unsigned char> frame = {8};
+  AppendUint16(static_cast<std::uint16_t>(image_size_.height), &frame);
+  AppendUint16(static_cast<std::uint16_t>(image_size_.width), &frame);
+  auto luma_sampling =
+      static_cast<unsigned char>((h_sampling_ << 4) | v_sampling_);
+  frame.insert(frame.end(),
+               {kNumComponents, 1, luma_sampling, 0, 2, 0x11, 1, 3, 0x11, 1});
+  AppendSegment(kSof0, frame, &header);
+
+  std::vector<unsigned char> huffman;
+  AppendHuffmanTable(0x00, kLumaDcBits, kLumaDcValues, &huffman);
+  AppendHuffmanTable(0x10, kLumaAcBits, kLumaAcValues, &huffman);
+  AppendHuffmanTable(0x01, kChromaDcBits, kChromaDcValues, &huffman);
+  AppendHuffmanTable(0x11, kChromaAcBits, kChromaAcValues, &huffman);
+  AppendSegment(kDht, huffman, &header);
+
+  std::vector<unsigned char> restart_interval;
+  AppendUint16(static_cast<std::uint16_t>(mcus_across_), &restart_interval);
+  AppendSegment(kDri, restart_interval, &header);
+
+  AppendSegment(kSos, {kNumComponents, 1, 0x00, 2, 0x11, 3, 0x11, 0, 63, 0},
+                &header);
+  return header;
+}
+
+std::vector<unsigned char> StripEncoder::Encode(const cv::Mat& strip,
+                                                int first_row) const {
+  int mcu_height = McuHeight();
+  int mcu_width = kBlockSize * h_sampling_;
+  CV_Assert(strip.type() == CV_8UC3 && strip.cols == image_size_.width);
+  CV_Assert(first_row % mcu_height == 0 &&
+            first_row + strip.rows <= image_size_.height);
+  bool is_last = first_row + strip.rows == image_size_.height;
+  CV_Assert(strip.rows % mcu_height == 0 || is_last);
+
+  // Full MCUs, the edges are padded by repeating the last pixels
+  int mcu_rows = (strip.rows + mcu_height - 1) / mcu_height;
+  cv::Mat ycrcb;
+  cv::cvtColor(strip, ycrcb, cv::COLOR_BGR2YCrCb);
+  cv::copyMakeBorder(ycrcb, ycrcb, 0, mcu_rows * mcu_height - strip.rows, 0,
+                     mcus_across_ * mcu_width - strip.cols,
+                     cv::BORDER_REPLICATE);
+  ycrcb.convertTo(ycrcb, CV_32FC3, 1.0, -128.0);
+
+  std::array<cv::Mat, 3> ycrcb_planes;
+  cv::split(ycrcb, ycrcb_planes.data());
+  // Component order of the file
+  std::array<cv::Mat, 3> planes = {ycrcb_planes[0], ycrcb_planes[2],
+                                   ycrcb_planes[1]};
+  if (h_sampling_ > 1 || v_sampling_ > 1) {
+    cv::Size chroma_size(ycrcb.cols / h_sampling_, ycrcb.rows / v_sampling_);
+    for (int i = 1; i < kNumComponents; i++) {
+      cv::resize(planes[i], planes[i], chroma_size, 0, 0, cv::INTER_AREA);
+    }
+  }
+
+  std::vector<unsigned char> result;
+  for (int row = 0; row < mcu_rows; row++) {
+    EncodeMcuRow(planes, row, &result);
+    int mcu_row = first_row / mcu_height + row;
+    if (mcu_row + 1 < mcus_down_) {
+      result.push_back(0xFF);
+      result.push_back(
+          static_cast<unsigned char>(kRst0 + mcu_row % kNumRestartMarkers));
+    }
+  }
+  return result;
+}
+
+std::vector<unsigned char> StripEncoder::Trailer() { return {0xFF, kEoi}; }
+
+void StripEncoder::EncodeMcuRow(const std::array<cv::Mat, 3>& planes, int row,
+                                std::vector<unsigned char>* out) const {
+  const auto& huffman_tables = StandardHuffmanTables();
+  BitWriter writer(out);
+  // Restarted at each row
+  std::array<int, kNumComponents> dc_predictions{};
+
+  int mcu_height = McuHeight();
+  for (int mcu = 0; mcu < mcus_across_; mcu++) {
+    for (int by = 0; by < v_sampling_; by++) {
+      for (int bx = 0; bx < h_sampling_; bx++) {
+        const auto* block = planes[0].ptr<float>(row * mcu_height +
+                                                 by * kBlockSize) +
+                            (mcu * h_sampling_ + bx) * kBlockSize;
+        EncodeBlock(block, planes[0].cols, quant_scales_[0],
+                    huffman_tables[0], &dc_predictions[0], &writer);
+      }
+    }
+    for (int i = 1; i < kNumComponents; i++) {
+      const auto* block =
+          planes[i].ptr<float>(row * kBlockSize) + mcu * kBlockSize;
+      EncodeBlock(block, planes[i].cols, quant_scales_[1], huffman_tables[1],
+                  &dc_predictions[i], &writer);
+    }
+  }
+  writer.Flush();
+}
+
+}  // namespace xpano::utils::jpeg
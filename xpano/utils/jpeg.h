@@ -0,0 +1,62 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+namespace xpano::utils::jpeg {
+
+enum class Subsampling { k444, k422, k420 };
+
+constexpr int kMaxDimension = 65535;
+// What fits into the APP1 segment after the Exif identifier
+constexpr int kMaxExifSize = 65527;
+
+// Baseline JPEG with a restart marker after each row of MCUs (minimum coded
+// units). The rows are entropy coded independently of each other, so the
+// image can be encoded strip by strip as it is produced, and the strips can
+// be encoded in parallel as long as they are written out in order:
+//   Header(), Encode(strip_0, 0), Encode(strip_1, rows_0), ..., Trailer()
+class StripEncoder {
+ public:
+  // Quality from 1 to 100, same scale as libjpeg
+  StripEncoder(cv::Size image_size, int quality, Subsampling subsampling);
+
+  [[nodiscard]] static bool IsSupported(cv::Size image_size);
+
+  // Strips have to start at a multiple of this
+  [[nodiscard]] int McuHeight() const;
+
+  // Everything before the entropy coded data. With Exif metadata in the TIFF
+  // layout, the header starts with an Exif APP1 segment instead of JFIF.
+  [[nodiscard]] std::vector<unsigned char> Header(
+      const std::vector<unsigned char>& exif = {}) const;
+  // 8-bit BGR rows of the image starting at first_row. The number of rows
+  // has to be a multiple of McuHeight() unless the strip is the last one.
+  // Thread safe.
+  [[nodiscard]] std::vector<unsigned char> Encode(const cv::Mat& strip,
+                                                  int first_row) const;
+  [[nodiscard]] static std::vector<unsigned char> Trailer();
+
+ private:
+  using Block = std::array<float, 64>;
+
+  void EncodeMcuRow(const std::array<cv::Mat, 3>& planes, int row,
+                    std::vector<unsigned char>* out) const;
+
+  cv::Size image_size_;
+  int h_sampling_;
+  int v_sampling_;
+  int mcus_across_;
+  int mcus_down_;
+  std::array<std::array<std::uint8_t, 64>, 2> quant_tables_;
+  // Reciprocals of the quantization tables, to multiply with
+  std::array<Block, 2> quant_scales_;
+};
+
+}  // namespace xpano::utils::jpeg
@@ -0,0 +1,116 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace xpano::utils {
+
+struct LruStats {
+  std::int64_t size_bytes = 0;
+  int num_entries = 0;
+  int hits = 0;
+  int misses = 0;
+  int evictions = 0;
+};
+
+// Least recently used cache bounded by the total size of its values in bytes,
+// as reported by the caller. Not thread safe.
+template <typename TKey, typename TValue>
+class LruCache {
+ public:
+  using Entry = std::pair<TKey, TValue>;
+
+  explicit LruCache(std::int64_t capacity_bytes)
+      : capacity_bytes_(capacity_bytes) {}
+
+  // Marks the entry as the most recently used one
+  std::optional<TValue> Get(const TKey& key) {
+    auto iter = index_.find(key);
+    if (iter == index_.end()) {
+      stats_.misses++;
+      return {};
+    }
+    stats_.hits++;
+    entries_.splice(entries_.begin(), entries_, iter->second);
+    return iter->second->value;
+  }
+
+  [[nodiscard]] bool Contains(const TKey& key) const {
+    return index_.contains(key);
+  }
+
+  // Returns the entries evicted to make room for the new one. A value larger
+  // than the whole capacity is not stored and is returned right away.
+  std::vector<Entry> Put(const TKey& key, TValue value,
+                         std::int64_t size_bytes) {
+    Erase(key);
+    std::vector<Entry> evicted;
+    if (size_bytes > capacity_bytes_) {
+      evicted.emplace_back(key, std::move(value));
+      stats_.evictions++;
+      return evicted;
+    }
+
+    while (stats_.size_bytes + size_bytes > capacity_bytes_) {
+      auto& last = entries_.back();
+      stats_.size_bytes -= last.size_bytes;
+      stats_.evictions++;
+      index_.erase(last.key);
+      evicted.emplace_back(std::move(last.key), std::move(last.value));
+      entries_.pop_back();
+    }
+
+    entries_.push_front({key, std::move(value), size_bytes});
+    index_[key] = entries_.begin();
+    stats_.size_bytes += size_bytes;
+    stats_.num_entries = static_cast<int>(entries_.size());
+    return evicted;
+  }
+
+  void Erase(const TKey& key) {
+    auto iter = index_.find(key);
+    if (iter == index_.end()) {
+      return;
+    }
+    stats_.size_bytes -= iter->second->size_bytes;
+    entries_.erase(iter->second);
+    index_.erase(iter);
+    stats_.num_entries = static_cast<int>(entries_.size());
+  }
+
+  void Clear() {
+    entries_.clear();
+    index_.clear();
+    stats_.size_bytes = 0;
+    stats_.num_entries = 0;
+  }
+
+  [[nodiscard]] LruStats Stats() const {
+    auto stats = stats_;
+    stats.num_entries = static_cast<int>(entries_.size());
+    return stats;
+  }
+
+  [[nodiscard]] std::int64_t Capacity() const { return capacity_bytes_; }
+
+ private:
+  struct Node {
+    TKey key;
+    TValue value;
+    std::int64_t size_bytes;
+  };
+
+  std::int64_t capacity_bytes_;
+  std::list<Node> entries_;
+  std::unordered_map<TKey, typename std::list<Node>::iterator> index_;
+  LruStats stats_;
+};
+
+}  // namespace xpano::utils
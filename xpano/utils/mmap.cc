@@ -0,0 +1,100 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/utils/mmap.h"
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <cstddef>
+#include <filesystem>
+#include <memory>
+
+#include <spdlog/spdlog.h>
+
+namespace xpano::utils::mmap {
+
+#ifdef _WIN32
+
+std::shared_ptr<const MappedFile> MappedFile::Open(
+    const std::filesystem::path& path) {
+  HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                            nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+                            nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    spdlog::warn("Failed to open {} for mapping", path.string());
+    return nullptr;
+  }
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+    CloseHandle(file);
+    return nullptr;
+  }
+  HANDLE mapping =
+      CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  // The view keeps the mapping and the file open
+  CloseHandle(file);
+  if (mapping == nullptr) {
+    spdlog::warn("Failed to map {}", path.string());
+    return nullptr;
+  }
+  void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  CloseHandle(mapping);
+  if (data == nullptr) {
+    spdlog::warn("Failed to map {}", path.string());
+    return nullptr;
+  }
+  return std::shared_ptr<const MappedFile>(
+      new MappedFile(static_cast<const std::byte*>(data),
+                     static_cast<std::size_t>(size.QuadPart)));
+}
+
+MappedFile::~MappedFile() { UnmapViewOfFile(data_); }
+
+#else
+
+std::shared_ptr<const MappedFile> MappedFile::Open(
+    const std::filesystem::path& path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    spdlog::warn("Failed to open {} for mapping", path.string());
+    return nullptr;
+  }
+  struct stat file_stat {};
+  if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) {
+    close(fd);
+    return nullptr;
+  }
+  auto size = static_cast<std::size_t>(file_stat.st_size);
+  void* data = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping stays valid after closing the descriptor
+  close(fd);
+  if (data == MAP_FAILED) {
+    spdlog::warn("Failed to map {}", path.string());
+    return nullptr;
+  }
+  return std::shared_ptr<const MappedFile>(
+      new MappedFile(static_cast<const std::byte*>(data), size));
+}
+
+MappedFile::~MappedFile() {
+  munmap(const_cast<std::byte*>(data_), size_);
+}
+
+#endif
+
+MappedFile::MappedFile(const std::byte* data, std::size_t size)
+    : data_(data), size_(size) {}
+
+const std::byte* MappedFile::Data() const { return data_; }
+
+std::size_t MappedFile::Size() const { return size_; }
+
+}  // namespace xpano::utils::mmap
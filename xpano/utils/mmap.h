@@ -0,0 +1,36 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <memory>
+
+namespace xpano::utils::mmap {
+
+// Read only memory mapping of a whole file, the pages are loaded on first
+// access and shared with the page cache
+class MappedFile {
+ public:
+  // nullptr on errors and for empty files
+  static std::shared_ptr<const MappedFile> Open(
+      const std::filesystem::path& path);
+
+  ~MappedFile();
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+  MappedFile(MappedFile&&) = delete;
+  MappedFile& operator=(MappedFile&&) = delete;
+
+  [[nodiscard]] const std::byte* Data() const;
+  [[nodiscard]] std::size_t Size() const;
+
+ private:
+  MappedFile(const std::byte* data, std::size_t size);
+
+  const std::byte* data_;
+  std::size_t size_;
+};
+
+}  // namespace xpano::utils::mmap
@@ -39,6 +39,14 @@ bool IsMetadataExtensionSupported(const std::filesystem::path& path) {
   return ContainsExtensionIgnoreCase(kMetadataSupportedExtensions, path);
 }
 
+bool IsTiffExtension(const std::filesystem::path& path) {
+  return ContainsExtensionIgnoreCase(kTiffExtensions, path);
+}
+
+bool IsJpegExtension(const std::filesystem::path& path) {
+  return ContainsExtensionIgnoreCase(kJpegExtensions, path);
+}
+
 std::vector<std::filesystem::path> KeepSupported(
     const std::vector<std::filesystem::path>& paths) {
   std::vector<std::filesystem::path> valid_paths;
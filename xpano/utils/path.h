@@ -12,6 +12,10 @@ bool IsExtensionSupported(const std::filesystem::path& path);
 
 bool IsMetadataExtensionSupported(const std::filesystem::path& path);
 
+bool IsTiffExtension(const std::filesystem::path& path);
+
+bool IsJpegExtension(const std::filesystem::path& path);
+
 std::vector<std::filesystem::path> KeepSupported(
     const std::vector<std::filesystem::path>& paths);
 